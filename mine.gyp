@@ -28,16 +28,23 @@
       "src/format/anvil-encode.c",
       "src/format/anvil-parse.c",
       "src/format/nbt-common.c",
+      "src/format/nbt-cursor.c",
       "src/format/nbt-encode.c",
+      "src/format/nbt-fields.c",
       "src/format/nbt-parse.c",
+      "src/format/nbt-sax.c",
       "src/format/nbt-utils.c",
       "src/format/nbt-value.c",
+      "src/format/nbt-writer.c",
 
       "src/protocol/framer.c",
       "src/protocol/parser.c",
 
       "src/utils/buffer.c",
+      "src/utils/chain.c",
+      "src/utils/chunk.c",
       "src/utils/common.c",
+      "src/utils/parallel.c",
       "src/utils/string.c",
 
       "src/server.c",
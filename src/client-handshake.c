@@ -1,6 +1,6 @@
 #include <assert.h>  /* assert */
-#include <stdlib.h>  /* free */
-#include <string.h>  /* memmove, strlen */
+#include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memmove */
 
 #include "client.h"
 #include "client-private.h"
@@ -252,10 +252,14 @@ int mc_client__handle_handshake(mc_client_t* client, mc_frame_t* frame) {
       if (r != 0)
         return r;
 
-      client->ascii_username = mc_string_to_ascii(&client->username);
+      client->ascii_username_len = mc_string_ascii_len(&client->username);
+      client->ascii_username = malloc(client->ascii_username_len + 1);
       if (client->ascii_username == NULL)
         return -1;
-      client->ascii_username_len = strlen(client->ascii_username);
+      mc_string_write_ascii(&client->username,
+                            client->ascii_username,
+                            client->ascii_username_len);
+      client->ascii_username[client->ascii_username_len] = 0;
 
       r = mc_client__send_enc_req(client);
       if (r != 0)
@@ -297,7 +301,7 @@ int mc_client__finish_login(mc_client_t* client) {
 
   r = mc_framer_login_req(&client->framer,
                           1,
-                          &client->username,
+                          client->server->level_type,
                           0,
                           0,
                           0,
@@ -11,6 +11,7 @@
 #include "protocol/parser.h"  /* mc_parser_execute */
 #include "server.h"  /* mc_server_t */
 #include "utils/buffer.h"  /* kMCBufferOOB */
+#include "utils/common.h"  /* mc_frame_destroy */
 #include "utils/string.h"  /* mc_string_t */
 #include "utils/common-private.h"  /* container_of */
 
@@ -337,6 +338,9 @@ void mc_client__cycle(mc_client_t* client) {
     else
       r = mc_client__handle_frame(client, &frame);
 
+    /* Release lazily parsed data, if any */
+    mc_frame_destroy(&frame);
+
     if (r != 0) {
       char err[128];
       snprintf(err, sizeof(err), "Failed to handle frame: %02x", frame.type);
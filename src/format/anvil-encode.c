@@ -1,116 +1,619 @@
 #include <arpa/inet.h>  /* ntohl */
 #include <assert.h>  /* assert */
-#include <stdlib.h>  /* free, NULL */
+#include <fcntl.h>  /* open */
+#include <stdlib.h>  /* malloc, free, NULL */
 #include <string.h>  /* memset */
+#include <sys/stat.h>  /* fstat */
+#include <sys/uio.h>  /* pwritev, struct iovec */
+#include <time.h>  /* time */
+#include <unistd.h>  /* close, fsync, pread, pwrite */
 
 #include "format/anvil.h"
-#include "format/nbt.h"  /* mc_nbt_t */
-#include "utils/buffer.h"  /* mc_buffer_t */
+#include "format/anvil-private.h"
+#include "format/nbt.h"  /* mc_nbt_writer_t */
+#include "utils/chain.h"  /* mc_chain_t */
+#include "utils/chunk.h"  /* mc_chunk_t */
 #include "utils/common.h"  /* mc_region_t */
+#include "utils/common-private.h"  /* ARRAY_SIZE */
+#include "utils/parallel.h"  /* mc_parallel_for */
 
 
-static int mc_anvil__encode(mc_buffer_t* b, mc_region_t* reg);
-static mc_nbt_t* mc_anvil__encode_column(mc_column_t* col,
-                                         int col_x,
-                                         int col_z);
-static mc_nbt_t* mc_anvil__encode_chunk(mc_chunk_t* chunk,
-                                        int chunk_y,
-                                        int* tile_count);
-static int mc_anvil__encode_tiles(mc_chunk_t* chunk,
+typedef struct mc_anvil__sectors_s mc_anvil__sectors_t;
+typedef struct mc_anvil__compress_s mc_anvil__compress_t;
+
+/* Bitmap of used sectors in .mca file */
+struct mc_anvil__sectors_s {
+  uint32_t* bits;
+  int count;
+  int size;
+};
+
+/* Shared state of column compression workers */
+struct mc_anvil__compress_s {
+  mc_region_t* reg;
+  mc_nbt_writer_t* writers;
+  mc_chain_t* out;
+  int writer_count;
+  mc_chain_t* columns;
+};
+
+static int mc_anvil__encode(mc_chain_t* c, mc_region_t* reg, int workers);
+static int mc_anvil__compress_column(void* arg, int worker, int i);
+static int mc_anvil__save(int fd, mc_region_t* reg);
+static int mc_anvil__save_column(int fd,
+                                 mc_nbt_writer_t* w,
+                                 mc_chain_t* c,
+                                 mc_column_t* col,
+                                 int x,
+                                 int z,
+                                 mc_anvil__sectors_t* used,
+                                 uint32_t* header);
+static int mc_anvil__sectors_mark(mc_anvil__sectors_t* used,
+                                  int start,
+                                  int count);
+static int mc_anvil__sectors_alloc(mc_anvil__sectors_t* used, int count);
+static int mc_anvil__pread(int fd, void* data, int len, off_t off);
+static int mc_anvil__pwrite(int fd, const void* data, int len, off_t off);
+static int mc_anvil__pwritev(int fd,
+                             const struct iovec* iov,
+                             int count,
+                             off_t off);
+static int mc_anvil__encode_column(mc_nbt_writer_t* w,
+                                   mc_column_t* col,
+                                   int col_x,
+                                   int col_z);
+static int mc_anvil__encode_chunk(mc_nbt_writer_t* w,
+                                  mc_chunk_t* chunk,
+                                  int chunk_y);
+static int mc_anvil__encode_tiles(mc_nbt_writer_t* w, mc_chunk_t* chunk);
+static int mc_anvil__update_column(mc_column_t* col, int col_x, int col_z);
+static int mc_anvil__update_tiles(mc_chunk_t* chunk,
                                   int x_off,
                                   int y_off,
-                                  int z_off,
-                                  mc_nbt_t*** out);
+                                  int z_off);
 static int mc_anvil__update_entity(mc_entity_t* entity);
 
 static const int kBlockSize = 4096;
+static const int kHeaderEntries = 1024;  /* 32 * 32 */
+static const unsigned char kBlockPadding[4096];
+static const mc_nbt_field_t kColumnFields[] = MC_ANVIL__FIELDS(COLUMN);
+static const mc_nbt_field_t kEntityFields[] = MC_ANVIL__FIELDS(ENTITY);
+static const mc_nbt_field_t kTileFields[] = MC_ANVIL__FIELDS(TILE);
 
 int mc_anvil_encode(mc_region_t* reg, unsigned char** out) {
+  return mc_anvil_encode_parallel(reg, 1, out);
+}
+
+
+int mc_anvil_encode_parallel(mc_region_t* reg,
+                             int workers,
+                             unsigned char** out) {
   int r;
-  mc_buffer_t buf;
+  mc_chain_t chain;
 
-  r = mc_buffer_init(&buf,
-                     kBlockSize * (2 * kMCColumnMaxX * kMCColumnMaxZ + 3));
-  if (r != 0)
-    return r;
+  mc_chain_init(&chain);
+  r = mc_anvil__encode(&chain, reg, workers);
+  if (r == 0)
+    r = mc_chain_flatten(&chain, out);
+  mc_chain_destroy(&chain);
+
+  return r;
+}
 
-  r = mc_anvil__encode(&buf, reg);
-  if (r != 0) {
-    mc_buffer_destroy(&buf);
-    return r;
-  }
 
-  *out = mc_buffer_data(&buf);
-  return mc_buffer_len(&buf);
+int mc_anvil_encode_chain(mc_region_t* reg, mc_chain_t* out) {
+  int r;
+
+  mc_chain_init(out);
+  r = mc_anvil__encode(out, reg, 1);
+  if (r != 0)
+    mc_chain_destroy(out);
+
+  return r;
 }
 
 
-int mc_anvil__encode(mc_buffer_t* b, mc_region_t* reg) {
+int mc_anvil__encode(mc_chain_t* c, mc_region_t* reg, int workers) {
   int r;
+  int i;
   int header;
   int x;
   int z;
   int off;
-  int len;
-  mc_nbt_t* col;
-  unsigned char* out;
+  int32_t len;
+  int sectors;
+  uint8_t comp;
+  const unsigned char* body;
+  mc_anvil__compress_t ctx;
   uint32_t* header_ptr;
 
   /* Reserve space for headers */
-  header = mc_buffer_reserve(b,
-                             MC_COLUMN_MAX_X *
+  header = mc_chain_reserve(c,
+                            MC_COLUMN_MAX_X *
                                 MC_COLUMN_MAX_Z *
                                 sizeof(int32_t) *
                                 2);
   if (header < 0)
     return header;
 
-  /* Translate every column to NBT first */
-  for (z = 0; z < kMCColumnMaxZ; z++) {
-    for (x = 0; x < kMCColumnMaxX; x++) {
-      if (!reg->columns[x][z].generated)
-        continue;
+  /* Deflate stream per worker, compressed column per chain */
+  if (workers < 1)
+    workers = 1;
+  if (workers > kMCParallelMaxWorkers)
+    workers = kMCParallelMaxWorkers;
+  ctx.reg = reg;
+  ctx.columns = malloc(kHeaderEntries * sizeof(*ctx.columns));
+  if (ctx.columns == NULL)
+    return -1;
+  for (i = 0; i < kHeaderEntries; i++)
+    mc_chain_init(&ctx.columns[i]);
+
+  ctx.writer_count = 0;
+  ctx.writers = malloc(workers * sizeof(*ctx.writers));
+  ctx.out = malloc(workers * sizeof(*ctx.out));
+  if (ctx.writers == NULL || ctx.out == NULL) {
+    r = -1;
+    goto fatal;
+  }
+  for (; ctx.writer_count < workers; ctx.writer_count++) {
+    mc_chain_init(&ctx.out[ctx.writer_count]);
+    r = mc_nbt_writer_init(&ctx.writers[ctx.writer_count],
+                           &ctx.out[ctx.writer_count],
+                           kNBTGZip);
+    if (r != 0)
+      goto fatal;
+  }
+
+  /*
+   * Updating entities and tiles copies NBT shared by clones and changes its
+   * non-atomic refcounts, so it is done here. Workers only read NBT.
+   */
+  for (i = 0; i < kHeaderEntries; i++) {
+    x = i % kMCColumnMaxX;
+    z = i / kMCColumnMaxX;
+    if (reg->data != NULL && !reg->decoded[x][z])
+      continue;
+    if (!reg->columns[x][z].generated)
+      continue;
+    r = mc_anvil__update_column(&reg->columns[x][z], x, z);
+    if (r != 0)
+      goto fatal;
+  }
 
-      col = mc_anvil__encode_column(&reg->columns[x][z], x, z);
-      if (col == NULL)
-        return -1;
+  /* Columns are independent, offsets are assigned once all are ready */
+  r = mc_parallel_for(workers,
+                      kHeaderEntries,
+                      mc_anvil__compress_column,
+                      &ctx);
+  if (r != 0)
+    goto fatal;
 
-      len = mc_nbt_encode(col, kNBTGZip, &out);
-      mc_nbt_destroy(col);
-      if (len < 0)
-        return r;
+  for (z = 0; z < kMCColumnMaxZ; z++) {
+    for (x = 0; x < kMCColumnMaxX; x++) {
+      off = mc_chain_len(c);
+
+      /* Column of lazy region wasn't touched, copy it as it is */
+      if (reg->data != NULL && !reg->decoded[x][z]) {
+        r = mc_anvil__column_body(reg->data,
+                                  reg->len,
+                                  x,
+                                  z,
+                                  &body,
+                                  &len,
+                                  &comp);
+        if (r < 0)
+          goto fatal;
+        if (r == 1)
+          continue;
 
-      off = mc_buffer_len(b);
+        r = mc_chain_write_i32(c, len);
+        if (r == 0)
+          r = mc_chain_write_i8(c, comp);
+        if (r == 0)
+          r = mc_chain_write_data(c, body, len);
+        if (r != 0)
+          goto fatal;
+      } else {
+        if (!reg->columns[x][z].generated)
+          continue;
 
-      r = mc_buffer_write_i32(b, len);
-      if (r == 0)
-        r = mc_buffer_write_i8(b, 1);
-      if (r == 0)
-        r = mc_buffer_write_data(b, out, len);
-      free(out);
-      if (r != 0)
-        return r;
+        len = mc_chain_len(&ctx.columns[x + z * kMCColumnMaxX]);
 
+        r = mc_chain_write_i32(c, len);
+        if (r == 0)
+          r = mc_chain_write_i8(c, 1);
+        if (r != 0)
+          goto fatal;
+        mc_chain_splice(c, &ctx.columns[x + z * kMCColumnMaxX]);
+      }
       /* Padd chunk data */
       if ((len + 5) % kBlockSize != 0) {
-        r = mc_buffer_reserve(b, kBlockSize - ((len + 5) % kBlockSize));
-        if (r < 0)
-          return r;
+        r = mc_chain_write_data(c,
+                                kBlockPadding,
+                                kBlockSize - ((len + 5) % kBlockSize));
+        if (r != 0)
+          goto fatal;
       }
 
       assert(off % kBlockSize == 0);
+      sectors = (len + 5 + kBlockSize - 1) / kBlockSize;
+      if (sectors > 0xff) {
+        r = -1;
+        goto fatal;
+      }
 
       /* Insert offset into headers */
-      header_ptr = (uint32_t*) mc_buffer_reserve_ptr(b, header);
-      *(header_ptr + x + z * kMCColumnMaxX) = htonl((off << 8) / kBlockSize);
+      header_ptr = (uint32_t*) mc_chain_reserve_ptr(c, header);
+      *(header_ptr + x + z * kMCColumnMaxX) =
+          htonl(((off / kBlockSize) << 8) | sectors);
     }
   }
+  r = 0;
 
+fatal:
+  for (i = 0; i < ctx.writer_count; i++) {
+    mc_nbt_writer_destroy(&ctx.writers[i]);
+    mc_chain_destroy(&ctx.out[i]);
+  }
+  for (i = 0; i < kHeaderEntries; i++)
+    mc_chain_destroy(&ctx.columns[i]);
+  free(ctx.writers);
+  free(ctx.out);
+  free(ctx.columns);
+  return r;
+}
+
+
+int mc_anvil__compress_column(void* arg, int worker, int i) {
+  int r;
+  int x;
+  int z;
+  mc_anvil__compress_t* ctx;
+
+  ctx = arg;
+  x = i % kMCColumnMaxX;
+  z = i / kMCColumnMaxX;
+  if (ctx->reg->data != NULL && !ctx->reg->decoded[x][z])
+    return 0;
+  if (!ctx->reg->columns[x][z].generated)
+    return 0;
+
+  /* Column is compressed straight into the chain's segments */
+  r = mc_anvil__encode_column(&ctx->writers[worker],
+                              &ctx->reg->columns[x][z],
+                              x,
+                              z);
+  if (r == 0)
+    r = mc_nbt_writer_finish(&ctx->writers[worker]);
+  if (r != 0)
+    return r;
+
+  mc_chain_splice(&ctx->columns[i], &ctx->out[worker]);
   return 0;
 }
 
 
-mc_nbt_t* mc_anvil__encode_column(mc_column_t* col, int col_x, int col_z) {
+int mc_anvil_save(mc_region_t* reg, const char* path) {
+  int r;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT, 0775);
+  if (fd == -1)
+    return -1;
+
+  r = mc_anvil__save(fd, reg);
+  if (close(fd) != 0)
+    r = -1;
+
+  return r;
+}
+
+
+int mc_anvil__save(int fd, mc_region_t* reg) {
+  int r;
+  int i;
+  int x;
+  int z;
+  int count;
+  int written;
+  struct stat s;
+  uint32_t loc;
+  uint32_t size;
+  uint32_t header[2 * MC_COLUMN_MAX_X * MC_COLUMN_MAX_Z];
+  mc_anvil__sectors_t used;
+  mc_chain_t col;
+  mc_nbt_writer_t writer;
+
+  r = fstat(fd, &s);
+  if (r != 0)
+    return -1;
+
+  /* New or truncated file gets an empty header */
+  if (s.st_size >= (off_t) sizeof(header)) {
+    r = mc_anvil__pread(fd, header, sizeof(header), 0);
+    if (r != 0)
+      return r;
+  } else {
+    memset(header, 0, sizeof(header));
+  }
+
+  /*
+   * Sectors of existing columns stay used, even for dirty ones: the old
+   * copy must be intact until the new header is written.
+   */
+  memset(&used, 0, sizeof(used));
+  r = mc_anvil__sectors_mark(&used, 0, sizeof(header) / kBlockSize);
+  for (i = 0; r == 0 && i < kHeaderEntries; i++) {
+    loc = ntohl(header[i]);
+    if (loc == 0)
+      continue;
+
+    /* Older encoder didn't store sector counts, take it from the column */
+    if ((loc & 0xff) == 0) {
+      r = mc_anvil__pread(fd,
+                          &size,
+                          sizeof(size),
+                          (off_t) (loc >> 8) * kBlockSize);
+      if (r != 0)
+        break;
+      size = (ntohl(size) + 5 + kBlockSize - 1) / kBlockSize;
+      if (size > 0xff) {
+        r = -1;
+        break;
+      }
+      loc |= size;
+      header[i] = htonl(loc);
+    }
+    r = mc_anvil__sectors_mark(&used, loc >> 8, loc & 0xff);
+  }
+  if (r != 0)
+    goto fatal;
+
+  /* Unreferenced sectors in the file are free as well */
+  count = (s.st_size + kBlockSize - 1) / kBlockSize;
+  if (used.count < count)
+    used.count = count;
+
+  mc_chain_init(&col);
+  r = mc_nbt_writer_init(&writer, &col, kNBTGZip);
+  if (r != 0)
+    goto fatal;
+
+  written = 0;
+  for (z = 0; z < kMCColumnMaxZ; z++) {
+    for (x = 0; x < kMCColumnMaxX; x++) {
+      if (!reg->columns[x][z].dirty)
+        continue;
+
+      r = mc_anvil__save_column(fd,
+                                &writer,
+                                &col,
+                                &reg->columns[x][z],
+                                x,
+                                z,
+                                &used,
+                                header);
+      if (r != 0)
+        goto writer_fatal;
+      written++;
+    }
+  }
+
+  /* Columns must reach the disk before the header that points to them */
+  if (written != 0 || s.st_size < (off_t) sizeof(header)) {
+    r = fsync(fd);
+    if (r == 0)
+      r = mc_anvil__pwrite(fd, header, sizeof(header), 0);
+    if (r == 0)
+      r = fsync(fd);
+    if (r != 0)
+      goto writer_fatal;
+  }
+
+  for (z = 0; z < kMCColumnMaxZ; z++)
+    for (x = 0; x < kMCColumnMaxX; x++)
+      reg->columns[x][z].dirty = 0;
+
+writer_fatal:
+  mc_nbt_writer_destroy(&writer);
+  mc_chain_destroy(&col);
+
+fatal:
+  free(used.bits);
+  return r;
+}
+
+
+int mc_anvil__save_column(int fd,
+                          mc_nbt_writer_t* w,
+                          mc_chain_t* c,
+                          mc_column_t* col,
+                          int x,
+                          int z,
+                          mc_anvil__sectors_t* used,
+                          uint32_t* header) {
+  int r;
+  int len;
+  int start;
+  int sectors;
+  int count;
+  unsigned char prefix[5];
+  struct iovec* iov;
+
+  /* Removed column */
+  if (!col->generated) {
+    header[x + z * kMCColumnMaxX] = 0;
+    return 0;
+  }
+
+  r = mc_anvil__update_column(col, x, z);
+  if (r == 0)
+    r = mc_anvil__encode_column(w, col, x, z);
+  if (r == 0)
+    r = mc_nbt_writer_finish(w);
+  if (r != 0)
+    return r;
+
+  len = mc_chain_len(c);
+  sectors = (len + 5 + kBlockSize - 1) / kBlockSize;
+  start = sectors > 0xff ? -1 : mc_anvil__sectors_alloc(used, sectors);
+  iov = malloc((mc_chain_count(c) + 2) * sizeof(*iov));
+  if (start < 0 || iov == NULL) {
+    r = -1;
+    goto fatal;
+  }
+
+  prefix[0] = (len >> 24) & 0xff;
+  prefix[1] = (len >> 16) & 0xff;
+  prefix[2] = (len >> 8) & 0xff;
+  prefix[3] = len & 0xff;
+  prefix[4] = 1;
+
+  /* Column's segments and padding up to the end of its last sector */
+  iov[0].iov_base = prefix;
+  iov[0].iov_len = sizeof(prefix);
+  count = 1 + mc_chain_iovec(c, iov + 1, mc_chain_count(c));
+  iov[count].iov_base = (void*) kBlockPadding;
+  iov[count].iov_len = sectors * kBlockSize - len - sizeof(prefix);
+  if (iov[count].iov_len != 0)
+    count++;
+  r = mc_anvil__pwritev(fd, iov, count, (off_t) start * kBlockSize);
+  if (r != 0)
+    goto fatal;
+
+  header[x + z * kMCColumnMaxX] = htonl(((uint32_t) start << 8) | sectors);
+  header[kHeaderEntries + x + z * kMCColumnMaxX] = htonl((uint32_t) time(NULL));
+
+fatal:
+  free(iov);
+  mc_chain_destroy(c);
+  return r;
+}
+
+
+int mc_anvil__sectors_mark(mc_anvil__sectors_t* used, int start, int count) {
+  int i;
+  int size;
+  uint32_t* bits;
+
+  /* Grow geometrically, new sectors are free */
+  if (start + count > used->size) {
+    size = used->size == 0 ? kHeaderEntries : used->size;
+    while (size < start + count)
+      size *= 2;
+    bits = realloc(used->bits, (size / 32) * sizeof(*bits));
+    if (bits == NULL)
+      return -1;
+    memset(bits + used->size / 32,
+           0,
+           ((size - used->size) / 32) * sizeof(*bits));
+    used->bits = bits;
+    used->size = size;
+  }
+
+  for (i = start; i < start + count; i++)
+    used->bits[i >> 5] |= 1u << (i & 31);
+  if (start + count > used->count)
+    used->count = start + count;
+
+  return 0;
+}
+
+
+int mc_anvil__sectors_alloc(mc_anvil__sectors_t* used, int count) {
+  int i;
+  int start;
+
+  /* First fit, or the free tail of the file */
+  start = 0;
+  for (i = 0; i < used->count; i++) {
+    if (i < used->size && (used->bits[i >> 5] & (1u << (i & 31))))
+      start = i + 1;
+    else if (i + 1 - start == count)
+      break;
+  }
+
+  if (mc_anvil__sectors_mark(used, start, count) != 0)
+    return -1;
+  return start;
+}
+
+
+int mc_anvil__pread(int fd, void* data, int len, off_t off) {
+  ssize_t r;
+
+  while (len > 0) {
+    r = pread(fd, data, len, off);
+    if (r <= 0)
+      return -1;
+    data = (char*) data + r;
+    len -= r;
+    off += r;
+  }
+
+  return 0;
+}
+
+
+int mc_anvil__pwrite(int fd, const void* data, int len, off_t off) {
+  ssize_t r;
+
+  while (len > 0) {
+    r = pwrite(fd, data, len, off);
+    if (r <= 0)
+      return -1;
+    data = (const char*) data + r;
+    len -= r;
+    off += r;
+  }
+
+  return 0;
+}
+
+
+int mc_anvil__pwritev(int fd,
+                      const struct iovec* iov,
+                      int count,
+                      off_t off) {
+  int i;
+  ssize_t r;
+  size_t skip;
+  struct iovec part[16];
+  int part_count;
+
+  /* Write at most ARRAY_SIZE(part) iovecs at a time, handle partial writes */
+  i = 0;
+  skip = 0;
+  while (i < count) {
+    part_count = 0;
+    while (i + part_count < count && part_count < (int) ARRAY_SIZE(part)) {
+      part[part_count] = iov[i + part_count];
+      part_count++;
+    }
+    part[0].iov_base = (char*) part[0].iov_base + skip;
+    part[0].iov_len -= skip;
+
+    r = pwritev(fd, part, part_count, off);
+    if (r <= 0)
+      return -1;
+    off += r;
+
+    /* Skip fully written iovecs */
+    skip += r;
+    while (i < count && skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      i++;
+    }
+  }
+
+  return 0;
+}
+
+
+int mc_anvil__encode_column(mc_nbt_writer_t* w,
+                            mc_column_t* col,
+                            int col_x,
+                            int col_z) {
   int r;
   int i;
   int x;
@@ -119,210 +622,188 @@ mc_nbt_t* mc_anvil__encode_column(mc_column_t* col, int col_x, int col_z) {
   int off;
   int chunk_count;
   int tile_count;
-  mc_nbt_t* res;
-  mc_nbt_t* level;
-  mc_nbt_t* biomes;
-  mc_nbt_t* height_map;
-  mc_nbt_t* chunks;
-  mc_nbt_t* chunk;
-  mc_nbt_t* entities;
-  mc_nbt_t* tiles;
-  mc_nbt_t** last_tile;
-
-  NBT_CREATE(res, compound, "", 1);
-  NBT_CREATE(level, compound, "Level", 10);
-  res->value.values.list[0] = level;
-
-  NBT_CREATE(level->value.values.list[0], i32, "xPos", col->world_x);
-  NBT_CREATE(level->value.values.list[1], i32, "zPos", col->world_z);
-  NBT_CREATE(level->value.values.list[2], i64, "LastUpdate", col->last_update);
-  NBT_CREATE(level->value.values.list[3],
-             i8,
-             "TerrainPopulated",
-             col->populated);
-  NBT_CREATE(level->value.values.list[4],
-             i64,
-             "InhabitedTime",
-             col->inhabited_time);
-  NBT_CREATE(biomes, i8l, "Biomes", kMCChunkMaxX * kMCChunkMaxZ);
-  level->value.values.list[5] = biomes;
-  NBT_CREATE(height_map, i32l, "HeightMap", kMCChunkMaxX * kMCChunkMaxZ);
-  level->value.values.list[6] = height_map;
+  int8_t biomes[kMCChunkMaxX * kMCChunkMaxZ];
+  int32_t height_map[kMCChunkMaxX * kMCChunkMaxZ];
+  mc_chunk_t* chunk;
 
   for (x = 0; x < kMCChunkMaxX; x++) {
     for (z = 0; z < kMCChunkMaxZ; z++) {
       off = x + z * kMCChunkMaxX;
-      biomes->value.i8l.list[off] = (int8_t) col->biomes[x][z];
-      height_map->value.i8l.list[off] = col->height_map[x][z];
+      biomes[off] = (int8_t) col->biomes[x][z];
+      height_map[off] = col->height_map[x][z];
     }
   }
 
-  /* Count chunks */
+  NBT_WRITE(mc_nbt_write_compound(w, "", 0));
+  NBT_WRITE(mc_nbt_write_compound(w, "Level", 5));
+  NBT_WRITE(mc_nbt_write_fields(w,
+                                kColumnFields,
+                                ARRAY_SIZE(kColumnFields),
+                                col));
+  NBT_WRITE(mc_nbt_write_i8l(w, "Biomes", 6, biomes, sizeof(biomes)));
+  NBT_WRITE(mc_nbt_write_i32l(w,
+                              "HeightMap",
+                              9,
+                              height_map,
+                              ARRAY_SIZE(height_map)));
+
+  /* Count chunks and tiles */
   chunk_count = 0;
-  for (y = 0; y < kMCChunkMaxY; y++)
-    if (col->chunks[y] != NULL)
-      chunk_count++;
-
-  NBT_CREATE(chunks, list, "Sections", chunk_count);
-  level->value.values.list[7] = chunks;
-
-  /* Put chunks and count tiles */
   tile_count = 0;
-  chunk_count = 0;
-  for (y = 0; y < kMCChunkMaxY; y++) {
-    if (col->chunks[y] == NULL)
-      continue;
-    chunk = mc_anvil__encode_chunk(col->chunks[y], y, &tile_count);
+  for (y = 0; y < kMCColumnMaxY; y++) {
+    chunk = col->chunks[y];
     if (chunk == NULL)
-      goto nbt_fatal;
-
-    chunks->value.values.list[chunk_count++] = chunk;
+      continue;
+    chunk_count++;
+    tile_count += chunk->tile_count;
   }
 
-  /* Put entities */
-  NBT_CREATE(entities, list, "Entities", col->entity_count);
-  level->value.values.list[8] = entities;
-  for (i = 0; i < col->entity_count; i++) {
-    r = mc_anvil__update_entity(&col->entities[i]);
+  /* Put chunks */
+  NBT_WRITE(mc_nbt_write_list(w, "Sections", 8, kNBTCompound, chunk_count));
+  for (y = 0; y < kMCColumnMaxY; y++) {
+    if (col->chunks[y] == NULL)
+      continue;
+    r = mc_anvil__encode_chunk(w, col->chunks[y], y);
     if (r != 0)
-      goto nbt_fatal;
-
-    entities->value.values.list[i] = mc_nbt_clone(col->entities[i].nbt);
-    if (entities->value.values.list[i] == NULL)
-      goto nbt_fatal;
+      return r;
   }
 
-  /* Put tiles */
-  NBT_CREATE(tiles, list, "TileEntities", tile_count);
-  level->value.values.list[9] = tiles;
-  last_tile = tiles->value.values.list;
+  /* Put entities, as they are */
+  NBT_WRITE(mc_nbt_write_list(w,
+                              "Entities",
+                              8,
+                              kNBTCompound,
+                              col->entity_count));
+  for (i = 0; i < col->entity_count; i++)
+    NBT_WRITE(mc_nbt_write_value(w, col->entities[i].nbt, 0));
 
-  for (y = 0; y < kMCChunkMaxY; y++) {
+  /* Put tiles */
+  NBT_WRITE(mc_nbt_write_list(w,
+                              "TileEntities",
+                              12,
+                              kNBTCompound,
+                              tile_count));
+  for (y = 0; y < kMCColumnMaxY; y++) {
     if (col->chunks[y] == NULL)
       continue;
-    r = mc_anvil__encode_tiles(col->chunks[y],
-                               col_x * kMCChunkMaxX,
-                               y * kMCChunkMaxY,
-                               col_z * kMCChunkMaxZ,
-                               &last_tile);
+    r = mc_anvil__encode_tiles(w, col->chunks[y]);
     if (r != 0)
-      goto nbt_fatal;
+      return r;
   }
 
-  return res;
+  /* End of Level and of the root */
+  NBT_WRITE(mc_nbt_write_end(w));
+  return mc_nbt_write_end(w);
+}
+
 
-nbt_fatal:
-  if (res != NULL)
-    mc_nbt_destroy(res);
-  return NULL;
+int mc_anvil__encode_chunk(mc_nbt_writer_t* w,
+                           mc_chunk_t* chunk,
+                           int chunk_y) {
+  int has_add;
+  uint16_t states[MC_CHUNK_BLOCKS];
+  uint8_t blocks[MC_CHUNK_BLOCKS];
+  uint8_t add[MC_CHUNK_NIBBLES];
+  uint8_t data[MC_CHUNK_NIBBLES];
+  uint8_t tmp[MC_CHUNK_NIBBLES];
+
+  mc_chunk_get_states(chunk, states);
+  has_add = mc_chunk_states_to_anvil(states, blocks, add, data);
+
+  NBT_WRITE(mc_nbt_write_compound(w, NULL, 0));
+  NBT_WRITE(mc_nbt_write_i8(w, "Y", 1, chunk_y));
+  NBT_WRITE(mc_nbt_write_i8l(w, "Blocks", 6, blocks, sizeof(blocks)));
+
+  /* Add is optional */
+  if (has_add)
+    NBT_WRITE(mc_nbt_write_i8l(w, "Add", 3, add, sizeof(add)));
+  NBT_WRITE(mc_nbt_write_i8l(w, "Data", 4, data, sizeof(data)));
+
+  /* Light is stored in Anvil's layout, unless it is uniform */
+  NBT_WRITE(mc_nbt_write_i8l(w,
+                             "BlockLight",
+                             10,
+                             mc_chunk_get_nibbles(chunk, 0, tmp),
+                             kMCChunkNibbles));
+  NBT_WRITE(mc_nbt_write_i8l(w,
+                             "SkyLight",
+                             8,
+                             mc_chunk_get_nibbles(chunk, 1, tmp),
+                             kMCChunkNibbles));
+  return mc_nbt_write_end(w);
 }
 
 
-mc_nbt_t* mc_anvil__encode_chunk(mc_chunk_t* chunk,
-                                 int chunk_y,
-                                 int* tile_count) {
-  int size;
-  int off;
-  int x;
-  int y;
-  int z;
-  mc_nbt_t* res;
-  int8_t* blocks;
-  int8_t* add;
-  int8_t* data;
-  int8_t* block_light;
-  int8_t* sky_light;
-
-  NBT_CREATE(res, compound, "", 6);
-  NBT_CREATE(res->value.values.list[0], i8, "Y", chunk_y);
-
-  size = kMCChunkMaxX * kMCChunkMaxZ * kMCChunkMaxY;
-  NBT_CREATE(res->value.values.list[1], i8l, "Blocks", size);
-  blocks = res->value.values.list[1]->value.i8l.list;
-  NBT_CREATE(res->value.values.list[2], i8l, "Add", size / 2);
-  add = res->value.values.list[2]->value.i8l.list;
-  NBT_CREATE(res->value.values.list[3], i8l, "Data", size / 2);
-  data = res->value.values.list[3]->value.i8l.list;
-  NBT_CREATE(res->value.values.list[4], i8l, "BlockLight", size / 2);
-  block_light = res->value.values.list[4]->value.i8l.list;
-  NBT_CREATE(res->value.values.list[5], i8l, "SkyLight", size / 2);
-  sky_light = res->value.values.list[5]->value.i8l.list;
-
-  memset(add, 0, size / 2);
-  memset(data, 0, size / 2);
-  memset(block_light, 0, size / 2);
-  memset(sky_light, 0, size / 2);
-
-  /* Fill arrays */
-  for (x = 0; x < kMCChunkMaxX; x++) {
-    for (z = 0; z < kMCChunkMaxZ; z++) {
-      for (y = 0; y < kMCChunkMaxY; y++) {
-        off = x + z * kMCChunkMaxX  + y * kMCChunkMaxZ * kMCChunkMaxX;
+int mc_anvil__encode_tiles(mc_nbt_writer_t* w, mc_chunk_t* chunk) {
+  int i;
 
-        blocks[off] = chunk->blocks[x][z][y].id & 0xff;
+  /* Only existing tiles are visited */
+  for (i = 0; i < chunk->tile_size; i++) {
+    if (chunk->tiles[i].nbt == NULL)
+      continue;
+    NBT_WRITE(mc_nbt_write_value(w, chunk->tiles[i].nbt, 0));
+  }
 
-        /* Put 4-bit values */
-        add[off >> 1] <<= 4;
-        data[off >> 1] <<= 4;
-        block_light[off >> 1] <<= 4;
-        sky_light[off >> 1] <<= 4;
+  return 0;
+}
 
-        add[off >> 1] |= (chunk->blocks[x][z][y].id >> 8) & 0xf;
-        data[off >> 1] |= chunk->blocks[x][z][y].metadata & 0xf;
-        block_light[off >> 1] |= chunk->blocks[x][z][y].light & 0xf;
-        sky_light[off >> 1] |= chunk->blocks[x][z][y].skylight & 0xf;
 
-        if (chunk->blocks[x][z][y].tile_data != NULL)
-          *tile_count = *tile_count + 1;
-      }
-    }
+int mc_anvil__update_column(mc_column_t* col, int col_x, int col_z) {
+  int r;
+  int i;
+  int y;
+
+  for (i = 0; i < col->entity_count; i++) {
+    r = mc_anvil__update_entity(&col->entities[i]);
+    if (r != 0)
+      return r;
   }
 
-  return res;
+  for (y = 0; y < kMCColumnMaxY; y++) {
+    if (col->chunks[y] == NULL)
+      continue;
+    r = mc_anvil__update_tiles(col->chunks[y],
+                               col_x * kMCChunkMaxX,
+                               y * kMCChunkMaxY,
+                               col_z * kMCChunkMaxZ);
+    if (r != 0)
+      return r;
+  }
 
-nbt_fatal:
-  if (res != NULL)
-    mc_nbt_destroy(res);
-  return NULL;
+  return 0;
 }
 
 
-int mc_anvil__encode_tiles(mc_chunk_t* chunk,
+int mc_anvil__update_tiles(mc_chunk_t* chunk,
                            int x_off,
                            int y_off,
-                           int z_off,
-                           mc_nbt_t*** out) {
-  int x;
-  int y;
-  int z;
-  int glob_x;
-  int glob_y;
-  int glob_z;
+                           int z_off) {
+  int r;
+  int i;
+  int index;
+  mc_anvil__tile_pos_t pos;
   mc_nbt_t* tile_data;
 
-  for (x = 0; x < kMCChunkMaxX; x++) {
-    for (z = 0; z < kMCChunkMaxZ; z++) {
-      for (y = 0; y < kMCChunkMaxY; y++) {
-        tile_data = chunk->blocks[x][z][y].tile_data;
-        if (tile_data == NULL)
-          continue;
-
-        /* Update position in tail data, just in case if the block was moved */
-        glob_x = x + x_off;
-        glob_y = y + y_off;
-        glob_z = z + z_off;
-        NBT_SET(tile_data, "x", kNBTInt, &glob_x);
-        NBT_SET(tile_data, "y", kNBTInt, &glob_y);
-        NBT_SET(tile_data, "z", kNBTInt, &glob_z);
-
-        tile_data = mc_nbt_clone(tile_data);
-        if (tile_data == NULL)
-          return -1;
+  for (i = 0; i < chunk->tile_size; i++) {
+    if (chunk->tiles[i].nbt == NULL)
+      continue;
 
-        **out = tile_data;
-        *out = *out + 1;
-      }
-    }
+    /* Tile may be shared with clones, copy it before updating */
+    tile_data = mc_nbt_unshare(&chunk->tiles[i].nbt);
+    if (tile_data == NULL)
+      return -1;
+
+    /* Update position in tail data, just in case if the block was moved */
+    index = chunk->tiles[i].index;
+    pos.x = (index % kMCChunkMaxX) + x_off;
+    pos.y = (index / (kMCChunkMaxX * kMCChunkMaxZ)) + y_off;
+    pos.z = ((index / kMCChunkMaxX) % kMCChunkMaxZ) + z_off;
+    r = mc_nbt_update_fields(tile_data,
+                             kTileFields,
+                             ARRAY_SIZE(kTileFields),
+                             &pos);
+    if (r != 0)
+      return r;
   }
 
   return 0;
@@ -330,44 +811,18 @@ int mc_anvil__encode_tiles(mc_chunk_t* chunk,
 
 
 static int mc_anvil__update_entity(mc_entity_t* entity) {
-  mc_nbt_t* pos;
-  mc_nbt_t* motion;
-  mc_nbt_t* rotation;
+  mc_nbt_t* nbt;
 
   if (entity->nbt == NULL)
     return -1;
 
-  NBT_OPT_SET(entity->nbt, "OnGround", kNBTByte, &entity->on_ground);
-  NBT_OPT_SET(entity->nbt, "Invulnerable", kNBTByte, &entity->invulnerable);
-  NBT_OPT_SET(entity->nbt, "Air", kNBTShort, &entity->air);
-  NBT_OPT_SET(entity->nbt, "Fire", kNBTShort, &entity->fire);
-  NBT_OPT_SET(entity->nbt, "FallDistance", kNBTFloat, &entity->fall_distance);
-  NBT_SET(entity->nbt, "UUIDMost", kNBTLong, &entity->uuid.obj.high);
-  NBT_SET(entity->nbt, "UUIDLeast", kNBTLong, &entity->uuid.obj.low);
-
-  pos = NBT_GET(entity->nbt, "Pos", kNBTList);
-  motion = NBT_GET(entity->nbt, "Motion", kNBTList);
-  rotation = NBT_GET(entity->nbt, "Rotation", kNBTList);
-  if (pos == NULL || motion == NULL || rotation == NULL)
-    return -1;
-
-  if (pos->value.values.len != 3 ||
-      pos->value.values.list[0]->type != kNBTDouble ||
-      motion->value.values.len != 3 ||
-      motion->value.values.list[0]->type != kNBTDouble ||
-      rotation->value.values.len != 2 ||
-      rotation->value.values.list[0]->type != kNBTFloat) {
+  /* Copy-on-write: only the updated path is copied if nbt is shared */
+  nbt = mc_nbt_unshare(&entity->nbt);
+  if (nbt == NULL)
     return -1;
-  }
-
-  pos->value.values.list[0]->value.f64 = entity->pos_x;
-  pos->value.values.list[1]->value.f64 = entity->pos_y;
-  pos->value.values.list[2]->value.f64 = entity->pos_z;
-  motion->value.values.list[0]->value.f64 = entity->motion_x;
-  motion->value.values.list[1]->value.f64 = entity->motion_y;
-  motion->value.values.list[2]->value.f64 = entity->motion_z;
-  rotation->value.values.list[0]->value.f32 = entity->yaw;
-  rotation->value.values.list[1]->value.f32 = entity->pitch;
 
-  return 0;
+  return mc_nbt_update_fields(nbt,
+                              kEntityFields,
+                              ARRAY_SIZE(kEntityFields),
+                              entity);
 }
@@ -1,134 +1,326 @@
 #include <arpa/inet.h>  /* ntohl */
-#include <stdint.h>  /* uint32_t, uint8_t */
+#include <stdint.h>  /* int64_t, uint32_t, uint8_t, intptr_t */
 #include <stdlib.h>  /* calloc, free, NULL */
-#include <string.h>  /* memcpy */
+#include <sys/mman.h>  /* madvise */
+#include <unistd.h>  /* sysconf */
 
 #include "format/anvil.h"
+#include "format/anvil-private.h"
 #include "format/nbt.h"
+#include "utils/chunk.h"  /* mc_chunk_t */
 #include "utils/common.h"
-
-static int mc_anvil__parse_column(mc_nbt_t* nbt, mc_column_t* col);
-static int mc_anvil__parse_biomes(mc_nbt_t* level, mc_column_t* col);
-static int mc_anvil__parse_chunks(mc_nbt_t* level, mc_column_t* col);
-static mc_entity_t* mc_anvil__parse_entities(mc_nbt_t* level, int* count);
+#include "utils/common-private.h"  /* ARRAY_SIZE */
+#include "utils/parallel.h"  /* mc_parallel_for */
+
+static mc_region_t* mc_anvil__open(const unsigned char* data, int len);
+static int mc_anvil__decode_column(void* arg, int worker, int i);
+static void mc_anvil__prefetch(mc_region_t* reg, int x, int z);
+static int mc_anvil__parse_column(mc_nbt_cursor_t* nbt, mc_column_t* col);
+static int mc_anvil__parse_biomes(mc_nbt_cursor_t* level, mc_column_t* col);
+static int mc_anvil__parse_chunks(mc_nbt_cursor_t* level, mc_column_t* col);
+static mc_entity_t* mc_anvil__parse_entities(mc_nbt_cursor_t* level,
+                                             int* count);
 static int mc_anvil__parse_entity(mc_nbt_t* nbt, mc_entity_t* entity);
-static int mc_anvil__parse_tile_entities(mc_nbt_t* nbt, mc_column_t* col);
-static int mc_anvil__parse_height_map(mc_nbt_t* nbt, mc_column_t* col);
+static int mc_anvil__parse_tile_entities(mc_nbt_cursor_t* level,
+                                         mc_column_t* col);
+static int mc_anvil__parse_height_map(mc_nbt_cursor_t* level,
+                                      mc_column_t* col);
+static int mc_anvil__get_nibbles(mc_nbt_cursor_t* chunk,
+                                 const mc_nbt_key_t* key,
+                                 const uint8_t** out);
 
 static const int kHeaderSize = 1024;  /* 32 * 32 */
 static const int kSectorSize = 4096;
+static const mc_nbt_field_t kColumnFields[] = MC_ANVIL__FIELDS(COLUMN);
+static const mc_nbt_field_t kEntityFields[] = MC_ANVIL__FIELDS(ENTITY);
+static const mc_nbt_field_t kTileFields[] = MC_ANVIL__FIELDS(TILE);
 
 int mc_anvil_parse(const unsigned char* data, int len, mc_region_t** out) {
+  return mc_anvil_parse_parallel(data, len, 1, out);
+}
+
+
+int mc_anvil_parse_parallel(const unsigned char* data,
+                            int len,
+                            int workers,
+                            mc_region_t** out) {
   int r;
-  mc_nbt_parser_t nbt_parser;
   mc_region_t* res;
+
+  res = mc_anvil__open(data, len);
+  if (res == NULL)
+    return -1;
+
+  /* Decode everything while `data` is still there */
+  r = mc_parallel_for(workers,
+                      kHeaderSize,
+                      mc_anvil__decode_column,
+                      res);
+
+  /* `data` is borrowed */
+  res->data = NULL;
+  if (r != 0) {
+    mc_region_destroy(res);
+    return -1;
+  }
+
+  *out = res;
+  return 0;
+}
+
+
+int mc_anvil__decode_column(void* arg, int worker, int i) {
   mc_column_t* col;
-  mc_nbt_t* nbt;
-  int offset;
-  int32_t body_len;
-  uint8_t comp;
-  int x;
-  int z;
 
-  /* Read .mca headers first */
-  if (kHeaderSize > len)
+  /* Columns are independent, and only touch their own `decoded` entry */
+  col = mc_region_get_column(arg, i % kMCColumnMaxX, i / kMCColumnMaxX);
+  return col == NULL ? -1 : 0;
+}
+
+
+int mc_anvil_open(unsigned char* data, int len, mc_region_t** out) {
+  mc_region_t* res;
+
+  res = mc_anvil__open(data, len);
+  if (res == NULL) {
+    free(data);
+    return -1;
+  }
+
+  *out = res;
+  return 0;
+}
+
+
+int mc_anvil_open_file(const char* path, mc_region_t** out) {
+  int len;
+  unsigned char* data;
+  mc_region_t* res;
+
+  len = mc_map_file(path, &data);
+  if (len < 0)
     return -1;
 
+  /* Columns are accessed sparsely, readahead only wastes the page cache */
+  madvise(data, len, MADV_RANDOM);
+
+  res = mc_anvil__open(data, len);
+  if (res == NULL) {
+    mc_unmap_file(data, len);
+    return -1;
+  }
+  res->mapped = 1;
+
+  *out = res;
+  return 0;
+}
+
+
+mc_region_t* mc_anvil__open(const unsigned char* data, int len) {
+  int i;
+  int64_t offset;
+  mc_region_t* res;
+
+  /* Read .mca headers first: locations and timestamps */
+  if (kHeaderSize * 8 > len)
+    return NULL;
+
+  /* Column offsets should point inside the data, past the headers */
+  for (i = 0; i < kHeaderSize; i++) {
+    offset = (int64_t) (ntohl(*(uint32_t*) (data + i * 4)) >> 8) *
+             kSectorSize;
+    if (offset != 0 && (offset < kHeaderSize * 8 || offset + 5 > len))
+      return NULL;
+  }
+
   /* Allocate space for the result */
   res = calloc(1, sizeof(*res));
   if (res == NULL)
-    return -1;
+    return NULL;
 
-  /* Read .mca column by column */
-  for (x = 0; x < kMCColumnMaxX; x++) {
-    for (z = 0; z < kMCColumnMaxZ; z++) {
-      offset = 4 * (x + z * kMCColumnMaxX);
-      offset = (ntohl(*(uint32_t*) (data + offset)) >> 8) * kSectorSize;
+  res->data = (unsigned char*) data;
+  res->len = len;
 
-      /* Not generated yet */
-      if (offset == 0)
-        continue;
+  return res;
+}
+
+
+mc_column_t* mc_region_get_column(mc_region_t* reg, int x, int z) {
+  int r;
+  mc_column_t* col;
+  mc_nbt_cursor_t nbt;
+  unsigned char* uncompressed;
+  const unsigned char* body;
+  int32_t body_len;
+  uint8_t comp;
 
-      if (offset + 5 > len)
-        goto fatal;
+  if (x < 0 || x >= kMCColumnMaxX || z < 0 || z >= kMCColumnMaxZ)
+    return NULL;
 
-      body_len = ntohl(*(int32_t*) (data + offset));
-      comp = data[offset + 4];
-      col = &res->columns[x][z];
+  col = &reg->columns[x][z];
+  if (reg->decoded[x][z])
+    return col;
 
-      /* Not generated yet */
-      if (body_len < 0)
+  /* Column without a file exists only in memory */
+  if (reg->data == NULL) {
+    reg->decoded[x][z] = 1;
+    return col;
+  }
+
+  r = mc_anvil__column_body(reg->data,
+                            reg->len,
+                            x,
+                            z,
+                            &body,
+                            &body_len,
+                            &comp);
+  if (r < 0)
+    return NULL;
+
+  /* Not generated yet */
+  if (r == 1) {
+    reg->decoded[x][z] = 1;
+    return col;
+  }
+
+  /* Neighbours are likely to be requested next */
+  if (reg->mapped)
+    mc_anvil__prefetch(reg, x, z);
+
+  /* Walk raw NBT, only entities are materialized */
+  r = mc_nbt_cursor_open(&nbt,
+                         body,
+                         body_len,
+                         comp == 1 ? kNBTGZip : kNBTDeflate,
+                         &uncompressed);
+  if (r != 0)
+    return NULL;
+
+  /* Parse column's NBT */
+  r = mc_anvil__parse_column(&nbt, col);
+  free(uncompressed);
+  if (r != 0) {
+    mc_column_destroy(col);
+    return NULL;
+  }
+
+  reg->decoded[x][z] = 1;
+  return col;
+}
+
+
+void mc_anvil__prefetch(mc_region_t* reg, int x, int z) {
+  int dx;
+  int dz;
+  long page;
+  uint32_t loc;
+  intptr_t start;
+  intptr_t end;
+
+  page = sysconf(_SC_PAGESIZE);
+  if (page <= 0)
+    return;
+
+  /* Column itself too, it may span several pages */
+  for (dx = x - 1; dx <= x + 1; dx++) {
+    for (dz = z - 1; dz <= z + 1; dz++) {
+      if (dx < 0 || dx >= kMCColumnMaxX || dz < 0 || dz >= kMCColumnMaxZ)
+        continue;
+      if (reg->decoded[dx][dz])
+        continue;
+
+      /* Use sector count from header, don't touch column's pages */
+      loc = ntohl(*(uint32_t*) (reg->data + 4 * (dx + dz * kMCColumnMaxX)));
+      if (loc == 0)
+        continue;
+      start = (intptr_t) (loc >> 8) * kSectorSize;
+      end = start + (intptr_t) (loc & 0xff) * kSectorSize;
+      if (end > reg->len)
+        end = reg->len;
+      if (start >= end)
         continue;
 
-      if (body_len + offset + 4 > len)
-        goto fatal;
-
-      nbt = mc_nbt_preparse(&nbt_parser,
-                            data + offset + 5,
-                            body_len,
-                            comp == 1 ? kNBTGZip : kNBTDeflate,
-                            kSameLifetime);
-      if (nbt == NULL)
-        goto fatal;
-
-      /* Parse column's NBT */
-      r = mc_anvil__parse_column(nbt, col);
-
-      /* Destroy NBT data */
-      mc_nbt_postparse(&nbt_parser);
-      mc_nbt_destroy(nbt);
-      if (r != 0)
-        goto fatal;
+      /* madvise() wants page aligned address */
+      start &= ~(intptr_t) (page - 1);
+      madvise(reg->data + start, end - start, MADV_WILLNEED);
     }
   }
+}
 
-  *out = res;
 
-  return 0;
+int mc_anvil__column_body(const unsigned char* data,
+                          int len,
+                          int x,
+                          int z,
+                          const unsigned char** body,
+                          int32_t* body_len,
+                          uint8_t* comp) {
+  int64_t offset;
 
-fatal:
-  mc_region_destroy(res);
+  offset = 4 * (x + z * kMCColumnMaxX);
+  offset = (int64_t) (ntohl(*(uint32_t*) (data + offset)) >> 8) *
+           kSectorSize;
 
-  return -1;
+  /* Not generated yet */
+  if (offset == 0)
+    return 1;
+
+  /* Offset shouldn't point into the 8 KB header */
+  if (offset < kHeaderSize * 8 || offset + 5 > len)
+    return -1;
+
+  *body_len = ntohl(*(int32_t*) (data + offset));
+  *comp = data[offset + 4];
+  *body = data + offset + 5;
+
+  /* Not generated yet */
+  if (*body_len < 0)
+    return 1;
+
+  if (*body_len > len - offset - 5)
+    return -1;
+
+  return 0;
 }
 
 
-int mc_anvil__parse_column(mc_nbt_t* nbt, mc_column_t* col) {
+int mc_anvil__parse_column(mc_nbt_cursor_t* nbt, mc_column_t* col) {
   int r;
-  mc_nbt_t* level;
+  mc_nbt_cursor_t level;
 
-  level = NBT_GET(nbt, "Level", kNBTCompound);
-  if (level == NULL)
+  r = NBT_CURSOR_FIND(nbt, "Level", kNBTCompound, &level);
+  if (r != 0)
     return -1;
 
-  NBT_READ(level, "TerrainPopulated", kNBTByte, &col->populated);
-  NBT_READ(level, "xPos", kNBTInt, &col->world_x);
-  NBT_READ(level, "zPos", kNBTInt, &col->world_z);
-  NBT_READ(level, "LastUpdate", kNBTLong, &col->last_update);
-  NBT_READ(level, "InhabitedTime", kNBTLong, &col->inhabited_time);
+  r = mc_nbt_cursor_decode_fields(&level,
+                                  kColumnFields,
+                                  ARRAY_SIZE(kColumnFields),
+                                  col);
+  if (r != 0)
+    return r;
 
   /* Parse biomes */
-  r = mc_anvil__parse_biomes(level, col);
+  r = mc_anvil__parse_biomes(&level, col);
   if (r != 0)
     return r;
 
   /* Parse chunks */
-  r = mc_anvil__parse_chunks(level, col);
+  r = mc_anvil__parse_chunks(&level, col);
   if (r != 0)
     return r;
 
   /* Parse entities */
-  col->entities = mc_anvil__parse_entities(level, &col->entity_count);
+  col->entities = mc_anvil__parse_entities(&level, &col->entity_count);
   if (col->entities == NULL)
     return -1;
 
   /* Parse tile entities */
-  r = mc_anvil__parse_tile_entities(level, col);
+  r = mc_anvil__parse_tile_entities(&level, col);
   if (r != 0)
     return -1;
 
   /* Parse height map */
-  r = mc_anvil__parse_height_map(level, col);
+  r = mc_anvil__parse_height_map(&level, col);
   if (r != 0)
     return -1;
 
@@ -138,21 +330,24 @@ int mc_anvil__parse_column(mc_nbt_t* nbt, mc_column_t* col) {
 }
 
 
-int mc_anvil__parse_biomes(mc_nbt_t* level, mc_column_t* col) {
+int mc_anvil__parse_biomes(mc_nbt_cursor_t* level, mc_column_t* col) {
+  int r;
   int x;
   int z;
   int off;
-  int array_size;
-  mc_nbt_t* biomes;
-
-  array_size = kMCChunkMaxX * kMCChunkMaxZ;
-  biomes = NBT_GET(level, "Biomes", kNBTByteArray);
-  if (biomes == NULL || biomes->value.i8l.len != array_size)
+  int32_t len;
+  const int8_t* biomes;
+  mc_nbt_cursor_t cur;
+
+  r = NBT_CURSOR_FIND(level, "Biomes", kNBTByteArray, &cur);
+  if (r == 0)
+    r = mc_nbt_cursor_array(&cur, kNBTByteArray, (const void**) &biomes, &len);
+  if (r != 0 || len != kMCChunkMaxX * kMCChunkMaxZ)
     return -1;
   for (x = 0; x < kMCChunkMaxX; x++) {
     for (z = 0; z < kMCChunkMaxZ; z++) {
       off = x + z * kMCChunkMaxX;
-      col->biomes[x][z] = (mc_biome_t) biomes->value.i8l.list[off];
+      col->biomes[x][z] = (mc_biome_t) biomes[off];
     }
   }
 
@@ -160,103 +355,109 @@ int mc_anvil__parse_biomes(mc_nbt_t* level, mc_column_t* col) {
 }
 
 
-int mc_anvil__parse_chunks(mc_nbt_t* level, mc_column_t* col) {
+int mc_anvil__get_nibbles(mc_nbt_cursor_t* chunk,
+                          const mc_nbt_key_t* key,
+                          const uint8_t** out) {
+  int r;
+  int32_t len;
+  mc_nbt_cursor_t cur;
+
+  r = mc_nbt_cursor_find_key(chunk, key, kNBTByteArray, &cur);
+  if (r != 0)
+    return r;
+  r = mc_nbt_cursor_array(&cur, kNBTByteArray, (const void**) out, &len);
+  if (r != 0)
+    return r;
+  if (len != kMCChunkNibbles)
+    return -1;
+
+  return 0;
+}
+
+
+int mc_anvil__parse_chunks(mc_nbt_cursor_t* level, mc_column_t* col) {
   int i;
-  int x;
+  int r;
   int8_t y;
-  int z;
-  int off;
-  int array_size;
-  uint8_t block_light;
-  uint8_t sky_light;
-  uint8_t block_data;
-  uint16_t block_add;
-  mc_nbt_t* chunks;
-  mc_nbt_t* chunk;
-  mc_nbt_t* blocks;
-  mc_nbt_t* block_lights;
-  mc_nbt_t* sky_lights;
-  mc_nbt_t* block_datas;
-  mc_nbt_t* block_adds;
+  int32_t len;
+  mc_nbt_cursor_t chunks;
+  mc_nbt_cursor_t chunk;
+  mc_nbt_cursor_t cur;
+  const uint8_t* blocks;
+  const uint8_t* block_lights;
+  const uint8_t* sky_lights;
+  const uint8_t* block_datas;
+  const uint8_t* block_adds;
   mc_chunk_t* mchunk;
-  mc_block_t* block;
+  uint16_t states[MC_CHUNK_BLOCKS];
 
-  chunks = NBT_GET(level, "Sections", kNBTList);
-  if (chunks == NULL)
+  r = NBT_CURSOR_FIND(level, "Sections", kNBTList, &chunks);
+  if (r != 0)
     return -1;
-  for (i = 0; i < chunks->value.values.len; i++) {
-    chunk = chunks->value.values.list[i];
+  for (r = mc_nbt_cursor_first(&chunks, &chunk);
+       r == 0;
+       r = mc_nbt_cursor_next(&chunk)) {
+    if (chunk.type != kNBTCompound)
+      goto read_chunks_failed;
 
-    NBT_READ(chunk, "Y", kNBTByte, &y);
-    if (y < 0 || y >= kMCColumnMaxY)
+    r = NBT_CURSOR_FIND(&chunk, "Y", kNBTByte, &cur);
+    if (r == 0)
+      r = mc_nbt_cursor_read(&cur, kNBTByte, &y);
+    if (r != 0 || y < 0 || y >= kMCColumnMaxY || col->chunks[y] != NULL)
+      goto read_chunks_failed;
+
+    /* Read block ids */
+    r = NBT_CURSOR_FIND(&chunk, "Blocks", kNBTByteArray, &cur);
+    if (r == 0) {
+      r = mc_nbt_cursor_array(&cur,
+                              kNBTByteArray,
+                              (const void**) &blocks,
+                              &len);
+    }
+    if (r != 0 || len != kMCChunkBlocks)
+      goto read_chunks_failed;
+
+    r = mc_anvil__get_nibbles(&chunk, NBT_KEY("BlockLight"), &block_lights);
+    if (r != 0)
+      goto read_chunks_failed;
+    r = mc_anvil__get_nibbles(&chunk, NBT_KEY("SkyLight"), &sky_lights);
+    if (r != 0)
+      goto read_chunks_failed;
+    r = mc_anvil__get_nibbles(&chunk, NBT_KEY("Data"), &block_datas);
+    if (r != 0)
       goto read_chunks_failed;
+    r = mc_anvil__get_nibbles(&chunk, NBT_KEY("Add"), &block_adds);
+    if (r != 0)
+      block_adds = NULL;
+
+    mc_chunk_states_from_anvil(blocks, block_adds, block_datas, states);
 
-    mchunk = malloc(sizeof(*mchunk));
+    mchunk = mc_chunk_new();
     if (mchunk == NULL)
       goto read_chunks_failed;
     col->chunks[y] = mchunk;
 
-    /* Read block ids */
-    array_size = kMCChunkMaxX * kMCChunkMaxZ * kMCChunkMaxY;
-    blocks = NBT_GET(chunk, "Blocks", kNBTByteArray);
-    block_lights = NBT_GET(chunk, "BlockLight", kNBTByteArray);
-    sky_lights = NBT_GET(chunk, "SkyLight", kNBTByteArray);
-    block_datas = NBT_GET(chunk, "Data", kNBTByteArray);
-    block_adds = NBT_GET(chunk, "Add", kNBTByteArray);
-
-    if (blocks == NULL || block_lights == NULL || sky_lights == NULL)
-      goto read_chunks_failed;
-    if (blocks->value.i8l.len != array_size ||
-        block_lights->value.i8l.len != (array_size / 2) ||
-        sky_lights->value.i8l.len != (array_size / 2) ||
-        block_datas->value.i8l.len != (array_size / 2) ||
-        (block_adds != NULL && block_adds->value.i8l.len != (array_size / 2))) {
+    r = mc_chunk_load_states(mchunk, states);
+    if (r != 0)
       goto read_chunks_failed;
-    }
 
-    for (x = 0; x < kMCChunkMaxX; x++) {
-      for (z = 0; z < kMCChunkMaxZ; z++) {
-        for (y = 0; y < kMCChunkMaxY; y++) {
-          off = x + z * kMCChunkMaxX + y * kMCChunkMaxX * kMCChunkMaxZ;
-
-          block = &mchunk->blocks[x][z][y];
-          if (block_adds == NULL) {
-            block_add = 0;
-          } else {
-            block_add = block_adds->value.i8l.list[off >> 1];
-            if (off % 2 == 0)
-              block_add = block_add >> 4;
-            else
-              block_add = block_add & 0xf;
-          }
-          block_add = block_add << 8;
-          block->id = (mc_block_id_t) (block_add | blocks->value.i8l.list[off]);
-
-          block_light = (uint8_t) block_lights->value.i8l.list[off >> 1];
-          sky_light = (uint8_t) sky_lights->value.i8l.list[off >> 1];
-          block_data = (uint8_t) block_datas->value.i8l.list[off >> 1];
-          if (off % 2 == 0) {
-            block->light = block_light >> 4;
-            block->skylight = sky_light >> 4;
-            block->metadata = block_data >> 4;
-          } else {
-            block->light = block_light & 0xf;
-            block->skylight = sky_light & 0xf;
-            block->metadata = block_data & 0xf;
-          }
-
-          block->tile_data = NULL;
-        }
-      }
-    }
+    /* Light has the same layout as in Anvil, uniform one isn't stored */
+    r = mc_chunk_load_light(mchunk, block_lights, sky_lights);
+    if (r != 0)
+      goto read_chunks_failed;
   }
 
+  /* Malformed list */
+  if (r < 0)
+    goto read_chunks_failed;
+
   return 0;
 
 read_chunks_failed:
   /* Deallocate all read chunks */
   for (i = 0; i < kMCColumnMaxY; i++) {
-    free(col->chunks[i]);
+    if (col->chunks[i] != NULL)
+      mc_chunk_destroy(col->chunks[i]);
     col->chunks[i] = NULL;
   }
 
@@ -264,28 +465,45 @@ read_chunks_failed:
 }
 
 
-mc_entity_t* mc_anvil__parse_entities(mc_nbt_t* level, int* count) {
-  mc_nbt_t* entities;
+mc_entity_t* mc_anvil__parse_entities(mc_nbt_cursor_t* level, int* count) {
+  mc_nbt_cursor_t entities;
+  mc_nbt_cursor_t cur;
   mc_nbt_t* entity;
   mc_entity_t* res;
+  int32_t len;
   int i;
   int r;
 
-  entities = NBT_GET(level, "Entities", kNBTList);
-  if (entities == NULL)
+  r = NBT_CURSOR_FIND(level, "Entities", kNBTList, &entities);
+  if (r != 0 || entities.end - entities.data < 5)
     goto get_entities_failed;
 
-  res = malloc(sizeof(*res) * entities->value.values.len);
+  len = ntohl(*(int32_t*) (entities.data + 1));
+  if (len < 0)
+    goto get_entities_failed;
+
+  res = malloc(sizeof(*res) * len);
   if (res == NULL)
     goto get_entities_failed;
 
-  for (i = 0; i < entities->value.values.len; i++) {
-    entity = entities->value.values.list[i];
+  /* Entities are stored as-is, materialize only them */
+  i = 0;
+  for (r = mc_nbt_cursor_first(&entities, &cur);
+       r == 0 && i < len;
+       r = mc_nbt_cursor_next(&cur), i++) {
+    entity = mc_nbt_cursor_parse(&cur);
+    if (entity == NULL)
+      goto read_entities_failed;
+
     r = mc_anvil__parse_entity(entity, &res[i]);
-    if (r != 0)
+    if (r != 0) {
+      mc_nbt_destroy(entity);
       goto read_entities_failed;
+    }
   }
-  *count = entities->value.values.len;
+  if (r < 0 || i != len)
+    goto read_entities_failed;
+  *count = len;
 
   return res;
 
@@ -303,7 +521,9 @@ get_entities_failed:
 
 int mc_anvil__parse_entity(mc_nbt_t* nbt, mc_entity_t* entity) {
   mc_nbt_t* id;
-  mc_nbt_t* list;
+
+  if (nbt->type != kNBTCompound)
+    return -1;
 
   id = NBT_GET(nbt, "id", kNBTString);
   if (id == NULL)
@@ -311,108 +531,97 @@ int mc_anvil__parse_entity(mc_nbt_t* nbt, mc_entity_t* entity) {
   else
     entity->id = mc_entity_str_to_id(id->value.str.value, id->value.str.len);
 
-  NBT_OPT_READ(nbt, "OnGround", kNBTByte, &entity->on_ground, 0);
-  NBT_OPT_READ(nbt, "Invulnerable", kNBTByte, &entity->invulnerable, 0);
-  NBT_OPT_READ(nbt, "Air", kNBTShort, &entity->air, 0);
-  NBT_OPT_READ(nbt, "Fire", kNBTShort, &entity->fire, 0);
-  NBT_OPT_READ(nbt, "FallDistance", kNBTFloat, &entity->fall_distance, 0.0);
-  NBT_READ(nbt, "UUIDMost", kNBTLong, &entity->uuid.obj.high);
-  NBT_READ(nbt, "UUIDLeast", kNBTLong, &entity->uuid.obj.low);
-
-  list = NBT_GET(nbt, "Pos", kNBTList);
-  if (list == NULL ||
-      list->value.values.len != 3 ||
-      list->value.values.list[0]->type != kNBTDouble) {
-    return -1;
-  }
-  entity->pos_x = list->value.values.list[0]->value.f64;
-  entity->pos_y = list->value.values.list[1]->value.f64;
-  entity->pos_z = list->value.values.list[2]->value.f64;
-
-  list = NBT_GET(nbt, "Motion", kNBTList);
-  if (list == NULL ||
-      list->value.values.len != 3 ||
-      list->value.values.list[0]->type != kNBTDouble) {
+  /* All fields in a single pass */
+  if (mc_nbt_decode_fields(nbt,
+                           kEntityFields,
+                           ARRAY_SIZE(kEntityFields),
+                           entity) != 0) {
     return -1;
   }
-  entity->motion_x = list->value.values.list[0]->value.f64;
-  entity->motion_y = list->value.values.list[1]->value.f64;
-  entity->motion_z = list->value.values.list[2]->value.f64;
-
-  list = NBT_GET(nbt, "Rotation", kNBTList);
-  if (list == NULL ||
-      list->value.values.len != 2 ||
-      list->value.values.list[0]->type != kNBTFloat) {
-    return -1;
-  }
-  entity->yaw = list->value.values.list[0]->value.f32;
-  entity->pitch = list->value.values.list[1]->value.f32;
 
-  entity->nbt = mc_nbt_clone(nbt);
-  if (entity->nbt == NULL)
-    return -1;
+  /* Entity owns the tree now */
+  entity->nbt = nbt;
 
   return 0;
 }
 
 
-int mc_anvil__parse_tile_entities(mc_nbt_t* nbt, mc_column_t* col) {
-  int i;
+int mc_anvil__parse_tile_entities(mc_nbt_cursor_t* level, mc_column_t* col) {
+  int r;
   int32_t x;
   int32_t y;
   int32_t z;
   int chunk_y;
   int chunk_y_off;
-  mc_nbt_t* list;
+  mc_nbt_cursor_t list;
+  mc_nbt_cursor_t cur;
   mc_nbt_t* tile;
   mc_chunk_t* chunk;
+  mc_anvil__tile_pos_t pos;
 
-  list = NBT_GET(nbt, "TileEntities", kNBTList);
-  if (list == NULL || list->value.values.len == 0)
+  r = NBT_CURSOR_FIND(level, "TileEntities", kNBTList, &list);
+  if (r != 0)
     return 0;
 
-  if (list->value.values.list[0]->type != kNBTCompound)
-    return -1;
-
-  for (i = 0; i < list->value.values.len; i++) {
-    tile = mc_nbt_clone(list->value.values.list[i]);
-    if (tile == NULL)
+  for (r = mc_nbt_cursor_first(&list, &cur);
+       r == 0;
+       r = mc_nbt_cursor_next(&cur)) {
+    if (cur.type != kNBTCompound)
       return -1;
 
-    NBT_READ(tile, "x", kNBTInt, &x);
-    NBT_READ(tile, "y", kNBTInt, &y);
-    NBT_READ(tile, "z", kNBTInt, &z);
+    r = mc_nbt_cursor_decode_fields(&cur,
+                                    kTileFields,
+                                    ARRAY_SIZE(kTileFields),
+                                    &pos);
+    if (r != 0)
+      return r;
+    x = pos.x;
+    y = pos.y;
+    z = pos.z;
 
+    if (y < 0 || y >= kMCColumnMaxY * kMCChunkMaxY)
+      return -1;
     chunk_y = y / kMCChunkMaxY;
     chunk_y_off = y % kMCChunkMaxY;
-    if (chunk_y < 0 || chunk_y > kMCColumnMaxY)
-      return -1;
 
-    x = x % kMCChunkMaxX;
-    z = z % kMCChunkMaxZ;
+    /* World coordinates may be negative */
+    x &= kMCChunkMaxX - 1;
+    z &= kMCChunkMaxZ - 1;
 
     chunk = col->chunks[chunk_y];
     if (chunk == NULL)
       return -1;
-    chunk->blocks[x][z][chunk_y_off].tile_data = tile;
+
+    tile = mc_nbt_cursor_parse(&cur);
+    if (tile == NULL)
+      return -1;
+    if (mc_chunk_set_tile(chunk, x, chunk_y_off, z, tile) != 0) {
+      mc_nbt_destroy(tile);
+      return -1;
+    }
   }
 
-  return 0;
+  return r < 0 ? -1 : 0;
 }
 
 
-int mc_anvil__parse_height_map(mc_nbt_t* nbt, mc_column_t* col) {
-  mc_nbt_t* map;
+int mc_anvil__parse_height_map(mc_nbt_cursor_t* level, mc_column_t* col) {
+  int r;
   int x;
   int z;
-
-  map = NBT_GET(nbt, "HeightMap", kNBTIntArray);
-  if (map == NULL || map->value.i32l.len != kMCChunkMaxX * kMCChunkMaxZ)
+  int32_t len;
+  const uint32_t* map;
+  mc_nbt_cursor_t cur;
+
+  r = NBT_CURSOR_FIND(level, "HeightMap", kNBTIntArray, &cur);
+  if (r == 0)
+    r = mc_nbt_cursor_array(&cur, kNBTIntArray, (const void**) &map, &len);
+  if (r != 0 || len != kMCChunkMaxX * kMCChunkMaxZ)
     return -1;
 
   for (x = 0; x < kMCChunkMaxX; x++)
     for (z = 0; z < kMCChunkMaxZ; z++)
-      col->height_map[x][z] = map->value.i32l.list[x + z * kMCChunkMaxX];
+      col->height_map[x][z] = ntohl(map[x + z * kMCChunkMaxX]);
 
   return 0;
 }
@@ -0,0 +1,67 @@
+#ifndef SRC_FORMAT_ANVIL_PRIVATE_H_
+#define SRC_FORMAT_ANVIL_PRIVATE_H_
+
+#include <stdint.h>  /* int32_t */
+
+#include "format/nbt.h"  /* MC_NBT_FIELD */
+#include "utils/common.h"  /* mc_column_t, mc_entity_t */
+
+typedef struct mc_anvil__tile_pos_s mc_anvil__tile_pos_t;
+
+/* Absolute position of tile entity */
+struct mc_anvil__tile_pos_s {
+  int32_t x;
+  int32_t y;
+  int32_t z;
+};
+
+/*
+ * Find compressed body of column in raw .mca data, returns 1 if column is
+ * not generated.
+ */
+int mc_anvil__column_body(const unsigned char* data,
+                          int len,
+                          int x,
+                          int z,
+                          const unsigned char** body,
+                          int32_t* body_len,
+                          uint8_t* comp);
+
+/*
+ * Field tables, X(prop, type, len, field, required). Expand them with
+ * MC_NBT_FIELD() to get mc_nbt_field_t arrays, see MC_ANVIL__FIELDS().
+ */
+#define MC_ANVIL__COLUMN_FIELDS(X) \
+    X("xPos", kNBTInt, 0, world_x, 1) \
+    X("zPos", kNBTInt, 0, world_z, 1) \
+    X("LastUpdate", kNBTLong, 0, last_update, 1) \
+    X("TerrainPopulated", kNBTByte, 0, populated, 1) \
+    X("InhabitedTime", kNBTLong, 0, inhabited_time, 1)
+
+#define MC_ANVIL__ENTITY_FIELDS(X) \
+    X("OnGround", kNBTByte, 0, on_ground, 0) \
+    X("Invulnerable", kNBTByte, 0, invulnerable, 0) \
+    X("Air", kNBTShort, 0, air, 0) \
+    X("Fire", kNBTShort, 0, fire, 0) \
+    X("FallDistance", kNBTFloat, 0, fall_distance, 0) \
+    X("UUIDMost", kNBTLong, 0, uuid.obj.high, 1) \
+    X("UUIDLeast", kNBTLong, 0, uuid.obj.low, 1) \
+    X("Pos", kNBTDouble, 3, pos_x, 1) \
+    X("Motion", kNBTDouble, 3, motion_x, 1) \
+    X("Rotation", kNBTFloat, 2, yaw, 1)
+
+#define MC_ANVIL__TILE_FIELDS(X) \
+    X("x", kNBTInt, 0, x, 1) \
+    X("y", kNBTInt, 0, y, 1) \
+    X("z", kNBTInt, 0, z, 1)
+
+#define MC_ANVIL__COLUMN_FIELD(...) MC_NBT_FIELD(mc_column_t, __VA_ARGS__)
+#define MC_ANVIL__ENTITY_FIELD(...) MC_NBT_FIELD(mc_entity_t, __VA_ARGS__)
+#define MC_ANVIL__TILE_FIELD(...) \
+    MC_NBT_FIELD(mc_anvil__tile_pos_t, __VA_ARGS__)
+
+/* Usage: static const mc_nbt_field_t k[] = MC_ANVIL__FIELDS(COLUMN); */
+#define MC_ANVIL__FIELDS(name) \
+    { MC_ANVIL__##name##_FIELDS(MC_ANVIL__##name##_FIELD) }
+
+#endif  /* SRC_FORMAT_ANVIL_PRIVATE_H_ */
@@ -1,9 +1,48 @@
 #ifndef SRC_FORMAT_ANVIL_H_
 #define SRC_FORMAT_ANVIL_H_
 
+#include "utils/chain.h"  /* mc_chain_t */
 #include "utils/common.h"
 
 int mc_anvil_parse(const unsigned char* data, int len, mc_region_t** out);
+
+/*
+ * Only validate .mca headers, columns are decoded on first access by
+ * mc_region_get_column(). Region takes ownership of malloc'ed `data`, even
+ * on failure.
+ */
+int mc_anvil_open(unsigned char* data, int len, mc_region_t** out);
+
+/*
+ * Same as mc_anvil_open(), but file is mmap()'ed. Compressed columns are
+ * read straight from the page cache, and only pages of touched columns
+ * (and of their neighbours) are read from disk.
+ */
+int mc_anvil_open_file(const char* path, mc_region_t** out);
+
+/* Returns NULL if column is malformed, or if `x`/`z` are out of region */
+mc_column_t* mc_region_get_column(mc_region_t* reg, int x, int z);
 int mc_anvil_encode(mc_region_t* reg, unsigned char** out);
+int mc_anvil_encode_chain(mc_region_t* reg, mc_chain_t* out);
+
+/*
+ * Decode or compress columns on `workers` threads, calling thread is one of
+ * them. Results are the same as of the sequential functions above.
+ */
+int mc_anvil_parse_parallel(const unsigned char* data,
+                            int len,
+                            int workers,
+                            mc_region_t** out);
+int mc_anvil_encode_parallel(mc_region_t* reg,
+                             int workers,
+                             unsigned char** out);
+
+/*
+ * Write only dirty columns of region into the .mca file at `path` in place,
+ * and clear their `dirty` flag. Columns are put into sectors that are free
+ * in the current file, and the header is written last, so the file stays
+ * consistent if the save is interrupted. File is created if needed.
+ */
+int mc_anvil_save(mc_region_t* reg, const char* path);
 
 #endif  /* SRC_FORMAT_ANVIL_H_ */
@@ -1,10 +1,36 @@
-#include <stdlib.h>  /* malloc, free, NULL */
+#include <limits.h>  /* INT_MAX */
+#include <pthread.h>  /* pthread_* */
+#include <stdlib.h>  /* abort, calloc, malloc, realloc, free, NULL */
 #include <string.h>  /* memset */
 
 #include "format/nbt-private.h"
 #include "zlib.h"
 
+typedef struct mc_nbt__zlib_cache_s mc_nbt__zlib_cache_t;
+
+/* Per-thread streams, indexed by [decompress][comp == kNBTGZip] */
+struct mc_nbt__zlib_cache_s {
+  z_stream streams[2][2];
+  int ready[2][2];
+};
+
+static z_stream* mc_nbt__zlib_stream(mc_nbt_comp_t comp, int decompress);
+static void mc_nbt__zlib_end(z_stream* stream, int decompress);
+static void mc_nbt__zlib_key_init();
+static void mc_nbt__zlib_cache_destroy(void* arg);
+static int mc_nbt__zlib_hint(z_stream* stream,
+                             const unsigned char* data,
+                             int len,
+                             mc_nbt_comp_t comp,
+                             int decompress);
+
 static const int kZlibIncrement = 64 * 1024;
+static const int kMaxInflateRatio = 1032;  /* deflate can't do better */
+static const int kInflateGuess = 4;
+
+static pthread_once_t mc_nbt__zlib_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mc_nbt__zlib_key;
+static int mc_nbt__zlib_key_ok;
 
 
 int mc_nbt__zlib(const unsigned char* data,
@@ -15,79 +41,243 @@ int mc_nbt__zlib(const unsigned char* data,
   int r;
   int out_len;
   unsigned char* tmp;
-  z_stream stream;
+  z_stream local;
+  z_stream* stream;
 
-  memset(&stream, 0, sizeof(stream));
-  if (decompress) {
-    r = inflateInit2(&stream, comp == kNBTGZip ? kGZipBits : kDeflateBits);
-  } else {
-    r = deflateInit2(&stream,
-                     3,
-                     Z_DEFLATED,
-                     comp == kNBTGZip ? kGZipBits : kDeflateBits,
-                     8,
-                     Z_DEFAULT_STRATEGY);
+  /* Reuse thread's stream, if possible */
+  stream = mc_nbt__zlib_stream(comp, decompress);
+  if (stream == NULL) {
+    stream = &local;
+    if (mc_nbt__zlib_init(stream, comp, decompress) != 0)
+      return -1;
   }
-  if (r != Z_OK)
-    return -1;
 
-  stream.next_in = (unsigned char*) data;
-  stream.avail_in = len;
+  stream->next_in = (unsigned char*) data;
+  stream->avail_in = len;
 
-  /* NBT should be really good at compressing */
-  out_len = kZlibIncrement;
+  /* Size output upfront, so that it usually is a single pass */
+  out_len = mc_nbt__zlib_hint(stream, data, len, comp, decompress);
   *out = malloc(out_len);
   if (*out == NULL)
     goto fatal;
 
-  stream.avail_out = out_len;
-  stream.next_out = *out;
+  stream->avail_out = out_len;
+  stream->next_out = *out;
 
   do {
     if (decompress)
-      r = inflate(&stream, stream.avail_in == 0 ? Z_FINISH : Z_SYNC_FLUSH);
+      r = inflate(stream, Z_FINISH);
     else
-      r = deflate(&stream, stream.avail_in == 0 ? Z_FINISH : Z_SYNC_FLUSH);
+      r = deflate(stream, Z_FINISH);
 
     if (r == Z_STREAM_END)
       break;
 
-    if (r != Z_OK)
+    /* Z_BUF_ERROR is returned with Z_FINISH if output is too small */
+    if (r != Z_OK && r != Z_BUF_ERROR)
+      goto fatal;
+    if (stream->avail_out != 0)
       goto fatal;
 
-    if (stream.avail_out != 0)
-      continue;
-
-    /* Buffer too small... */
-    tmp = malloc(out_len + kZlibIncrement);
+    /* Hint was wrong, grow geometrically */
+    if (out_len > INT_MAX / 2)
+      goto fatal;
+    tmp = realloc(*out, out_len * 2);
     if (tmp == NULL)
       goto fatal;
-    memcpy(tmp, *out, out_len);
-    free(*out);
     *out = tmp;
 
-    stream.avail_out = kZlibIncrement;
-    stream.next_out = *out + out_len;
-    out_len += kZlibIncrement;
+    stream->avail_out = out_len;
+    stream->next_out = *out + out_len;
+    out_len *= 2;
   } while (1);
 
-  if (r != Z_STREAM_END)
-    goto fatal;
-
-  if (decompress)
-    r = inflateEnd(&stream);
-  else
-    r = deflateEnd(&stream);
-  if (r != Z_OK)
-    goto fatal;
+  out_len -= stream->avail_out;
+  if (stream == &local)
+    mc_nbt__zlib_end(stream, decompress);
 
-  return out_len - stream.avail_out;
+  return out_len;
 
 fatal:
-  if (decompress)
-    inflateEnd(&stream);
-  else
-    deflateEnd(&stream);
+  if (stream == &local)
+    mc_nbt__zlib_end(stream, decompress);
   free(*out);
   return -1;
 }
+
+
+void mc_nbt_thread_cleanup() {
+  mc_nbt__zlib_cache_t* cache;
+
+  pthread_once(&mc_nbt__zlib_once, mc_nbt__zlib_key_init);
+  if (!mc_nbt__zlib_key_ok)
+    return;
+
+  /* Destructor isn't invoked for the main thread */
+  cache = pthread_getspecific(mc_nbt__zlib_key);
+  if (cache == NULL)
+    return;
+  pthread_setspecific(mc_nbt__zlib_key, NULL);
+  mc_nbt__zlib_cache_destroy(cache);
+}
+
+
+z_stream* mc_nbt__zlib_stream(mc_nbt_comp_t comp, int decompress) {
+  int r;
+  int gzip;
+  mc_nbt__zlib_cache_t* cache;
+
+  pthread_once(&mc_nbt__zlib_once, mc_nbt__zlib_key_init);
+  if (!mc_nbt__zlib_key_ok)
+    return NULL;
+
+  cache = pthread_getspecific(mc_nbt__zlib_key);
+  if (cache == NULL) {
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+      return NULL;
+    if (pthread_setspecific(mc_nbt__zlib_key, cache) != 0) {
+      free(cache);
+      return NULL;
+    }
+  }
+
+  decompress = decompress ? 1 : 0;
+  gzip = comp == kNBTGZip ? 1 : 0;
+  if (cache->ready[decompress][gzip]) {
+    if (decompress)
+      r = inflateReset(&cache->streams[decompress][gzip]);
+    else
+      r = deflateReset(&cache->streams[decompress][gzip]);
+    if (r == Z_OK)
+      return &cache->streams[decompress][gzip];
+
+    mc_nbt__zlib_end(&cache->streams[decompress][gzip], decompress);
+    cache->ready[decompress][gzip] = 0;
+  }
+
+  r = mc_nbt__zlib_init(&cache->streams[decompress][gzip], comp, decompress);
+  if (r != 0)
+    return NULL;
+  cache->ready[decompress][gzip] = 1;
+
+  return &cache->streams[decompress][gzip];
+}
+
+
+int mc_nbt__zlib_init(z_stream* stream, mc_nbt_comp_t comp, int decompress) {
+  int r;
+
+  memset(stream, 0, sizeof(*stream));
+  if (decompress) {
+    r = inflateInit2(stream, comp == kNBTGZip ? kGZipBits : kDeflateBits);
+  } else {
+    r = deflateInit2(stream,
+                     3,
+                     Z_DEFLATED,
+                     comp == kNBTGZip ? kGZipBits : kDeflateBits,
+                     8,
+                     Z_DEFAULT_STRATEGY);
+  }
+
+  return r == Z_OK ? 0 : -1;
+}
+
+
+void mc_nbt__zlib_end(z_stream* stream, int decompress) {
+  if (decompress)
+    inflateEnd(stream);
+  else
+    deflateEnd(stream);
+}
+
+
+void mc_nbt__zlib_key_init() {
+  mc_nbt__zlib_key_ok = pthread_key_create(&mc_nbt__zlib_key,
+                                           mc_nbt__zlib_cache_destroy) == 0;
+}
+
+
+void mc_nbt__zlib_cache_destroy(void* arg) {
+  int i;
+  int j;
+  mc_nbt__zlib_cache_t* cache;
+
+  cache = arg;
+  for (i = 0; i < 2; i++)
+    for (j = 0; j < 2; j++)
+      if (cache->ready[i][j])
+        mc_nbt__zlib_end(&cache->streams[i][j], i);
+  free(cache);
+}
+
+
+int mc_nbt__zlib_hint(z_stream* stream,
+                      const unsigned char* data,
+                      int len,
+                      mc_nbt_comp_t comp,
+                      int decompress) {
+  uint32_t isize;
+
+  /* NOTE: zlib 1.2.3 deflateBound() doesn't account for gzip header */
+  if (!decompress)
+    return (int) deflateBound(stream, len) + 32;
+
+  /* GZip trailer has uncompressed size modulo 2^32 */
+  if (comp == kNBTGZip && len >= 18) {
+    isize = (uint32_t) data[len - 4] |
+            ((uint32_t) data[len - 3] << 8) |
+            ((uint32_t) data[len - 2] << 16) |
+            ((uint32_t) data[len - 1] << 24);
+
+    /* +1 to get Z_STREAM_END without extra pass */
+    if (isize > 0 &&
+        isize < 0x7fffffff &&
+        isize / kMaxInflateRatio <= (uint32_t) len) {
+      return (int) isize + 1;
+    }
+  }
+
+  if (len > 0x7fffffff / kInflateGuess / 2)
+    return kZlibIncrement;
+  return len * kInflateGuess > kZlibIncrement ? len * kInflateGuess :
+                                                kZlibIncrement;
+}
+
+mc_nbt__tag_t mc_nbt__type_to_tag(mc_nbt_type_t type) {
+  switch (type) {
+    case kNBTByte: return kNBTTagByte; break;
+    case kNBTShort: return kNBTTagShort; break;
+    case kNBTInt: return kNBTTagInt; break;
+    case kNBTLong: return kNBTTagLong; break;
+    case kNBTFloat: return kNBTTagFloat; break;
+    case kNBTDouble: return kNBTTagDouble; break;
+    case kNBTByteArray: return kNBTTagByteArray; break;
+    case kNBTIntArray: return kNBTTagIntArray; break;
+    case kNBTString: return kNBTTagString; break;
+    case kNBTList: return kNBTTagList; break;
+    case kNBTCompound: return kNBTTagCompound; break;
+    default: abort(); break;
+  }
+}
+
+
+int mc_nbt__tag_to_type(uint8_t tag, mc_nbt_type_t* type) {
+  switch ((mc_nbt__tag_t) tag) {
+    case kNBTTagByte: *type = kNBTByte; break;
+    case kNBTTagShort: *type = kNBTShort; break;
+    case kNBTTagInt: *type = kNBTInt; break;
+    case kNBTTagLong: *type = kNBTLong; break;
+    case kNBTTagFloat: *type = kNBTFloat; break;
+    case kNBTTagDouble: *type = kNBTDouble; break;
+    case kNBTTagByteArray: *type = kNBTByteArray; break;
+    case kNBTTagString: *type = kNBTString; break;
+    case kNBTTagIntArray: *type = kNBTIntArray; break;
+    case kNBTTagList: *type = kNBTList; break;
+    case kNBTTagCompound: *type = kNBTCompound; break;
+    default:
+      return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,370 @@
+#include <arpa/inet.h>  /* ntohs, ntohl */
+#include <stdlib.h>  /* free, NULL */
+#include <string.h>  /* memcmp, memcpy */
+
+#include "format/nbt.h"
+#include "format/nbt-private.h"
+
+static int mc_nbt_cursor__header(mc_nbt_cursor_t* cur,
+                                 const unsigned char* data,
+                                 const unsigned char* end);
+static int mc_nbt_cursor__fixed_size(uint8_t tag);
+static const unsigned char* mc_nbt_cursor__skip(uint8_t tag,
+                                                const unsigned char* data,
+                                                const unsigned char* end,
+                                                int depth);
+
+static const int kMaxDepth = 1024;
+
+
+int mc_nbt_cursor_init(mc_nbt_cursor_t* cur,
+                       const unsigned char* data,
+                       int len) {
+  int r;
+
+  r = mc_nbt_cursor__header(cur, data, data + len);
+  if (r != 0)
+    return -1;
+
+  /* Root has no siblings */
+  cur->left = 0;
+
+  return 0;
+}
+
+
+int mc_nbt_cursor_open(mc_nbt_cursor_t* cur,
+                       const unsigned char* data,
+                       int len,
+                       mc_nbt_comp_t comp,
+                       unsigned char** uncompressed) {
+  int r;
+
+  if (comp == kNBTUncompressed) {
+    *uncompressed = NULL;
+    return mc_nbt_cursor_init(cur, data, len);
+  }
+
+  len = mc_nbt__zlib(data, len, comp, 1, uncompressed);
+  if (len < 0) {
+    *uncompressed = NULL;
+    return -1;
+  }
+
+  r = mc_nbt_cursor_init(cur, *uncompressed, len);
+  if (r != 0) {
+    free(*uncompressed);
+    *uncompressed = NULL;
+  }
+
+  return r;
+}
+
+
+int mc_nbt_cursor_first(const mc_nbt_cursor_t* cur, mc_nbt_cursor_t* child) {
+  int r;
+  int32_t len;
+
+  if (cur->type == kNBTCompound) {
+    child->left = -1;
+    return mc_nbt_cursor__header(child, cur->data, cur->end);
+  }
+
+  if (cur->type != kNBTList || cur->end - cur->data < 5)
+    return -1;
+
+  len = ntohl(*(uint32_t*) (cur->data + 1));
+  if (len < 0)
+    return -1;
+  if (len == 0)
+    return 1;
+
+  r = mc_nbt__tag_to_type(cur->data[0], &child->type);
+  if (r != 0)
+    return r;
+
+  child->name.value = NULL;
+  child->name.len = 0;
+  child->data = cur->data + 5;
+  child->end = cur->end;
+  child->left = len - 1;
+
+  return 0;
+}
+
+
+int mc_nbt_cursor_next(mc_nbt_cursor_t* cur) {
+  const unsigned char* next;
+
+  if (cur->left == 0)
+    return 1;
+
+  next = mc_nbt_cursor__skip(mc_nbt__type_to_tag(cur->type),
+                             cur->data,
+                             cur->end,
+                             0);
+  if (next == NULL)
+    return -1;
+
+  /* Compound's child, read next header */
+  if (cur->left < 0)
+    return mc_nbt_cursor__header(cur, next, cur->end);
+
+  /* List's item, all of them has the same type */
+  cur->data = next;
+  cur->left--;
+
+  return 0;
+}
+
+
+int mc_nbt_cursor_find_key(const mc_nbt_cursor_t* cur,
+                           const mc_nbt_key_t* key,
+                           mc_nbt_type_t type,
+                           mc_nbt_cursor_t* out) {
+  int r;
+
+  if (cur->type != kNBTCompound)
+    return -1;
+
+  for (r = mc_nbt_cursor_first(cur, out);
+       r == 0;
+       r = mc_nbt_cursor_next(out)) {
+    if (out->name.len != key->len ||
+        memcmp(out->name.value, key->value, key->len) != 0) {
+      continue;
+    }
+
+    /* First property with the same name wins, as in mc_nbt_find() */
+    return out->type == type ? 0 : -1;
+  }
+
+  return -1;
+}
+
+
+int mc_nbt_cursor_find(const mc_nbt_cursor_t* cur,
+                       const char* prop,
+                       int len,
+                       mc_nbt_type_t type,
+                       mc_nbt_cursor_t* out) {
+  mc_nbt_key_t key;
+
+  /* Hash isn't used for scanning */
+  key.value = prop;
+  key.len = len;
+  key.hash = 0;
+  return mc_nbt_cursor_find_key(cur, &key, type, out);
+}
+
+
+int mc_nbt_cursor_read(const mc_nbt_cursor_t* cur,
+                       mc_nbt_type_t type,
+                       void* to) {
+  int size;
+  uint32_t i32;
+  uint64_t i64;
+
+  if (cur->type != type)
+    return -1;
+
+  size = mc_nbt_cursor__fixed_size(mc_nbt__type_to_tag(type));
+  if (size == 0 || cur->end - cur->data < size)
+    return -1;
+
+  switch (size) {
+    case 1:
+      *(int8_t*) to = (int8_t) cur->data[0];
+      break;
+    case 2:
+      *(int16_t*) to = (int16_t) ntohs(*(uint16_t*) cur->data);
+      break;
+    case 4:
+      i32 = ntohl(*(uint32_t*) cur->data);
+      memcpy(to, &i32, sizeof(i32));
+      break;
+    case 8:
+      i64 = ((uint64_t) ntohl(*(uint32_t*) cur->data) << 32) |
+            ntohl(*(uint32_t*) (cur->data + 4));
+      memcpy(to, &i64, sizeof(i64));
+      break;
+  }
+
+  return 0;
+}
+
+
+int mc_nbt_cursor_array(const mc_nbt_cursor_t* cur,
+                        mc_nbt_type_t type,
+                        const void** data,
+                        int32_t* len) {
+  int32_t size;
+  int header;
+
+  if (cur->type != type)
+    return -1;
+
+  switch (type) {
+    case kNBTString:
+      if (cur->end - cur->data < 2)
+        return -1;
+      header = 2;
+      *len = ntohs(*(uint16_t*) cur->data);
+      size = *len;
+      break;
+    case kNBTByteArray:
+    case kNBTIntArray:
+      if (cur->end - cur->data < 4)
+        return -1;
+      header = 4;
+      *len = ntohl(*(uint32_t*) cur->data);
+      if (*len < 0 || *len > cur->end - cur->data)
+        return -1;
+      if (type == kNBTIntArray && *len > (cur->end - cur->data) / 4)
+        return -1;
+      size = type == kNBTIntArray ? *len * 4 : *len;
+      break;
+    default:
+      return -1;
+  }
+
+  if (cur->end - cur->data - header < size)
+    return -1;
+
+  /* NOTE: Int arrays are in network byte order */
+  *data = cur->data + header;
+
+  return 0;
+}
+
+
+int mc_nbt_cursor__header(mc_nbt_cursor_t* cur,
+                          const unsigned char* data,
+                          const unsigned char* end) {
+  int r;
+  uint8_t tag;
+  int name_len;
+
+  if (data >= end)
+    return -1;
+
+  tag = data[0];
+  data++;
+
+  /* Tag end doesn't have a name */
+  if (tag == kNBTTagEnd)
+    return 1;
+
+  r = mc_nbt__tag_to_type(tag, &cur->type);
+  if (r != 0)
+    return r;
+
+  if (end - data < 2)
+    return -1;
+  name_len = ntohs(*(uint16_t*) data);
+  if (name_len > 0x7fff || end - data - 2 < name_len)
+    return -1;
+
+  cur->name.value = (const char*) data + 2;
+  cur->name.len = name_len;
+  cur->data = data + 2 + name_len;
+  cur->end = end;
+
+  return 0;
+}
+
+
+int mc_nbt_cursor__fixed_size(uint8_t tag) {
+  switch ((mc_nbt__tag_t) tag) {
+    case kNBTTagByte: return 1;
+    case kNBTTagShort: return 2;
+    case kNBTTagInt: return 4;
+    case kNBTTagFloat: return 4;
+    case kNBTTagLong: return 8;
+    case kNBTTagDouble: return 8;
+    default: return 0;
+  }
+}
+
+
+const unsigned char* mc_nbt_cursor__skip(uint8_t tag,
+                                         const unsigned char* data,
+                                         const unsigned char* end,
+                                         int depth) {
+  int size;
+  int32_t i;
+  int32_t len;
+  uint8_t child;
+
+  if (depth >= kMaxDepth)
+    return NULL;
+
+  size = mc_nbt_cursor__fixed_size(tag);
+  if (size != 0)
+    return end - data < size ? NULL : data + size;
+
+  switch ((mc_nbt__tag_t) tag) {
+    case kNBTTagString:
+      if (end - data < 2)
+        return NULL;
+      len = ntohs(*(uint16_t*) data);
+      data += 2;
+      break;
+    case kNBTTagByteArray:
+    case kNBTTagIntArray:
+      if (end - data < 4)
+        return NULL;
+      len = ntohl(*(uint32_t*) data);
+      data += 4;
+      if (len < 0 || len > end - data)
+        return NULL;
+      if (tag == kNBTTagIntArray) {
+        if (len > (end - data) / 4)
+          return NULL;
+        len *= 4;
+      }
+      break;
+    case kNBTTagList:
+      if (end - data < 5)
+        return NULL;
+      child = data[0];
+      len = ntohl(*(uint32_t*) (data + 1));
+      data += 5;
+      if (len < 0)
+        return NULL;
+
+      /* Lists of primitives are skipped at once */
+      size = mc_nbt_cursor__fixed_size(child);
+      if (size != 0) {
+        if (len > (end - data) / size)
+          return NULL;
+        return data + len * size;
+      }
+
+      for (i = 0; i < len && data != NULL; i++)
+        data = mc_nbt_cursor__skip(child, data, end, depth + 1);
+      return data;
+    case kNBTTagCompound:
+      while (data != NULL) {
+        if (data >= end)
+          return NULL;
+        child = data[0];
+        data++;
+        if (child == kNBTTagEnd)
+          break;
+
+        if (end - data < 2)
+          return NULL;
+        len = ntohs(*(uint16_t*) data);
+        data += 2;
+        if (end - data < len)
+          return NULL;
+        data = mc_nbt_cursor__skip(child, data + len, end, depth + 1);
+      }
+      return data;
+    default:
+      return NULL;
+  }
+
+  return end - data < len ? NULL : data + len;
+}
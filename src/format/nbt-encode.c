@@ -9,7 +9,6 @@
 static int mc_nbt__encode(mc_buffer_t* buffer,
                           int with_name,
                           mc_nbt_t* val);
-static mc_nbt__tag_t mc_nbt__type_to_tag(mc_nbt_type_t type);
 static int mc_nbt__encode_payload(mc_buffer_t* buffer,
                                   mc_nbt_t* val);
 static int mc_nbt__encode_high_order(mc_buffer_t* buffer,
@@ -61,24 +60,6 @@ int mc_nbt__encode(mc_buffer_t* buffer, int with_name, mc_nbt_t* val) {
 }
 
 
-mc_nbt__tag_t mc_nbt__type_to_tag(mc_nbt_type_t type) {
-  switch (type) {
-    case kNBTByte: return kNBTTagByte; break;
-    case kNBTShort: return kNBTTagShort; break;
-    case kNBTInt: return kNBTTagInt; break;
-    case kNBTLong: return kNBTTagLong; break;
-    case kNBTFloat: return kNBTTagFloat; break;
-    case kNBTDouble: return kNBTTagDouble; break;
-    case kNBTByteArray: return kNBTTagByteArray; break;
-    case kNBTIntArray: return kNBTTagIntArray; break;
-    case kNBTString: return kNBTTagString; break;
-    case kNBTList: return kNBTTagList; break;
-    case kNBTCompound: return kNBTTagCompound; break;
-    default: abort(); break;
-  }
-}
-
-
 int mc_nbt__encode_payload(mc_buffer_t* buffer, mc_nbt_t* val) {
   switch (val->type) {
     case kNBTByte:
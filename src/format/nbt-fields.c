@@ -0,0 +1,380 @@
+#include <string.h>  /* memcmp, memcpy, memset */
+
+#include "format/nbt.h"
+#include "format/nbt-private.h"
+
+static int mc_nbt__field_match(const mc_nbt_field_t* fields,
+                               int count,
+                               uint32_t found,
+                               const char* name,
+                               int name_len);
+static int mc_nbt__field_size(mc_nbt_type_t type);
+static int mc_nbt__field_finish(const mc_nbt_field_t* fields,
+                                int count,
+                                uint32_t found,
+                                void* out);
+static int mc_nbt__field_decode(const mc_nbt_field_t* field,
+                                mc_nbt_t* val,
+                                char* out);
+static int mc_nbt__field_update(const mc_nbt_field_t* field,
+                                mc_nbt_t** slot,
+                                const char* in);
+static int mc_nbt__field_cursor_decode(const mc_nbt_field_t* field,
+                                       const mc_nbt_cursor_t* cur,
+                                       char* out);
+static int mc_nbt__field_write(mc_nbt_writer_t* w,
+                               const mc_nbt_field_t* field,
+                               const char* name,
+                               int name_len,
+                               const char* in);
+
+
+int mc_nbt_decode_fields(mc_nbt_t* obj,
+                         const mc_nbt_field_t* fields,
+                         int count,
+                         void* out) {
+  int i;
+  int j;
+  uint32_t found;
+  mc_nbt_t* item;
+
+  if (obj->type != kNBTCompound || count > kNBTMaxFields)
+    return -1;
+
+  found = 0;
+  for (i = 0; i < obj->value.values.len; i++) {
+    item = obj->value.values.list[i];
+    j = mc_nbt__field_match(fields,
+                            count,
+                            found,
+                            item->name.value,
+                            item->name.len);
+    if (j < 0)
+      continue;
+
+    /* Wrong type is the same as missing field */
+    if (mc_nbt__field_decode(&fields[j],
+                             item,
+                             (char*) out + fields[j].offset) == 0) {
+      found |= 1u << j;
+    }
+  }
+
+  return mc_nbt__field_finish(fields, count, found, out);
+}
+
+
+int mc_nbt_update_fields(mc_nbt_t* obj,
+                         const mc_nbt_field_t* fields,
+                         int count,
+                         const void* in) {
+  int i;
+  int j;
+  uint32_t found;
+  mc_nbt_t* item;
+
+  /* NOTE: `obj` should be already unshared by the caller */
+  if (obj->type != kNBTCompound || count > kNBTMaxFields)
+    return -1;
+
+  found = 0;
+  for (i = 0; i < obj->value.values.len; i++) {
+    item = obj->value.values.list[i];
+    j = mc_nbt__field_match(fields,
+                            count,
+                            found,
+                            item->name.value,
+                            item->name.len);
+    if (j < 0)
+      continue;
+
+    if (mc_nbt__field_update(&fields[j],
+                             &obj->value.values.list[i],
+                             (const char*) in + fields[j].offset) == 0) {
+      found |= 1u << j;
+    }
+  }
+
+  /* Optional fields are updated only if present */
+  for (j = 0; j < count; j++)
+    if (fields[j].required && (found & (1u << j)) == 0)
+      return -1;
+
+  return 0;
+}
+
+
+int mc_nbt_cursor_decode_fields(const mc_nbt_cursor_t* cur,
+                                const mc_nbt_field_t* fields,
+                                int count,
+                                void* out) {
+  int r;
+  int j;
+  uint32_t found;
+  mc_nbt_cursor_t item;
+
+  if (cur->type != kNBTCompound || count > kNBTMaxFields)
+    return -1;
+
+  found = 0;
+  for (r = mc_nbt_cursor_first(cur, &item);
+       r == 0;
+       r = mc_nbt_cursor_next(&item)) {
+    j = mc_nbt__field_match(fields,
+                            count,
+                            found,
+                            item.name.value,
+                            item.name.len);
+    if (j < 0)
+      continue;
+
+    if (mc_nbt__field_cursor_decode(&fields[j],
+                                    &item,
+                                    (char*) out + fields[j].offset) == 0) {
+      found |= 1u << j;
+    }
+  }
+  if (r < 0)
+    return -1;
+
+  return mc_nbt__field_finish(fields, count, found, out);
+}
+
+
+int mc_nbt_write_fields(mc_nbt_writer_t* w,
+                        const mc_nbt_field_t* fields,
+                        int count,
+                        const void* in) {
+  int i;
+  int j;
+  int size;
+  const char* ptr;
+
+  for (i = 0; i < count; i++) {
+    ptr = (const char*) in + fields[i].offset;
+    if (fields[i].len == 0) {
+      NBT_WRITE(mc_nbt__field_write(w,
+                                    &fields[i],
+                                    fields[i].key.value,
+                                    fields[i].key.len,
+                                    ptr));
+      continue;
+    }
+
+    NBT_WRITE(mc_nbt_write_list(w,
+                                fields[i].key.value,
+                                fields[i].key.len,
+                                fields[i].type,
+                                fields[i].len));
+    size = mc_nbt__field_size(fields[i].type);
+    for (j = 0; j < fields[i].len; j++)
+      NBT_WRITE(mc_nbt__field_write(w, &fields[i], NULL, 0, ptr + j * size));
+  }
+
+  return 0;
+}
+
+
+int mc_nbt__field_match(const mc_nbt_field_t* fields,
+                        int count,
+                        uint32_t found,
+                        const char* name,
+                        int name_len) {
+  int i;
+  uint32_t hash;
+
+  hash = mc_nbt_hash(name, name_len);
+  for (i = 0; i < count; i++) {
+    /* Duplicate property, first one wins - as in mc_nbt_find() */
+    if ((found & (1u << i)) != 0)
+      continue;
+    if (fields[i].key.hash == hash &&
+        fields[i].key.len == name_len &&
+        memcmp(fields[i].key.value, name, name_len) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+
+int mc_nbt__field_size(mc_nbt_type_t type) {
+  switch (type) {
+    case kNBTByte: return 1;
+    case kNBTShort: return 2;
+    case kNBTInt: return 4;
+    case kNBTLong: return 8;
+    case kNBTFloat: return 4;
+    case kNBTDouble: return 8;
+    default: return 0;
+  }
+}
+
+
+int mc_nbt__field_finish(const mc_nbt_field_t* fields,
+                         int count,
+                         uint32_t found,
+                         void* out) {
+  int i;
+  int len;
+
+  for (i = 0; i < count; i++) {
+    if ((found & (1u << i)) != 0)
+      continue;
+    if (fields[i].required)
+      return -1;
+
+    len = fields[i].len == 0 ? 1 : fields[i].len;
+    memset((char*) out + fields[i].offset,
+           0,
+           len * mc_nbt__field_size(fields[i].type));
+  }
+
+  return 0;
+}
+
+
+int mc_nbt__field_decode(const mc_nbt_field_t* field,
+                         mc_nbt_t* val,
+                         char* out) {
+  int i;
+  int size;
+
+  size = mc_nbt__field_size(field->type);
+  if (size == 0)
+    return -1;
+
+  /* NOTE: All numeric union members start at the same address */
+  if (field->len == 0) {
+    if (val->type != field->type)
+      return -1;
+    memcpy(out, &val->value, size);
+    return 0;
+  }
+
+  if (val->type != kNBTList || val->value.values.len != field->len)
+    return -1;
+  for (i = 0; i < field->len; i++)
+    if (val->value.values.list[i]->type != field->type)
+      return -1;
+  for (i = 0; i < field->len; i++)
+    memcpy(out + i * size, &val->value.values.list[i]->value, size);
+
+  return 0;
+}
+
+
+int mc_nbt__field_update(const mc_nbt_field_t* field,
+                         mc_nbt_t** slot,
+                         const char* in) {
+  int i;
+  int size;
+  mc_nbt_t* val;
+  mc_nbt_t* item;
+
+  size = mc_nbt__field_size(field->type);
+  if (size == 0)
+    return -1;
+
+  val = *slot;
+  if (field->len == 0) {
+    if (val->type != field->type)
+      return -1;
+  } else {
+    if (val->type != kNBTList || val->value.values.len != field->len)
+      return -1;
+    for (i = 0; i < field->len; i++)
+      if (val->value.values.list[i]->type != field->type)
+        return -1;
+  }
+
+  /* Copy-on-write: the path to updated values should be private */
+  val = mc_nbt_unshare(slot);
+  if (val == NULL)
+    return -1;
+
+  if (field->len == 0) {
+    memcpy(&val->value, in, size);
+    return 0;
+  }
+
+  for (i = 0; i < field->len; i++) {
+    item = mc_nbt_unshare(&val->value.values.list[i]);
+    if (item == NULL)
+      return -1;
+    memcpy(&item->value, in + i * size, size);
+  }
+
+  return 0;
+}
+
+
+int mc_nbt__field_cursor_decode(const mc_nbt_field_t* field,
+                                const mc_nbt_cursor_t* cur,
+                                char* out) {
+  int r;
+  int i;
+  int size;
+  mc_nbt_cursor_t item;
+
+  size = mc_nbt__field_size(field->type);
+  if (size == 0)
+    return -1;
+
+  if (field->len == 0)
+    return mc_nbt_cursor_read(cur, field->type, out);
+
+  if (cur->type != kNBTList)
+    return -1;
+
+  i = 0;
+  for (r = mc_nbt_cursor_first(cur, &item);
+       r == 0;
+       r = mc_nbt_cursor_next(&item)) {
+    if (i == field->len)
+      return -1;
+    if (mc_nbt_cursor_read(&item, field->type, out + i * size) != 0)
+      return -1;
+    i++;
+  }
+
+  return r < 0 || i != field->len ? -1 : 0;
+}
+
+
+int mc_nbt__field_write(mc_nbt_writer_t* w,
+                        const mc_nbt_field_t* field,
+                        const char* name,
+                        int name_len,
+                        const char* in) {
+  int8_t i8;
+  int16_t i16;
+  int32_t i32;
+  int64_t i64;
+  float f32;
+  double f64;
+
+  switch (field->type) {
+    case kNBTByte:
+      memcpy(&i8, in, sizeof(i8));
+      return mc_nbt_write_i8(w, name, name_len, i8);
+    case kNBTShort:
+      memcpy(&i16, in, sizeof(i16));
+      return mc_nbt_write_i16(w, name, name_len, i16);
+    case kNBTInt:
+      memcpy(&i32, in, sizeof(i32));
+      return mc_nbt_write_i32(w, name, name_len, i32);
+    case kNBTLong:
+      memcpy(&i64, in, sizeof(i64));
+      return mc_nbt_write_i64(w, name, name_len, i64);
+    case kNBTFloat:
+      memcpy(&f32, in, sizeof(f32));
+      return mc_nbt_write_f32(w, name, name_len, f32);
+    case kNBTDouble:
+      memcpy(&f64, in, sizeof(f64));
+      return mc_nbt_write_f64(w, name, name_len, f64);
+    default:
+      return -1;
+  }
+}
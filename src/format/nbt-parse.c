@@ -1,7 +1,6 @@
-#include <arpa/inet.h>  /* ntohs, ntohl */
-#include <assert.h>  /* assert */
-#include <stdlib.h>  /* NULL, malloc, free */
-#include <string.h>  /* memcpy, memset */
+#include <arpa/inet.h>  /* ntohl */
+#include <stdlib.h>  /* NULL, malloc, free, realloc */
+#include <string.h>  /* memcpy */
 
 #include "format/nbt.h"
 #include "format/nbt-private.h"
@@ -10,23 +9,56 @@ static int mc_nbt__decompress(const unsigned char* data,
                               int len,
                               mc_nbt_comp_t comp,
                               unsigned char** out);
-static mc_nbt_t* mc_nbt__parse(mc_nbt_parser_t* parser);
-static mc_nbt_t* mc_nbt__parse_payload(mc_nbt__tag_t tag,
-                                       mc_nbt_parser_t* parser);
-static mc_nbt_t* mc_nbt__alloc(mc_nbt__tag_t tag,
-                               mc_nbt_parser_t* parser,
+static mc_nbt_t* mc_nbt__build(mc_nbt_parser_t* parser, mc_nbt_sax_t* sax);
+static mc_nbt_t* mc_nbt__alloc(mc_nbt_parser_t* parser,
+                               mc_nbt_type_t type,
+                               const char* name,
+                               int name_len,
                                int additional_payload);
-static mc_nbt_t* mc_nbt__parse_primitive(mc_nbt__tag_t tag,
-                                         mc_nbt_parser_t* parser);
-static mc_nbt_t* mc_nbt__parse_array(mc_nbt__tag_t tag,
-                                     mc_nbt_parser_t* parser);
-static mc_nbt_t* mc_nbt__parse_high_order(mc_nbt__tag_t tag,
-                                          mc_nbt_parser_t* parser);
-
-/* Used as tag end value */
-static mc_nbt_t mc_nbt__end;
-static const int kMaxDepth = 1024;
-static const int kCompoundCapacity = 4;
+static void* mc_nbt__arena_alloc(mc_nbt_parser_t* parser, int size);
+static void mc_nbt__arena_destroy(mc_nbt_parser_t* parser);
+static void mc_nbt__free(mc_nbt_parser_t* parser, mc_nbt_t* val);
+static void mc_nbt__destroy(mc_nbt_parser_t* parser, mc_nbt_t* val);
+static int mc_nbt__push(mc_nbt_parser_t* parser, mc_nbt_t* val);
+static int mc_nbt__open(mc_nbt_sax_t* sax, const char* name, int name_len);
+static int mc_nbt__close(mc_nbt_sax_t* sax, mc_nbt_type_t type);
+static int mc_nbt__on_begin_compound(mc_nbt_sax_t* sax,
+                                     const char* name,
+                                     int name_len);
+static int mc_nbt__on_end_compound(mc_nbt_sax_t* sax);
+static int mc_nbt__on_begin_list(mc_nbt_sax_t* sax,
+                                 const char* name,
+                                 int name_len,
+                                 mc_nbt_type_t type,
+                                 int32_t len);
+static int mc_nbt__on_end_list(mc_nbt_sax_t* sax);
+static int mc_nbt__on_value(mc_nbt_sax_t* sax,
+                            const char* name,
+                            int name_len,
+                            mc_nbt_type_t type,
+                            const void* value);
+static int mc_nbt__on_array(mc_nbt_sax_t* sax,
+                            const char* name,
+                            int name_len,
+                            mc_nbt_type_t type,
+                            const void* data,
+                            int32_t len,
+                            int32_t offset,
+                            int32_t total);
+static int mc_nbt__grow_stack(mc_nbt_parser_t* parser);
+
+static const int kStackCapacity = 64;
+static const int kArenaChunkSize = 65536;
+
+/* Tree is built out of SAX events */
+static const mc_nbt_sax_cbs_t mc_nbt__builder = {
+  mc_nbt__on_begin_compound,
+  mc_nbt__on_end_compound,
+  mc_nbt__on_begin_list,
+  mc_nbt__on_end_list,
+  mc_nbt__on_value,
+  mc_nbt__on_array
+};
 
 
 mc_nbt_t* mc_nbt_parse(const unsigned char* data,
@@ -49,10 +81,13 @@ mc_nbt_t* mc_nbt_preparse(mc_nbt_parser_t* parser,
                           int len,
                           mc_nbt_comp_t comp,
                           mc_nbt_lifetime_t lifetime) {
+  int r;
   unsigned char* uncompressed;
   mc_nbt_t* res;
+  mc_nbt_sax_t sax;
 
   parser->lifetime = lifetime;
+  parser->arena = NULL;
   if (comp == kNBTUncompressed) {
     parser->len = len;
     parser->data = (unsigned char*) data;
@@ -65,13 +100,16 @@ mc_nbt_t* mc_nbt_preparse(mc_nbt_parser_t* parser,
     parser->uncompressed = parser->data;
   }
 
-  parser->name_len = 0;
-  parser->depth = 0;
+  r = mc_nbt_sax_init(&sax, kNBTUncompressed, &mc_nbt__builder);
+  if (r == 0)
+    res = mc_nbt__build(parser, &sax);
+  else
+    res = NULL;
 
-  res = mc_nbt__parse(parser);
   if (res == NULL) {
     free(parser->uncompressed);
     parser->uncompressed = NULL;
+    mc_nbt__arena_destroy(parser);
   }
 
   return res;
@@ -82,6 +120,31 @@ void mc_nbt_postparse(mc_nbt_parser_t* parser) {
   /* De-allocate uncompressed data */
   if (parser->uncompressed != NULL)
     free(parser->uncompressed);
+  parser->uncompressed = NULL;
+
+  /* And the whole tree, if it was allocated in arena */
+  mc_nbt__arena_destroy(parser);
+}
+
+
+mc_nbt_t* mc_nbt_cursor_parse(const mc_nbt_cursor_t* cur) {
+  int r;
+  mc_nbt_parser_t parser;
+  mc_nbt_sax_t sax;
+
+  /* Copy everything, input is read-only */
+  parser.data = (unsigned char*) cur->data;
+  parser.len = cur->end - cur->data;
+  parser.lifetime = kIndependentLifetime;
+  parser.uncompressed = NULL;
+  parser.arena = NULL;
+
+  r = mc_nbt_sax_init(&sax, kNBTUncompressed, &mc_nbt__builder);
+  if (r != 0)
+    return NULL;
+  mc_nbt__sax_start(&sax, cur->type, cur->name.value, cur->name.len);
+
+  return mc_nbt__build(&parser, &sax);
 }
 
 
@@ -93,371 +156,343 @@ int mc_nbt__decompress(const unsigned char* data,
 }
 
 
-mc_nbt_t* mc_nbt__parse(mc_nbt_parser_t* parser) {
-  mc_nbt__tag_t tag;
+mc_nbt_t* mc_nbt__build(mc_nbt_parser_t* parser, mc_nbt_sax_t* sax) {
+  int r;
   mc_nbt_t* res;
-  const char* name;
-  int name_len;
 
-  if (parser->depth >= kMaxDepth)
-    return NULL;
+  parser->stack = NULL;
+  parser->stack_len = 0;
+  parser->stack_capacity = 0;
+  parser->frames = NULL;
+  parser->frame_len = 0;
+  parser->frame_capacity = 0;
 
-  if (parser->len < 1)
-    return NULL;
+  /*
+   * Whole input is passed at once, so all names and arrays are pointing
+   * into it.
+   */
+  sax->data = parser;
+  r = mc_nbt_sax_write(sax, parser->data, parser->len);
+  if (r == 0)
+    r = mc_nbt_sax_finish(sax);
+  mc_nbt_sax_destroy(sax);
+
+  if (r == 0 && parser->stack_len == 1) {
+    res = parser->stack[0];
+  } else {
+    /* Error, free all parsed items */
+    res = NULL;
+    while (parser->stack_len > 0)
+      mc_nbt__destroy(parser, parser->stack[--parser->stack_len]);
+  }
 
-  tag = (mc_nbt__tag_t) parser->data[0];
-  parser->data++;
-  parser->len--;
+  /* Stacks are needed only while parsing */
+  free(parser->stack);
+  parser->stack = NULL;
+  parser->stack_capacity = 0;
+  free(parser->frames);
+  parser->frames = NULL;
+  parser->frame_capacity = 0;
 
-  /* Tag end doesn't have a name */
-  if (tag == kNBTTagEnd)
-    return &mc_nbt__end;
+  return res;
+}
 
-  /* Parse tag's name */
-  if (parser->len < 2)
-    return NULL;
 
-  name_len = ntohs(*(uint16_t*) parser->data);
-  name = (const char*) parser->data + 2;
+mc_nbt_t* mc_nbt__alloc(mc_nbt_parser_t* parser,
+                        mc_nbt_type_t type,
+                        const char* name,
+                        int name_len,
+                        int additional_payload) {
+  int size;
+  mc_nbt_t* res;
 
-  parser->data += 2 + name_len;
-  parser->len -= 2 + name_len;
-  if (parser->len < 0)
-    return NULL;
+  size = sizeof(*res) + additional_payload;
+  if (parser->lifetime == kIndependentLifetime)
+    size += name_len;
 
-  parser->name_len = name_len;
+  if (parser->lifetime == kArenaLifetime)
+    res = mc_nbt__arena_alloc(parser, size);
+  else
+    res = malloc(size);
+  if (res == NULL)
+    return NULL;
 
-  /* Parse tag's payload */
-  parser->depth++;
-  res = mc_nbt__parse_payload(tag, parser);
-  parser->depth--;
+  res->type = type;
 
-  if (res != NULL) {
-    assert(res->name.len == name_len);
-    if (parser->lifetime == kSameLifetime)
-      res->name.value = name;
-    else
-      memcpy((char*) res->name.value, name, res->name.len);
+  /* Only independent nodes may be shared by clones */
+  res->refs = parser->lifetime == kIndependentLifetime ? 1 : 0;
+  if (parser->lifetime != kIndependentLifetime) {
+    res->name.value = name;
+  } else if (name_len != 0) {
+    res->name.value = (char*) res + sizeof(*res) + additional_payload;
+    memcpy((char*) res->name.value, name, name_len);
+  } else {
+    res->name.value = NULL;
   }
+  res->name.len = name_len;
 
   return res;
 }
 
 
-mc_nbt_t* mc_nbt__parse_payload(mc_nbt__tag_t tag, mc_nbt_parser_t* parser) {
-  switch (tag) {
-    case kNBTTagByte:
-    case kNBTTagShort:
-    case kNBTTagInt:
-    case kNBTTagLong:
-    case kNBTTagFloat:
-    case kNBTTagDouble:
-      return mc_nbt__parse_primitive(tag, parser);
-    case kNBTTagByteArray:
-    case kNBTTagString:
-    case kNBTTagIntArray:
-      return mc_nbt__parse_array(tag, parser);
-    case kNBTTagList:
-    case kNBTTagCompound:
-      return mc_nbt__parse_high_order(tag, parser);
-    default:
-      return NULL;
+int mc_nbt__push(mc_nbt_parser_t* parser, mc_nbt_t* val) {
+  if (parser->stack_len == parser->stack_capacity &&
+      mc_nbt__grow_stack(parser) != 0) {
+    mc_nbt__destroy(parser, val);
+    return -1;
   }
+  parser->stack[parser->stack_len++] = val;
+
+  return 0;
 }
 
 
-mc_nbt_t* mc_nbt__alloc(mc_nbt__tag_t tag,
-                        mc_nbt_parser_t* parser,
-                        int additional_payload) {
+int mc_nbt__open(mc_nbt_sax_t* sax, const char* name, int name_len) {
+  int capacity;
+  mc_nbt_parser_t* parser;
+  mc_nbt_parser_frame_t* frames;
+  mc_nbt_parser_frame_t* frame;
+
+  parser = sax->data;
+  if (parser->frame_len == parser->frame_capacity) {
+    capacity = parser->frame_capacity == 0 ? kStackCapacity :
+                                             parser->frame_capacity * 2;
+    frames = realloc(parser->frames, capacity * sizeof(*frames));
+    if (frames == NULL)
+      return -1;
+    parser->frames = frames;
+    parser->frame_capacity = capacity;
+  }
+
+  frame = &parser->frames[parser->frame_len++];
+  frame->base = parser->stack_len;
+  frame->name = name;
+  frame->name_len = name_len;
+
+  return 0;
+}
+
+
+int mc_nbt__close(mc_nbt_sax_t* sax, mc_nbt_type_t type) {
+  int len;
+  int slots;
   mc_nbt_t* res;
+  mc_nbt_parser_t* parser;
+  mc_nbt_parser_frame_t* frame;
 
-  res = malloc(sizeof(*res) +
-               additional_payload +
-               (parser->lifetime == kSameLifetime ? 0 : parser->name_len));
+  /*
+   * Children were collected on the parser's stack (shared with nested
+   * compounds and lists), allocate node once.
+   */
+  parser = sax->data;
+  frame = &parser->frames[--parser->frame_len];
+  len = parser->stack_len - frame->base;
+
+  /* Reserve space for name index, it'll be built on first lookup */
+  slots = type == kNBTCompound ? mc_nbt__index_slots(len) : 0;
+  res = mc_nbt__alloc(parser,
+                      type,
+                      frame->name,
+                      frame->name_len,
+                      (len - 1) * sizeof(*res->value.values.list) +
+                          slots * sizeof(int32_t));
   if (res == NULL)
-    return NULL;
-  switch (tag) {
-    case kNBTTagByte: res->type = kNBTByte; break;
-    case kNBTTagShort: res->type = kNBTShort; break;
-    case kNBTTagInt: res->type = kNBTInt; break;
-    case kNBTTagLong: res->type = kNBTLong; break;
-    case kNBTTagFloat: res->type = kNBTFloat; break;
-    case kNBTTagDouble: res->type = kNBTDouble; break;
-    case kNBTTagByteArray: res->type = kNBTByteArray; break;
-    case kNBTTagString: res->type = kNBTString; break;
-    case kNBTTagIntArray: res->type = kNBTIntArray; break;
-    case kNBTTagList: res->type = kNBTList; break;
-    case kNBTTagCompound: res->type = kNBTCompound; break;
-    default:
-      /* Unexpected */
-      abort();
-  }
-  if (parser->name_len != 0 && parser->lifetime == kIndependentLifetime)
-    res->name.value = (char*) res + sizeof(*res) + additional_payload;
-  else
-    res->name.value = NULL;
-  res->name.len = parser->name_len;
-  parser->name_len = 0;
+    return -1;
 
-  return res;
+  memcpy(res->value.values.list,
+         parser->stack + frame->base,
+         len * sizeof(*res->value.values.list));
+  res->value.values.len = len;
+  res->value.values.index = -slots;
+  parser->stack_len = frame->base;
+
+  return mc_nbt__push(parser, res);
+}
+
+
+int mc_nbt__on_begin_compound(mc_nbt_sax_t* sax,
+                              const char* name,
+                              int name_len) {
+  return mc_nbt__open(sax, name, name_len);
 }
 
 
-mc_nbt_t* mc_nbt__parse_primitive(mc_nbt__tag_t tag, mc_nbt_parser_t* parser) {
+int mc_nbt__on_end_compound(mc_nbt_sax_t* sax) {
+  return mc_nbt__close(sax, kNBTCompound);
+}
+
+
+int mc_nbt__on_begin_list(mc_nbt_sax_t* sax,
+                          const char* name,
+                          int name_len,
+                          mc_nbt_type_t type,
+                          int32_t len) {
+  return mc_nbt__open(sax, name, name_len);
+}
+
+
+int mc_nbt__on_end_list(mc_nbt_sax_t* sax) {
+  return mc_nbt__close(sax, kNBTList);
+}
+
+
+int mc_nbt__on_value(mc_nbt_sax_t* sax,
+                     const char* name,
+                     int name_len,
+                     mc_nbt_type_t type,
+                     const void* value) {
   mc_nbt_t* res;
+  mc_nbt_parser_t* parser;
 
-  res = mc_nbt__alloc(tag, parser, 0);
+  parser = sax->data;
+  res = mc_nbt__alloc(parser, type, name, name_len, 0);
   if (res == NULL)
-    return NULL;
-  switch (tag) {
-    case kNBTTagByte:
-      if (parser->len < 1)
-        goto fatal;
-      res->value.i8 = parser->data[0];
-      parser->data++;
-      parser->len--;
+    return -1;
+
+  switch (type) {
+    case kNBTByte:
+      res->value.i8 = *(const int8_t*) value;
       break;
-    case kNBTTagShort:
-      if (parser->len < 2)
-        goto fatal;
-      res->value.i16 = ntohs(*(int16_t*) parser->data);
-      parser->data += 2;
-      parser->len -= 2;
+    case kNBTShort:
+      res->value.i16 = *(const int16_t*) value;
       break;
-    case kNBTTagFloat:
-    case kNBTTagInt:
-      if (parser->len < 4)
-        goto fatal;
-      res->value.i32 = ntohl(*(int32_t*) parser->data);
-      parser->data += 4;
-      parser->len -= 4;
+    case kNBTInt:
+    case kNBTFloat:
+      memcpy(&res->value.i32, value, sizeof(res->value.i32));
       break;
-    case kNBTTagDouble:
-    case kNBTTagLong:
-      if (parser->len < 8)
-        goto fatal;
-      res->value.i64 = ((int64_t) ntohl(*(int32_t*) parser->data) << 32) |
-                       ntohl(*(int32_t*) parser->data);
-      parser->data += 8;
-      parser->len -= 8;
+    case kNBTLong:
+    case kNBTDouble:
+      memcpy(&res->value.i64, value, sizeof(res->value.i64));
       break;
     default:
-      goto fatal;
+      mc_nbt__free(parser, res);
+      return -1;
   }
 
-  return res;
-
-fatal:
-  free(res);
-  return NULL;
+  return mc_nbt__push(parser, res);
 }
 
 
-mc_nbt_t* mc_nbt__parse_array(mc_nbt__tag_t tag, mc_nbt_parser_t* parser) {
-  mc_nbt_t* res;
+int mc_nbt__on_array(mc_nbt_sax_t* sax,
+                     const char* name,
+                     int name_len,
+                     mc_nbt_type_t type,
+                     const void* data,
+                     int32_t len,
+                     int32_t offset,
+                     int32_t total) {
   int32_t i;
+  int size;
   int additional_len;
-  int32_t len;
+  mc_nbt_t* res;
+  mc_nbt_parser_t* parser;
 
-  /* Read header */
+  /* Whole input is available, so arrays are never split */
+  if (offset != 0 || len != total)
+    return -1;
+
+  parser = sax->data;
+  size = type == kNBTIntArray ? len * 4 : len;
   additional_len = 0;
-  switch (tag) {
-    case kNBTTagByteArray:
-      if (parser->len < 4)
-        return NULL;
-
-      len = ntohl(*(uint32_t*) parser->data);
-      parser->data += 4;
-      parser->len += 4;
-      if (parser->len < len)
-        return NULL;
-
-      if (parser->lifetime == kIndependentLifetime)
-        additional_len = len;
-      break;
-    case kNBTTagString:
-      if (parser->len < 2)
-        return NULL;
-
-      len = ntohs(*(uint16_t*) parser->data);
-      parser->data += 2;
-      parser->len += 2;
-      if (parser->len < len)
-        return NULL;
-
-      if (parser->lifetime == kIndependentLifetime)
-        additional_len = len;
-      break;
-    case kNBTTagIntArray:
-      if (parser->len < 4)
-        return NULL;
-
-      len = ntohl(*(uint32_t*) parser->data);
-      parser->data += 4;
-      parser->len -= 4;
-      if (parser->len < len * 4)
-        return NULL;
-
-      if (parser->lifetime == kIndependentLifetime ||
-          parser->uncompressed == NULL) {
-        additional_len = len * 4;
-      }
-      break;
-    default:
-      return NULL;
+  if (parser->lifetime == kIndependentLifetime ||
+      (type == kNBTIntArray && parser->uncompressed == NULL)) {
+    additional_len = size;
   }
 
-  res = mc_nbt__alloc(tag,
-                      parser,
-                      additional_len);
+  res = mc_nbt__alloc(parser, type, name, name_len, additional_len);
   if (res == NULL)
-    return NULL;
+    return -1;
 
   /*
    * NOTE: all those arrays have `len` field, so it doesn't matter -
    * which one to choose in union
    */
   res->value.str.len = len;
-
-  /* Read items */
-  switch (tag) {
-    case kNBTTagByteArray:
-    case kNBTTagString:
-      if (parser->lifetime == kSameLifetime) {
-        res->value.str.value = (char*) parser->data;
-      } else {
-        res->value.str.value = (char*) (&res->value.str.value + 1);
-        memcpy(res->value.str.value, parser->data, len);
-      }
-      parser->data += len;
-      parser->len -= len;
-      break;
-    case kNBTTagIntArray:
-      if (parser->len < 4)
-        goto fatal;
-
-      /* Perform byte rotation in-place if possible */
-      if (additional_len == 0) {
-        res->value.i32l.list = (int32_t*) parser->data;
-        for (i = 0; i < len; i++)
-          res->value.i32l.list[i] = ntohl(res->value.i32l.list[i]);
-        parser->data += 4 * len;
-        parser->len -= 4 * len;
-      } else {
-        res->value.i32l.list = (int32_t*) (&res->value.i32l.list + 1);
-        for (i = 0; i < len; i++) {
-          res->value.i32l.list[i] = ntohl(*(uint32_t*) parser->data);
-          parser->data += 4;
-          parser->len -= 4;
-        }
-      }
-      break;
-    default:
-      return NULL;
+  if (additional_len == 0)
+    res->value.str.value = (char*) data;
+  else
+    res->value.str.value = (char*) res + sizeof(*res);
+
+  if (type != kNBTIntArray) {
+    if (additional_len != 0)
+      memcpy(res->value.str.value, data, len);
+  } else if (additional_len == 0) {
+    /* Perform byte rotation in-place, data is our own copy */
+    for (i = 0; i < len; i++)
+      res->value.i32l.list[i] = ntohl(res->value.i32l.list[i]);
+  } else {
+    for (i = 0; i < len; i++)
+      res->value.i32l.list[i] = ntohl(((const uint32_t*) data)[i]);
   }
 
-  return res;
+  return mc_nbt__push(parser, res);
+}
 
-fatal:
-  free(res);
-  return NULL;
+
+int mc_nbt__grow_stack(mc_nbt_parser_t* parser) {
+  int capacity;
+  mc_nbt_t** stack;
+
+  capacity = parser->stack_capacity == 0 ? kStackCapacity :
+                                           parser->stack_capacity * 2;
+  stack = realloc(parser->stack, capacity * sizeof(*stack));
+  if (stack == NULL)
+    return -1;
+
+  parser->stack = stack;
+  parser->stack_capacity = capacity;
+
+  return 0;
 }
 
 
-mc_nbt_t* mc_nbt__parse_high_order(mc_nbt__tag_t tag,
-                                   mc_nbt_parser_t* parser) {
-  mc_nbt_t* res;
-  mc_nbt_t* tmp;
-  mc_nbt_t* child;
-  mc_nbt__tag_t child_tag;
-  const char* name;
-  int len;
-  int i;
-  int name_len;
+void* mc_nbt__arena_alloc(mc_nbt_parser_t* parser, int size) {
+  int chunk_size;
+  mc_nbt_arena_t* arena;
+  void* res;
 
-  if (tag == kNBTTagList) {
-    if (parser->len < 5)
+  /* Keep nodes aligned */
+  size = (size + 7) & ~7;
+
+  arena = parser->arena;
+  if (arena == NULL || arena->size - arena->offset < size) {
+    chunk_size = size > kArenaChunkSize ? size : kArenaChunkSize;
+    arena = malloc(sizeof(*arena) + chunk_size);
+    if (arena == NULL)
       return NULL;
+    arena->next = parser->arena;
+    arena->offset = 0;
+    arena->size = chunk_size;
+    parser->arena = arena;
+  }
 
-    child_tag = (mc_nbt__tag_t) parser->data[0];
-    len = ntohl(*(uint32_t*) (parser->data + 1));
+  res = (char*) (arena + 1) + arena->offset;
+  arena->offset += size;
 
-    parser->data += 5;
-    parser->len -= 5;
+  return res;
+}
 
-    res = mc_nbt__alloc(tag,
-                        parser,
-                        (len - 1) * sizeof(*res->value.values.list));
-    if (res == NULL)
-      return NULL;
-    for (i = 0; i < len; i++) {
-      res->value.values.list[i] = mc_nbt__parse_payload(child_tag, parser);
 
-      /* Failure - dealloc all previous items */
-      if (res->value.values.list[i] == NULL)
-        goto fatal;
-    }
-  } else {
-    assert(tag == kNBTTagCompound);
-
-    /* Remember name_len as we might want to grow initial res */
-    name_len = parser->name_len;
-
-    /* Allocate compound with initial capacity */
-    len = kCompoundCapacity;
-    res = mc_nbt__alloc(tag,
-                        parser,
-                        (len -1) * sizeof(*res->value.values.list));
-    if (res == NULL)
-      return res;
-
-    i = 0;
-    while (1) {
-      /* Not enough space */
-      if (i == len) {
-        parser->name_len = name_len;
-        len += kCompoundCapacity;
-        tmp = mc_nbt__alloc(tag,
-                            parser,
-                            (len - 1) * sizeof(*res->value.values.list));
-        if (tmp == NULL)
-          goto fatal;
-
-        /* Restore old data */
-        name = tmp->name.value;
-        memcpy(tmp,
-               res,
-               sizeof(*res) + (len - kCompoundCapacity - 1) *
-                              sizeof(*res->value.values.list));
-        tmp->name.value = name;
-        free(res);
-        res = tmp;
-        tmp = NULL;
-      }
-
-      /* Parse child */
-      child = mc_nbt__parse(parser);
-
-      /* End tag */
-      if (child == &mc_nbt__end)
-        break;
-
-      /* Error, free all previous items */
-      if (child == NULL)
-        goto fatal;
-
-      /* Insert child in the list */
-      res->value.values.list[i++] = child;
-    }
+void mc_nbt__arena_destroy(mc_nbt_parser_t* parser) {
+  mc_nbt_arena_t* arena;
+  mc_nbt_arena_t* next;
+
+  for (arena = parser->arena; arena != NULL; arena = next) {
+    next = arena->next;
+    free(arena);
   }
-  res->value.values.len = i;
+  parser->arena = NULL;
+}
+
+
+void mc_nbt__free(mc_nbt_parser_t* parser, mc_nbt_t* val) {
+  /* Arena is released all at once */
+  if (parser->lifetime != kArenaLifetime)
+    free(val);
+}
 
-  return res;
 
-fatal:
-  i--;
-  for (; i >= 0; i--)
-    mc_nbt_destroy(res->value.values.list[i]);
-  free(res);
-  return NULL;
+void mc_nbt__destroy(mc_nbt_parser_t* parser, mc_nbt_t* val) {
+  if (parser->lifetime != kArenaLifetime)
+    mc_nbt_destroy(val);
 }
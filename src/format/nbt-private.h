@@ -23,10 +23,28 @@ enum mc_nbt__tag_e {
 static const int kGZipBits = 31;
 static const int kDeflateBits = 15;
 
+/* Forward declarations */
+struct z_stream_s;
+
 int mc_nbt__zlib(const unsigned char* data,
                  int len,
                  mc_nbt_comp_t comp,
                  int decompress,
                  unsigned char** out);
 
+int mc_nbt__zlib_init(struct z_stream_s* stream,
+                      mc_nbt_comp_t comp,
+                      int decompress);
+mc_nbt__tag_t mc_nbt__type_to_tag(mc_nbt_type_t type);
+int mc_nbt__tag_to_type(uint8_t tag, mc_nbt_type_t* type);
+
+/* Start SAX parser at value's payload, instead of the named tag */
+void mc_nbt__sax_start(mc_nbt_sax_t* sax,
+                       mc_nbt_type_t type,
+                       const char* name,
+                       int name_len);
+
+/* Number of name index slots to reserve for compound, 0 - if not needed */
+int mc_nbt__index_slots(int len);
+
 #endif  /* SRC_FORMAT_NBT_PRIVATE_H_ */
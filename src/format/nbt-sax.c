@@ -0,0 +1,541 @@
+#include <arpa/inet.h>  /* ntohs, ntohl */
+#include <stdlib.h>  /* malloc, realloc, free, NULL */
+#include <string.h>  /* memcpy, memset */
+
+#include "format/nbt.h"
+#include "format/nbt-private.h"
+#include "zlib.h"
+
+typedef enum mc_nbt_sax__state_e mc_nbt_sax__state_t;
+
+enum mc_nbt_sax__state_e {
+  kSaxTag,
+  kSaxNameLen,
+  kSaxName,
+  kSaxPayload,
+  kSaxArray,
+  kSaxDone,
+  kSaxError
+};
+
+static int mc_nbt_sax__process(mc_nbt_sax_t* sax,
+                               const unsigned char* data,
+                               int len);
+static const unsigned char* mc_nbt_sax__take(mc_nbt_sax_t* sax,
+                                             const unsigned char** data,
+                                             const unsigned char* end,
+                                             int need);
+static int mc_nbt_sax__payload(mc_nbt_sax_t* sax,
+                               const unsigned char** data,
+                               const unsigned char* end);
+static int mc_nbt_sax__array(mc_nbt_sax_t* sax,
+                             const unsigned char** data,
+                             const unsigned char* end);
+static int mc_nbt_sax__push(mc_nbt_sax_t* sax, uint8_t tag, int32_t left);
+static int mc_nbt_sax__complete(mc_nbt_sax_t* sax);
+static int mc_nbt_sax__save_name(mc_nbt_sax_t* sax, const char* name);
+
+static const int kMaxDepth = 1024;
+static const int kFrameCapacity = 16;
+static const int kSaxWindow = 16384;
+
+
+int mc_nbt_sax_init(mc_nbt_sax_t* sax,
+                    mc_nbt_comp_t comp,
+                    const mc_nbt_sax_cbs_t* cbs) {
+  int r;
+  z_stream* stream;
+
+  memset(sax, 0, sizeof(*sax));
+  sax->cbs = *cbs;
+  sax->comp = comp;
+  sax->state = kSaxTag;
+
+  if (comp == kNBTUncompressed)
+    return 0;
+
+  /* Inflated data goes through a fixed window */
+  stream = malloc(sizeof(*stream) + kSaxWindow);
+  if (stream == NULL)
+    return -1;
+  memset(stream, 0, sizeof(*stream));
+
+  r = inflateInit2(stream, comp == kNBTGZip ? kGZipBits : kDeflateBits);
+  if (r != Z_OK) {
+    free(stream);
+    return -1;
+  }
+  sax->stream = stream;
+
+  return 0;
+}
+
+
+int mc_nbt_sax_write(mc_nbt_sax_t* sax, const unsigned char* data, int len) {
+  int r;
+  int err;
+  z_stream* stream;
+  unsigned char* window;
+
+  if (sax->state == kSaxError)
+    return -1;
+
+  if (sax->comp == kNBTUncompressed)
+    return mc_nbt_sax__process(sax, data, len);
+
+  stream = sax->stream;
+  window = (unsigned char*) (stream + 1);
+  stream->next_in = (unsigned char*) data;
+  stream->avail_in = len;
+  do {
+    stream->next_out = window;
+    stream->avail_out = kSaxWindow;
+    r = inflate(stream, Z_NO_FLUSH);
+    if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+      sax->state = kSaxError;
+      return -1;
+    }
+
+    err = mc_nbt_sax__process(sax, window, kSaxWindow - stream->avail_out);
+    if (err != 0)
+      return err;
+
+    /* Window was filled up, there may be more output */
+  } while (r == Z_OK && stream->avail_out == 0);
+
+  return 0;
+}
+
+
+int mc_nbt_sax_finish(mc_nbt_sax_t* sax) {
+  return sax->state == kSaxDone ? 0 : -1;
+}
+
+
+void mc_nbt_sax_destroy(mc_nbt_sax_t* sax) {
+  if (sax->stream != NULL) {
+    inflateEnd(sax->stream);
+    free(sax->stream);
+    sax->stream = NULL;
+  }
+  free(sax->pending);
+  sax->pending = NULL;
+  free(sax->name_buf);
+  sax->name_buf = NULL;
+  free(sax->frames);
+  sax->frames = NULL;
+}
+
+
+void mc_nbt__sax_start(mc_nbt_sax_t* sax,
+                       mc_nbt_type_t type,
+                       const char* name,
+                       int name_len) {
+  sax->state = kSaxPayload;
+  sax->tag = mc_nbt__type_to_tag(type);
+  sax->name = name;
+  sax->name_len = name_len;
+}
+
+
+int mc_nbt_sax__process(mc_nbt_sax_t* sax,
+                        const unsigned char* data,
+                        int len) {
+  int r;
+  const unsigned char* end;
+  const unsigned char* token;
+
+  end = data + len;
+  while (sax->state != kSaxDone) {
+    r = 0;
+    switch (sax->state) {
+      case kSaxTag:
+        token = mc_nbt_sax__take(sax, &data, end, 1);
+        if (token == NULL) {
+          r = 1;
+          break;
+        }
+        sax->tag = token[0];
+        if (sax->tag != kNBTTagEnd) {
+          sax->state = kSaxNameLen;
+          break;
+        }
+
+        /* End of compound */
+        if (sax->frame_len == 0) {
+          r = -1;
+          break;
+        }
+        sax->frame_len--;
+        if (sax->cbs.end_compound != NULL && sax->cbs.end_compound(sax) != 0)
+          r = -1;
+        else
+          r = mc_nbt_sax__complete(sax);
+        break;
+      case kSaxNameLen:
+        token = mc_nbt_sax__take(sax, &data, end, 2);
+        if (token == NULL) {
+          r = 1;
+          break;
+        }
+        sax->name_len = ntohs(*(uint16_t*) token);
+        if (sax->name_len > 0x7fff)
+          r = -1;
+        sax->state = kSaxName;
+        break;
+      case kSaxName:
+        token = mc_nbt_sax__take(sax, &data, end, sax->name_len);
+        if (token == NULL) {
+          r = 1;
+          break;
+        }
+        sax->name = (const char*) token;
+        if (token == sax->pending)
+          r = mc_nbt_sax__save_name(sax, sax->name);
+        sax->state = kSaxPayload;
+        break;
+      case kSaxPayload:
+        r = mc_nbt_sax__payload(sax, &data, end);
+        break;
+      case kSaxArray:
+        r = mc_nbt_sax__array(sax, &data, end);
+        break;
+      default:
+        r = -1;
+        break;
+    }
+
+    /* Allocation failure in mc_nbt_sax__take() */
+    if (r < 0 || sax->state == kSaxError) {
+      sax->state = kSaxError;
+      return -1;
+    }
+
+    if (r == 1)
+      break;
+  }
+
+  /* Input will go away, keep the name */
+  if (sax->name != NULL && sax->name != sax->name_buf) {
+    r = mc_nbt_sax__save_name(sax, sax->name);
+    if (r != 0) {
+      sax->state = kSaxError;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+const unsigned char* mc_nbt_sax__take(mc_nbt_sax_t* sax,
+                                      const unsigned char** data,
+                                      const unsigned char* end,
+                                      int need) {
+  int size;
+  int chunk;
+  unsigned char* pending;
+  const unsigned char* res;
+
+  /* Fast case: whole token is in the input */
+  if (sax->pending_len == 0 && end - *data >= need) {
+    res = *data;
+    *data += need;
+    return res;
+  }
+
+  if (need > sax->pending_size) {
+    size = need;
+    pending = realloc(sax->pending, size);
+    if (pending == NULL) {
+      sax->state = kSaxError;
+      return NULL;
+    }
+    sax->pending = pending;
+    sax->pending_size = size;
+  }
+
+  chunk = need - sax->pending_len;
+  if (chunk > end - *data)
+    chunk = end - *data;
+  memcpy(sax->pending + sax->pending_len, *data, chunk);
+  sax->pending_len += chunk;
+  *data += chunk;
+  if (sax->pending_len < need)
+    return NULL;
+
+  sax->pending_len = 0;
+  return sax->pending;
+}
+
+
+int mc_nbt_sax__payload(mc_nbt_sax_t* sax,
+                        const unsigned char** data,
+                        const unsigned char* end) {
+  int r;
+  int size;
+  int32_t len;
+  uint8_t item;
+  uint32_t i32;
+  uint64_t i64;
+  mc_nbt_type_t type;
+  const unsigned char* token;
+  union {
+    int8_t i8;
+    int16_t i16;
+    int32_t i32;
+    int64_t i64;
+    float f32;
+    double f64;
+  } value;
+
+  r = mc_nbt__tag_to_type(sax->tag, &type);
+  if (r != 0)
+    return -1;
+
+  switch (type) {
+    case kNBTByte:
+    case kNBTShort:
+    case kNBTInt:
+    case kNBTFloat:
+    case kNBTLong:
+    case kNBTDouble:
+      size = type == kNBTByte ? 1 :
+             type == kNBTShort ? 2 :
+             type == kNBTInt || type == kNBTFloat ? 4 : 8;
+      token = mc_nbt_sax__take(sax, data, end, size);
+      if (token == NULL)
+        return 1;
+      switch (size) {
+        case 1:
+          value.i8 = (int8_t) token[0];
+          break;
+        case 2:
+          value.i16 = (int16_t) ntohs(*(uint16_t*) token);
+          break;
+        case 4:
+          i32 = ntohl(*(uint32_t*) token);
+          memcpy(&value, &i32, sizeof(i32));
+          break;
+        default:
+          i64 = ((uint64_t) ntohl(*(uint32_t*) token) << 32) |
+                ntohl(*(uint32_t*) (token + 4));
+          memcpy(&value, &i64, sizeof(i64));
+          break;
+      }
+      if (sax->cbs.value != NULL &&
+          sax->cbs.value(sax, sax->name, sax->name_len, type, &value) != 0) {
+        return -1;
+      }
+      return mc_nbt_sax__complete(sax);
+    case kNBTByteArray:
+    case kNBTIntArray:
+    case kNBTString:
+      size = type == kNBTString ? 2 : 4;
+      token = mc_nbt_sax__take(sax, data, end, size);
+      if (token == NULL)
+        return 1;
+      if (type == kNBTString)
+        sax->total = ntohs(*(uint16_t*) token);
+      else
+        sax->total = ntohl(*(uint32_t*) token);
+      if (sax->total < 0)
+        return -1;
+      sax->offset = 0;
+      sax->state = kSaxArray;
+
+      /* Empty arrays are reported too */
+      if (sax->total != 0)
+        return 0;
+      if (sax->cbs.array != NULL &&
+          sax->cbs.array(sax,
+                         sax->name,
+                         sax->name_len,
+                         type,
+                         *data,
+                         0,
+                         0,
+                         0) != 0) {
+        return -1;
+      }
+      return mc_nbt_sax__complete(sax);
+    case kNBTList:
+      token = mc_nbt_sax__take(sax, data, end, 5);
+      if (token == NULL)
+        return 1;
+      item = token[0];
+      len = ntohl(*(uint32_t*) (token + 1));
+      if (len < 0)
+        return -1;
+
+      /* Empty lists are often written with End tag */
+      r = mc_nbt__tag_to_type(item, &type);
+      if (r != 0) {
+        if (len != 0)
+          return -1;
+        type = kNBTByte;
+      }
+
+      if (sax->cbs.begin_list != NULL &&
+          sax->cbs.begin_list(sax,
+                              sax->name,
+                              sax->name_len,
+                              type,
+                              len) != 0) {
+        return -1;
+      }
+      r = mc_nbt_sax__push(sax, item, len);
+      if (r != 0)
+        return r;
+
+      /* Items have neither tag nor name */
+      sax->name = NULL;
+      sax->name_len = 0;
+      sax->tag = item;
+      if (len != 0)
+        return 0;
+
+      sax->frame_len--;
+      if (sax->cbs.end_list != NULL && sax->cbs.end_list(sax) != 0)
+        return -1;
+      return mc_nbt_sax__complete(sax);
+    case kNBTCompound:
+      if (sax->cbs.begin_compound != NULL &&
+          sax->cbs.begin_compound(sax, sax->name, sax->name_len) != 0) {
+        return -1;
+      }
+      r = mc_nbt_sax__push(sax, kNBTTagEnd, -1);
+      if (r != 0)
+        return r;
+
+      sax->name = NULL;
+      sax->name_len = 0;
+      sax->state = kSaxTag;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+
+int mc_nbt_sax__array(mc_nbt_sax_t* sax,
+                      const unsigned char** data,
+                      const unsigned char* end) {
+  int size;
+  int32_t len;
+  mc_nbt_type_t type;
+  const unsigned char* token;
+
+  if (mc_nbt__tag_to_type(sax->tag, &type) != 0)
+    return -1;
+  size = type == kNBTIntArray ? 4 : 1;
+
+  if (sax->pending_len != 0 || end - *data < size) {
+    /* Int split between inputs */
+    token = mc_nbt_sax__take(sax, data, end, size);
+    if (token == NULL)
+      return 1;
+    len = 1;
+  } else {
+    token = *data;
+    len = (end - *data) / size;
+    if (len > sax->total - sax->offset)
+      len = sax->total - sax->offset;
+    *data += len * size;
+  }
+
+  if (sax->cbs.array != NULL &&
+      sax->cbs.array(sax,
+                     sax->name,
+                     sax->name_len,
+                     type,
+                     token,
+                     len,
+                     sax->offset,
+                     sax->total) != 0) {
+    return -1;
+  }
+  sax->name = NULL;
+  sax->name_len = 0;
+
+  sax->offset += len;
+  if (sax->offset == sax->total)
+    return mc_nbt_sax__complete(sax);
+
+  return 0;
+}
+
+
+int mc_nbt_sax__push(mc_nbt_sax_t* sax, uint8_t tag, int32_t left) {
+  int capacity;
+  mc_nbt_sax_frame_t* frames;
+
+  if (sax->frame_len >= kMaxDepth)
+    return -1;
+
+  if (sax->frame_len == sax->frame_capacity) {
+    capacity = sax->frame_capacity == 0 ? kFrameCapacity :
+                                          sax->frame_capacity * 2;
+    frames = realloc(sax->frames, capacity * sizeof(*frames));
+    if (frames == NULL)
+      return -1;
+    sax->frames = frames;
+    sax->frame_capacity = capacity;
+  }
+
+  sax->frames[sax->frame_len].tag = tag;
+  sax->frames[sax->frame_len].left = left;
+  sax->frame_len++;
+
+  return 0;
+}
+
+
+int mc_nbt_sax__complete(mc_nbt_sax_t* sax) {
+  mc_nbt_sax_frame_t* frame;
+
+  sax->name = NULL;
+  sax->name_len = 0;
+
+  /* Value is done, find out what comes next */
+  while (sax->frame_len > 0) {
+    frame = &sax->frames[sax->frame_len - 1];
+    if (frame->tag == kNBTTagEnd) {
+      sax->state = kSaxTag;
+      return 0;
+    }
+
+    if (--frame->left > 0) {
+      sax->tag = frame->tag;
+      sax->state = kSaxPayload;
+      return 0;
+    }
+
+    /* Last item in the list */
+    sax->frame_len--;
+    if (sax->cbs.end_list != NULL && sax->cbs.end_list(sax) != 0)
+      return -1;
+  }
+
+  sax->state = kSaxDone;
+  return 0;
+}
+
+
+int mc_nbt_sax__save_name(mc_nbt_sax_t* sax, const char* name) {
+  char* name_buf;
+
+  if (sax->name_len > sax->name_size) {
+    name_buf = realloc(sax->name_buf, sax->name_len);
+    if (name_buf == NULL)
+      return -1;
+    sax->name_buf = name_buf;
+    sax->name_size = sax->name_len;
+  }
+
+  if (sax->name_len != 0)
+    memcpy(sax->name_buf, name, sax->name_len);
+  sax->name = sax->name_buf;
+
+  return 0;
+}
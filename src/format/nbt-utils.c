@@ -1,29 +1,93 @@
-#include <stdlib.h>  /* NULL */
-#include <string.h>  /* strncmp */
+#include <stdlib.h>  /* malloc, free, NULL */
+#include <string.h>  /* memcmp, memcpy, memset */
 
 #include "format/nbt.h"
+#include "format/nbt-private.h"
+
+static mc_nbt_t* mc_nbt__copy(const mc_nbt_t* val);
+static mc_nbt_t* mc_nbt__share(const mc_nbt_t* val);
+static void mc_nbt__index_build(mc_nbt_t* obj);
+static int mc_nbt__name_eq(mc_nbt_t* item, const char* value, int len);
+
+static const int kIndexThreshold = 16;
+static const int kHashChars = 32;
+static const uint32_t kHashPrime = 0x01000193u;
+
+
+uint32_t mc_nbt_hash(const char* value, int len) {
+  int i;
+  uint32_t hash;
+  uint32_t mul;
+
+  /* NOTE: should match MC_NBT_HASH() */
+  hash = (uint32_t) len * 0x9e3779b1u;
+  mul = 1;
+  for (i = 0; i < len && i < kHashChars; i++) {
+    hash += (uint32_t) (uint8_t) value[i] * mul;
+    mul *= kHashPrime;
+  }
+
+  return hash ^ (hash >> 16);
+}
+
+
+void mc_nbt_key_init(mc_nbt_key_t* key, const char* value, int len) {
+  key->value = value;
+  key->len = len;
+  key->hash = mc_nbt_hash(value, len);
+}
+
 
 mc_nbt_t** mc_nbt_find(mc_nbt_t* obj,
                        const char* prop,
                        int len,
                        mc_nbt_type_t type) {
+  mc_nbt_key_t key;
+
+  mc_nbt_key_init(&key, prop, len);
+  return mc_nbt_find_key(obj, &key, type);
+}
+
+
+mc_nbt_t** mc_nbt_find_key(mc_nbt_t* obj,
+                           const mc_nbt_key_t* key,
+                           mc_nbt_type_t type) {
   int i;
+  uint32_t mask;
+  int32_t* index;
   mc_nbt_t* item;
+
   if (obj->type != kNBTCompound)
     return NULL;
 
-  for (i = 0; i < obj->value.values.len;i++) {
-    item = obj->value.values.list[i];
-    if (item->name.len != len ||
-        strncmp(item->name.value, prop, len) != 0) {
-      continue;
+  /* Build index on first lookup */
+  if (obj->value.values.index < 0)
+    mc_nbt__index_build(obj);
+
+  if (obj->value.values.index == 0) {
+    for (i = 0; i < obj->value.values.len; i++) {
+      item = obj->value.values.list[i];
+      if (mc_nbt__name_eq(item, key->value, key->len))
+        break;
+    }
+    if (i == obj->value.values.len)
+      return NULL;
+  } else {
+    index = (int32_t*) &obj->value.values.list[obj->value.values.len];
+    mask = obj->value.values.index - 1;
+    for (i = key->hash & mask; index[i] != 0; i = (i + 1) & mask) {
+      item = obj->value.values.list[index[i] - 1];
+      if (mc_nbt__name_eq(item, key->value, key->len))
+        break;
     }
-    if (item->type != type)
+    if (index[i] == 0)
       return NULL;
-    return &obj->value.values.list[i];
+    i = index[i] - 1;
   }
 
-  return NULL;
+  if (obj->value.values.list[i]->type != type)
+    return NULL;
+  return &obj->value.values.list[i];
 }
 
 
@@ -31,9 +95,19 @@ mc_nbt_t* mc_nbt_get(mc_nbt_t* obj,
                      const char* prop,
                      int len,
                      mc_nbt_type_t type) {
+  mc_nbt_key_t key;
+
+  mc_nbt_key_init(&key, prop, len);
+  return mc_nbt_get_key(obj, &key, type);
+}
+
+
+mc_nbt_t* mc_nbt_get_key(mc_nbt_t* obj,
+                         const mc_nbt_key_t* key,
+                         mc_nbt_type_t type) {
   mc_nbt_t** slot;
 
-  slot = mc_nbt_find(obj, prop, len, type);
+  slot = mc_nbt_find_key(obj, key, type);
   if (slot == NULL)
     return NULL;
 
@@ -46,9 +120,21 @@ int mc_nbt_set(mc_nbt_t* obj,
                int len,
                mc_nbt_type_t type,
                void* val) {
+  mc_nbt_key_t key;
+
+  mc_nbt_key_init(&key, prop, len);
+  return mc_nbt_set_key(obj, &key, type, val);
+}
+
+
+int mc_nbt_set_key(mc_nbt_t* obj,
+                   const mc_nbt_key_t* key,
+                   mc_nbt_type_t type,
+                   void* val) {
   mc_nbt_t* r;
 
-  r = mc_nbt_get(obj, prop, len, type);
+  /* Copy value, if it is shared with clones */
+  r = mc_nbt_edit_key(obj, key, type);
   if (r == NULL)
     return -1;
 
@@ -84,11 +170,22 @@ int mc_nbt_read(mc_nbt_t* obj,
                 int len,
                 mc_nbt_type_t type,
                 void* to) {
+  mc_nbt_key_t key;
+
+  mc_nbt_key_init(&key, prop, len);
+  return mc_nbt_read_key(obj, &key, type, to);
+}
+
+
+int mc_nbt_read_key(mc_nbt_t* obj,
+                    const mc_nbt_key_t* key,
+                    mc_nbt_type_t type,
+                    void* to) {
   mc_nbt_t* r;
   int byte_size;
   unsigned char* tmp;
 
-  r = mc_nbt_get(obj, prop, len, type);
+  r = mc_nbt_get_key(obj, key, type);
   if (r == NULL)
     return -1;
   switch (type) {
@@ -130,10 +227,91 @@ int mc_nbt_read(mc_nbt_t* obj,
 
 
 mc_nbt_t* mc_nbt_clone(const mc_nbt_t* val) {
+  /* Root is always copied, so clone can be edited right away */
+  return mc_nbt__copy(val);
+}
+
+
+int mc_nbt_size(const mc_nbt_t* val) {
   int i;
+  int res;
+
+  /* Same layout as in mc_nbt__copy() */
+  res = sizeof(*val) + val->name.len;
+  switch (val->type) {
+    case kNBTByteArray:
+    case kNBTString:
+      res += val->value.i8l.len;
+      break;
+    case kNBTIntArray:
+      res += val->value.i32l.len * 4;
+      break;
+    case kNBTCompound:
+      res += mc_nbt__index_slots(val->value.values.len) * sizeof(int32_t);
+      /* Fall through */
+    case kNBTList:
+      res += (val->value.values.len - 1) * sizeof(*val->value.values.list);
+      for (i = 0; i < val->value.values.len; i++)
+        res += mc_nbt_size(val->value.values.list[i]);
+      break;
+    default:
+      break;
+  }
+
+  return res;
+}
+
+
+mc_nbt_t* mc_nbt_unshare(mc_nbt_t** slot) {
+  mc_nbt_t* res;
+
+  if ((*slot)->refs <= 1)
+    return *slot;
+
+  /* Copy only this node, children are shared with the original */
+  res = mc_nbt__copy(*slot);
+  if (res == NULL)
+    return NULL;
+
+  mc_nbt_destroy(*slot);
+  *slot = res;
+
+  return res;
+}
+
+
+mc_nbt_t* mc_nbt_edit(mc_nbt_t* obj,
+                      const char* prop,
+                      int len,
+                      mc_nbt_type_t type) {
+  mc_nbt_key_t key;
+
+  mc_nbt_key_init(&key, prop, len);
+  return mc_nbt_edit_key(obj, &key, type);
+}
+
+
+mc_nbt_t* mc_nbt_edit_key(mc_nbt_t* obj,
+                          const mc_nbt_key_t* key,
+                          mc_nbt_type_t type) {
+  mc_nbt_t** slot;
+
+  /* `obj` is either a clone's root or was returned by this function */
+  slot = mc_nbt_find_key(obj, key, type);
+  if (slot == NULL)
+    return NULL;
+
+  return mc_nbt_unshare(slot);
+}
+
+
+mc_nbt_t* mc_nbt__copy(const mc_nbt_t* val) {
+  int i;
+  int slots;
   int additional_size;
   mc_nbt_t* res;
 
+  slots = 0;
   switch (val->type) {
     case kNBTByteArray:
     case kNBTString:
@@ -142,10 +320,13 @@ mc_nbt_t* mc_nbt_clone(const mc_nbt_t* val) {
     case kNBTIntArray:
       additional_size = val->value.i32l.len * 4;
       break;
-    case kNBTList:
     case kNBTCompound:
+      slots = mc_nbt__index_slots(val->value.values.len);
+      /* Fall through */
+    case kNBTList:
       additional_size = (val->value.values.len - 1) *
-                        sizeof(*val->value.values.list);
+                        sizeof(*val->value.values.list) +
+                        slots * sizeof(int32_t);
       break;
     default:
       additional_size = 0;
@@ -159,14 +340,15 @@ mc_nbt_t* mc_nbt_clone(const mc_nbt_t* val) {
   switch (val->type) {
     case kNBTList:
     case kNBTCompound:
-      /* Clone children */
+      /* Clone (i.e. share) children */
       for (i = 0; i < val->value.values.len; i++) {
-        res->value.values.list[i] = mc_nbt_clone(val->value.values.list[i]);
+        res->value.values.list[i] = mc_nbt__share(val->value.values.list[i]);
         if (res->value.values.list[i] == NULL)
           goto high_level_failed;
       }
       res->type = val->type;
       res->value.values.len = val->value.values.len;
+      res->value.values.index = -slots;
       break;
     default:
       /* Copy all primitive data */
@@ -181,6 +363,7 @@ mc_nbt_t* mc_nbt_clone(const mc_nbt_t* val) {
       }
       break;
   }
+  res->refs = 1;
 
   /* Copy name */
   res->name.value = (char*) res + sizeof(*res) + additional_size;
@@ -195,3 +378,63 @@ high_level_failed:
   free(res);
   return NULL;
 }
+
+
+mc_nbt_t* mc_nbt__share(const mc_nbt_t* val) {
+  /* Share owned nodes, they'll be copied by the first writer */
+  if (val->refs > 0) {
+    ((mc_nbt_t*) val)->refs++;
+    return (mc_nbt_t*) val;
+  }
+
+  return mc_nbt__copy(val);
+}
+
+
+int mc_nbt__index_slots(int len) {
+  int slots;
+
+  if (len < kIndexThreshold)
+    return 0;
+
+  /* Keep load factor below 1/2 */
+  for (slots = kIndexThreshold; slots < 2 * len; slots *= 2) {
+    /* no-op */
+  }
+
+  return slots;
+}
+
+
+void mc_nbt__index_build(mc_nbt_t* obj) {
+  int i;
+  int j;
+  uint32_t mask;
+  int32_t* index;
+  mc_nbt_t* item;
+
+  index = (int32_t*) &obj->value.values.list[obj->value.values.len];
+  obj->value.values.index = -obj->value.values.index;
+  mask = obj->value.values.index - 1;
+  memset(index, 0, obj->value.values.index * sizeof(*index));
+
+  for (i = 0; i < obj->value.values.len; i++) {
+    item = obj->value.values.list[i];
+    j = mc_nbt_hash(item->name.value, item->name.len) & mask;
+    for (; index[j] != 0; j = (j + 1) & mask) {
+      /* Duplicate name, first one wins - as in linear lookup */
+      if (mc_nbt__name_eq(obj->value.values.list[index[j] - 1],
+                          item->name.value,
+                          item->name.len)) {
+        break;
+      }
+    }
+    if (index[j] == 0)
+      index[j] = i + 1;
+  }
+}
+
+
+int mc_nbt__name_eq(mc_nbt_t* item, const char* value, int len) {
+  return item->name.len == len && memcmp(item->name.value, value, len) == 0;
+}
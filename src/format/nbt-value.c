@@ -128,6 +128,13 @@ mc_nbt_t* mc_nbt_create_compound(const char* name, int name_len, int len) {
 
 void mc_nbt_destroy(mc_nbt_t* val) {
   int32_t i;
+
+  /* Still used by clones */
+  if (val->refs > 1) {
+    val->refs--;
+    return;
+  }
+
   if (val->type == kNBTList || val->type == kNBTCompound)
     for (i = 0; i < val->value.values.len; i++)
       if (val->value.values.list[i] != NULL)
@@ -147,6 +154,7 @@ mc_nbt_t* mc_nbt__create(const char* name,
     return NULL;
 
   res->type = type;
+  res->refs = 1;
   res->name.value = (char*) res + sizeof(*res) + additional_payload;
   res->name.len = name_len;
   memcpy((char*) res->name.value, name, name_len);
@@ -170,6 +178,7 @@ mc_nbt_t* mc_nbt__create_vl(mc_nbt_type_t type,
     for (i = 0; i < len; i++)
       res->value.values.list[i] = NULL;
     res->value.values.len = len;
+    res->value.values.index = 0;
   }
 
   return res;
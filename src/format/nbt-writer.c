@@ -0,0 +1,413 @@
+#include <stdlib.h>  /* malloc, free, NULL */
+#include <string.h>  /* memcpy */
+
+#include "format/nbt.h"
+#include "format/nbt-private.h"
+#include "utils/chain.h"  /* mc_chain_t */
+#include "zlib.h"
+
+static int mc_nbt_writer__header(mc_nbt_writer_t* w,
+                                 mc_nbt_type_t type,
+                                 const char* name,
+                                 int name_len);
+static int mc_nbt_writer__put(mc_nbt_writer_t* w, const void* data, int len);
+static int mc_nbt_writer__deflate(mc_nbt_writer_t* w,
+                                  const void* data,
+                                  int len,
+                                  int flush);
+static void mc_nbt_writer__be(unsigned char* out, uint64_t val, int size);
+
+static const int kWriterWindow = 16384;
+static const int kWriterSegment = 16384;
+
+
+int mc_nbt_writer_init(mc_nbt_writer_t* w,
+                       struct mc_chain_s* out,
+                       mc_nbt_comp_t comp) {
+  int r;
+
+  w->out = out;
+  w->comp = comp;
+  w->stream = NULL;
+  w->window = NULL;
+  w->window_len = 0;
+  w->seg = NULL;
+  if (comp == kNBTUncompressed)
+    return 0;
+
+  w->stream = malloc(sizeof(z_stream));
+  w->window = malloc(kWriterWindow);
+  if (w->stream == NULL || w->window == NULL)
+    goto fatal;
+
+  r = mc_nbt__zlib_init(w->stream, comp, 0);
+  if (r != 0)
+    goto fatal;
+
+  return 0;
+
+fatal:
+  free(w->stream);
+  free(w->window);
+  w->stream = NULL;
+  w->window = NULL;
+  return -1;
+}
+
+
+int mc_nbt_writer_finish(mc_nbt_writer_t* w) {
+  int r;
+  int len;
+  z_stream* stream;
+
+  if (w->comp == kNBTUncompressed)
+    return 0;
+
+  stream = w->stream;
+  r = mc_nbt_writer__deflate(w, w->window, w->window_len, Z_FINISH);
+  w->window_len = 0;
+  if (r != 0)
+    return r;
+
+  /* Link in the last partial segment, its slack is used by later writes */
+  len = kWriterSegment - stream->avail_out;
+  if (w->seg != NULL && len != 0) {
+    r = mc_chain_adopt(w->out, w->seg, len, kWriterSegment);
+    if (r != 0)
+      return r;
+  } else {
+    free(w->seg);
+  }
+  w->seg = NULL;
+
+  /* Ready for the next document */
+  return deflateReset(stream) == Z_OK ? 0 : -1;
+}
+
+
+void mc_nbt_writer_destroy(mc_nbt_writer_t* w) {
+  if (w->stream != NULL) {
+    deflateEnd(w->stream);
+    free(w->stream);
+    w->stream = NULL;
+  }
+  free(w->window);
+  w->window = NULL;
+  free(w->seg);
+  w->seg = NULL;
+}
+
+
+int mc_nbt_write_compound(mc_nbt_writer_t* w,
+                          const char* name,
+                          int name_len) {
+  return mc_nbt_writer__header(w, kNBTCompound, name, name_len);
+}
+
+
+int mc_nbt_write_end(mc_nbt_writer_t* w) {
+  unsigned char tag;
+
+  tag = kNBTTagEnd;
+  return mc_nbt_writer__put(w, &tag, 1);
+}
+
+
+int mc_nbt_write_list(mc_nbt_writer_t* w,
+                      const char* name,
+                      int name_len,
+                      mc_nbt_type_t type,
+                      int32_t len) {
+  unsigned char tmp[5];
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTList, name, name_len));
+  tmp[0] = mc_nbt__type_to_tag(type);
+  mc_nbt_writer__be(tmp + 1, (uint32_t) len, 4);
+  return mc_nbt_writer__put(w, tmp, sizeof(tmp));
+}
+
+
+int mc_nbt_write_i8(mc_nbt_writer_t* w,
+                    const char* name,
+                    int name_len,
+                    int8_t val) {
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTByte, name, name_len));
+  return mc_nbt_writer__put(w, &val, 1);
+}
+
+
+int mc_nbt_write_i16(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     int16_t val) {
+  unsigned char tmp[2];
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTShort, name, name_len));
+  mc_nbt_writer__be(tmp, (uint16_t) val, sizeof(tmp));
+  return mc_nbt_writer__put(w, tmp, sizeof(tmp));
+}
+
+
+int mc_nbt_write_i32(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     int32_t val) {
+  unsigned char tmp[4];
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTInt, name, name_len));
+  mc_nbt_writer__be(tmp, (uint32_t) val, sizeof(tmp));
+  return mc_nbt_writer__put(w, tmp, sizeof(tmp));
+}
+
+
+int mc_nbt_write_i64(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     int64_t val) {
+  unsigned char tmp[8];
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTLong, name, name_len));
+  mc_nbt_writer__be(tmp, (uint64_t) val, sizeof(tmp));
+  return mc_nbt_writer__put(w, tmp, sizeof(tmp));
+}
+
+
+int mc_nbt_write_f32(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     float val) {
+  uint32_t bits;
+  unsigned char tmp[4];
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTFloat, name, name_len));
+  memcpy(&bits, &val, sizeof(bits));
+  mc_nbt_writer__be(tmp, bits, sizeof(tmp));
+  return mc_nbt_writer__put(w, tmp, sizeof(tmp));
+}
+
+
+int mc_nbt_write_f64(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     double val) {
+  uint64_t bits;
+  unsigned char tmp[8];
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTDouble, name, name_len));
+  memcpy(&bits, &val, sizeof(bits));
+  mc_nbt_writer__be(tmp, bits, sizeof(tmp));
+  return mc_nbt_writer__put(w, tmp, sizeof(tmp));
+}
+
+
+int mc_nbt_write_str(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     const char* value,
+                     int value_len) {
+  unsigned char tmp[2];
+
+  if (value_len > 0xffff)
+    return -1;
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTString, name, name_len));
+  mc_nbt_writer__be(tmp, value_len, sizeof(tmp));
+  NBT_WRITE(mc_nbt_writer__put(w, tmp, sizeof(tmp)));
+  return mc_nbt_writer__put(w, value, value_len);
+}
+
+
+int mc_nbt_write_i8l(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     const void* data,
+                     int32_t len) {
+  unsigned char tmp[4];
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTByteArray, name, name_len));
+  mc_nbt_writer__be(tmp, (uint32_t) len, sizeof(tmp));
+  NBT_WRITE(mc_nbt_writer__put(w, tmp, sizeof(tmp)));
+  return mc_nbt_writer__put(w, data, len);
+}
+
+
+int mc_nbt_write_i32l(mc_nbt_writer_t* w,
+                      const char* name,
+                      int name_len,
+                      const int32_t* data,
+                      int32_t len) {
+  int i;
+  int chunk;
+  unsigned char tmp[1024];
+
+  NBT_WRITE(mc_nbt_writer__header(w, kNBTIntArray, name, name_len));
+  mc_nbt_writer__be(tmp, (uint32_t) len, 4);
+  NBT_WRITE(mc_nbt_writer__put(w, tmp, 4));
+
+  /* Swap bytes in small chunks */
+  while (len > 0) {
+    chunk = len > (int) sizeof(tmp) / 4 ? (int) sizeof(tmp) / 4 : len;
+    for (i = 0; i < chunk; i++)
+      mc_nbt_writer__be(tmp + i * 4, (uint32_t) data[i], 4);
+    NBT_WRITE(mc_nbt_writer__put(w, tmp, chunk * 4));
+    data += chunk;
+    len -= chunk;
+  }
+
+  return 0;
+}
+
+
+int mc_nbt_write_value(mc_nbt_writer_t* w,
+                       const mc_nbt_t* val,
+                       int with_name) {
+  int32_t i;
+  const char* name;
+  mc_nbt_type_t type;
+
+  name = NULL;
+  if (with_name)
+    name = val->name.value == NULL ? "" : val->name.value;
+
+  switch (val->type) {
+    case kNBTByte:
+      return mc_nbt_write_i8(w, name, val->name.len, val->value.i8);
+    case kNBTShort:
+      return mc_nbt_write_i16(w, name, val->name.len, val->value.i16);
+    case kNBTInt:
+      return mc_nbt_write_i32(w, name, val->name.len, val->value.i32);
+    case kNBTLong:
+      return mc_nbt_write_i64(w, name, val->name.len, val->value.i64);
+    case kNBTFloat:
+      return mc_nbt_write_f32(w, name, val->name.len, val->value.f32);
+    case kNBTDouble:
+      return mc_nbt_write_f64(w, name, val->name.len, val->value.f64);
+    case kNBTByteArray:
+      return mc_nbt_write_i8l(w,
+                              name,
+                              val->name.len,
+                              val->value.i8l.list,
+                              val->value.i8l.len);
+    case kNBTIntArray:
+      return mc_nbt_write_i32l(w,
+                               name,
+                               val->name.len,
+                               val->value.i32l.list,
+                               val->value.i32l.len);
+    case kNBTString:
+      return mc_nbt_write_str(w,
+                              name,
+                              val->name.len,
+                              val->value.str.value,
+                              val->value.str.len);
+    case kNBTList:
+      if (val->value.values.len == 0)
+        type = kNBTByte;
+      else
+        type = val->value.values.list[0]->type;
+      NBT_WRITE(mc_nbt_write_list(w,
+                                  name,
+                                  val->name.len,
+                                  type,
+                                  val->value.values.len));
+      for (i = 0; i < val->value.values.len; i++)
+        NBT_WRITE(mc_nbt_write_value(w, val->value.values.list[i], 0));
+      return 0;
+    case kNBTCompound:
+      NBT_WRITE(mc_nbt_write_compound(w, name, val->name.len));
+      for (i = 0; i < val->value.values.len; i++)
+        NBT_WRITE(mc_nbt_write_value(w, val->value.values.list[i], 1));
+      return mc_nbt_write_end(w);
+    default:
+      return -1;
+  }
+}
+
+
+int mc_nbt_writer__header(mc_nbt_writer_t* w,
+                          mc_nbt_type_t type,
+                          const char* name,
+                          int name_len) {
+  unsigned char tmp[3];
+
+  /* List item */
+  if (name == NULL)
+    return 0;
+
+  tmp[0] = mc_nbt__type_to_tag(type);
+  mc_nbt_writer__be(tmp + 1, name_len, 2);
+  NBT_WRITE(mc_nbt_writer__put(w, tmp, sizeof(tmp)));
+  return mc_nbt_writer__put(w, name, name_len);
+}
+
+
+int mc_nbt_writer__put(mc_nbt_writer_t* w, const void* data, int len) {
+  int r;
+
+  if (w->comp == kNBTUncompressed)
+    return mc_chain_write_data(w->out, data, len);
+
+  if (w->window_len + len <= kWriterWindow) {
+    memcpy(w->window + w->window_len, data, len);
+    w->window_len += len;
+    return 0;
+  }
+
+  r = mc_nbt_writer__deflate(w, w->window, w->window_len, Z_NO_FLUSH);
+  w->window_len = 0;
+  if (r != 0)
+    return r;
+
+  /* Big arrays go to zlib without copying */
+  if (len >= kWriterWindow)
+    return mc_nbt_writer__deflate(w, data, len, Z_NO_FLUSH);
+
+  memcpy(w->window, data, len);
+  w->window_len = len;
+  return 0;
+}
+
+
+int mc_nbt_writer__deflate(mc_nbt_writer_t* w,
+                           const void* data,
+                           int len,
+                           int flush) {
+  int r;
+  z_stream* stream;
+
+  stream = w->stream;
+  stream->next_in = (unsigned char*) data;
+  stream->avail_in = len;
+  do {
+    /* Compressed output goes straight into chain's segments */
+    if (w->seg == NULL) {
+      w->seg = malloc(kWriterSegment);
+      if (w->seg == NULL)
+        return -1;
+      stream->next_out = w->seg;
+      stream->avail_out = kWriterSegment;
+    }
+
+    r = deflate(stream, flush);
+    if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+      return -1;
+
+    if (stream->avail_out == 0) {
+      if (mc_chain_append(w->out, w->seg, kWriterSegment) != 0)
+        return -1;
+      w->seg = NULL;
+    }
+  } while (stream->avail_in != 0 || (flush == Z_FINISH && r != Z_STREAM_END));
+
+  return 0;
+}
+
+
+void mc_nbt_writer__be(unsigned char* out, uint64_t val, int size) {
+  int i;
+
+  for (i = size - 1; i >= 0; i--) {
+    out[i] = val & 0xff;
+    val >>= 8;
+  }
+}
@@ -1,15 +1,64 @@
 #ifndef SRC_FORMAT_NBT_H_
 #define SRC_FORMAT_NBT_H_
 
+#include <stddef.h>  /* offsetof */
 #include <stdint.h>  /* uint8_t, and friends */
 
+/*
+ * Compile-time version of mc_nbt_hash() for string literals: sum of first
+ * 32 characters multiplied by powers of FNV prime, mixed with the length.
+ */
+#define MC_NBT__HASH_CHAR(s, i, p) \
+    ((i) < sizeof(s) - 1 ? \
+        (uint32_t) (uint8_t) (s)[(i) < sizeof(s) - 1 ? (i) : 0] * (p) : 0u)
+
+#define MC_NBT__HASH_SUM(s) \
+    ((uint32_t) (sizeof(s) - 1) * 0x9e3779b1u + \
+     MC_NBT__HASH_CHAR(s, 0, 0x00000001u) + \
+     MC_NBT__HASH_CHAR(s, 1, 0x01000193u) + \
+     MC_NBT__HASH_CHAR(s, 2, 0x26027a69u) + \
+     MC_NBT__HASH_CHAR(s, 3, 0x3ee6b34bu) + \
+     MC_NBT__HASH_CHAR(s, 4, 0x502c3f11u) + \
+     MC_NBT__HASH_CHAR(s, 5, 0x46a747c3u) + \
+     MC_NBT__HASH_CHAR(s, 6, 0xfc55f7f9u) + \
+     MC_NBT__HASH_CHAR(s, 7, 0x34555cfbu) + \
+     MC_NBT__HASH_CHAR(s, 8, 0x5d615f21u) + \
+     MC_NBT__HASH_CHAR(s, 9, 0x2148c0f3u) + \
+     MC_NBT__HASH_CHAR(s, 10, 0x5887be89u) + \
+     MC_NBT__HASH_CHAR(s, 11, 0xe6b0f1abu) + \
+     MC_NBT__HASH_CHAR(s, 12, 0xd38c7031u) + \
+     MC_NBT__HASH_CHAR(s, 13, 0x37149d23u) + \
+     MC_NBT__HASH_CHAR(s, 14, 0xd8735e19u) + \
+     MC_NBT__HASH_CHAR(s, 15, 0xd69d215bu) + \
+     MC_NBT__HASH_CHAR(s, 16, 0x345b8241u) + \
+     MC_NBT__HASH_CHAR(s, 17, 0xad0e0c53u) + \
+     MC_NBT__HASH_CHAR(s, 18, 0xc01d66a9u) + \
+     MC_NBT__HASH_CHAR(s, 19, 0x17489c0bu) + \
+     MC_NBT__HASH_CHAR(s, 20, 0xb24da551u) + \
+     MC_NBT__HASH_CHAR(s, 21, 0x013b3e83u) + \
+     MC_NBT__HASH_CHAR(s, 22, 0x73436839u) + \
+     MC_NBT__HASH_CHAR(s, 23, 0xac1d11bbu) + \
+     MC_NBT__HASH_CHAR(s, 24, 0xacc2e961u) + \
+     MC_NBT__HASH_CHAR(s, 25, 0x57d563b3u) + \
+     MC_NBT__HASH_CHAR(s, 26, 0xf7ebf2c9u) + \
+     MC_NBT__HASH_CHAR(s, 27, 0x116f326bu) + \
+     MC_NBT__HASH_CHAR(s, 28, 0xdd0c5e71u) + \
+     MC_NBT__HASH_CHAR(s, 29, 0x6b78abe3u) + \
+     MC_NBT__HASH_CHAR(s, 30, 0x11f69659u) + \
+     MC_NBT__HASH_CHAR(s, 31, 0xa02eae1bu))
+
+#define MC_NBT_HASH(s) (MC_NBT__HASH_SUM(s) ^ (MC_NBT__HASH_SUM(s) >> 16))
+
+#define NBT_KEY(prop) \
+    (&(mc_nbt_key_t) { (prop), sizeof((prop)) - 1, MC_NBT_HASH(prop) })
+
 #define NBT_GET(obj, prop, type) \
-    mc_nbt_get((obj), (prop), sizeof((prop)) - 1, (type))
+    mc_nbt_get_key((obj), NBT_KEY(prop), (type))
 
 #define NBT_READ(obj, prop, type, to) \
     do { \
       int r; \
-      r = mc_nbt_read((obj), (prop), sizeof((prop)) - 1, (type), (to)); \
+      r = mc_nbt_read_key((obj), NBT_KEY(prop), (type), (to)); \
       if (r != 0) \
         return r; \
     } while (0)
@@ -17,21 +66,55 @@
 #define NBT_OPT_READ(obj, prop, type, to, def) \
     do { \
       int r; \
-      r = mc_nbt_read((obj), (prop), sizeof((prop)) - 1, (type), (to)); \
+      r = mc_nbt_read_key((obj), NBT_KEY(prop), (type), (to)); \
       if (r != 0) \
         *(to) = def; \
     } while (0)
 
+/*
+ * Entry of mc_nbt_field_t table, binding NBT property to the `field` of C
+ * `record`. `len` is zero for single values, otherwise property is a list
+ * of `len` items stored in consecutive fields of the same C type.
+ */
+#define MC_NBT_FIELD(record, prop, type, len, field, required) \
+    { { (prop), sizeof((prop)) - 1, MC_NBT_HASH(prop) }, \
+      (type), (len), offsetof(record, field), (required) },
+
+#define NBT_EDIT(obj, prop, type) \
+    mc_nbt_edit_key((obj), NBT_KEY(prop), (type))
+
 #define NBT_SET(obj, prop, type, value) \
     do { \
       int r; \
-      r = mc_nbt_set((obj), (prop), sizeof((prop)) - 1, (type), (value)); \
+      r = mc_nbt_set_key((obj), NBT_KEY(prop), (type), (value)); \
       if (r != 0) \
         return r; \
     } while (0)
 
 #define NBT_OPT_SET(obj, prop, type, value) \
-    mc_nbt_set((obj), (prop), sizeof((prop)) - 1, (type), (value));
+    mc_nbt_set_key((obj), NBT_KEY(prop), (type), (value));
+
+#define NBT_CURSOR_FIND(obj, prop, type, out) \
+    mc_nbt_cursor_find_key((obj), NBT_KEY(prop), (type), (out))
+
+#define NBT_CURSOR_READ(obj, prop, type, to) \
+    do { \
+      int r; \
+      mc_nbt_cursor_t c; \
+      r = mc_nbt_cursor_find_key((obj), NBT_KEY(prop), (type), &c); \
+      if (r == 0) \
+        r = mc_nbt_cursor_read(&c, (type), (to)); \
+      if (r != 0) \
+        return r; \
+    } while (0)
+
+#define NBT_WRITE(expr) \
+    do { \
+      int r; \
+      r = (expr); \
+      if (r != 0) \
+        return r; \
+    } while (0)
 
 #define NBT_CREATE(out, type, name, arg) \
     do { \
@@ -40,12 +123,26 @@
         goto nbt_fatal; \
     } while (0)
 
+/* Forward declarations */
+struct mc_chain_s;
+
 typedef struct mc_nbt_s mc_nbt_t;
 typedef struct mc_nbt_parser_s mc_nbt_parser_t;
+typedef struct mc_nbt_arena_s mc_nbt_arena_t;
+typedef struct mc_nbt_key_s mc_nbt_key_t;
+typedef struct mc_nbt_field_s mc_nbt_field_t;
+typedef struct mc_nbt_cursor_s mc_nbt_cursor_t;
+typedef struct mc_nbt_writer_s mc_nbt_writer_t;
+typedef struct mc_nbt_parser_frame_s mc_nbt_parser_frame_t;
+typedef struct mc_nbt_sax_s mc_nbt_sax_t;
+typedef struct mc_nbt_sax_cbs_s mc_nbt_sax_cbs_t;
+typedef struct mc_nbt_sax_frame_s mc_nbt_sax_frame_t;
 typedef enum mc_nbt_type_e mc_nbt_type_t;
 typedef enum mc_nbt_comp_e mc_nbt_comp_t;
 typedef enum mc_nbt_lifetime_e mc_nbt_lifetime_t;
 
+static const int kNBTMaxFields = 32;
+
 enum mc_nbt_comp_e {
   kNBTUncompressed,
   kNBTDeflate,
@@ -54,18 +151,48 @@ enum mc_nbt_comp_e {
 
 enum mc_nbt_lifetime_e {
   kSameLifetime,
-  kIndependentLifetime
+  kIndependentLifetime,
+
+  /*
+   * Like kSameLifetime, but all nodes are allocated from the parser's arena
+   * and are freed at once by mc_nbt_postparse(). mc_nbt_destroy() should
+   * not be called on such tree.
+   */
+  kArenaLifetime
+};
+
+/* Open compound or list: its name and start of its children on the stack */
+struct mc_nbt_parser_frame_s {
+  int base;
+  const char* name;
+  int name_len;
+};
+
+/* Bump-pointer chunk, data follows the header */
+struct mc_nbt_arena_s {
+  mc_nbt_arena_t* next;
+  int offset;
+  int size;
 };
 
 struct mc_nbt_parser_s {
   unsigned char* data;
   int len;
-  int depth;
-  int name_len;
 
   /* NBT tree has the same lifetime as input data */
   mc_nbt_lifetime_t lifetime;
   unsigned char* uncompressed;
+
+  /* Chunks of kArenaLifetime, newest first */
+  mc_nbt_arena_t* arena;
+
+  /* Children of compounds and lists that are being parsed */
+  mc_nbt_t** stack;
+  int stack_len;
+  int stack_capacity;
+  mc_nbt_parser_frame_t* frames;
+  int frame_len;
+  int frame_capacity;
 };
 
 enum mc_nbt_type_e {
@@ -87,8 +214,140 @@ enum mc_nbt_type_e {
   kNBTCompound
 };
 
+/* Property name with precomputed hash, see NBT_KEY() */
+struct mc_nbt_key_s {
+  const char* value;
+  int len;
+  uint32_t hash;
+};
+
+/* Binding of a numeric property to C struct's field, see MC_NBT_FIELD() */
+struct mc_nbt_field_s {
+  mc_nbt_key_t key;
+  mc_nbt_type_t type;
+  int len;
+  int offset;
+  int required;
+};
+
+/*
+ * Read-only view of a value inside of uncompressed NBT data. Nothing is
+ * allocated or modified, the data should outlive the cursor.
+ */
+struct mc_nbt_cursor_s {
+  mc_nbt_type_t type;
+  struct {
+    const char* value;
+    int16_t len;
+  } name;
+
+  /* Value's payload and the end of the input */
+  const unsigned char* data;
+  const unsigned char* end;
+
+  /* Private: number of list items after this one, -1 in compound */
+  int32_t left;
+};
+
+/*
+ * SAX callbacks, any of them could be NULL. Non-zero return value aborts
+ * parsing. Names and data are valid only during the call, names are NULL
+ * for list items.
+ */
+struct mc_nbt_sax_cbs_s {
+  int (*begin_compound)(mc_nbt_sax_t* sax, const char* name, int name_len);
+  int (*end_compound)(mc_nbt_sax_t* sax);
+  int (*begin_list)(mc_nbt_sax_t* sax,
+                    const char* name,
+                    int name_len,
+                    mc_nbt_type_t type,
+                    int32_t len);
+  int (*end_list)(mc_nbt_sax_t* sax);
+
+  /* `value` points to int8_t, int16_t, ... double in host byte order */
+  int (*value)(mc_nbt_sax_t* sax,
+               const char* name,
+               int name_len,
+               mc_nbt_type_t type,
+               const void* value);
+
+  /*
+   * Strings, byte and int arrays may arrive in several chunks: `len` items
+   * starting at `offset` out of `total`. Name is passed only with the first
+   * chunk, int arrays are in network byte order.
+   */
+  int (*array)(mc_nbt_sax_t* sax,
+               const char* name,
+               int name_len,
+               mc_nbt_type_t type,
+               const void* data,
+               int32_t len,
+               int32_t offset,
+               int32_t total);
+};
+
+/* Open compound (tag is kNBTTagEnd) or list with `left` items to go */
+struct mc_nbt_sax_frame_s {
+  uint8_t tag;
+  int32_t left;
+};
+
+struct mc_nbt_sax_s {
+  /* User data */
+  void* data;
+
+  mc_nbt_sax_cbs_t cbs;
+  mc_nbt_comp_t comp;
+
+  /* Private: z_stream followed by output window */
+  void* stream;
+
+  /* Private: current token */
+  int state;
+  uint8_t tag;
+  const char* name;
+  int name_len;
+  int32_t offset;
+  int32_t total;
+
+  /* Private: bytes of tokens split between inputs */
+  unsigned char* pending;
+  int pending_len;
+  int pending_size;
+  char* name_buf;
+  int name_size;
+
+  /* Private: explicit stack instead of recursion */
+  mc_nbt_sax_frame_t* frames;
+  int frame_len;
+  int frame_capacity;
+};
+
+/*
+ * Streaming encoder: NBT bytes are written (and compressed) straight into
+ * the `out` chain, without building a tree first. `out` may be changed
+ * between documents.
+ */
+struct mc_nbt_writer_s {
+  struct mc_chain_s* out;
+  mc_nbt_comp_t comp;
+
+  /* Private: z_stream, input window and current output segment */
+  void* stream;
+  unsigned char* window;
+  int window_len;
+  unsigned char* seg;
+};
+
 struct mc_nbt_s {
   mc_nbt_type_t type;
+
+  /*
+   * Number of owners, clones share nodes and copy them only on write.
+   * Zero for nodes that don't own their memory (arena or kSameLifetime),
+   * those are always copied. Not atomic, see mc_nbt_clone().
+   */
+  int32_t refs;
   struct {
     const char* value;
     int16_t len;
@@ -118,6 +377,13 @@ struct mc_nbt_s {
     } str;
     struct {
       int32_t len;
+
+      /*
+       * Compound's name index: hash table of `index` slots right after the
+       * `list`. Negative if space is reserved, but index isn't built yet,
+       * zero if there is no index.
+       */
+      int32_t index;
       mc_nbt_t* list[1];
     } values;
   } value;
@@ -134,10 +400,127 @@ mc_nbt_t* mc_nbt_preparse(mc_nbt_parser_t* parser,
                           mc_nbt_lifetime_t lifetime);
 void mc_nbt_postparse(mc_nbt_parser_t* parser);
 
+/*
+ * Free zlib streams cached by the calling thread. Other threads free them on
+ * exit, but main thread should call it before returning from main().
+ */
+void mc_nbt_thread_cleanup();
+
+/* SAX API */
+int mc_nbt_sax_init(mc_nbt_sax_t* sax,
+                    mc_nbt_comp_t comp,
+                    const mc_nbt_sax_cbs_t* cbs);
+int mc_nbt_sax_write(mc_nbt_sax_t* sax, const unsigned char* data, int len);
+int mc_nbt_sax_finish(mc_nbt_sax_t* sax);
+void mc_nbt_sax_destroy(mc_nbt_sax_t* sax);
+
+/* Cursor API */
+int mc_nbt_cursor_init(mc_nbt_cursor_t* cur,
+                       const unsigned char* data,
+                       int len);
+int mc_nbt_cursor_open(mc_nbt_cursor_t* cur,
+                       const unsigned char* data,
+                       int len,
+                       mc_nbt_comp_t comp,
+                       unsigned char** uncompressed);
+int mc_nbt_cursor_first(const mc_nbt_cursor_t* cur, mc_nbt_cursor_t* child);
+int mc_nbt_cursor_next(mc_nbt_cursor_t* cur);
+int mc_nbt_cursor_find_key(const mc_nbt_cursor_t* cur,
+                           const mc_nbt_key_t* key,
+                           mc_nbt_type_t type,
+                           mc_nbt_cursor_t* out);
+int mc_nbt_cursor_find(const mc_nbt_cursor_t* cur,
+                       const char* prop,
+                       int len,
+                       mc_nbt_type_t type,
+                       mc_nbt_cursor_t* out);
+int mc_nbt_cursor_read(const mc_nbt_cursor_t* cur,
+                       mc_nbt_type_t type,
+                       void* to);
+int mc_nbt_cursor_array(const mc_nbt_cursor_t* cur,
+                        mc_nbt_type_t type,
+                        const void** data,
+                        int32_t* len);
+mc_nbt_t* mc_nbt_cursor_parse(const mc_nbt_cursor_t* cur);
+
 /* Encoder API */
 int mc_nbt_encode(mc_nbt_t* val, mc_nbt_comp_t comp, unsigned char** out);
 
+/*
+ * Writer API. Name should be NULL for list items, they have neither tag
+ * nor name. List items should follow mc_nbt_write_list(), compound's
+ * children should be followed by mc_nbt_write_end().
+ */
+int mc_nbt_writer_init(mc_nbt_writer_t* w,
+                       struct mc_chain_s* out,
+                       mc_nbt_comp_t comp);
+int mc_nbt_writer_finish(mc_nbt_writer_t* w);
+void mc_nbt_writer_destroy(mc_nbt_writer_t* w);
+int mc_nbt_write_compound(mc_nbt_writer_t* w, const char* name, int name_len);
+int mc_nbt_write_end(mc_nbt_writer_t* w);
+int mc_nbt_write_list(mc_nbt_writer_t* w,
+                      const char* name,
+                      int name_len,
+                      mc_nbt_type_t type,
+                      int32_t len);
+int mc_nbt_write_i8(mc_nbt_writer_t* w,
+                    const char* name,
+                    int name_len,
+                    int8_t val);
+int mc_nbt_write_i16(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     int16_t val);
+int mc_nbt_write_i32(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     int32_t val);
+int mc_nbt_write_i64(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     int64_t val);
+int mc_nbt_write_f32(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     float val);
+int mc_nbt_write_f64(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     double val);
+int mc_nbt_write_str(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     const char* value,
+                     int value_len);
+int mc_nbt_write_i8l(mc_nbt_writer_t* w,
+                     const char* name,
+                     int name_len,
+                     const void* data,
+                     int32_t len);
+int mc_nbt_write_i32l(mc_nbt_writer_t* w,
+                      const char* name,
+                      int name_len,
+                      const int32_t* data,
+                      int32_t len);
+int mc_nbt_write_value(mc_nbt_writer_t* w, const mc_nbt_t* val, int with_name);
+
 /* Utils API */
+uint32_t mc_nbt_hash(const char* value, int len);
+void mc_nbt_key_init(mc_nbt_key_t* key, const char* value, int len);
+mc_nbt_t** mc_nbt_find_key(mc_nbt_t* obj,
+                           const mc_nbt_key_t* key,
+                           mc_nbt_type_t type);
+mc_nbt_t* mc_nbt_get_key(mc_nbt_t* obj,
+                         const mc_nbt_key_t* key,
+                         mc_nbt_type_t type);
+int mc_nbt_set_key(mc_nbt_t* obj,
+                   const mc_nbt_key_t* key,
+                   mc_nbt_type_t type,
+                   void* val);
+int mc_nbt_read_key(mc_nbt_t* obj,
+                    const mc_nbt_key_t* key,
+                    mc_nbt_type_t type,
+                    void* to);
 mc_nbt_t** mc_nbt_find(mc_nbt_t* obj,
                        const char* prop,
                        int len,
@@ -156,8 +539,51 @@ int mc_nbt_read(mc_nbt_t* obj,
                 int len,
                 mc_nbt_type_t type,
                 void* to);
+
+/*
+ * Clone copies only the root node and shares its children, which are copied
+ * on the first mc_nbt_set()/mc_nbt_edit() through either tree (nested nodes
+ * must be reached with mc_nbt_edit() too). Reference counts aren't atomic:
+ * trees sharing nodes must not be cloned, edited or destroyed concurrently
+ * on different threads.
+ */
 mc_nbt_t* mc_nbt_clone(const mc_nbt_t* val);
 
+/* Approximate memory used by the tree, shared nodes are counted too */
+int mc_nbt_size(const mc_nbt_t* val);
+
+/* Replace shared `*slot` with a copy of its node, returns the new node */
+mc_nbt_t* mc_nbt_unshare(mc_nbt_t** slot);
+mc_nbt_t* mc_nbt_edit_key(mc_nbt_t* obj,
+                          const mc_nbt_key_t* key,
+                          mc_nbt_type_t type);
+mc_nbt_t* mc_nbt_edit(mc_nbt_t* obj,
+                      const char* prop,
+                      int len,
+                      mc_nbt_type_t type);
+
+/*
+ * Field API. Tables are matched against compound's children in a single
+ * pass. Missing optional fields are zeroed on decode and skipped on update.
+ * At most kNBTMaxFields fields per table.
+ */
+int mc_nbt_decode_fields(mc_nbt_t* obj,
+                         const mc_nbt_field_t* fields,
+                         int count,
+                         void* out);
+int mc_nbt_update_fields(mc_nbt_t* obj,
+                         const mc_nbt_field_t* fields,
+                         int count,
+                         const void* in);
+int mc_nbt_cursor_decode_fields(const mc_nbt_cursor_t* cur,
+                                const mc_nbt_field_t* fields,
+                                int count,
+                                void* out);
+int mc_nbt_write_fields(mc_nbt_writer_t* w,
+                        const mc_nbt_field_t* fields,
+                        int count,
+                        const void* in);
+
 /* Value API */
 mc_nbt_t* mc_nbt_create_i8(const char* name, int name_len, int8_t val);
 mc_nbt_t* mc_nbt_create_i16(const char* name, int name_len, int16_t val);
@@ -2,6 +2,7 @@
 #include <string.h>  /* memset */
 
 #include "openssl/crypto.h"
+#include "format/nbt.h"  /* mc_nbt_thread_cleanup */
 #include "server.h"
 
 int main() {
@@ -26,6 +27,7 @@ int main() {
 
   fprintf(stdout, "Exiting...\n");
   mc_server_destroy(&server);
+  mc_nbt_thread_cleanup();
 
   return 0;
 }
@@ -1,113 +1,505 @@
 #include <arpa/inet.h>  /* ntohs, ntohl */
 #include <stdlib.h>  /* malloc, free, realloc */
-#include <string.h>  /* memcpy */
+#include <string.h>  /* memmove */
 
 #include "protocol/framer.h"
 #include "uv.h"  /* uv_write */
 #include "utils/common.h"  /* mc_frame_t */
 #include "utils/common-private.h"  /* container_of */
-#include "utils/buffer.h"  /* mc_buffer_t */
+#include "utils/buffer.h"  /* MC_BUFFER_WRAP */
+#include "utils/chain.h"  /* mc_chain_t */
 #include "openssl/evp.h"  /* EVP_* */
 
-#define WRITE(framer, t, v) MC_BUFFER_WRITE(&(framer)->buffer, t, v)
-#define WRITE_RAW(framer, d, l) MC_BUFFER_WRITE_DATA(&(framer)->buffer, d, l)
+#define BEGIN(framer, type) MC_BUFFER_WRAP(mc_framer__begin((framer), (type)))
+#define LANE(framer) (&(framer)->lanes[(framer)->lane].chain)
+#define WRITE(framer, t, v) MC_CHAIN_WRITE(LANE(framer), t, v)
+#define WRITE_RAW(framer, d, l) MC_CHAIN_WRITE_DATA(LANE(framer), d, l)
 
 typedef struct mc_framer__req_s mc_framer__req_t;
 
 struct mc_framer__req_s {
   uv_write_t req;
   mc_framer_t* framer;
-  mc_framer_send_cb_t cb;
+
+  /* Plaintext segments are handed over to uv_write() as they are */
+  mc_chain_t chain;
 
   /* Not really necessary, but might be useful for debugging */
   int len;
 };
 
+static int mc_framer__begin(mc_framer_t* framer, mc_frame_type_t type);
+static int mc_framer__commit(mc_framer_t* framer);
+static int mc_framer__take(mc_framer_t* framer, mc_chain_t* out, int* taken);
+static int mc_framer__flush(mc_framer_t* framer);
 static void mc_framer__after_send(uv_write_t* req, int status);
+static void mc_framer__complete(mc_framer_t* framer, int status);
+static int mc_framer__finished(mc_framer_waiter_t* waiter);
 
+static const int kMCFramerDefaultBudget = 32768;
+static const int kMCFramerInitialFrames = 16;
 
-int mc_framer_init(mc_framer_t* framer) {
-  int r;
+/* Index of plaintext backlog in `taken` and `remaining` */
+static const int kMCFramerPlain = kMCFramerLaneCount;
 
-  r = mc_buffer_init(&framer->buffer, 0);
-  if (r != 0)
-    return r;
+
+int mc_framer_init(mc_framer_t* framer) {
+  int i;
+  mc_framer_lane_t* lane;
+
+  for (i = 0; i < kMCFramerLaneCount; i++) {
+    lane = &framer->lanes[i];
+    mc_chain_init(&lane->chain);
+    lane->frames = NULL;
+    lane->frame_start = 0;
+    lane->frame_count = 0;
+    lane->frame_capacity = 0;
+    lane->len = 0;
+  }
+  mc_chain_init(&framer->plain);
   framer->aes = NULL;
+  framer->lane = kMCFramerLaneControl;
+  framer->budget = kMCFramerDefaultBudget;
+  framer->in_flight = 0;
+  memset(framer->taken, 0, sizeof(framer->taken));
+  framer->stream = NULL;
+  framer->waiters = NULL;
+  framer->last_waiter = NULL;
+  framer->error = 0;
 
   return 0;
 }
 
 
 void mc_framer_destroy(mc_framer_t* framer) {
-  mc_buffer_destroy(&framer->buffer);
+  int i;
+  mc_framer_lane_t* lane;
+  mc_framer_waiter_t* waiter;
+
+  for (i = 0; i < kMCFramerLaneCount; i++) {
+    lane = &framer->lanes[i];
+    mc_chain_destroy(&lane->chain);
+    free(lane->frames);
+    lane->frames = NULL;
+    lane->frame_start = 0;
+    lane->frame_count = 0;
+    lane->frame_capacity = 0;
+    lane->len = 0;
+  }
+  mc_chain_destroy(&framer->plain);
   framer->aes = NULL;
+
+  /* Callbacks of unfinished sends are never invoked */
+  while (framer->waiters != NULL) {
+    waiter = framer->waiters;
+    framer->waiters = waiter->next;
+    free(waiter);
+  }
+  framer->last_waiter = NULL;
 }
 
 
 void mc_framer_use_aes(mc_framer_t* framer, EVP_CIPHER_CTX* aes) {
+  int i;
+  int off;
+  int extra;
+  int start[kMCFramerLaneCount];
+  mc_framer_lane_t* lane;
+  mc_framer_waiter_t* waiter;
+
+  /* Queued frames of lanes are appended to the backlog, in lane order */
+  off = framer->taken[kMCFramerPlain] + mc_chain_len(&framer->plain);
+  for (i = 0; i < kMCFramerLaneCount; i++) {
+    start[i] = off;
+    off += framer->lanes[i].len;
+  }
+  for (waiter = framer->waiters; waiter != NULL; waiter = waiter->next) {
+    for (i = 0; i < kMCFramerLaneCount; i++) {
+      /* Frames in flight stay accounted to the lane */
+      extra = waiter->remaining[i] - framer->taken[i];
+      if (extra <= 0)
+        continue;
+      waiter->remaining[i] -= extra;
+      if (waiter->remaining[kMCFramerPlain] < start[i] + extra)
+        waiter->remaining[kMCFramerPlain] = start[i] + extra;
+    }
+  }
+
+  for (i = 0; i < kMCFramerLaneCount; i++) {
+    lane = &framer->lanes[i];
+    mc_chain_truncate(&lane->chain, lane->len);
+    mc_chain_splice(&framer->plain, &lane->chain);
+    lane->frame_start = 0;
+    lane->frame_count = 0;
+    lane->len = 0;
+  }
   framer->aes = aes;
 }
 
 
+void mc_framer_set_budget(mc_framer_t* framer, int budget) {
+  framer->budget = budget;
+}
+
+
+int mc_framer_pending(mc_framer_t* framer) {
+  int i;
+  int res;
+
+  res = mc_chain_len(&framer->plain);
+  for (i = 0; i < kMCFramerLaneCount; i++)
+    res += framer->lanes[i].len;
+
+  return res;
+}
+
+
+mc_framer_lane_type_t mc_framer_lane(mc_frame_type_t type) {
+  switch (type) {
+    /* Session state, never delayed by the budget */
+    case kMCKeepAliveType:
+    case kMCLoginReqType:
+    case kMCHandshakeType:
+    case kMCRespawnType:
+    case kMCClientStatusType:
+    case kMCServerListPingType:
+    case kMCEncryptionReqType:
+    case kMCEncryptionResType:
+    case kMCKickType:
+      return kMCFramerLaneControl;
+    case kMCPosAndLookType:
+    case kMCPlayerType:
+    case kMCPlayerPosType:
+    case kMCPlayerLookType:
+    case kMCSteerVehicleType:
+    case kMCEntityVelocityType:
+    case kMCEntityType:
+    case kMCEntityRelMoveType:
+    case kMCEntityLookType:
+    case kMCEntityLookAndRelMoveType:
+    case kMCEntityTeleportType:
+    case kMCEntityHeadLookType:
+      return kMCFramerLaneMovement;
+    case kMCChunkDataType:
+    case kMCMapChunkBulkType:
+    case kMCItemDataType:
+      return kMCFramerLaneBulk;
+    default:
+      return kMCFramerLaneWorld;
+  }
+}
+
+
 int mc_framer_send(mc_framer_t* framer,
                    uv_stream_t* stream,
                    mc_framer_send_cb_t cb) {
   int r;
-  int aes_len;
-  mc_framer__req_t* req;
-  uv_buf_t buf;
-  char* data;
-  int packet_len;
-
-  packet_len = mc_buffer_len(&framer->buffer);
+  int i;
+  mc_framer_waiter_t* waiter;
+
+  if (framer->error != 0)
+    return framer->error;
+  framer->stream = stream;
+
+  /* Frames will be picked up once current write will finish */
+  if (!framer->in_flight) {
+    r = mc_framer__flush(framer);
+    if (r != 0) {
+      mc_framer__complete(framer, r);
+      return r;
+    }
+  }
 
-  /* Account space for possible AES padding */
-  if (framer->aes != NULL)
-    packet_len += EVP_CIPHER_CTX_block_size(framer->aes) - 1;
+  if (cb == NULL)
+    return 0;
 
-  req = malloc(sizeof(*req) + packet_len);
-  if (req == NULL)
+  /* Wait for what is queued now, including frames that are in flight */
+  waiter = malloc(sizeof(*waiter));
+  if (waiter == NULL)
     return -1;
+  waiter->cb = cb;
+  for (i = 0; i < kMCFramerLaneCount; i++)
+    waiter->remaining[i] = framer->lanes[i].len + framer->taken[i];
+  waiter->remaining[kMCFramerPlain] = mc_chain_len(&framer->plain) +
+                                      framer->taken[kMCFramerPlain];
+  waiter->next = NULL;
+  if (framer->last_waiter == NULL)
+    framer->waiters = waiter;
+  else
+    framer->last_waiter->next = waiter;
+  framer->last_waiter = waiter;
+
+  /* Nothing was pending */
+  if (!framer->in_flight)
+    mc_framer__complete(framer, 0);
 
-  req->framer = framer;
-  req->cb = cb;
-  req->len = packet_len;
+  return 0;
+}
 
-  data = ((char*) req) + sizeof(*req);
-  if (framer->aes == NULL) {
-    memcpy(data, mc_buffer_data(&framer->buffer), req->len);
-  } else {
-    aes_len = req->len;
-    r = EVP_EncryptUpdate(framer->aes,
-                          (unsigned char*) data,
-                          &aes_len,
-                          mc_buffer_data(&framer->buffer),
-                          mc_buffer_len(&framer->buffer));
-    if (r != 1) {
-      free(req);
+
+int mc_framer__begin(mc_framer_t* framer, mc_frame_type_t type) {
+  mc_framer_lane_t* lane;
+
+  framer->lane = mc_framer_lane(type);
+  lane = &framer->lanes[framer->lane];
+
+  /* Drop leftovers of the frame that has failed half-way */
+  mc_chain_truncate(&lane->chain, lane->len);
+
+  return mc_chain_write_u8(&lane->chain, type);
+}
+
+
+int mc_framer__commit(mc_framer_t* framer) {
+  int* frames;
+  int capacity;
+  mc_framer_lane_t* lane;
+
+  lane = &framer->lanes[framer->lane];
+
+  /* Reclaim space of already sent frames */
+  if (lane->frame_start != 0) {
+    memmove(lane->frames,
+            lane->frames + lane->frame_start,
+            lane->frame_count * sizeof(*lane->frames));
+    lane->frame_start = 0;
+  }
+
+  if (lane->frame_count == lane->frame_capacity) {
+    capacity = lane->frame_capacity == 0 ? kMCFramerInitialFrames :
+                                           lane->frame_capacity * 2;
+    frames = realloc(lane->frames, capacity * sizeof(*frames));
+    if (frames == NULL)
       return -1;
+    lane->frames = frames;
+    lane->frame_capacity = capacity;
+  }
+
+  lane->frames[lane->frame_count++] = mc_chain_len(&lane->chain) - lane->len;
+  lane->len = mc_chain_len(&lane->chain);
+
+  return 0;
+}
+
+
+int mc_framer_next(mc_framer_t* framer, mc_chain_t* out) {
+  int taken[kMCFramerLaneCount + 1];
+
+  return mc_framer__take(framer, out, taken);
+}
+
+
+int mc_framer__take(mc_framer_t* framer, mc_chain_t* out, int* taken) {
+  int r;
+  int i;
+  int len;
+  mc_framer_lane_t* lane;
+
+  memset(taken, 0, (kMCFramerLaneCount + 1) * sizeof(*taken));
+
+  /* Plaintext backlog goes in a separate write */
+  if (mc_chain_len(&framer->plain) != 0) {
+    taken[kMCFramerPlain] = mc_chain_len(&framer->plain);
+    mc_chain_splice(out, &framer->plain);
+    return 0;
+  }
+
+  /*
+   * Take whole frames in the order of lane priority, without reordering
+   * them inside of the lane. Control frames are always taken, and at
+   * least one frame is taken even if it doesn't fit into the budget.
+   */
+  for (i = 0; i < kMCFramerLaneCount; i++) {
+    lane = &framer->lanes[i];
+    len = 0;
+    while (lane->frame_count != 0) {
+      if (i != kMCFramerLaneControl &&
+          framer->budget != 0 &&
+          mc_chain_len(out) + len != 0 &&
+          mc_chain_len(out) + len + lane->frames[lane->frame_start] >
+              framer->budget) {
+        break;
+      }
+      len += lane->frames[lane->frame_start];
+      lane->frame_start++;
+      lane->frame_count--;
     }
-    req->len = aes_len;
+    if (lane->frame_count == 0)
+      lane->frame_start = 0;
+
+    r = mc_chain_shift(&lane->chain, len, out);
+    if (r != 0)
+      return r;
+    lane->len -= len;
+    taken[i] = len;
+  }
+
+  return framer->aes != NULL;
+}
+
+
+int mc_framer__flush(mc_framer_t* framer) {
+  int r;
+  int aes_len;
+  int count;
+  int packet_len;
+  int taken[kMCFramerLaneCount + 1];
+  mc_chain_t out;
+  mc_framer__req_t* req;
+  mc_chain_seg_t* seg;
+  uv_buf_t* bufs;
+  char* data;
+  EVP_CIPHER_CTX* aes;
+
+  mc_chain_init(&out);
+  r = mc_framer__take(framer, &out, taken);
+  if (r < 0)
+    goto fatal;
+  aes = r == 1 ? framer->aes : NULL;
+
+  /* Nothing to send */
+  if (mc_chain_len(&out) == 0)
+    return 0;
+
+  /* Encrypted data goes into one piece, plaintext - one buf per segment */
+  if (aes != NULL)
+    packet_len = mc_chain_len(&out) + EVP_CIPHER_CTX_block_size(aes) - 1;
+  else
+    packet_len = 0;
+  count = mc_chain_count(&out);
+
+  /* NOTE: at least one buf is needed for encrypted data */
+  req = malloc(sizeof(*req) + (count + 1) * sizeof(*bufs) + packet_len);
+  if (req == NULL) {
+    r = -1;
+    goto fatal;
   }
 
-  buf = uv_buf_init(data, req->len);
-  r = uv_write(&req->req, stream, &buf, 1, mc_framer__after_send);
+  req->framer = framer;
+  req->len = 0;
+  mc_chain_init(&req->chain);
+
+  bufs = (uv_buf_t*) (((char*) req) + sizeof(*req));
+  data = (char*) (bufs + count + 1);
+  if (aes == NULL) {
+    /* Steal segments, they'll be freed after write */
+    mc_chain_splice(&req->chain, &out);
+    count = 0;
+    for (seg = req->chain.head; seg != NULL; seg = seg->next)
+      bufs[count++] = uv_buf_init((char*) seg->data, seg->len);
+    req->len = mc_chain_len(&req->chain);
+  } else {
+    for (seg = out.head; seg != NULL; seg = seg->next) {
+      aes_len = packet_len - req->len;
+      r = EVP_EncryptUpdate(aes,
+                            (unsigned char*) data + req->len,
+                            &aes_len,
+                            seg->data,
+                            seg->len);
+      if (r != 1) {
+        free(req);
+        r = -1;
+        goto fatal;
+      }
+      req->len += aes_len;
+    }
+    bufs[0] = uv_buf_init(data, req->len);
+    count = 1;
+    mc_chain_destroy(&out);
+  }
 
-  /* Clear state */
-  mc_buffer_reset(&framer->buffer);
+  r = uv_write(&req->req, framer->stream, bufs, count, mc_framer__after_send);
+  if (r != 0) {
+    mc_chain_destroy(&req->chain);
+    free(req);
+    framer->error = r;
+    return r;
+  }
+  framer->in_flight = 1;
+  memcpy(framer->taken, taken, sizeof(taken));
 
+  return 0;
+
+fatal:
+  /* Dequeued frames can't be put back, stream is out of sync now */
+  mc_chain_destroy(&out);
+  framer->error = r;
   return r;
 }
 
 
 void mc_framer__after_send(uv_write_t* req, int status) {
+  int i;
   mc_framer__req_t* freq;
+  mc_framer_t* framer;
+  mc_framer_waiter_t* waiter;
 
   freq = container_of(req, mc_framer__req_t, req);
-  if (freq->cb != NULL)
-    freq->cb(freq->framer, status);
-
+  framer = freq->framer;
+  mc_chain_destroy(&freq->chain);
   free(freq);
+
+  framer->in_flight = 0;
+  for (waiter = framer->waiters; waiter != NULL; waiter = waiter->next) {
+    for (i = 0; i <= kMCFramerPlain; i++) {
+      if (waiter->remaining[i] > framer->taken[i])
+        waiter->remaining[i] -= framer->taken[i];
+      else
+        waiter->remaining[i] = 0;
+    }
+  }
+  memset(framer->taken, 0, sizeof(framer->taken));
+
+  /* Send next batch of frames before callbacks queue more */
+  if (status != 0)
+    framer->error = status;
+  else if (mc_framer_pending(framer) != 0)
+    status = mc_framer__flush(framer);
+
+  mc_framer__complete(framer, status);
+}
+
+
+void mc_framer__complete(mc_framer_t* framer, int status) {
+  mc_framer_waiter_t* done;
+  mc_framer_waiter_t* last;
+  mc_framer_waiter_t* waiter;
+  mc_framer_send_cb_t cb;
+
+  /*
+   * Detach finished callbacks (all of them on error) before invoking any,
+   * a callback may queue more sends or destroy the framer.
+   */
+  done = framer->waiters;
+  last = NULL;
+  while (framer->waiters != NULL &&
+         (status != 0 || mc_framer__finished(framer->waiters))) {
+    last = framer->waiters;
+    framer->waiters = last->next;
+  }
+  if (last == NULL)
+    return;
+  last->next = NULL;
+  if (framer->waiters == NULL)
+    framer->last_waiter = NULL;
+
+  while (done != NULL) {
+    waiter = done;
+    done = waiter->next;
+    cb = waiter->cb;
+    free(waiter);
+    cb(framer, status);
+  }
+}
+
+
+int mc_framer__finished(mc_framer_waiter_t* waiter) {
+  int i;
+
+  for (i = 0; i <= kMCFramerPlain; i++)
+    if (waiter->remaining[i] != 0)
+      return 0;
+  return 1;
 }
 
 
@@ -117,14 +509,14 @@ int mc_framer_enc_key_req(mc_framer_t* framer,
                           uint16_t public_key_len,
                           const unsigned char* token,
                           uint16_t token_len) {
-  WRITE(framer, u8, kMCEncryptionReqType);
+  BEGIN(framer, kMCEncryptionReqType);
   WRITE(framer, string, server_id);
   WRITE(framer, u16, public_key_len);
   WRITE_RAW(framer, public_key, public_key_len);
   WRITE(framer, u16, token_len);
   WRITE_RAW(framer, token, token_len);
 
-  return 0;
+  return mc_framer__commit(framer);
 }
 
 
@@ -133,13 +525,13 @@ int mc_framer_enc_key_res(mc_framer_t* framer,
                           uint16_t secret_len,
                           const unsigned char* token,
                           uint16_t token_len) {
-  WRITE(framer, u8, kMCEncryptionResType);
+  BEGIN(framer, kMCEncryptionResType);
   WRITE(framer, u16, secret_len);
   WRITE_RAW(framer, secret, secret_len);
   WRITE(framer, u16, token_len);
   WRITE_RAW(framer, token, token_len);
 
-  return 0;
+  return mc_framer__commit(framer);
 }
 
 
@@ -150,7 +542,7 @@ int mc_framer_login_req(mc_framer_t* framer,
                         int8_t dimension,
                         uint8_t difficulty,
                         uint8_t max_players) {
-  WRITE(framer, u8, kMCLoginReqType);
+  BEGIN(framer, kMCLoginReqType);
   WRITE(framer, u32, entity_id);
   WRITE(framer, string, level_type);
   WRITE(framer, u8, mode);
@@ -159,13 +551,24 @@ int mc_framer_login_req(mc_framer_t* framer,
   WRITE(framer, u8, 0);
   WRITE(framer, u8, max_players);
 
-  return 0;
+  return mc_framer__commit(framer);
 }
 
 
 int mc_framer_kick(mc_framer_t* framer, mc_string_t* reason) {
-  WRITE(framer, u8, kMCKickType);
+  BEGIN(framer, kMCKickType);
   WRITE(framer, string, reason);
 
-  return 0;
+  return mc_framer__commit(framer);
+}
+
+
+int mc_framer_raw(mc_framer_t* framer,
+                  mc_frame_type_t type,
+                  const unsigned char* data,
+                  int len) {
+  BEGIN(framer, type);
+  WRITE_RAW(framer, data, len);
+
+  return mc_framer__commit(framer);
 }
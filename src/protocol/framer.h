@@ -4,25 +4,101 @@
 #include <stdint.h>  /* uint8_t */
 
 #include "uv.h"  /* uv_stream_t */
+#include "utils/common.h"  /* mc_frame_type_t */
 #include "utils/string.h"  /* mc_string_t */
-#include "utils/buffer.h"  /* mc_buffer_t */
+#include "utils/chain.h"  /* mc_chain_t */
 #include "openssl/evp.h"  /* EVP_CIPHER_CTX */
 
 typedef struct mc_framer_s mc_framer_t;
+typedef struct mc_framer_lane_s mc_framer_lane_t;
+typedef struct mc_framer_waiter_s mc_framer_waiter_t;
+typedef enum mc_framer_lane_type_e mc_framer_lane_type_t;
 typedef void (*mc_framer_send_cb_t)(mc_framer_t*, int status);
 
+/* Outbound lanes, in the order of priority, see mc_framer_lane() */
+enum mc_framer_lane_type_e {
+  kMCFramerLaneControl,
+  kMCFramerLaneMovement,
+  kMCFramerLaneWorld,
+  kMCFramerLaneBulk,
+  kMCFramerLaneCount
+};
+
+struct mc_framer_lane_s {
+  mc_chain_t chain;
+
+  /* Lengths of committed frames, starting at `frame_start` */
+  int* frames;
+  int frame_start;
+  int frame_count;
+  int frame_capacity;
+
+  /* Total length of committed frames */
+  int len;
+};
+
+/* Callback of mc_framer_send(), waiting for the frames queued before it */
+struct mc_framer_waiter_s {
+  mc_framer_send_cb_t cb;
+
+  /* Bytes left to write of each lane, and of the plaintext backlog */
+  int remaining[kMCFramerLaneCount + 1];
+  mc_framer_waiter_t* next;
+};
+
 struct mc_framer_s {
-  mc_buffer_t buffer;
+  mc_framer_lane_t lanes[kMCFramerLaneCount];
   EVP_CIPHER_CTX* aes;
+
+  /* Frames generated before mc_framer_use_aes(), sent before anything */
+  mc_chain_t plain;
+
+  /* Lane of the frame that is being generated */
+  mc_framer_lane_type_t lane;
+
+  /*
+   * Scheduler: at most one write is in flight, and each write takes up to
+   * `budget` bytes of frames - control lane first, bulk lane last.
+   */
+  int budget;
+  int in_flight;
+  int taken[kMCFramerLaneCount + 1];
+  uv_stream_t* stream;
+
+  /* Callbacks in the order of mc_framer_send() calls */
+  mc_framer_waiter_t* waiters;
+  mc_framer_waiter_t* last_waiter;
+
+  /* Failed write loses dequeued frames, every later send fails too */
+  int error;
 };
 
 int mc_framer_init(mc_framer_t* framer);
 void mc_framer_destroy(mc_framer_t* framer);
 
-/* Start using encryption */
+/* Start using encryption, already generated frames are sent as they are */
 void mc_framer_use_aes(mc_framer_t* framer, EVP_CIPHER_CTX* aes);
 
-/* Send all accumulated data */
+/* Set maximum amount of bytes per write, 0 - unlimited */
+void mc_framer_set_budget(mc_framer_t* framer, int budget);
+
+/* Amount of bytes in frames that are waiting for the write */
+int mc_framer_pending(mc_framer_t* framer);
+
+/* Lane that frames of given type are queued into */
+mc_framer_lane_type_t mc_framer_lane(mc_frame_type_t type);
+
+/*
+ * Move frames for the next write into `out`, as mc_framer_send() does.
+ * Returns 1 if they are to be encrypted, 0 if they are sent as they are.
+ */
+int mc_framer_next(mc_framer_t* framer, mc_chain_t* out);
+
+/*
+ * Schedule all accumulated frames for sending, `cb` will be invoked once
+ * all of them will be written (or on error). Frames queued after the call
+ * don't delay `cb`. It is invoked right away if nothing is pending.
+ */
 int mc_framer_send(mc_framer_t* framer,
                    uv_stream_t* stream,
                    mc_framer_send_cb_t cb);
@@ -48,4 +124,10 @@ int mc_framer_login_req(mc_framer_t* framer,
                         uint8_t max_players);
 int mc_framer_kick(mc_framer_t* framer, mc_string_t* reason);
 
+/* Frame with already serialized payload, e.g. compressed chunk data */
+int mc_framer_raw(mc_framer_t* framer,
+                  mc_frame_type_t type,
+                  const unsigned char* data,
+                  int len);
+
 #endif  /* SRC_PROTOCOL_FRAMER_H_ */
@@ -10,6 +10,7 @@
 #include "openssl/rand.h"  /* RAND_bytes */
 #include "openssl/rsa.h"  /* RSA_generate_key, RSA_free */
 #include "utils/common-private.h"  /* ARRAY_SIZE */
+#include "utils/string.h"  /* mc_string_table_t */
 #include "uv.h"
 
 static int mc_server__generate_rsa(mc_server_t* server);
@@ -42,10 +43,21 @@ int mc_server_init(mc_server_t* server, mc_config_t* config) {
   if (r != 0)
     goto fatal;
 
+  r = mc_string_table_init(&server->strings);
+  if (r != 0)
+    goto fatal;
+
+  server->level_type = mc_string_table_intern_ascii(&server->strings,
+                                                    "default");
+  if (server->level_type == NULL) {
+    r = -1;
+    goto failed_intern;
+  }
+
   /* Initialize and start TCP server */
   r = uv_tcp_init(server->loop, server->tcp);
   if (r != 0)
-    goto fatal;
+    goto failed_intern;
 
   /* Copy config and set defaults */
   memcpy(&server->config, config, sizeof(*config));
@@ -58,17 +70,20 @@ int mc_server_init(mc_server_t* server, mc_config_t* config) {
 
   r = uv_tcp_bind(server->tcp, uv_ip4_addr("0.0.0.0", server->config.port));
   if (r != 0)
-    goto fatal;
+    goto failed_intern;
 
   r = uv_listen((uv_stream_t*) server->tcp, 256, mc_server__on_connection);
   if (r != 0)
-    goto fatal;
+    goto failed_intern;
 
   server->version = 74;  /* 1.6.2 */
   server->clients = 0;
 
   return 0;
 
+failed_intern:
+  mc_string_table_destroy(&server->strings);
+
 fatal:
   free(server->rsa_pub_asn1);
   RSA_free(server->rsa);
@@ -147,6 +162,8 @@ void mc_server_destroy(mc_server_t* server) {
   server->rsa = NULL;
   free(server->rsa_pub_asn1);
   server->rsa_pub_asn1 = NULL;
+  mc_string_table_destroy(&server->strings);
+  server->level_type = NULL;
 }
 
 
@@ -3,6 +3,8 @@
 
 #include <stdint.h>  /* uint8_t */
 
+#include "utils/string.h"  /* mc_string_t, mc_string_table_t */
+
 /* Forward declarations */
 struct uv_loop_s;
 struct uv_tcp_s;
@@ -55,6 +57,10 @@ struct mc_server_s {
   /* Server id */
   uint16_t server_id[16];
   unsigned char ascii_server_id[16];
+
+  /* Interned strings, shared by all clients */
+  mc_string_table_t strings;
+  mc_string_t* level_type;
 };
 
 int mc_server_init(mc_server_t* server, mc_config_t* config);
@@ -295,8 +295,10 @@ int mc_buffer_read_slot(mc_buffer_t* buffer, mc_slot_t* slot) {
   MC_BUFFER_READ(buffer, u16, &slot->count);
   MC_BUFFER_READ(buffer, u16, &slot->damage);
   MC_BUFFER_READ(buffer, u16, &slot->nbt_len);
-  if (slot->nbt_len == 0xfff)
+  if (slot->nbt_len == 0xffff) {
+    slot->nbt_len = 0;
     return 0;
+  }
 
   MC_BUFFER_READ_DATA(buffer, &slot->nbt, slot->nbt_len);
 
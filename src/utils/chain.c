@@ -0,0 +1,341 @@
+#include <arpa/inet.h>  /* htonl, htons */
+#include <assert.h>  /* assert */
+#include <stdlib.h>  /* malloc, free, NULL */
+#include <string.h>  /* memcpy, memmove, memset */
+#include <sys/uio.h>  /* struct iovec */
+
+#include "utils/chain.h"
+#include "utils/buffer.h"  /* kMCBufferNoMem */
+#include "utils/string.h"  /* mc_string_t */
+
+static mc_chain_seg_t* mc_chain__grow(mc_chain_t* chain, int size);
+static void mc_chain__link(mc_chain_t* chain, mc_chain_seg_t* seg);
+static void mc_chain__free_seg(mc_chain_seg_t* seg);
+
+static const int kMCChainSegmentSize = 16384;
+
+
+void mc_chain_init(mc_chain_t* chain) {
+  chain->head = NULL;
+  chain->tail = NULL;
+  chain->len = 0;
+  chain->count = 0;
+}
+
+
+void mc_chain_destroy(mc_chain_t* chain) {
+  mc_chain_seg_t* seg;
+  mc_chain_seg_t* next;
+
+  for (seg = chain->head; seg != NULL; seg = next) {
+    next = seg->next;
+    mc_chain__free_seg(seg);
+  }
+  mc_chain_init(chain);
+}
+
+
+int mc_chain_len(mc_chain_t* chain) {
+  return chain->len;
+}
+
+
+int mc_chain_count(mc_chain_t* chain) {
+  return chain->count;
+}
+
+
+int mc_chain_reserve(mc_chain_t* chain, int size) {
+  mc_chain_seg_t* seg;
+
+  /* Reserved space should not cross segment boundary */
+  seg = chain->tail;
+  if (seg == NULL || seg->capacity - seg->len < size) {
+    seg = mc_chain__grow(chain, size);
+    if (seg == NULL)
+      return kMCBufferNoMem;
+  }
+
+  memset(seg->data + seg->len, 0, size);
+  seg->len += size;
+  chain->len += size;
+
+  return chain->len - size;
+}
+
+
+unsigned char* mc_chain_reserve_ptr(mc_chain_t* chain, int reserve_off) {
+  mc_chain_seg_t* seg;
+
+  for (seg = chain->head; seg != NULL; seg = seg->next) {
+    if (reserve_off < seg->len)
+      return seg->data + reserve_off;
+    reserve_off -= seg->len;
+  }
+
+  return NULL;
+}
+
+
+int mc_chain_append(mc_chain_t* chain, unsigned char* data, int len) {
+  return mc_chain_adopt(chain, data, len, len);
+}
+
+
+int mc_chain_adopt(mc_chain_t* chain,
+                   unsigned char* data,
+                   int len,
+                   int capacity) {
+  mc_chain_seg_t* seg;
+
+  seg = malloc(sizeof(*seg));
+  if (seg == NULL)
+    return kMCBufferNoMem;
+
+  seg->data = data;
+  seg->len = len;
+  seg->capacity = capacity;
+  mc_chain__link(chain, seg);
+  chain->len += len;
+
+  return 0;
+}
+
+
+void mc_chain_splice(mc_chain_t* to, mc_chain_t* from) {
+  if (from->head == NULL)
+    return;
+
+  if (to->tail == NULL)
+    to->head = from->head;
+  else
+    to->tail->next = from->head;
+  to->tail = from->tail;
+  to->len += from->len;
+  to->count += from->count;
+
+  mc_chain_init(from);
+}
+
+
+int mc_chain_shift(mc_chain_t* from, int len, mc_chain_t* to) {
+  mc_chain_seg_t* seg;
+
+  assert(len <= from->len);
+  while (len > 0) {
+    seg = from->head;
+
+    /* Copy head of the segment and move the rest to its start */
+    if (seg->len > len) {
+      MC_CHAIN_WRITE_DATA(to, seg->data, len);
+      memmove(seg->data, seg->data + len, seg->len - len);
+      seg->len -= len;
+      from->len -= len;
+      break;
+    }
+
+    /* Relink whole segment */
+    from->head = seg->next;
+    if (from->head == NULL)
+      from->tail = NULL;
+    from->len -= seg->len;
+    from->count--;
+    len -= seg->len;
+
+    mc_chain__link(to, seg);
+    to->len += seg->len;
+  }
+
+  return 0;
+}
+
+
+void mc_chain_truncate(mc_chain_t* chain, int len) {
+  int off;
+  mc_chain_seg_t* seg;
+  mc_chain_seg_t* next;
+
+  if (len >= chain->len)
+    return;
+
+  if (len == 0) {
+    mc_chain_destroy(chain);
+    return;
+  }
+
+  /* Find segment containing the last byte */
+  off = len;
+  for (seg = chain->head; seg->len < off; seg = seg->next)
+    off -= seg->len;
+  seg->len = off;
+  chain->len = len;
+
+  /* Free everything after it */
+  chain->tail = seg;
+  for (seg = seg->next; seg != NULL; seg = next) {
+    next = seg->next;
+    chain->count--;
+    mc_chain__free_seg(seg);
+  }
+  chain->tail->next = NULL;
+}
+
+
+int mc_chain_iovec(mc_chain_t* chain, struct iovec* iov, int count) {
+  int i;
+  mc_chain_seg_t* seg;
+
+  i = 0;
+  for (seg = chain->head; seg != NULL && i < count; seg = seg->next) {
+    if (seg->len == 0)
+      continue;
+    iov[i].iov_base = seg->data;
+    iov[i].iov_len = seg->len;
+    i++;
+  }
+
+  return i;
+}
+
+
+int mc_chain_flatten(mc_chain_t* chain, unsigned char** out) {
+  int off;
+  unsigned char* res;
+  mc_chain_seg_t* seg;
+
+  res = malloc(chain->len == 0 ? 1 : chain->len);
+  if (res == NULL)
+    return kMCBufferNoMem;
+
+  off = 0;
+  for (seg = chain->head; seg != NULL; seg = seg->next) {
+    memcpy(res + off, seg->data, seg->len);
+    off += seg->len;
+  }
+
+  *out = res;
+  return off;
+}
+
+
+int mc_chain_write_u8(mc_chain_t* chain, uint8_t value) {
+  return mc_chain_write_data(chain, &value, sizeof(value));
+}
+
+
+int mc_chain_write_u16(mc_chain_t* chain, uint16_t value) {
+  value = htons(value);
+  return mc_chain_write_data(chain, &value, sizeof(value));
+}
+
+
+int mc_chain_write_u32(mc_chain_t* chain, uint32_t value) {
+  value = htonl(value);
+  return mc_chain_write_data(chain, &value, sizeof(value));
+}
+
+
+int mc_chain_write_u64(mc_chain_t* chain, uint64_t value) {
+  uint32_t parts[2];
+
+  parts[0] = htonl((value >> 32) & 0xffffffff);
+  parts[1] = htonl(value & 0xffffffff);
+  return mc_chain_write_data(chain, parts, sizeof(parts));
+}
+
+
+int mc_chain_write_i8(mc_chain_t* chain, int8_t value) {
+  return mc_chain_write_u8(chain, (uint8_t) value);
+}
+
+
+int mc_chain_write_i16(mc_chain_t* chain, int16_t value) {
+  return mc_chain_write_u16(chain, (uint16_t) value);
+}
+
+
+int mc_chain_write_i32(mc_chain_t* chain, int32_t value) {
+  return mc_chain_write_u32(chain, (uint32_t) value);
+}
+
+
+int mc_chain_write_i64(mc_chain_t* chain, int64_t value) {
+  return mc_chain_write_u64(chain, (uint64_t) value);
+}
+
+
+int mc_chain_write_string(mc_chain_t* chain, mc_string_t* str) {
+  uint16_t len;
+
+  len = str->len;
+  MC_CHAIN_WRITE(chain, u16, len);
+  MC_CHAIN_WRITE_DATA(chain, str->data, len * sizeof(*str->data));
+
+  return 0;
+}
+
+
+int mc_chain_write_data(mc_chain_t* chain, const void* data, int len) {
+  int avail;
+  const unsigned char* ptr;
+  mc_chain_seg_t* seg;
+
+  ptr = data;
+  while (len > 0) {
+    seg = chain->tail;
+    if (seg == NULL || seg->len == seg->capacity) {
+      seg = mc_chain__grow(chain, 0);
+      if (seg == NULL)
+        return kMCBufferNoMem;
+    }
+
+    /* Fill the tail segment and spill the rest into the next one */
+    avail = seg->capacity - seg->len;
+    if (avail > len)
+      avail = len;
+    memcpy(seg->data + seg->len, ptr, avail);
+    seg->len += avail;
+    chain->len += avail;
+    ptr += avail;
+    len -= avail;
+  }
+
+  return 0;
+}
+
+
+mc_chain_seg_t* mc_chain__grow(mc_chain_t* chain, int size) {
+  int capacity;
+  mc_chain_seg_t* seg;
+
+  capacity = size > kMCChainSegmentSize ? size : kMCChainSegmentSize;
+  seg = malloc(sizeof(*seg) + capacity);
+  if (seg == NULL)
+    return NULL;
+
+  seg->data = (unsigned char*) (seg + 1);
+  seg->len = 0;
+  seg->capacity = capacity;
+  mc_chain__link(chain, seg);
+
+  return seg;
+}
+
+
+void mc_chain__link(mc_chain_t* chain, mc_chain_seg_t* seg) {
+  seg->next = NULL;
+  if (chain->tail == NULL)
+    chain->head = seg;
+  else
+    chain->tail->next = seg;
+  chain->tail = seg;
+  chain->count++;
+}
+
+
+void mc_chain__free_seg(mc_chain_seg_t* seg) {
+  /* Adopted data lives in a separate allocation */
+  if (seg->data != (unsigned char*) (seg + 1))
+    free(seg->data);
+  free(seg);
+}
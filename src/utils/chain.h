@@ -0,0 +1,96 @@
+#ifndef SRC_UTILS_CHAIN_H_
+#define SRC_UTILS_CHAIN_H_
+
+#include <stdint.h>  /* uint8_t */
+
+#include "utils/buffer.h"  /* MC_BUFFER_WRAP */
+#include "utils/string.h"  /* mc_string_t */
+
+#define MC_CHAIN_WRITE(chain, type, value) \
+    MC_BUFFER_WRAP(mc_chain_write_##type((chain), (value)))
+
+#define MC_CHAIN_WRITE_DATA(chain, data, len) \
+    MC_BUFFER_WRAP(mc_chain_write_data((chain), (data), (len)))
+
+/* Forward declarations */
+struct iovec;
+
+typedef struct mc_chain_s mc_chain_t;
+typedef struct mc_chain_seg_s mc_chain_seg_t;
+
+/*
+ * Chained (rope) buffer: a list of segments, written at the tail. Segments
+ * are either allocated by the chain itself (kMCChainSegmentSize bytes),
+ * or adopted from the caller via `mc_chain_append`/`mc_chain_adopt` without
+ * copying.
+ */
+struct mc_chain_seg_s {
+  mc_chain_seg_t* next;
+  unsigned char* data;
+  int len;
+  int capacity;
+};
+
+struct mc_chain_s {
+  mc_chain_seg_t* head;
+  mc_chain_seg_t* tail;
+  int len;
+  int count;
+};
+
+void mc_chain_init(mc_chain_t* chain);
+
+/* Free all segments, chain stays usable afterwards */
+void mc_chain_destroy(mc_chain_t* chain);
+
+int mc_chain_len(mc_chain_t* chain);
+int mc_chain_count(mc_chain_t* chain);
+
+/* Reserve contiguous zeroed space and return its offset in the chain */
+int mc_chain_reserve(mc_chain_t* chain, int size);
+unsigned char* mc_chain_reserve_ptr(mc_chain_t* chain, int reserve_off);
+
+/*
+ * Take ownership of malloc()'ed `data` and link it in as a segment. On
+ * failure `data` is still owned (and should be freed) by the caller.
+ */
+int mc_chain_append(mc_chain_t* chain, unsigned char* data, int len);
+
+/* Same, but following writes fill the rest of `capacity` bytes of `data` */
+int mc_chain_adopt(mc_chain_t* chain,
+                   unsigned char* data,
+                   int len,
+                   int capacity);
+
+/* Move all segments of `from` to the end of `to` */
+void mc_chain_splice(mc_chain_t* to, mc_chain_t* from);
+
+/*
+ * Move first `len` bytes of `from` to the end of `to`. Whole segments are
+ * moved as they are, only the last partial one is copied.
+ */
+int mc_chain_shift(mc_chain_t* from, int len, mc_chain_t* to);
+
+/* Drop everything after first `len` bytes */
+void mc_chain_truncate(mc_chain_t* chain, int len);
+
+/* Fill at most `count` iovecs, returns number of filled entries */
+int mc_chain_iovec(mc_chain_t* chain, struct iovec* iov, int count);
+
+/* Copy everything into one malloc()'ed buffer, returns its length */
+int mc_chain_flatten(mc_chain_t* chain, unsigned char** out);
+
+/* Write interface */
+
+int mc_chain_write_u8(mc_chain_t* chain, uint8_t value);
+int mc_chain_write_u16(mc_chain_t* chain, uint16_t value);
+int mc_chain_write_u32(mc_chain_t* chain, uint32_t value);
+int mc_chain_write_u64(mc_chain_t* chain, uint64_t value);
+int mc_chain_write_i8(mc_chain_t* chain, int8_t value);
+int mc_chain_write_i16(mc_chain_t* chain, int16_t value);
+int mc_chain_write_i32(mc_chain_t* chain, int32_t value);
+int mc_chain_write_i64(mc_chain_t* chain, int64_t value);
+int mc_chain_write_string(mc_chain_t* chain, mc_string_t* str);
+int mc_chain_write_data(mc_chain_t* chain, const void* data, int len);
+
+#endif  /* SRC_UTILS_CHAIN_H_ */
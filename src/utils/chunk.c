@@ -0,0 +1,832 @@
+#include <stdlib.h>  /* calloc, malloc, realloc, free, NULL */
+#include <string.h>  /* memcpy, memset */
+
+#if defined(__AVX2__)
+# include <immintrin.h>  /* _mm256_* */
+#elif defined(__SSE2__)
+# include <emmintrin.h>  /* _mm_* */
+#endif
+
+#include "utils/chunk.h"
+#include "format/nbt.h"  /* mc_nbt_destroy, mc_nbt_size */
+
+static int mc_chunk__bits(int palette_len);
+static int mc_chunk__find(mc_chunk_t* chunk, uint16_t state);
+static int mc_chunk__resize(mc_chunk_t* chunk, int bits);
+static int mc_chunk__get_index(mc_chunk_t* chunk, int i);
+static void mc_chunk__set_index(uint32_t* data, int bits, int i, int index);
+static uint8_t mc_chunk__get_nibble(const uint8_t* arr, int i);
+static void mc_chunk__set_nibble(uint8_t* arr, int i, uint8_t value);
+static int mc_chunk__uniform_nibbles(const uint8_t* arr);
+static int mc_chunk__set_light(uint8_t** arr,
+                               uint8_t* uniform,
+                               int i,
+                               uint8_t value);
+static mc_chunk_tile_t* mc_chunk__tile_slot(mc_chunk_tile_t* tiles,
+                                            int size,
+                                            int index);
+static int mc_chunk__tile_grow(mc_chunk_t* chunk);
+static void mc_chunk__tile_remove(mc_chunk_t* chunk, mc_chunk_tile_t* slot);
+
+static const int kPaletteInitial = 16;
+static const int kStateSlotBits = 13;
+static const int kTileInitial = 4;
+
+
+mc_chunk_t* mc_chunk_new() {
+  mc_chunk_t* chunk;
+
+  chunk = calloc(1, sizeof(*chunk));
+  if (chunk == NULL)
+    return NULL;
+
+  /* All air */
+  chunk->palette = malloc(kPaletteInitial * sizeof(*chunk->palette));
+  if (chunk->palette == NULL) {
+    free(chunk);
+    return NULL;
+  }
+  chunk->palette[0] = MC_CHUNK_STATE(kMCBlockAir, 0);
+  chunk->palette_len = 1;
+  chunk->palette_size = kPaletteInitial;
+
+  return chunk;
+}
+
+
+void mc_chunk_destroy(mc_chunk_t* chunk) {
+  int i;
+
+  for (i = 0; i < chunk->tile_size; i++)
+    if (chunk->tiles[i].nbt != NULL)
+      mc_nbt_destroy(chunk->tiles[i].nbt);
+  free(chunk->tiles);
+  free(chunk->palette);
+  free(chunk->data);
+  free(chunk->light);
+  free(chunk->skylight);
+  free(chunk);
+}
+
+
+int mc_chunk_size(mc_chunk_t* chunk) {
+  int i;
+  int res;
+
+  res = sizeof(*chunk);
+  res += chunk->palette_size * sizeof(*chunk->palette);
+  res += kMCChunkBlocks * chunk->bits / 8;
+  res += chunk->tile_size * sizeof(*chunk->tiles);
+  for (i = 0; i < chunk->tile_size; i++)
+    if (chunk->tiles[i].nbt != NULL)
+      res += mc_nbt_size(chunk->tiles[i].nbt);
+  if (chunk->light != NULL)
+    res += kMCChunkNibbles;
+  if (chunk->skylight != NULL)
+    res += kMCChunkNibbles;
+
+  return res;
+}
+
+
+int mc_chunk_load_states(mc_chunk_t* chunk, const uint16_t* states) {
+  int i;
+  int j;
+  int k;
+  int bits;
+  int per_word;
+  uint32_t word;
+  int palette_len;
+  uint32_t hash;
+  uint32_t mask;
+  uint16_t* palette;
+  uint32_t* data;
+  uint16_t indices[MC_CHUNK_BLOCKS];
+  uint16_t palette_tmp[MC_CHUNK_BLOCKS];
+
+  /* (state << 16) | (index + 1), open addressing */
+  uint32_t slots[1 << kStateSlotBits];
+
+  /* Uniform section needs neither hash, nor indices */
+  for (i = 1; i < kMCChunkBlocks; i++)
+    if (states[i] != states[0])
+      break;
+  if (i == kMCChunkBlocks) {
+    palette = malloc(sizeof(*palette));
+    if (palette == NULL)
+      return -1;
+    palette[0] = states[0];
+    free(chunk->palette);
+    free(chunk->data);
+    chunk->palette = palette;
+    chunk->palette_len = 1;
+    chunk->palette_size = 1;
+    chunk->bits = 0;
+    chunk->data = NULL;
+    return 0;
+  }
+
+  memset(slots, 0, sizeof(slots));
+  mask = (1 << kStateSlotBits) - 1;
+  palette_len = 0;
+  for (i = 0; i < kMCChunkBlocks; i++) {
+    hash = (states[i] * 0x9e3779b1u) >> (32 - kStateSlotBits);
+    for (; slots[hash] != 0; hash = (hash + 1) & mask)
+      if ((slots[hash] >> 16) == states[i])
+        break;
+
+    if (slots[hash] == 0) {
+      palette_tmp[palette_len] = states[i];
+      slots[hash] = ((uint32_t) states[i] << 16) | (palette_len + 1);
+      palette_len++;
+    }
+    indices[i] = (slots[hash] & 0xffff) - 1;
+  }
+
+  bits = mc_chunk__bits(palette_len);
+  palette = malloc(palette_len * sizeof(*palette));
+  if (palette == NULL)
+    return -1;
+  memcpy(palette, palette_tmp, palette_len * sizeof(*palette));
+
+  data = NULL;
+  if (bits != 0) {
+    data = malloc(kMCChunkBlocks * bits / 8);
+    if (data == NULL) {
+      free(palette);
+      return -1;
+    }
+
+    /* Whole words at a time */
+    per_word = 32 / bits;
+    for (i = 0, j = 0; i < kMCChunkBlocks; i += per_word, j++) {
+      word = 0;
+      for (k = 0; k < per_word; k++)
+        word |= (uint32_t) indices[i + k] << (k * bits);
+      data[j] = word;
+    }
+  }
+
+  free(chunk->palette);
+  free(chunk->data);
+  chunk->palette = palette;
+  chunk->palette_len = palette_len;
+  chunk->palette_size = palette_len;
+  chunk->bits = bits;
+  chunk->data = data;
+
+  return 0;
+}
+
+
+void mc_chunk_get_states(mc_chunk_t* chunk, uint16_t* states) {
+  int i;
+  int j;
+  int k;
+  int per_word;
+  uint32_t mask;
+  uint32_t word;
+
+  if (chunk->bits == 0) {
+    for (i = 0; i < kMCChunkBlocks; i++)
+      states[i] = chunk->palette[0];
+    return;
+  }
+
+  /* Whole words at a time */
+  mask = (1u << chunk->bits) - 1;
+  per_word = 32 / chunk->bits;
+  for (i = 0, j = 0; i < kMCChunkBlocks; j++) {
+    word = chunk->data[j];
+    for (k = 0; k < per_word; k++, i++) {
+      states[i] = chunk->palette[word & mask];
+      word >>= chunk->bits;
+    }
+  }
+}
+
+
+int mc_chunk_load_light(mc_chunk_t* chunk,
+                        const uint8_t* light,
+                        const uint8_t* skylight) {
+  int i;
+  uint8_t* arrs[2];
+  const uint8_t* src[2];
+
+  src[0] = light;
+  src[1] = skylight;
+  for (i = 0; i < 2; i++) {
+    arrs[i] = NULL;
+    if (mc_chunk__uniform_nibbles(src[i]))
+      continue;
+
+    arrs[i] = malloc(kMCChunkNibbles);
+    if (arrs[i] == NULL) {
+      free(arrs[0]);
+      return -1;
+    }
+    memcpy(arrs[i], src[i], kMCChunkNibbles);
+  }
+
+  free(chunk->light);
+  free(chunk->skylight);
+  chunk->light = arrs[0];
+  chunk->skylight = arrs[1];
+  chunk->light_value = light[0] & 0xf;
+  chunk->skylight_value = skylight[0] & 0xf;
+
+  return 0;
+}
+
+
+const uint8_t* mc_chunk_get_nibbles(mc_chunk_t* chunk,
+                                    int sky,
+                                    uint8_t* tmp) {
+  uint8_t* arr;
+  uint8_t value;
+
+  arr = sky ? chunk->skylight : chunk->light;
+  if (arr != NULL)
+    return arr;
+
+  value = sky ? chunk->skylight_value : chunk->light_value;
+  memset(tmp, value | (value << 4), kMCChunkNibbles);
+  return tmp;
+}
+
+
+void mc_chunk_states_from_anvil(const uint8_t* blocks,
+                                const uint8_t* add,
+                                const uint8_t* data,
+                                uint16_t* states) {
+  int i;
+  uint8_t a;
+
+  i = 0;
+
+  /*
+   * Nibbles are widened to bytes in block order, then every state is built
+   * from two bytes: (block << 4 | data) and (add << 4 | block >> 4).
+   */
+#if defined(__AVX2__)
+  {
+    __m256i lo_nibble;
+    __m256i hi_nibble;
+    __m256i b;
+    __m256i d;
+    __m256i a;
+    __m256i lo;
+    __m256i hi;
+    __m256i first;
+    __m256i second;
+
+    lo_nibble = _mm256_set1_epi8(0x0f);
+    hi_nibble = _mm256_set1_epi8((char) 0xf0);
+    a = _mm256_setzero_si256();
+    for (; i + 32 <= kMCChunkBlocks; i += 32) {
+      b = _mm256_loadu_si256((const __m256i*) (blocks + i));
+      d = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i*) (data + (i >> 1))));
+      d = _mm256_or_si256(
+          _mm256_and_si256(d, _mm256_set1_epi16(0x000f)),
+          _mm256_and_si256(_mm256_slli_epi16(d, 4),
+                           _mm256_set1_epi16(0x0f00)));
+      if (add != NULL) {
+        a = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*) (add + (i >> 1))));
+        a = _mm256_or_si256(
+            _mm256_and_si256(a, _mm256_set1_epi16(0x000f)),
+            _mm256_and_si256(_mm256_slli_epi16(a, 4),
+                             _mm256_set1_epi16(0x0f00)));
+      }
+
+      lo = _mm256_or_si256(
+          _mm256_and_si256(_mm256_slli_epi16(b, 4), hi_nibble), d);
+      hi = _mm256_or_si256(
+          _mm256_and_si256(_mm256_slli_epi16(a, 4), hi_nibble),
+          _mm256_and_si256(_mm256_srli_epi16(b, 4), lo_nibble));
+
+      /* unpack works per 128-bit lane, restore the order afterwards */
+      first = _mm256_unpacklo_epi8(lo, hi);
+      second = _mm256_unpackhi_epi8(lo, hi);
+      _mm256_storeu_si256((__m256i*) (states + i),
+                          _mm256_permute2x128_si256(first, second, 0x20));
+      _mm256_storeu_si256((__m256i*) (states + i + 16),
+                          _mm256_permute2x128_si256(first, second, 0x31));
+    }
+  }
+#endif  /* defined(__AVX2__) */
+
+#if defined(__SSE2__)
+  {
+    __m128i lo_nibble;
+    __m128i hi_nibble;
+    __m128i zero;
+    __m128i b;
+    __m128i d;
+    __m128i a;
+    __m128i lo;
+    __m128i hi;
+
+    lo_nibble = _mm_set1_epi8(0x0f);
+    hi_nibble = _mm_set1_epi8((char) 0xf0);
+    zero = _mm_setzero_si128();
+    a = zero;
+    for (; i + 16 <= kMCChunkBlocks; i += 16) {
+      b = _mm_loadu_si128((const __m128i*) (blocks + i));
+      d = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i*) (data + (i >> 1))), zero);
+      d = _mm_or_si128(_mm_and_si128(d, _mm_set1_epi16(0x000f)),
+                       _mm_and_si128(_mm_slli_epi16(d, 4),
+                                     _mm_set1_epi16(0x0f00)));
+      if (add != NULL) {
+        a = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*) (add + (i >> 1))), zero);
+        a = _mm_or_si128(_mm_and_si128(a, _mm_set1_epi16(0x000f)),
+                         _mm_and_si128(_mm_slli_epi16(a, 4),
+                                       _mm_set1_epi16(0x0f00)));
+      }
+
+      lo = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(b, 4), hi_nibble), d);
+      hi = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(a, 4), hi_nibble),
+                        _mm_and_si128(_mm_srli_epi16(b, 4), lo_nibble));
+      _mm_storeu_si128((__m128i*) (states + i), _mm_unpacklo_epi8(lo, hi));
+      _mm_storeu_si128((__m128i*) (states + i + 8),
+                       _mm_unpackhi_epi8(lo, hi));
+    }
+  }
+#endif  /* defined(__SSE2__) */
+
+  /* Scalar tail, or the whole section without SIMD */
+  for (; i < kMCChunkBlocks; i += 2) {
+    a = add == NULL ? 0 : add[i >> 1];
+    states[i] = ((a & 0xf) << 12) |
+                (blocks[i] << 4) |
+                (data[i >> 1] & 0xf);
+    states[i + 1] = ((a >> 4) << 12) |
+                    (blocks[i + 1] << 4) |
+                    (data[i >> 1] >> 4);
+  }
+}
+
+
+int mc_chunk_states_to_anvil(const uint16_t* states,
+                             uint8_t* blocks,
+                             uint8_t* add,
+                             uint8_t* data) {
+  int i;
+  uint8_t has_add;
+
+  i = 0;
+  has_add = 0;
+
+  /*
+   * States are split into low and high bytes, and nibbles of every pair of
+   * bytes are joined in 16-bit lanes: (x | x >> 4) & 0xff.
+   */
+#if defined(__AVX2__)
+  {
+    __m256i lo_nibble;
+    __m256i lo_byte;
+    __m256i zero;
+    __m256i acc;
+    __m256i s0;
+    __m256i s1;
+    __m256i lo;
+    __m256i hi;
+    __m256i m;
+
+    lo_nibble = _mm256_set1_epi8(0x0f);
+    lo_byte = _mm256_set1_epi16(0x00ff);
+    zero = _mm256_setzero_si256();
+    acc = zero;
+    for (; i + 32 <= kMCChunkBlocks; i += 32) {
+      s0 = _mm256_loadu_si256((const __m256i*) (states + i));
+      s1 = _mm256_loadu_si256((const __m256i*) (states + i + 16));
+
+      /* packus works per 128-bit lane, restore the order afterwards */
+      lo = _mm256_packus_epi16(_mm256_and_si256(s0, lo_byte),
+                               _mm256_and_si256(s1, lo_byte));
+      hi = _mm256_packus_epi16(_mm256_srli_epi16(s0, 8),
+                               _mm256_srli_epi16(s1, 8));
+      lo = _mm256_permute4x64_epi64(lo, 0xd8);
+      hi = _mm256_permute4x64_epi64(hi, 0xd8);
+
+      _mm256_storeu_si256(
+          (__m256i*) (blocks + i),
+          _mm256_or_si256(
+              _mm256_and_si256(_mm256_srli_epi16(lo, 4), lo_nibble),
+              _mm256_andnot_si256(lo_nibble, _mm256_slli_epi16(hi, 4))));
+
+      m = _mm256_and_si256(lo, lo_nibble);
+      m = _mm256_and_si256(_mm256_or_si256(m, _mm256_srli_epi16(m, 4)),
+                           lo_byte);
+      m = _mm256_permute4x64_epi64(_mm256_packus_epi16(m, zero), 0xd8);
+      _mm_storeu_si128((__m128i*) (data + (i >> 1)),
+                       _mm256_castsi256_si128(m));
+
+      m = _mm256_and_si256(_mm256_srli_epi16(hi, 4), lo_nibble);
+      acc = _mm256_or_si256(acc, m);
+      m = _mm256_and_si256(_mm256_or_si256(m, _mm256_srli_epi16(m, 4)),
+                           lo_byte);
+      m = _mm256_permute4x64_epi64(_mm256_packus_epi16(m, zero), 0xd8);
+      _mm_storeu_si128((__m128i*) (add + (i >> 1)),
+                       _mm256_castsi256_si128(m));
+    }
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(acc, zero)) != -1)
+      has_add = 1;
+  }
+#endif  /* defined(__AVX2__) */
+
+#if defined(__SSE2__)
+  {
+    __m128i lo_nibble;
+    __m128i lo_byte;
+    __m128i zero;
+    __m128i acc;
+    __m128i s0;
+    __m128i s1;
+    __m128i lo;
+    __m128i hi;
+    __m128i m;
+
+    lo_nibble = _mm_set1_epi8(0x0f);
+    lo_byte = _mm_set1_epi16(0x00ff);
+    zero = _mm_setzero_si128();
+    acc = zero;
+    for (; i + 16 <= kMCChunkBlocks; i += 16) {
+      s0 = _mm_loadu_si128((const __m128i*) (states + i));
+      s1 = _mm_loadu_si128((const __m128i*) (states + i + 8));
+      lo = _mm_packus_epi16(_mm_and_si128(s0, lo_byte),
+                            _mm_and_si128(s1, lo_byte));
+      hi = _mm_packus_epi16(_mm_srli_epi16(s0, 8), _mm_srli_epi16(s1, 8));
+
+      _mm_storeu_si128(
+          (__m128i*) (blocks + i),
+          _mm_or_si128(_mm_and_si128(_mm_srli_epi16(lo, 4), lo_nibble),
+                       _mm_andnot_si128(lo_nibble, _mm_slli_epi16(hi, 4))));
+
+      m = _mm_and_si128(lo, lo_nibble);
+      m = _mm_and_si128(_mm_or_si128(m, _mm_srli_epi16(m, 4)), lo_byte);
+      _mm_storel_epi64((__m128i*) (data + (i >> 1)),
+                       _mm_packus_epi16(m, zero));
+
+      m = _mm_and_si128(_mm_srli_epi16(hi, 4), lo_nibble);
+      acc = _mm_or_si128(acc, m);
+      m = _mm_and_si128(_mm_or_si128(m, _mm_srli_epi16(m, 4)), lo_byte);
+      _mm_storel_epi64((__m128i*) (add + (i >> 1)),
+                       _mm_packus_epi16(m, zero));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+      has_add = 1;
+  }
+#endif  /* defined(__SSE2__) */
+
+  /* Scalar tail, or the whole section without SIMD */
+  for (; i < kMCChunkBlocks; i += 2) {
+    blocks[i] = (states[i] >> 4) & 0xff;
+    blocks[i + 1] = (states[i + 1] >> 4) & 0xff;
+    add[i >> 1] = (states[i] >> 12) | ((states[i + 1] >> 12) << 4);
+    data[i >> 1] = (states[i] & 0xf) | ((states[i + 1] & 0xf) << 4);
+    has_add |= add[i >> 1];
+  }
+
+  return has_add != 0;
+}
+
+
+uint16_t mc_chunk_get_state(mc_chunk_t* chunk, int x, int y, int z) {
+  return chunk->palette[mc_chunk__get_index(chunk, MC_CHUNK_INDEX(x, y, z))];
+}
+
+
+int mc_chunk_set_state(mc_chunk_t* chunk, int x, int y, int z, uint16_t st) {
+  int r;
+  int index;
+  uint16_t* palette;
+
+  index = mc_chunk__find(chunk, st);
+  if (index < 0) {
+    /* Add state to palette, and widen indices if needed */
+    if (chunk->palette_len == chunk->palette_size) {
+      palette = realloc(chunk->palette,
+                        2 * chunk->palette_size * sizeof(*palette));
+      if (palette == NULL)
+        return -1;
+      chunk->palette = palette;
+      chunk->palette_size *= 2;
+    }
+
+    r = mc_chunk__resize(chunk, mc_chunk__bits(chunk->palette_len + 1));
+    if (r != 0)
+      return r;
+
+    index = chunk->palette_len++;
+    chunk->palette[index] = st;
+  }
+
+  if (chunk->bits != 0) {
+    mc_chunk__set_index(chunk->data,
+                        chunk->bits,
+                        MC_CHUNK_INDEX(x, y, z),
+                        index);
+  }
+
+  return 0;
+}
+
+
+uint8_t mc_chunk_get_light(mc_chunk_t* chunk, int x, int y, int z) {
+  if (chunk->light == NULL)
+    return chunk->light_value;
+  return mc_chunk__get_nibble(chunk->light, MC_CHUNK_INDEX(x, y, z));
+}
+
+
+int mc_chunk_set_light(mc_chunk_t* chunk, int x, int y, int z, uint8_t v) {
+  return mc_chunk__set_light(&chunk->light,
+                             &chunk->light_value,
+                             MC_CHUNK_INDEX(x, y, z),
+                             v);
+}
+
+
+uint8_t mc_chunk_get_skylight(mc_chunk_t* chunk, int x, int y, int z) {
+  if (chunk->skylight == NULL)
+    return chunk->skylight_value;
+  return mc_chunk__get_nibble(chunk->skylight, MC_CHUNK_INDEX(x, y, z));
+}
+
+
+int mc_chunk_set_skylight(mc_chunk_t* chunk,
+                          int x,
+                          int y,
+                          int z,
+                          uint8_t v) {
+  return mc_chunk__set_light(&chunk->skylight,
+                             &chunk->skylight_value,
+                             MC_CHUNK_INDEX(x, y, z),
+                             v);
+}
+
+
+struct mc_nbt_s* mc_chunk_get_tile(mc_chunk_t* chunk, int x, int y, int z) {
+  if (chunk->tile_count == 0)
+    return NULL;
+  return mc_chunk__tile_slot(chunk->tiles,
+                             chunk->tile_size,
+                             MC_CHUNK_INDEX(x, y, z))->nbt;
+}
+
+
+int mc_chunk_set_tile(mc_chunk_t* chunk,
+                      int x,
+                      int y,
+                      int z,
+                      struct mc_nbt_s* tile) {
+  int index;
+  mc_chunk_tile_t* slot;
+
+  index = MC_CHUNK_INDEX(x, y, z);
+  if (chunk->tile_count == 0 && tile == NULL)
+    return 0;
+
+  /* Keep load factor below 1/2 */
+  if (tile != NULL &&
+      2 * (chunk->tile_count + 1) > chunk->tile_size &&
+      mc_chunk__tile_grow(chunk) != 0) {
+    return -1;
+  }
+
+  /* Chunk owns the tile */
+  slot = mc_chunk__tile_slot(chunk->tiles, chunk->tile_size, index);
+  if (slot->nbt == tile)
+    return 0;
+  if (slot->nbt != NULL)
+    mc_nbt_destroy(slot->nbt);
+
+  if (tile == NULL) {
+    mc_chunk__tile_remove(chunk, slot);
+  } else {
+    if (slot->nbt == NULL)
+      chunk->tile_count++;
+    slot->index = index;
+    slot->nbt = tile;
+  }
+
+  return 0;
+}
+
+
+void mc_chunk_get(mc_chunk_t* chunk, int x, int y, int z, mc_block_t* out) {
+  uint16_t state;
+
+  state = mc_chunk_get_state(chunk, x, y, z);
+  out->id = (mc_block_id_t) (state >> 4);
+  out->metadata = state & 0xf;
+  out->light = mc_chunk_get_light(chunk, x, y, z);
+  out->skylight = mc_chunk_get_skylight(chunk, x, y, z);
+  out->tile_data = mc_chunk_get_tile(chunk, x, y, z);
+}
+
+
+int mc_chunk_set(mc_chunk_t* chunk,
+                 int x,
+                 int y,
+                 int z,
+                 mc_block_id_t id,
+                 uint8_t metadata) {
+  return mc_chunk_set_state(chunk, x, y, z, MC_CHUNK_STATE(id, metadata));
+}
+
+
+int mc_chunk__bits(int palette_len) {
+  int bits;
+
+  if (palette_len <= 1)
+    return 0;
+
+  /* Power of two, so that indices never cross words */
+  for (bits = 1; (1 << bits) < palette_len; bits *= 2) {
+    /* no-op */
+  }
+
+  return bits;
+}
+
+
+int mc_chunk__find(mc_chunk_t* chunk, uint16_t state) {
+  int i;
+
+  for (i = 0; i < chunk->palette_len; i++)
+    if (chunk->palette[i] == state)
+      return i;
+  return -1;
+}
+
+
+int mc_chunk__resize(mc_chunk_t* chunk, int bits) {
+  int i;
+  uint32_t* data;
+
+  if (bits == chunk->bits)
+    return 0;
+
+  data = calloc(kMCChunkBlocks * bits / 32, sizeof(*data));
+  if (data == NULL)
+    return -1;
+
+  /* Single state section has all indices equal to zero */
+  if (chunk->bits != 0)
+    for (i = 0; i < kMCChunkBlocks; i++)
+      mc_chunk__set_index(data, bits, i, mc_chunk__get_index(chunk, i));
+
+  free(chunk->data);
+  chunk->data = data;
+  chunk->bits = bits;
+
+  return 0;
+}
+
+
+int mc_chunk__get_index(mc_chunk_t* chunk, int i) {
+  int per_word;
+
+  if (chunk->bits == 0)
+    return 0;
+
+  per_word = 32 / chunk->bits;
+  return (chunk->data[i / per_word] >> ((i % per_word) * chunk->bits)) &
+         ((1u << chunk->bits) - 1);
+}
+
+
+void mc_chunk__set_index(uint32_t* data, int bits, int i, int index) {
+  int per_word;
+  int shift;
+  uint32_t mask;
+
+  per_word = 32 / bits;
+  shift = (i % per_word) * bits;
+  mask = ((1u << bits) - 1) << shift;
+  data[i / per_word] = (data[i / per_word] & ~mask) |
+                       (((uint32_t) index << shift) & mask);
+}
+
+
+uint8_t mc_chunk__get_nibble(const uint8_t* arr, int i) {
+  if (i % 2 == 0)
+    return arr[i >> 1] & 0xf;
+  else
+    return arr[i >> 1] >> 4;
+}
+
+
+void mc_chunk__set_nibble(uint8_t* arr, int i, uint8_t value) {
+  if (i % 2 == 0)
+    arr[i >> 1] = (arr[i >> 1] & 0xf0) | (value & 0xf);
+  else
+    arr[i >> 1] = (arr[i >> 1] & 0x0f) | ((value & 0xf) << 4);
+}
+
+
+int mc_chunk__uniform_nibbles(const uint8_t* arr) {
+  int i;
+
+  if ((arr[0] >> 4) != (arr[0] & 0xf))
+    return 0;
+  for (i = 1; i < kMCChunkNibbles; i++)
+    if (arr[i] != arr[0])
+      return 0;
+  return 1;
+}
+
+
+int mc_chunk__set_light(uint8_t** arr,
+                        uint8_t* uniform,
+                        int i,
+                        uint8_t value) {
+  if (*arr == NULL) {
+    if ((value & 0xf) == *uniform)
+      return 0;
+
+    /* First different value, materialize the array */
+    *arr = malloc(kMCChunkNibbles);
+    if (*arr == NULL)
+      return -1;
+    memset(*arr, *uniform | (*uniform << 4), kMCChunkNibbles);
+  }
+
+  mc_chunk__set_nibble(*arr, i, value);
+  return 0;
+}
+
+
+mc_chunk_tile_t* mc_chunk__tile_slot(mc_chunk_tile_t* tiles,
+                                     int size,
+                                     int index) {
+  uint32_t i;
+  uint32_t mask;
+
+  mask = size - 1;
+  i = ((uint32_t) index * 0x9e3779b1u) >> 16;
+  for (i &= mask; tiles[i].nbt != NULL; i = (i + 1) & mask)
+    if (tiles[i].index == index)
+      break;
+
+  return &tiles[i];
+}
+
+
+int mc_chunk__tile_grow(mc_chunk_t* chunk) {
+  int i;
+  int size;
+  mc_chunk_tile_t* tiles;
+  mc_chunk_tile_t* slot;
+
+  size = chunk->tile_size == 0 ? kTileInitial : chunk->tile_size * 2;
+  tiles = calloc(size, sizeof(*tiles));
+  if (tiles == NULL)
+    return -1;
+
+  for (i = 0; i < chunk->tile_size; i++) {
+    if (chunk->tiles[i].nbt == NULL)
+      continue;
+    slot = mc_chunk__tile_slot(tiles, size, chunk->tiles[i].index);
+    *slot = chunk->tiles[i];
+  }
+
+  free(chunk->tiles);
+  chunk->tiles = tiles;
+  chunk->tile_size = size;
+
+  return 0;
+}
+
+
+void mc_chunk__tile_remove(mc_chunk_t* chunk, mc_chunk_tile_t* slot) {
+  uint32_t i;
+  uint32_t j;
+  uint32_t home;
+  uint32_t mask;
+
+  if (slot->nbt == NULL)
+    return;
+
+  /* Shift following entries back, so that probing still finds them */
+  mask = chunk->tile_size - 1;
+  i = slot - chunk->tiles;
+  chunk->tiles[i].nbt = NULL;
+  chunk->tile_count--;
+  for (j = (i + 1) & mask; chunk->tiles[j].nbt != NULL; j = (j + 1) & mask) {
+    home = (((uint32_t) chunk->tiles[j].index * 0x9e3779b1u) >> 16) & mask;
+
+    /* Entry can't be moved before its home slot */
+    if (((j - home) & mask) < ((j - i) & mask))
+      continue;
+
+    chunk->tiles[i] = chunk->tiles[j];
+    chunk->tiles[j].nbt = NULL;
+    i = j;
+  }
+}
@@ -0,0 +1,125 @@
+#ifndef SRC_UTILS_CHUNK_H_
+#define SRC_UTILS_CHUNK_H_
+
+#include <stdint.h>  /* uint8_t, uint16_t, uint32_t */
+
+#include "utils/common.h"  /* mc_chunk_t, mc_block_t, mc_block_id_t */
+
+#define MC_CHUNK_BLOCKS (MC_CHUNK_MAX_X * MC_CHUNK_MAX_Z * MC_CHUNK_MAX_Y)
+#define MC_CHUNK_NIBBLES (MC_CHUNK_BLOCKS / 2)
+
+/* Block's index in section, same as in Anvil */
+#define MC_CHUNK_INDEX(x, y, z) \
+    ((x) + (z) * MC_CHUNK_MAX_X + (y) * MC_CHUNK_MAX_X * MC_CHUNK_MAX_Z)
+
+/* Block state is a pair of 12-bit id and 4-bit metadata */
+#define MC_CHUNK_STATE(id, metadata) \
+    ((uint16_t) ((((id) & 0xfff) << 4) | ((metadata) & 0xf)))
+
+typedef struct mc_chunk_tile_s mc_chunk_tile_t;
+
+static const int kMCChunkBlocks = MC_CHUNK_BLOCKS;
+static const int kMCChunkNibbles = MC_CHUNK_NIBBLES;
+
+/* Tile entity in section, slot is empty if `nbt` is NULL */
+struct mc_chunk_tile_s {
+  uint16_t index;
+  struct mc_nbt_s* nbt;
+};
+
+/*
+ * Section of 16x16x16 blocks. Block states are stored in a palette, and
+ * every block has an index into it packed into `bits` bits. Light is kept
+ * in nibble arrays. Both are in Anvil's order, see MC_CHUNK_INDEX().
+ *
+ * Uniform sections (e.g. air with full sky light) have neither indices nor
+ * light arrays, they are allocated on first write of a different value.
+ */
+struct mc_chunk_s {
+  uint16_t* palette;
+  int palette_len;
+  int palette_size;
+
+  /* 0 (single state, no `data`), 1, 2, 4, 8 or 16 */
+  int bits;
+  uint32_t* data;
+
+  /* Even block is in low nibble, NULL if light is uniform */
+  uint8_t* light;
+  uint8_t* skylight;
+  uint8_t light_value;
+  uint8_t skylight_value;
+
+  /*
+   * Open addressing hash of tile entities keyed by block's index. NULL,
+   * unless section has tile entities. Iterate over `tile_size` slots.
+   */
+  mc_chunk_tile_t* tiles;
+  int tile_count;
+  int tile_size;
+};
+
+mc_chunk_t* mc_chunk_new();
+void mc_chunk_destroy(mc_chunk_t* chunk);
+
+/* Approximate memory used by section, including tile entities' NBT */
+int mc_chunk_size(mc_chunk_t* chunk);
+
+/* Replace all blocks at once, `states` has kMCChunkBlocks entries */
+int mc_chunk_load_states(mc_chunk_t* chunk, const uint16_t* states);
+void mc_chunk_get_states(mc_chunk_t* chunk, uint16_t* states);
+
+/* Replace light with kMCChunkNibbles arrays, uniform ones aren't copied */
+int mc_chunk_load_light(mc_chunk_t* chunk,
+                        const uint8_t* light,
+                        const uint8_t* skylight);
+
+/*
+ * Return nibble array of block (or sky) light. If light is uniform, `tmp`
+ * of kMCChunkNibbles bytes is filled and returned instead.
+ */
+const uint8_t* mc_chunk_get_nibbles(mc_chunk_t* chunk,
+                                    int sky,
+                                    uint8_t* tmp);
+
+/*
+ * Conversion between states and Anvil's Blocks, Add and Data arrays. `add`
+ * may be NULL when decoding, encoder returns 1 if `add` is needed.
+ */
+void mc_chunk_states_from_anvil(const uint8_t* blocks,
+                                const uint8_t* add,
+                                const uint8_t* data,
+                                uint16_t* states);
+int mc_chunk_states_to_anvil(const uint16_t* states,
+                             uint8_t* blocks,
+                             uint8_t* add,
+                             uint8_t* data);
+
+/* Accessors */
+uint16_t mc_chunk_get_state(mc_chunk_t* chunk, int x, int y, int z);
+int mc_chunk_set_state(mc_chunk_t* chunk, int x, int y, int z, uint16_t st);
+uint8_t mc_chunk_get_light(mc_chunk_t* chunk, int x, int y, int z);
+int mc_chunk_set_light(mc_chunk_t* chunk, int x, int y, int z, uint8_t v);
+uint8_t mc_chunk_get_skylight(mc_chunk_t* chunk, int x, int y, int z);
+int mc_chunk_set_skylight(mc_chunk_t* chunk,
+                          int x,
+                          int y,
+                          int z,
+                          uint8_t v);
+struct mc_nbt_s* mc_chunk_get_tile(mc_chunk_t* chunk, int x, int y, int z);
+int mc_chunk_set_tile(mc_chunk_t* chunk,
+                      int x,
+                      int y,
+                      int z,
+                      struct mc_nbt_s* tile);
+
+/* Unpacked copy of block, `tile_data` is still owned by chunk */
+void mc_chunk_get(mc_chunk_t* chunk, int x, int y, int z, mc_block_t* out);
+int mc_chunk_set(mc_chunk_t* chunk,
+                 int x,
+                 int y,
+                 int z,
+                 mc_block_id_t id,
+                 uint8_t metadata);
+
+#endif  /* SRC_UTILS_CHUNK_H_ */
@@ -2,74 +2,69 @@
 #include <assert.h>  /* assert */
 #include <fcntl.h>  /* open, close */
 #include <stdio.h>  /* rename */
-#include <stdlib.h>  /* malloc */
+#include <stdlib.h>  /* calloc, malloc, free */
 #include <string.h>  /* memcpy, strncmp */
+#include <sys/mman.h>  /* mmap, munmap */
 #include <sys/stat.h>  /* stat */
+#include <sys/uio.h>  /* writev, struct iovec */
 #include <unistd.h>  /* read, write */
 
 #include "utils/common.h"
-#include "format/nbt.h"  /* mc_nbt_destroy */
+#include "utils/common-private.h"  /* ARRAY_SIZE */
+#include "utils/chunk.h"  /* mc_chunk_destroy */
+#include "format/nbt.h"  /* mc_nbt_destroy, mc_nbt_preparse */
 
-static void mc_chunk__destroy(mc_chunk_t* block);
-static void mc_block__destroy(mc_block_t* block);
 
 static const char kBackupSuffix[] = ".backup";
 static const char kTmpSuffix[] = ".tmp";
 
 
+mc_region_t* mc_region_new() {
+  /* No columns are generated */
+  return calloc(1, sizeof(mc_region_t));
+}
+
+
 void mc_region_destroy(mc_region_t* region) {
   int x;
-  int y;
   int z;
-  int i;
-  mc_column_t* col;
-
-  for (x = 0; x < kMCColumnMaxX; x++) {
-    for (z = 0; z < kMCColumnMaxZ; z++) {
-      col = &region->columns[x][z];
-
-      /* Free chunks */
-      for (y = 0; y < kMCColumnMaxY; y++) {
-        if (col->chunks[y] == NULL)
-          continue;
-        mc_chunk__destroy(col->chunks[y]);
-        col->chunks[y] = NULL;
-      }
-
-      /* Free entities */
-      for (i = 0; i < col->entity_count; i++) {
-        mc_nbt_destroy(col->entities[i].nbt);
-        col->entities[i].nbt = NULL;
-      }
-      free(col->entities);
-      col->entities = NULL;
-      col->entity_count = 0;
-    }
-  }
+
+  for (x = 0; x < kMCColumnMaxX; x++)
+    for (z = 0; z < kMCColumnMaxZ; z++)
+      mc_column_destroy(&region->columns[x][z]);
+  if (region->mapped)
+    mc_unmap_file(region->data, region->len);
+  else
+    free(region->data);
   free(region);
 }
 
 
-void mc_chunk__destroy(mc_chunk_t* chunk) {
-  int x;
+void mc_column_destroy(mc_column_t* col) {
   int y;
-  int z;
-
-  for (x = 0; x < kMCChunkMaxX; x++)
-    for (z = 0; z < kMCChunkMaxZ; z++)
-      for (y = 0; y < kMCChunkMaxY; y++)
-        mc_block__destroy(&chunk->blocks[x][z][y]);
-  free(chunk);
-}
+  int i;
 
+  /* Free chunks */
+  for (y = 0; y < kMCColumnMaxY; y++) {
+    if (col->chunks[y] == NULL)
+      continue;
+    mc_chunk_destroy(col->chunks[y]);
+    col->chunks[y] = NULL;
+  }
 
-void mc_block__destroy(mc_block_t* block) {
-  if (block->tile_data != NULL) {
-    mc_nbt_destroy(block->tile_data);
-    block->tile_data = NULL;
+  /* Free entities */
+  for (i = 0; i < col->entity_count; i++) {
+    mc_nbt_destroy(col->entities[i].nbt);
+    col->entities[i].nbt = NULL;
   }
+  free(col->entities);
+  col->entities = NULL;
+  col->entity_count = 0;
+  col->generated = 0;
+  col->dirty = 0;
 }
 
+
 #define ENTITY_TO_STR_DECL(id, value, str) \
     if (len == (sizeof(str) - 1) && strncmp(val, str, len) == 0) { \
       return kMCEntity##id; \
@@ -89,6 +84,9 @@ void mc_slot_init(mc_slot_t* slot) {
   slot->nbt_len = 0;
   slot->nbt = NULL;
   slot->allocated = 0;
+  slot->parsed = 0;
+  slot->tag = NULL;
+  slot->uncompressed = NULL;
 }
 
 void mc_slot_destroy(mc_slot_t* slot) {
@@ -96,6 +94,55 @@ void mc_slot_destroy(mc_slot_t* slot) {
     free(slot->nbt);
     slot->nbt = NULL;
   }
+
+  /* Parsed tree points into `uncompressed` */
+  if (slot->tag != NULL) {
+    mc_nbt_destroy(slot->tag);
+    slot->tag = NULL;
+  }
+  free(slot->uncompressed);
+  slot->uncompressed = NULL;
+  slot->parsed = 0;
+}
+
+
+struct mc_nbt_s* mc_slot_nbt(mc_slot_t* slot) {
+  mc_nbt_parser_t parser;
+
+  if (slot->parsed)
+    return slot->tag;
+
+  /* Do not retry on malformed data */
+  slot->parsed = 1;
+  if (slot->nbt == NULL || slot->nbt_len == 0)
+    return NULL;
+
+  slot->tag = mc_nbt_preparse(&parser,
+                              slot->nbt,
+                              slot->nbt_len,
+                              kNBTGZip,
+                              kSameLifetime);
+  if (slot->tag != NULL)
+    slot->uncompressed = parser.uncompressed;
+
+  return slot->tag;
+}
+
+
+void mc_frame_destroy(mc_frame_t* frame) {
+  switch (frame->type) {
+    case kMCBlockPlacementType:
+      mc_slot_destroy(&frame->body.block_placement.held_item);
+      break;
+    case kMCClickWindowType:
+      mc_slot_destroy(&frame->body.click_window.clicked_item);
+      break;
+    case kMCCreativeInvActionType:
+      mc_slot_destroy(&frame->body.creative_action.clicked_slot);
+      break;
+    default:
+      break;
+  }
 }
 
 
@@ -143,16 +190,66 @@ open_failed:
 }
 
 
+int mc_map_file(const char* path, unsigned char** out) {
+  int r;
+  int fd;
+  int len;
+  void* res;
+  struct stat s;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  r = fstat(fd, &s);
+  if (r != 0 || s.st_size == 0 || s.st_size > 0x7fffffff) {
+    close(fd);
+    return -1;
+  }
+  len = s.st_size;
+
+  /* Mapping outlives the descriptor */
+  res = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (res == MAP_FAILED)
+    return -1;
+
+  *out = res;
+  return len;
+}
+
+
+void mc_unmap_file(unsigned char* data, int len) {
+  if (data != NULL)
+    munmap(data, len);
+}
+
+
 int mc_write_file(const char* path,
                   const unsigned char* out,
                   int len,
                   int update) {
+  struct iovec iov;
+
+  iov.iov_base = (void*) out;
+  iov.iov_len = len;
+  return mc_write_filev(path, &iov, 1, update);
+}
+
+
+int mc_write_filev(const char* path,
+                   const struct iovec* iov,
+                   int count,
+                   int update) {
   int r;
   int fd;
-  int off;
+  int i;
   int path_len;
+  size_t off;
   char* backup_path;
   char* tmp_path;
+  struct iovec part[16];
+  int part_count;
 
   path_len = strlen(path);
 
@@ -176,12 +273,30 @@ int mc_write_file(const char* path,
   if (fd == -1)
     goto concat_failed;
 
+  /* Write at most ARRAY_SIZE(part) iovecs at a time, handle partial writes */
+  i = 0;
   off = 0;
-  while (off < len) {
-    r = write(fd, out + off, len - off);
-    if (r <= 0)
+  while (i < count) {
+    part_count = 0;
+    while (i + part_count < count && part_count < (int) ARRAY_SIZE(part)) {
+      part[part_count] = iov[i + part_count];
+      part_count++;
+    }
+    part[0].iov_base = (char*) part[0].iov_base + off;
+    part[0].iov_len -= off;
+
+    r = writev(fd, part, part_count);
+    if (r < 0) {
+      close(fd);
       goto concat_failed;
+    }
+
+    /* Skip fully written iovecs */
     off += r;
+    while (i < count && off >= iov[i].iov_len) {
+      off -= iov[i].iov_len;
+      i++;
+    }
   }
 
   close(fd);
@@ -7,6 +7,7 @@
 
 /* Forward-declarations */
 struct mc_nbt_s;
+struct iovec;
 
 #define MC_ENTITY_LIST(ENTITY_DECL) \
     ENTITY_DECL(DroppedItem, 0x1, "Item") \
@@ -438,6 +439,11 @@ struct mc_slot_s {
   uint16_t nbt_len;
   unsigned char* nbt;
   int allocated;
+
+  /* Lazily parsed `nbt`, see mc_slot_nbt() */
+  int parsed;
+  struct mc_nbt_s* tag;
+  unsigned char* uncompressed;
 };
 
 union mc_uuid_u {
@@ -448,6 +454,7 @@ union mc_uuid_u {
   } obj;
 };
 
+/* Unpacked block, see utils/chunk.h for the storage */
 struct mc_block_s {
   mc_block_id_t id;
   uint8_t metadata;
@@ -504,12 +511,11 @@ struct mc_player_s {
   mc_mob_t common;
 };
 
-struct mc_chunk_s {
-  mc_block_t blocks[MC_CHUNK_MAX_X][MC_CHUNK_MAX_Z][MC_CHUNK_MAX_Y];
-};
-
 struct mc_column_s {
   int generated;
+
+  /* Modified since it was read, set by the user. See mc_anvil_save() */
+  int dirty;
   int8_t populated;
   int32_t world_x;
   int32_t world_z;
@@ -525,6 +531,17 @@ struct mc_column_s {
 
 struct mc_region_s {
   mc_column_t columns[MC_COLUMN_MAX_X][MC_COLUMN_MAX_Z];
+
+  /*
+   * Raw .mca contents of region opened with mc_anvil_open(), or mapping of
+   * the file if `mapped` is set. NULL if region was fully decoded by
+   * mc_anvil_parse(). Column is decoded on first access, see
+   * mc_region_get_column().
+   */
+  unsigned char* data;
+  int len;
+  int mapped;
+  uint8_t decoded[MC_COLUMN_MAX_X][MC_COLUMN_MAX_Z];
 };
 
 struct mc_frame_s {
@@ -680,6 +697,7 @@ struct mc_frame_s {
 /* Region utils */
 mc_region_t* mc_region_new();
 void mc_region_destroy(mc_region_t* region);
+void mc_column_destroy(mc_column_t* col);
 
 /* Entity utils */
 mc_entity_id_t mc_entity_str_to_id(const char* val, int len);
@@ -688,11 +706,29 @@ mc_entity_id_t mc_entity_str_to_id(const char* val, int len);
 void mc_slot_init(mc_slot_t* slot);
 void mc_slot_destroy(mc_slot_t* slot);
 
+/*
+ * Decompress and parse slot's NBT on first call, result is cached in the
+ * slot and is freed by mc_slot_destroy(). Returns NULL if there is no NBT
+ * or if it is malformed.
+ */
+struct mc_nbt_s* mc_slot_nbt(mc_slot_t* slot);
+
+/* Frame utils */
+void mc_frame_destroy(mc_frame_t* frame);
+
 /* File utilities, should be called from worker threads */
 int mc_read_file(const char* path, unsigned char** out);
+
+/* Read-only mapping of the whole file, returns its length */
+int mc_map_file(const char* path, unsigned char** out);
+void mc_unmap_file(unsigned char* data, int len);
 int mc_write_file(const char* path,
                   const unsigned char* out,
                   int len,
                   int update);
+int mc_write_filev(const char* path,
+                   const struct iovec* iov,
+                   int count,
+                   int update);
 
 #endif  /* SRC_UTILS_COMMON_H_ */
@@ -0,0 +1,112 @@
+#include <pthread.h>  /* pthread_* */
+#include <stdlib.h>  /* malloc, free, NULL */
+
+#include "utils/parallel.h"
+
+typedef struct mc_parallel__state_s mc_parallel__state_t;
+typedef struct mc_parallel__worker_s mc_parallel__worker_t;
+
+struct mc_parallel__state_s {
+  pthread_mutex_t mutex;
+  int next;
+  int count;
+  int failed;
+  mc_parallel_cb cb;
+  void* arg;
+};
+
+struct mc_parallel__worker_s {
+  mc_parallel__state_t* state;
+  int index;
+  pthread_t thread;
+};
+
+static void* mc_parallel__worker(void* arg);
+
+
+int mc_parallel_for(int workers, int count, mc_parallel_cb cb, void* arg) {
+  int r;
+  int i;
+  int started;
+  mc_parallel__state_t state;
+  mc_parallel__worker_t* w;
+
+  if (workers > count)
+    workers = count;
+  if (workers > kMCParallelMaxWorkers)
+    workers = kMCParallelMaxWorkers;
+
+  /* Nothing to share */
+  if (workers <= 1) {
+    for (i = 0; i < count; i++) {
+      r = cb(arg, 0, i);
+      if (r != 0)
+        return -1;
+    }
+    return 0;
+  }
+
+  w = malloc(workers * sizeof(*w));
+  if (w == NULL)
+    return -1;
+  if (pthread_mutex_init(&state.mutex, NULL) != 0) {
+    free(w);
+    return -1;
+  }
+  state.next = 0;
+  state.count = count;
+  state.failed = 0;
+  state.cb = cb;
+  state.arg = arg;
+
+  /* Fewer threads is fine, caller does the rest of the work anyway */
+  for (started = 1; started < workers; started++) {
+    w[started].state = &state;
+    w[started].index = started;
+    r = pthread_create(&w[started].thread,
+                       NULL,
+                       mc_parallel__worker,
+                       &w[started]);
+    if (r != 0)
+      break;
+  }
+
+  w[0].state = &state;
+  w[0].index = 0;
+  mc_parallel__worker(&w[0]);
+
+  for (i = 1; i < started; i++)
+    pthread_join(w[i].thread, NULL);
+
+  pthread_mutex_destroy(&state.mutex);
+  free(w);
+
+  return state.failed ? -1 : 0;
+}
+
+
+void* mc_parallel__worker(void* arg) {
+  int i;
+  mc_parallel__worker_t* w;
+  mc_parallel__state_t* state;
+
+  w = arg;
+  state = w->state;
+  for (;;) {
+    pthread_mutex_lock(&state->mutex);
+    if (state->failed || state->next == state->count) {
+      pthread_mutex_unlock(&state->mutex);
+      break;
+    }
+    i = state->next++;
+    pthread_mutex_unlock(&state->mutex);
+
+    if (state->cb(state->arg, w->index, i) != 0) {
+      pthread_mutex_lock(&state->mutex);
+      state->failed = 1;
+      pthread_mutex_unlock(&state->mutex);
+    }
+  }
+
+  return NULL;
+}
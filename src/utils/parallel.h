@@ -0,0 +1,17 @@
+#ifndef SRC_UTILS_PARALLEL_H_
+#define SRC_UTILS_PARALLEL_H_
+
+typedef int (*mc_parallel_cb)(void* arg, int worker, int i);
+
+static const int kMCParallelMaxWorkers = 64;
+
+/*
+ * Call `cb` for every `i` in [0, count) from at most `workers` threads
+ * (capped at kMCParallelMaxWorkers), the calling thread is worker 0. Items
+ * are handed out one at a time, so that slow items don't stall the rest.
+ * Once `cb` fails no more items are handed out, and -1 is returned after
+ * all workers have stopped.
+ */
+int mc_parallel_for(int workers, int count, mc_parallel_cb cb, void* arg);
+
+#endif  /* SRC_UTILS_PARALLEL_H_ */
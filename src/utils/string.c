@@ -1,9 +1,37 @@
-#include <arpa/inet.h>  /* ntohs */
+#include <arpa/inet.h>  /* ntohs, htons */
 #include <assert.h>  /* assert */
-#include <stdlib.h>  /* malloc, free, NULL */
-#include <string.h>  /* memcpy, strlen */
+#include <stdint.h>  /* uint16_t */
+#include <stdlib.h>  /* calloc, malloc, free, NULL */
+#include <string.h>  /* memcmp, memcpy, strlen */
+
+#if defined(__AVX2__)
+# include <immintrin.h>  /* _mm256_* */
+#elif defined(__SSE2__)
+# include <emmintrin.h>  /* _mm_* */
+#endif
 
 #include "utils/string.h"
+#include "utils/common-private.h"  /* ARRAY_SIZE */
+
+static uint16_t* mc_string__alloc(mc_string_t* str, int len);
+static uint32_t mc_string__hash(mc_string_t* str);
+static mc_string_t** mc_string__table_slot(mc_string_table_t* table,
+                                           mc_string_t* str);
+static int mc_string__table_grow(mc_string_table_t* table);
+static int mc_string__narrow(const uint16_t* data,
+                             int len,
+                             unsigned char* out,
+                             int stop_at_one);
+static int mc_string__widen(const unsigned char* data,
+                            int len,
+                            uint16_t* out,
+                            int ascii_only);
+static int mc_string__decode_utf8(const unsigned char* data,
+                                  int len,
+                                  uint32_t* code);
+
+static const uint32_t kReplacementChar = 0xfffd;
+static const int kMCStringTableInitialSize = 16;
 
 
 void mc_string_init(mc_string_t* str) {
@@ -30,31 +58,66 @@ void mc_string_set(mc_string_t* str, const uint16_t* data, int len) {
 
 
 int mc_string_copy(mc_string_t* to, mc_string_t* from) {
+  uint16_t* data;
+
   assert(to->data == NULL);
 
-  to->data = malloc(from->len * sizeof(*to->data));
-  if (to->data == NULL)
+  data = mc_string__alloc(to, from->len);
+  if (data == NULL)
     return -1;
 
-  memcpy((char*) to->data, from->data, from->len * sizeof(*to->data));
-  to->allocated = 1;
-  to->len = from->len;
+  memcpy(data, from->data, from->len * sizeof(*data));
 
   return 0;
 }
 
 
-char* mc_string_to_ascii(mc_string_t* str) {
-  unsigned char* result;
+int mc_string_ascii_len(mc_string_t* str) {
   int i;
   int j;
+  int run;
   uint16_t c;
 
-  result = malloc(str->len + 1);
-  if (result == NULL)
-    return NULL;
+  for (i = 0, j = 0; i < str->len; i++) {
+    /* Count runs of plain ASCII at once */
+    run = mc_string__narrow(str->data + i, str->len - i, NULL, 1);
+    i += run;
+    j += run;
+    if (i == str->len)
+      break;
+
+    c = ntohs(str->data[i]);
+    if (c == 0x0001) {
+      i++;
+      continue;
+    }
+    if ((c & 0xFF80) == 0)
+      j++;
+  }
+
+  return j;
+}
+
+
+int mc_string_write_ascii(mc_string_t* str, char* out, int size) {
+  int i;
+  int j;
+  int run;
+  uint16_t c;
 
   for (i = 0, j = 0; i < str->len; i++) {
+    /* Convert runs of plain ASCII at once */
+    if (size - j >= str->len - i) {
+      run = mc_string__narrow(str->data + i,
+                              str->len - i,
+                              (unsigned char*) out + j,
+                              1);
+      i += run;
+      j += run;
+      if (i == str->len)
+        break;
+    }
+
     c = ntohs(str->data[i]);
 
     /* Skip two units */
@@ -66,32 +129,599 @@ char* mc_string_to_ascii(mc_string_t* str) {
     /* Check if character can be converted to ASCII */
     if ((c & 0xFF80) != 0)
       continue;
-    result[j++] = (unsigned char) c;
+    if (j == size)
+      return -1;
+    out[j++] = (char) c;
   }
-  result[j] = 0;
-  assert(j <= str->len);
 
-  return (char*) result;
+  return j;
+}
+
+
+char* mc_string_to_ascii(mc_string_t* str) {
+  char* result;
+  int len;
+
+  result = malloc(str->len + 1);
+  if (result == NULL)
+    return NULL;
+
+  len = mc_string_write_ascii(str, result, str->len);
+  assert(len >= 0 && len <= str->len);
+  result[len] = 0;
+
+  return result;
 }
 
 
 int mc_string_from_ascii(mc_string_t* to, const char* from) {
-  int i;
   int len;
   uint16_t* data;
 
   assert(to->data == NULL);
 
   len = strlen(from);
-  data = malloc(len * sizeof(*to->data));
+  data = mc_string__alloc(to, len);
   if (data == NULL)
     return -1;
 
-  for (i = 0; i < len; i++)
-    data[i] = htons((unsigned char) from[i]);
-  to->data = data;
-  to->allocated = 1;
-  to->len = len;
+  mc_string__widen((const unsigned char*) from, len, data, 0);
+
+  return 0;
+}
+
+
+int mc_string_utf8_len(mc_string_t* str) {
+  int i;
+  int res;
+  int run;
+  uint16_t c;
+  uint16_t next;
+
+  res = 0;
+  for (i = 0; i < str->len; i++) {
+    run = mc_string__narrow(str->data + i, str->len - i, NULL, 0);
+    i += run;
+    res += run;
+    if (i == str->len)
+      break;
+
+    c = ntohs(str->data[i]);
+    if (c < 0x80) {
+      res += 1;
+    } else if (c < 0x800) {
+      res += 2;
+    } else if (c >= 0xd800 && c <= 0xdbff && i + 1 < str->len) {
+      next = ntohs(str->data[i + 1]);
+      if (next >= 0xdc00 && next <= 0xdfff) {
+        /* Surrogate pair */
+        res += 4;
+        i++;
+      } else {
+        res += 3;
+      }
+    } else {
+      /* BMP character or U+FFFD in place of lone surrogate */
+      res += 3;
+    }
+  }
+
+  return res;
+}
+
+
+int mc_string_write_utf8(mc_string_t* str, char* out, int size) {
+  int i;
+  int j;
+  int run;
+  uint32_t c;
+  uint16_t next;
+  unsigned char* o;
+
+  o = (unsigned char*) out;
+  for (i = 0, j = 0; i < str->len; i++) {
+    if (size - j >= str->len - i) {
+      run = mc_string__narrow(str->data + i, str->len - i, o + j, 0);
+      i += run;
+      j += run;
+      if (i == str->len)
+        break;
+    }
+
+    c = ntohs(str->data[i]);
+    if (c >= 0xd800 && c <= 0xdfff) {
+      next = i + 1 < str->len ? ntohs(str->data[i + 1]) : 0;
+      if (c <= 0xdbff && next >= 0xdc00 && next <= 0xdfff) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (next - 0xdc00);
+        i++;
+      } else {
+        c = kReplacementChar;
+      }
+    }
+
+    if (c < 0x80) {
+      if (size - j < 1)
+        return -1;
+      o[j++] = c;
+    } else if (c < 0x800) {
+      if (size - j < 2)
+        return -1;
+      o[j++] = 0xc0 | (c >> 6);
+      o[j++] = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+      if (size - j < 3)
+        return -1;
+      o[j++] = 0xe0 | (c >> 12);
+      o[j++] = 0x80 | ((c >> 6) & 0x3f);
+      o[j++] = 0x80 | (c & 0x3f);
+    } else {
+      if (size - j < 4)
+        return -1;
+      o[j++] = 0xf0 | (c >> 18);
+      o[j++] = 0x80 | ((c >> 12) & 0x3f);
+      o[j++] = 0x80 | ((c >> 6) & 0x3f);
+      o[j++] = 0x80 | (c & 0x3f);
+    }
+  }
+
+  return j;
+}
+
+
+char* mc_string_to_utf8(mc_string_t* str, int* len) {
+  char* result;
+  int res_len;
+
+  res_len = mc_string_utf8_len(str);
+  result = malloc(res_len + 1);
+  if (result == NULL)
+    return NULL;
+
+  res_len = mc_string_write_utf8(str, result, res_len);
+  assert(res_len >= 0);
+  result[res_len] = 0;
+  if (len != NULL)
+    *len = res_len;
+
+  return result;
+}
+
+
+int mc_string_utf16_len(const char* from, int len) {
+  int i;
+  int res;
+  int run;
+  int seq;
+  uint32_t c;
+  const unsigned char* data;
+
+  data = (const unsigned char*) from;
+  res = 0;
+  for (i = 0; i < len; i += seq) {
+    run = mc_string__widen(data + i, len - i, NULL, 1);
+    i += run;
+    res += run;
+    if (i == len)
+      break;
+
+    seq = mc_string__decode_utf8(data + i, len - i, &c);
+    res += c >= 0x10000 ? 2 : 1;
+  }
+
+  return res;
+}
+
+
+int mc_string_from_utf8(mc_string_t* to, const char* from, int len) {
+  int i;
+  int j;
+  int run;
+  int seq;
+  int res_len;
+  uint32_t c;
+  uint16_t* res;
+  const unsigned char* data;
+
+  assert(to->data == NULL);
+
+  res_len = mc_string_utf16_len(from, len);
+  if (res_len > 0xffff)
+    return -1;
+
+  res = mc_string__alloc(to, res_len);
+  if (res == NULL)
+    return -1;
+
+  data = (const unsigned char*) from;
+  for (i = 0, j = 0; i < len; i += seq) {
+    run = mc_string__widen(data + i, len - i, res + j, 1);
+    i += run;
+    j += run;
+    if (i == len)
+      break;
+
+    seq = mc_string__decode_utf8(data + i, len - i, &c);
+    if (c >= 0x10000) {
+      c -= 0x10000;
+      res[j++] = htons(0xd800 | (c >> 10));
+      res[j++] = htons(0xdc00 | (c & 0x3ff));
+    } else {
+      res[j++] = htons(c);
+    }
+  }
+  assert(j == res_len);
 
   return 0;
 }
+
+
+int mc_string_equals(mc_string_t* a, mc_string_t* b) {
+  if (a == b || (a->data == b->data && a->len == b->len))
+    return 1;
+  if (a->len != b->len)
+    return 0;
+  return memcmp(a->data, b->data, a->len * sizeof(*a->data)) == 0;
+}
+
+
+int mc_string_table_init(mc_string_table_t* table) {
+  table->size = kMCStringTableInitialSize;
+  table->count = 0;
+  table->entries = calloc(table->size, sizeof(*table->entries));
+  if (table->entries == NULL)
+    return -1;
+
+  return 0;
+}
+
+
+void mc_string_table_destroy(mc_string_table_t* table) {
+  int i;
+
+  for (i = 0; i < table->size; i++)
+    free(table->entries[i]);
+  free(table->entries);
+  table->entries = NULL;
+  table->size = 0;
+  table->count = 0;
+}
+
+
+mc_string_t* mc_string_table_intern(mc_string_table_t* table,
+                                    mc_string_t* str) {
+  mc_string_t** slot;
+  mc_string_t* entry;
+
+  slot = mc_string__table_slot(table, str);
+  if (*slot != NULL)
+    return *slot;
+
+  /* Keep load factor below 1/2 */
+  if ((table->count + 1) * 2 > table->size) {
+    if (mc_string__table_grow(table) != 0)
+      return NULL;
+    slot = mc_string__table_slot(table, str);
+  }
+
+  /* Contents are stored right after the entry */
+  entry = malloc(sizeof(*entry) + str->len * sizeof(*str->data));
+  if (entry == NULL)
+    return NULL;
+
+  memcpy(entry + 1, str->data, str->len * sizeof(*str->data));
+  entry->data = (const uint16_t*) (entry + 1);
+  entry->len = str->len;
+  entry->allocated = 0;
+
+  *slot = entry;
+  table->count++;
+
+  return entry;
+}
+
+
+mc_string_t* mc_string_table_intern_ascii(mc_string_table_t* table,
+                                          const char* str) {
+  int r;
+  mc_string_t tmp;
+  mc_string_t* res;
+
+  mc_string_init(&tmp);
+  r = mc_string_from_ascii(&tmp, str);
+  if (r != 0)
+    return NULL;
+
+  res = mc_string_table_intern(table, &tmp);
+  mc_string_destroy(&tmp);
+
+  return res;
+}
+
+
+mc_string_t* mc_string_table_lookup(mc_string_table_t* table,
+                                    mc_string_t* str) {
+  return *mc_string__table_slot(table, str);
+}
+
+
+/* Point `str` to inline storage or heap, depending on `len` */
+uint16_t* mc_string__alloc(mc_string_t* str, int len) {
+  uint16_t* data;
+
+  if (len <= (int) ARRAY_SIZE(str->inline_data)) {
+    data = str->inline_data;
+    str->allocated = 0;
+  } else {
+    data = malloc(len * sizeof(*data));
+    if (data == NULL)
+      return NULL;
+    str->allocated = 1;
+  }
+  str->data = data;
+  str->len = len;
+
+  return data;
+}
+
+
+/* FNV-1a over code units */
+uint32_t mc_string__hash(mc_string_t* str) {
+  int i;
+  uint32_t hash;
+
+  hash = 2166136261u;
+  for (i = 0; i < str->len; i++) {
+    hash ^= str->data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+
+/* Find either slot with equal string, or empty slot where it should go */
+mc_string_t** mc_string__table_slot(mc_string_table_t* table,
+                                    mc_string_t* str) {
+  uint32_t mask;
+  uint32_t index;
+  mc_string_t** slot;
+
+  mask = table->size - 1;
+  index = mc_string__hash(str) & mask;
+  for (;;) {
+    slot = &table->entries[index];
+    if (*slot == NULL || mc_string_equals(*slot, str))
+      return slot;
+    index = (index + 1) & mask;
+  }
+}
+
+
+int mc_string__table_grow(mc_string_table_t* table) {
+  int i;
+  mc_string_table_t grown;
+  mc_string_t** slot;
+
+  grown.size = table->size * 2;
+  grown.count = table->count;
+  grown.entries = calloc(grown.size, sizeof(*grown.entries));
+  if (grown.entries == NULL)
+    return -1;
+
+  for (i = 0; i < table->size; i++) {
+    if (table->entries[i] == NULL)
+      continue;
+    slot = mc_string__table_slot(&grown, table->entries[i]);
+    *slot = table->entries[i];
+  }
+
+  free(table->entries);
+  *table = grown;
+
+  return 0;
+}
+
+
+/*
+ * Convert leading run of ASCII UTF-16BE units into bytes, returns length of
+ * the run. `out` might be NULL if only the length is needed. If `stop_at_one`
+ * is set - U+0001 (which has special meaning in mc_string_to_ascii) ends the
+ * run too.
+ */
+int mc_string__narrow(const uint16_t* data,
+                      int len,
+                      unsigned char* out,
+                      int stop_at_one) {
+  int i;
+  uint16_t c;
+
+  i = 0;
+
+#if defined(__AVX2__)
+  {
+    __m256i mask;
+    __m256i one;
+    __m256i zero;
+    __m256i v;
+    __m256i packed;
+
+    mask = _mm256_set1_epi16((short) 0xFF80);
+    one = _mm256_set1_epi16(1);
+    zero = _mm256_setzero_si256();
+    for (; i + 16 <= len; i += 16) {
+      v = _mm256_loadu_si256((const __m256i*) (data + i));
+
+      /* Swap bytes of every unit: big-endian -> host */
+      v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+      if (_mm256_movemask_epi8(
+              _mm256_cmpeq_epi16(_mm256_and_si256(v, mask), zero)) != -1) {
+        break;
+      }
+      if (stop_at_one &&
+          _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, one)) != 0) {
+        break;
+      }
+      if (out != NULL) {
+        /* packus works per 128-bit lane, restore the order afterwards */
+        packed = _mm256_packus_epi16(v, zero);
+        packed = _mm256_permute4x64_epi64(packed, 0xd8);
+        _mm_storeu_si128((__m128i*) (out + i),
+                         _mm256_castsi256_si128(packed));
+      }
+    }
+  }
+#endif  /* defined(__AVX2__) */
+
+#if defined(__SSE2__)
+  {
+    __m128i mask;
+    __m128i one;
+    __m128i zero;
+    __m128i v;
+
+    mask = _mm_set1_epi16((short) 0xFF80);
+    one = _mm_set1_epi16(1);
+    zero = _mm_setzero_si128();
+    for (; i + 8 <= len; i += 8) {
+      v = _mm_loadu_si128((const __m128i*) (data + i));
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), zero)) !=
+          0xffff) {
+        break;
+      }
+      if (stop_at_one && _mm_movemask_epi8(_mm_cmpeq_epi16(v, one)) != 0)
+        break;
+      if (out != NULL)
+        _mm_storel_epi64((__m128i*) (out + i), _mm_packus_epi16(v, zero));
+    }
+  }
+#endif  /* defined(__SSE2__) */
+
+  /* Scalar tail, or the whole string without SIMD */
+  for (; i < len; i++) {
+    c = ntohs(data[i]);
+    if ((c & 0xFF80) != 0 || (stop_at_one && c == 0x0001))
+      break;
+    if (out != NULL)
+      out[i] = (unsigned char) c;
+  }
+
+  return i;
+}
+
+
+/*
+ * Convert leading run of bytes into UTF-16BE units, returns length of the
+ * run. If `ascii_only` is set - run ends at first non-ASCII byte, otherwise
+ * bytes are treated as Latin-1 and the whole input is converted.
+ */
+int mc_string__widen(const unsigned char* data,
+                     int len,
+                     uint16_t* out,
+                     int ascii_only) {
+  int i;
+
+  i = 0;
+
+#if defined(__AVX2__)
+  {
+    __m256i zero;
+    __m256i v;
+
+    zero = _mm256_setzero_si256();
+    for (; i + 32 <= len; i += 32) {
+      v = _mm256_loadu_si256((const __m256i*) (data + i));
+      if (ascii_only && _mm256_movemask_epi8(v) != 0)
+        break;
+      if (out != NULL) {
+        /* Interleave with zeroes, in the order of 128-bit lanes */
+        v = _mm256_permute4x64_epi64(v, 0xd8);
+        _mm256_storeu_si256((__m256i*) (out + i),
+                            _mm256_unpacklo_epi8(zero, v));
+        _mm256_storeu_si256((__m256i*) (out + i + 16),
+                            _mm256_unpackhi_epi8(zero, v));
+      }
+    }
+  }
+#endif  /* defined(__AVX2__) */
+
+#if defined(__SSE2__)
+  {
+    __m128i zero;
+    __m128i v;
+
+    zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+      v = _mm_loadu_si128((const __m128i*) (data + i));
+      if (ascii_only && _mm_movemask_epi8(v) != 0)
+        break;
+      if (out != NULL) {
+        /* Zero goes first: that's the high byte of big-endian unit */
+        _mm_storeu_si128((__m128i*) (out + i), _mm_unpacklo_epi8(zero, v));
+        _mm_storeu_si128((__m128i*) (out + i + 8),
+                         _mm_unpackhi_epi8(zero, v));
+      }
+    }
+  }
+#endif  /* defined(__SSE2__) */
+
+  for (; i < len; i++) {
+    if (ascii_only && data[i] >= 0x80)
+      break;
+    if (out != NULL)
+      out[i] = htons(data[i]);
+  }
+
+  return i;
+}
+
+
+/*
+ * Decode one UTF-8 sequence, returns number of consumed bytes. Malformed
+ * input decodes to U+FFFD and consumes one byte.
+ */
+int mc_string__decode_utf8(const unsigned char* data, int len, uint32_t* code) {
+  int i;
+  int seq;
+  uint32_t c;
+  uint32_t min;
+
+  c = data[0];
+  if (c < 0x80) {
+    *code = c;
+    return 1;
+  } else if ((c & 0xe0) == 0xc0) {
+    seq = 2;
+    min = 0x80;
+    c &= 0x1f;
+  } else if ((c & 0xf0) == 0xe0) {
+    seq = 3;
+    min = 0x800;
+    c &= 0x0f;
+  } else if ((c & 0xf8) == 0xf0) {
+    seq = 4;
+    min = 0x10000;
+    c &= 0x07;
+  } else {
+    goto malformed;
+  }
+
+  if (seq > len)
+    goto malformed;
+  for (i = 1; i < seq; i++) {
+    if ((data[i] & 0xc0) != 0x80)
+      goto malformed;
+    c = (c << 6) | (data[i] & 0x3f);
+  }
+
+  /* Overlong encodings, surrogates and out of range values */
+  if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+    goto malformed;
+
+  *code = c;
+  return seq;
+
+malformed:
+  *code = kReplacementChar;
+  return 1;
+}
@@ -1,12 +1,30 @@
 #ifndef SRC_UTILS_STRING_H_
 #define SRC_UTILS_STRING_H_
 
+#include <stdint.h>  /* uint16_t */
+
 typedef struct mc_string_s mc_string_t;
+typedef struct mc_string_table_s mc_string_table_t;
 
+/*
+ * Strings of up to 16 units are stored inline, `data` points into the
+ * struct itself in such case - so it should not be moved with memcpy().
+ */
 struct mc_string_s {
   const uint16_t* data;
   uint16_t len;
   int allocated;
+  uint16_t inline_data[16];
+};
+
+/*
+ * Intern table: all interned strings with equal contents share the same
+ * `mc_string_t*`, and could be compared by pointer.
+ */
+struct mc_string_table_s {
+  mc_string_t** entries;
+  int size;
+  int count;
 };
 
 void mc_string_init(mc_string_t* str);
@@ -14,7 +32,40 @@ void mc_string_destroy(mc_string_t* str);
 
 void mc_string_set(mc_string_t* str, const uint16_t* data, int len);
 int mc_string_copy(mc_string_t* to, mc_string_t* from);
+
+/*
+ * ASCII conversion: non-ASCII units are dropped, U+0001 skips the next unit.
+ * `_len` returns the exact number of bytes `_write` will produce, `_write`
+ * returns -1 if `out` is too small.
+ */
+int mc_string_ascii_len(mc_string_t* str);
+int mc_string_write_ascii(mc_string_t* str, char* out, int size);
 char* mc_string_to_ascii(mc_string_t* str);
 int mc_string_from_ascii(mc_string_t* to, const char* from);
 
+/* UTF-8 conversion, lone surrogates and malformed input become U+FFFD */
+int mc_string_utf8_len(mc_string_t* str);
+int mc_string_write_utf8(mc_string_t* str, char* out, int size);
+char* mc_string_to_utf8(mc_string_t* str, int* len);
+int mc_string_utf16_len(const char* from, int len);
+int mc_string_from_utf8(mc_string_t* to, const char* from, int len);
+
+int mc_string_equals(mc_string_t* a, mc_string_t* b);
+
+int mc_string_table_init(mc_string_table_t* table);
+void mc_string_table_destroy(mc_string_table_t* table);
+
+/* Return interned copy of `str`, or NULL if allocation has failed */
+mc_string_t* mc_string_table_intern(mc_string_table_t* table,
+                                    mc_string_t* str);
+mc_string_t* mc_string_table_intern_ascii(mc_string_table_t* table,
+                                          const char* str);
+
+/*
+ * Find interned copy without inserting it, should be used for strings
+ * received from the client.
+ */
+mc_string_t* mc_string_table_lookup(mc_string_table_t* table,
+                                    mc_string_t* str);
+
 #endif  /* SRC_UTILS_STRING_H_ */
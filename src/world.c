@@ -1,14 +1,46 @@
-#include <stdlib.h>  /* malloc, free, NULL */
-#include <string.h>  /* strdup */
+#include <errno.h>  /* errno */
+#include <stdio.h>  /* snprintf */
+#include <stdlib.h>  /* calloc, malloc, free, NULL */
+#include <string.h>  /* memset, strdup, strlen */
+#include <sys/stat.h>  /* mkdir */
+#include <unistd.h>  /* access */
 
 #include "world.h"
+#include "format/anvil.h"  /* mc_anvil_open_file, mc_anvil_save */
 #include "format/nbt.h"
+#include "utils/chunk.h"  /* mc_chunk_size */
+
+static mc_world_region_t* mc_world__get_region(mc_world_t* world,
+                                               int32_t x,
+                                               int32_t z);
+static void mc_world__close_region(mc_world_t* world,
+                                   mc_world_region_t* reg);
+static int mc_world__save_region(mc_world_t* world, mc_world_region_t* reg);
+static int mc_world__mkdir(const char* path);
+static mc_world_column_t* mc_world__find(mc_world_t* world,
+                                         int32_t x,
+                                         int32_t z);
+static mc_world_column_t* mc_world__load(mc_world_t* world,
+                                         int32_t x,
+                                         int32_t z);
+static int mc_world__grow(mc_world_t* world);
+static void mc_world__touch(mc_world_t* world, mc_world_column_t* entry);
+static void mc_world__remove(mc_world_t* world, mc_world_column_t* entry);
+static int mc_world__evict(mc_world_t* world, mc_world_column_t* entry);
+static int mc_world__shrink(mc_world_t* world, mc_world_column_t* keep);
+static int mc_world__column_size(mc_column_t* col);
+static uint32_t mc_world__hash(int32_t x, int32_t z);
+static int32_t mc_world__region_coord(int32_t c);
+
+static const int kInitialBuckets = 64;
+static const char kRegionDir[] = "%s/region";
+static const char kRegionFormat[] = "%s/region/r.%d.%d.mca";
 
 
 mc_world_t* mc_world_new(const char* path) {
   mc_world_t* res;
 
-  res = malloc(sizeof(*res));
+  res = calloc(1, sizeof(*res));
   if (res == NULL)
     goto malloc_failed;
 
@@ -18,6 +50,9 @@ mc_world_t* mc_world_new(const char* path) {
 
   /* Retained after allocation */
   res->ref_count = 1;
+  res->budget = kMCWorldDefaultBudget;
+
+  return res;
 
 strdup_failed:
   free(res);
@@ -33,8 +68,448 @@ void mc_world_retain(mc_world_t* world) {
 
 
 void mc_world_release(mc_world_t* world) {
+  mc_world_column_t* entry;
+  mc_world_column_t* next;
+
   if (--world->ref_count != 0)
     return;
+
+  /* Nothing to report the error to */
+  mc_world_flush(world);
+
+  for (entry = world->head; entry != NULL; entry = next) {
+    next = entry->next;
+    free(entry);
+  }
+  while (world->regions != NULL)
+    mc_world__close_region(world, world->regions);
+  free(world->buckets);
   free(world->path);
   free(world);
 }
+
+
+int mc_world_set_budget(mc_world_t* world, int64_t budget) {
+  world->budget = budget;
+  return mc_world__shrink(world, NULL);
+}
+
+
+mc_column_t* mc_world_get_column(mc_world_t* world, int32_t x, int32_t z) {
+  int size;
+  mc_world_column_t* entry;
+
+  entry = mc_world__find(world, x, z);
+  if (entry != NULL) {
+    world->stats.hits++;
+  } else {
+    world->stats.misses++;
+    entry = mc_world__load(world, x, z);
+    if (entry == NULL)
+      return NULL;
+  }
+
+  /* Column may have changed since the last access */
+  size = mc_world__column_size(entry->column);
+  world->used += size - entry->size;
+  entry->size = size;
+
+  /* Requested column stays cached, even if others couldn't be saved */
+  mc_world__touch(world, entry);
+  if (mc_world__shrink(world, entry) != 0)
+    return NULL;
+
+  return entry->column;
+}
+
+
+mc_column_t* mc_world_pin_column(mc_world_t* world, int32_t x, int32_t z) {
+  mc_column_t* res;
+
+  res = mc_world_get_column(world, x, z);
+  if (res != NULL)
+    mc_world__find(world, x, z)->pins++;
+
+  return res;
+}
+
+
+int mc_world_unpin_column(mc_world_t* world, int32_t x, int32_t z) {
+  mc_world_column_t* entry;
+
+  entry = mc_world__find(world, x, z);
+  if (entry == NULL || entry->pins == 0)
+    return 0;
+
+  /* Column might have been kept over the budget */
+  entry->pins--;
+  return mc_world__shrink(world, NULL);
+}
+
+
+int mc_world_flush(mc_world_t* world) {
+  int r;
+  mc_world_region_t* reg;
+
+  r = 0;
+  for (reg = world->regions; reg != NULL; reg = reg->next)
+    if (mc_world__save_region(world, reg) != 0)
+      r = -1;
+
+  return r;
+}
+
+
+mc_world_region_t* mc_world__get_region(mc_world_t* world,
+                                        int32_t x,
+                                        int32_t z) {
+  int r;
+  int len;
+  mc_world_region_t* reg;
+
+  for (reg = world->regions; reg != NULL; reg = reg->next)
+    if (reg->x == x && reg->z == z)
+      return reg;
+
+  reg = calloc(1, sizeof(*reg));
+  if (reg == NULL)
+    return NULL;
+  reg->x = x;
+  reg->z = z;
+
+  len = snprintf(NULL, 0, kRegionFormat, world->path, x, z);
+  reg->path = malloc(len + 1);
+  if (reg->path == NULL)
+    goto fatal;
+  snprintf(reg->path, len + 1, kRegionFormat, world->path, x, z);
+
+  /* Missing file is an empty region, it is created on first save */
+  r = mc_anvil_open_file(reg->path, &reg->region);
+  if (r != 0) {
+    if (access(reg->path, F_OK) == 0)
+      goto fatal;
+    reg->region = mc_region_new();
+    if (reg->region == NULL)
+      goto fatal;
+  }
+
+  /* Region's column array is resident while any of its columns is */
+  world->used += sizeof(*reg->region);
+
+  reg->next = world->regions;
+  world->regions = reg;
+  return reg;
+
+fatal:
+  free(reg->path);
+  free(reg);
+  return NULL;
+}
+
+
+void mc_world__close_region(mc_world_t* world, mc_world_region_t* reg) {
+  mc_world_region_t** ptr;
+
+  for (ptr = &world->regions; *ptr != reg; ptr = &(*ptr)->next) {
+    /* no-op */
+  }
+  *ptr = reg->next;
+
+  world->used -= sizeof(*reg->region);
+  mc_region_destroy(reg->region);
+  free(reg->path);
+  free(reg);
+}
+
+
+int mc_world__save_region(mc_world_t* world, mc_world_region_t* reg) {
+  int r;
+  int x;
+  int z;
+  int len;
+  int dirty;
+  char* dir;
+  unsigned char* data;
+  mc_region_t* region;
+
+  region = reg->region;
+  dirty = 0;
+  for (x = 0; x < kMCColumnMaxX && !dirty; x++)
+    for (z = 0; z < kMCColumnMaxZ && !dirty; z++)
+      dirty = region->columns[x][z].dirty;
+  if (!dirty)
+    return 0;
+
+  /* New world has no region directory yet */
+  len = snprintf(NULL, 0, kRegionDir, world->path);
+  dir = malloc(len + 1);
+  if (dir == NULL)
+    return -1;
+  snprintf(dir, len + 1, kRegionDir, world->path);
+  r = mc_world__mkdir(world->path);
+  if (r == 0)
+    r = mc_world__mkdir(dir);
+  free(dir);
+  if (r != 0)
+    return r;
+
+  r = mc_anvil_save(region, reg->path);
+  if (r != 0)
+    return r;
+
+  /*
+   * Columns that aren't decoded are read through the new header. Without a
+   * file all of them are only in memory.
+   */
+  if (region->data == NULL)
+    memset(region->decoded, 1, sizeof(region->decoded));
+  len = mc_map_file(reg->path, &data);
+  if (len < 0)
+    return -1;
+  if (region->mapped)
+    mc_unmap_file(region->data, region->len);
+  else
+    free(region->data);
+  region->data = data;
+  region->len = len;
+  region->mapped = 1;
+
+  return 0;
+}
+
+
+int mc_world__mkdir(const char* path) {
+  if (mkdir(path, 0775) == 0 || errno == EEXIST)
+    return 0;
+  return -1;
+}
+
+
+mc_world_column_t* mc_world__find(mc_world_t* world, int32_t x, int32_t z) {
+  mc_world_column_t* entry;
+
+  if (world->bucket_count == 0)
+    return NULL;
+
+  entry = world->buckets[mc_world__hash(x, z) & (world->bucket_count - 1)];
+  for (; entry != NULL; entry = entry->hnext)
+    if (entry->x == x && entry->z == z)
+      return entry;
+
+  return NULL;
+}
+
+
+mc_world_column_t* mc_world__load(mc_world_t* world, int32_t x, int32_t z) {
+  int32_t rx;
+  int32_t rz;
+  uint32_t bucket;
+  mc_world_region_t* reg;
+  mc_world_column_t* entry;
+  mc_column_t* col;
+
+  /* Keep load factor below 1 */
+  if (world->column_count + 1 > world->bucket_count &&
+      mc_world__grow(world) != 0) {
+    return NULL;
+  }
+
+  rx = mc_world__region_coord(x);
+  rz = mc_world__region_coord(z);
+  reg = mc_world__get_region(world, rx, rz);
+  if (reg == NULL)
+    return NULL;
+
+  entry = calloc(1, sizeof(*entry));
+  if (entry == NULL)
+    goto fatal;
+
+  col = mc_region_get_column(reg->region,
+                             x - rx * kMCColumnMaxX,
+                             z - rz * kMCColumnMaxZ);
+  if (col == NULL)
+    goto fatal;
+
+  entry->x = x;
+  entry->z = z;
+  entry->region = reg;
+  entry->column = col;
+  reg->column_count++;
+
+  bucket = mc_world__hash(x, z) & (world->bucket_count - 1);
+  entry->hnext = world->buckets[bucket];
+  world->buckets[bucket] = entry;
+  world->column_count++;
+
+  return entry;
+
+fatal:
+  free(entry);
+  if (reg->column_count == 0)
+    mc_world__close_region(world, reg);
+  return NULL;
+}
+
+
+int mc_world__grow(mc_world_t* world) {
+  int i;
+  int count;
+  uint32_t bucket;
+  mc_world_column_t** buckets;
+  mc_world_column_t* entry;
+  mc_world_column_t* next;
+
+  count = world->bucket_count == 0 ? kInitialBuckets :
+                                     world->bucket_count * 2;
+  buckets = calloc(count, sizeof(*buckets));
+  if (buckets == NULL)
+    return -1;
+
+  for (i = 0; i < world->bucket_count; i++) {
+    for (entry = world->buckets[i]; entry != NULL; entry = next) {
+      next = entry->hnext;
+      bucket = mc_world__hash(entry->x, entry->z) & (count - 1);
+      entry->hnext = buckets[bucket];
+      buckets[bucket] = entry;
+    }
+  }
+
+  free(world->buckets);
+  world->buckets = buckets;
+  world->bucket_count = count;
+
+  return 0;
+}
+
+
+void mc_world__touch(mc_world_t* world, mc_world_column_t* entry) {
+  if (world->head == entry)
+    return;
+
+  /* Unlink, if linked */
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  if (world->tail == entry)
+    world->tail = entry->prev;
+
+  entry->prev = NULL;
+  entry->next = world->head;
+  if (world->head != NULL)
+    world->head->prev = entry;
+  world->head = entry;
+  if (world->tail == NULL)
+    world->tail = entry;
+}
+
+
+void mc_world__remove(mc_world_t* world, mc_world_column_t* entry) {
+  mc_world_column_t** ptr;
+
+  ptr = &world->buckets[mc_world__hash(entry->x, entry->z) &
+                        (world->bucket_count - 1)];
+  for (; *ptr != entry; ptr = &(*ptr)->hnext) {
+    /* no-op */
+  }
+  *ptr = entry->hnext;
+
+  if (entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    world->head = entry->next;
+  if (entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    world->tail = entry->prev;
+
+  world->column_count--;
+  world->used -= entry->size;
+}
+
+
+int mc_world__evict(mc_world_t* world, mc_world_column_t* entry) {
+  int r;
+  mc_world_region_t* reg;
+
+  /* Dirty column is written back with the rest of its region */
+  reg = entry->region;
+  if (entry->column->dirty) {
+    r = mc_world__save_region(world, reg);
+    if (r != 0)
+      return r;
+    world->stats.writebacks++;
+  }
+
+  /* Column will be decoded from the file again on next access */
+  mc_column_destroy(entry->column);
+  reg->region->decoded[entry->x - reg->x * kMCColumnMaxX]
+                      [entry->z - reg->z * kMCColumnMaxZ] = 0;
+
+  mc_world__remove(world, entry);
+  free(entry);
+  world->stats.evictions++;
+
+  if (--reg->column_count == 0)
+    mc_world__close_region(world, reg);
+
+  return 0;
+}
+
+
+int mc_world__shrink(mc_world_t* world, mc_world_column_t* keep) {
+  int r;
+  mc_world_column_t* entry;
+  mc_world_column_t* prev;
+
+  /* Least recently used first, pinned columns are skipped */
+  r = 0;
+  for (entry = world->tail;
+       entry != NULL && world->used > world->budget;
+       entry = prev) {
+    prev = entry->prev;
+    if (entry == keep || entry->pins != 0)
+      continue;
+
+    /* Keep the column in memory if it can't be saved, evict clean ones */
+    if (mc_world__evict(world, entry) != 0)
+      r = -1;
+  }
+
+  return r;
+}
+
+
+int mc_world__column_size(mc_column_t* col) {
+  int i;
+  int y;
+  int res;
+
+  /* Column itself is counted in its region's size */
+  res = col->entity_count * sizeof(*col->entities);
+  for (i = 0; i < col->entity_count; i++)
+    if (col->entities[i].nbt != NULL)
+      res += mc_nbt_size(col->entities[i].nbt);
+  for (y = 0; y < kMCColumnMaxY; y++)
+    if (col->chunks[y] != NULL)
+      res += mc_chunk_size(col->chunks[y]);
+
+  return res;
+}
+
+
+uint32_t mc_world__hash(int32_t x, int32_t z) {
+  uint32_t h;
+
+  /* Buckets are picked by low bits, mix high ones into them */
+  h = ((uint32_t) x * 0x9e3779b1u) ^ ((uint32_t) z * 0x85ebca6bu);
+  return h ^ (h >> 16);
+}
+
+
+int32_t mc_world__region_coord(int32_t c) {
+  /* Floor division, column -1 is in region -1 */
+  if (c >= 0)
+    return c / kMCColumnMaxX;
+  return -((-c - 1) / kMCColumnMaxX) - 1;
+}
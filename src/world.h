@@ -1,14 +1,68 @@
 #ifndef SRC_WORLD_H_
 #define SRC_WORLD_H_
 
-#include "utils/common.h" /* mc_block_id_t, mc_biome_t */
+#include <stdint.h>  /* int32_t, int64_t */
+
+#include "utils/common.h" /* mc_block_id_t, mc_biome_t, mc_column_t */
 
 typedef struct mc_world_s mc_world_t;
+typedef struct mc_world_region_s mc_world_region_t;
+typedef struct mc_world_column_s mc_world_column_t;
+typedef struct mc_world_stats_s mc_world_stats_t;
+
+/* Default memory budget of column cache */
+static const int kMCWorldDefaultBudget = 256 * 1024 * 1024;
+
+/* Loaded .mca file, stays open while any of its columns is cached */
+struct mc_world_region_s {
+  int32_t x;
+  int32_t z;
+  char* path;
+  mc_region_t* region;
+  int column_count;
+  mc_world_region_t* next;
+};
+
+/* Cached column, in hash bucket list and in LRU list */
+struct mc_world_column_s {
+  int32_t x;
+  int32_t z;
+  mc_world_region_t* region;
+  mc_column_t* column;
+  int size;
+  int pins;
+  mc_world_column_t* hnext;
+  mc_world_column_t* prev;
+  mc_world_column_t* next;
+};
 
+struct mc_world_stats_s {
+  int64_t hits;
+  int64_t misses;
+  int64_t evictions;
+  int64_t writebacks;
+};
 
 struct mc_world_s {
   char* path;
   int ref_count;
+
+  mc_world_region_t* regions;
+
+  /*
+   * Column cache keyed by world column coordinates, `head` is the most
+   * recently used column. `used` counts cached columns and the regions they
+   * keep open. Unpinned columns are evicted from the tail once it exceeds
+   * `budget`, dirty ones are saved before that.
+   */
+  mc_world_column_t** buckets;
+  int bucket_count;
+  int column_count;
+  mc_world_column_t* head;
+  mc_world_column_t* tail;
+  int64_t used;
+  int64_t budget;
+  mc_world_stats_t stats;
 };
 
 
@@ -16,4 +70,25 @@ mc_world_t* mc_world_new(const char* path);
 void mc_world_retain(mc_world_t* world);
 void mc_world_release(mc_world_t* world);
 
+/*
+ * Evicts columns right away, if needed. Returns -1 if a dirty column couldn't
+ * be saved (it stays cached), other columns are still evicted.
+ */
+int mc_world_set_budget(mc_world_t* world, int64_t budget);
+
+/*
+ * Return column at world column coordinates, loading it from
+ * `path`/region/r.X.Z.mca if it isn't cached. Set column's `dirty` flag
+ * after modifying it. Does disk I/O on miss, and may evict other columns.
+ * Returns NULL on error, including failure to save an evicted column.
+ */
+mc_column_t* mc_world_get_column(mc_world_t* world, int32_t x, int32_t z);
+
+/* Pinned columns (e.g. around players) are never evicted */
+mc_column_t* mc_world_pin_column(mc_world_t* world, int32_t x, int32_t z);
+int mc_world_unpin_column(mc_world_t* world, int32_t x, int32_t z);
+
+/* Save dirty columns of all loaded regions */
+int mc_world_flush(mc_world_t* world);
+
 #endif  /* SRC_WORLD_H_ */
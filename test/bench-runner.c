@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "format/nbt.h"
+#include "utils/chunk.h"
+
+#define ASSERT(cond, str) \
+    if (!(cond)) { \
+      fprintf(stderr, "Assertion failed: " str "\n"); \
+      abort(); \
+    }
+
+typedef struct bench_s bench_t;
+typedef void (*bench_cb)(bench_t* b);
+
+struct bench_s {
+  const char* name;
+  unsigned char* data;
+  int len;
+  int raw_len;
+  mc_nbt_comp_t comp;
+  mc_nbt_lifetime_t lifetime;
+  mc_nbt_t* tree;
+
+  /* Cost doesn't depend on the data size, report operations per second */
+  int per_op;
+};
+
+static const double kMinTime = 0.5;
+static const int kDepth = 256;
+static const int kListLen = 100000;
+static const int kByteArrayLen = 4 * 1024 * 1024;
+static const int kIntArrayLen = 1024 * 1024;
+static const int kStringCount = 20000;
+
+static long long bench_allocs;
+static long long bench_nodes;
+
+/* Section arrays for Anvil conversion kernels */
+static uint16_t bench_states[MC_CHUNK_BLOCKS];
+static uint8_t bench_blocks[MC_CHUNK_BLOCKS];
+static uint8_t bench_add[MC_CHUNK_NIBBLES];
+static uint8_t bench_data[MC_CHUNK_NIBBLES];
+
+#ifdef BENCH_WRAP_MALLOC
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+
+void* __wrap_malloc(size_t size) {
+  bench_allocs++;
+  return __real_malloc(size);
+}
+
+
+void* __wrap_calloc(size_t count, size_t size) {
+  bench_allocs++;
+  return __real_calloc(count, size);
+}
+
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  bench_allocs++;
+  return __real_realloc(ptr, size);
+}
+
+
+void __wrap_free(void* ptr) {
+  __real_free(ptr);
+}
+
+#endif  /* BENCH_WRAP_MALLOC */
+
+
+double bench_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+long long bench_count(mc_nbt_t* val) {
+  int i;
+  long long res;
+
+  res = 1;
+  if (val->type == kNBTList || val->type == kNBTCompound)
+    for (i = 0; i < val->value.values.len; i++)
+      res += bench_count(val->value.values.list[i]);
+  return res;
+}
+
+
+mc_nbt_t* bench_deep(int depth) {
+  mc_nbt_t* res;
+
+  res = mc_nbt_create_compound("deep", 4, depth == 0 ? 2 : 3);
+  ASSERT(res != NULL, "Create compound failed");
+  res->value.values.list[0] = mc_nbt_create_i32("depth", 5, depth);
+  res->value.values.list[1] = mc_nbt_create_f64("weight", 6, depth * 0.5);
+  if (depth != 0)
+    res->value.values.list[2] = bench_deep(depth - 1);
+  return res;
+}
+
+
+mc_nbt_t* bench_corpus() {
+  int i;
+  char name[32];
+  mc_nbt_t* res;
+  mc_nbt_t* val;
+
+  res = mc_nbt_create_compound("corpus", 6, 5);
+  ASSERT(res != NULL, "Create compound failed");
+
+  /* Deep compounds */
+  res->value.values.list[0] = bench_deep(kDepth);
+
+  /* Long list */
+  val = mc_nbt_create_list("list", 4, kListLen);
+  ASSERT(val != NULL, "Create list failed");
+  for (i = 0; i < kListLen; i++) {
+    val->value.values.list[i] = mc_nbt_create_i64("", 0, i * 7919LL);
+    ASSERT(val->value.values.list[i] != NULL, "Create i64 failed");
+  }
+  res->value.values.list[1] = val;
+
+  /* Big arrays, compressible, but not trivially */
+  val = mc_nbt_create_i8l("bytes", 5, kByteArrayLen);
+  ASSERT(val != NULL, "Create i8l failed");
+  for (i = 0; i < kByteArrayLen; i++)
+    val->value.i8l.list[i] = (i * 31 + (i >> 9)) & 0x3f;
+  res->value.values.list[2] = val;
+
+  val = mc_nbt_create_i32l("ints", 4, kIntArrayLen);
+  ASSERT(val != NULL, "Create i32l failed");
+  for (i = 0; i < kIntArrayLen; i++)
+    val->value.i32l.list[i] = i % 251;
+  res->value.values.list[3] = val;
+
+  /* Many small strings */
+  val = mc_nbt_create_compound("strings", 7, kStringCount);
+  ASSERT(val != NULL, "Create compound failed");
+  for (i = 0; i < kStringCount; i++) {
+    snprintf(name, sizeof(name), "key%d", i);
+    val->value.values.list[i] = mc_nbt_create_str(name,
+                                                  strlen(name),
+                                                  name + 3,
+                                                  strlen(name + 3));
+    ASSERT(val->value.values.list[i] != NULL, "Create str failed");
+  }
+  res->value.values.list[4] = val;
+
+  return res;
+}
+
+
+void bench_parse(bench_t* b) {
+  mc_nbt_t* res;
+  mc_nbt_parser_t parser;
+
+  res = mc_nbt_preparse(&parser, b->data, b->len, b->comp, b->lifetime);
+  ASSERT(res != NULL, "Parse failed");
+  if (b->lifetime != kArenaLifetime)
+    mc_nbt_destroy(res);
+  mc_nbt_postparse(&parser);
+}
+
+
+void bench_encode(bench_t* b) {
+  int r;
+  unsigned char* out;
+
+  r = mc_nbt_encode(b->tree, b->comp, &out);
+  ASSERT(r > 0, "Encode failed");
+  free(out);
+}
+
+
+void bench_clone(bench_t* b) {
+  mc_nbt_t* res;
+
+  res = mc_nbt_clone(b->tree);
+  ASSERT(res != NULL, "Clone failed");
+  mc_nbt_destroy(res);
+}
+
+
+void bench_from_anvil(bench_t* b) {
+  mc_chunk_states_from_anvil(bench_blocks,
+                             bench_add,
+                             bench_data,
+                             bench_states);
+}
+
+
+void bench_to_anvil(bench_t* b) {
+  int r;
+
+  r = mc_chunk_states_to_anvil(bench_states,
+                               bench_blocks,
+                               bench_add,
+                               bench_data);
+  ASSERT(r == 1, "Add should be used");
+}
+
+
+void bench_run(bench_t* b, bench_cb cb) {
+  int i;
+  int iterations;
+  long long allocs;
+  double start;
+  double time;
+
+  /* Warm up */
+  cb(b);
+
+  allocs = bench_allocs;
+  start = bench_now();
+  iterations = 0;
+  do {
+    for (i = 0; i < 4; i++)
+      cb(b);
+    iterations += 4;
+    time = bench_now() - start;
+  } while (time < kMinTime);
+  allocs = bench_allocs - allocs;
+
+  if (b->per_op) {
+    fprintf(stdout,
+            "%-28s %12.2f M ops/s%20s %10lld allocs/op\n",
+            b->name,
+            (double) iterations / time / 1e6,
+            "",
+            allocs / iterations);
+    return;
+  }
+
+  fprintf(stdout,
+          "%-28s %12.1f MB/s %12.2f M nodes/s %10lld allocs/op\n",
+          b->name,
+          (double) b->raw_len * iterations / time / (1024 * 1024),
+          (double) bench_nodes * iterations / time / 1e6,
+          allocs / iterations);
+}
+
+
+int main() {
+  int i;
+  int raw_len;
+  mc_nbt_t* corpus;
+  mc_nbt_t* same;
+  unsigned char* raw;
+  unsigned char* comp[3];
+  int comp_len[3];
+  mc_nbt_parser_t parser;
+  bench_t b;
+  static const char* parse_names[] = {
+    "parse (same lifetime)",
+    "parse (independent lifetime)",
+    "parse (arena lifetime)"
+  };
+  static const char* encode_names[] = {
+    "encode (uncompressed)",
+    "encode (deflate)",
+    "encode (gzip)"
+  };
+
+  corpus = bench_corpus();
+  bench_nodes = bench_count(corpus);
+  for (i = kNBTUncompressed; i <= kNBTGZip; i++) {
+    comp_len[i] = mc_nbt_encode(corpus, i, &comp[i]);
+    ASSERT(comp_len[i] > 0, "Encode failed");
+  }
+  raw = comp[kNBTUncompressed];
+  raw_len = comp_len[kNBTUncompressed];
+
+  fprintf(stdout,
+          "Corpus: %lld nodes, %d bytes, %d deflate, %d gzip\n",
+          bench_nodes,
+          raw_len,
+          comp_len[kNBTDeflate],
+          comp_len[kNBTGZip]);
+#ifndef BENCH_WRAP_MALLOC
+  fprintf(stdout, "NOTE: allocations are not counted on this platform\n");
+#endif  /* !BENCH_WRAP_MALLOC */
+
+  /* MB/s are always relative to uncompressed size */
+  memset(&b, 0, sizeof(b));
+  b.raw_len = raw_len;
+  b.tree = corpus;
+
+  for (i = kSameLifetime; i <= kArenaLifetime; i++) {
+    b.name = parse_names[i];
+    b.data = raw;
+    b.len = raw_len;
+    b.comp = kNBTUncompressed;
+    b.lifetime = i;
+    bench_run(&b, bench_parse);
+  }
+
+  for (i = kNBTDeflate; i <= kNBTGZip; i++) {
+    b.name = i == kNBTDeflate ? "parse (deflate, independent)" :
+                                "parse (gzip, independent)";
+    b.data = comp[i];
+    b.len = comp_len[i];
+    b.comp = i;
+    b.lifetime = kIndependentLifetime;
+    bench_run(&b, bench_parse);
+  }
+
+  for (i = kNBTUncompressed; i <= kNBTGZip; i++) {
+    b.name = encode_names[i];
+    b.comp = i;
+    bench_run(&b, bench_encode);
+  }
+
+  /* Clone of owned tree copies only the root, of borrowed one - everything */
+  b.name = "clone (shared)";
+  b.per_op = 1;
+  bench_run(&b, bench_clone);
+  b.per_op = 0;
+
+  same = mc_nbt_preparse(&parser,
+                         raw,
+                         raw_len,
+                         kNBTUncompressed,
+                         kSameLifetime);
+  ASSERT(same != NULL, "Parse failed");
+  b.name = "clone (copy)";
+  b.tree = same;
+  bench_run(&b, bench_clone);
+  mc_nbt_destroy(same);
+  mc_nbt_postparse(&parser);
+
+  /* Section kernels: MB/s of states, nodes are blocks */
+  for (i = 0; i < kMCChunkBlocks; i++)
+    bench_states[i] = (uint16_t) (i * 2654435761u >> 16);
+  bench_nodes = kMCChunkBlocks;
+  b.raw_len = sizeof(bench_states);
+  b.name = "section to anvil";
+  bench_run(&b, bench_to_anvil);
+  b.name = "section from anvil";
+  bench_run(&b, bench_from_anvil);
+
+  for (i = kNBTUncompressed; i <= kNBTGZip; i++)
+    free(comp[i]);
+  mc_nbt_destroy(corpus);
+
+  return 0;
+}
@@ -1,9 +1,20 @@
+#include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "format/anvil.h"
 #include "format/nbt.h"
+#include "protocol/framer.h"
+#include "utils/buffer.h"
+#include "utils/chain.h"
+#include "utils/chunk.h"
 #include "utils/common.h"
+#include "utils/string.h"
 #include "world.h"
 
 #define ASSERT(cond, str) \
@@ -98,11 +109,873 @@ void test_nbt_cycle() {
 }
 
 
+void test_nbt_arena() {
+  int i;
+  int r;
+  char name[16];
+  mc_nbt_t* res;
+  mc_nbt_t* val;
+  mc_nbt_parser_t parser;
+  unsigned char* out;
+
+  /* Enough children to grow the compound and to span several chunks */
+  res = mc_nbt_create_compound("arena", 5, 5000);
+  ASSERT(res != NULL, "Create compound failed");
+  for (i = 0; i < 5000; i++) {
+    snprintf(name, sizeof(name), "item%d", i);
+    val = mc_nbt_create_i32(name, strlen(name), i);
+    ASSERT(val != NULL, "Create i32 failed");
+    res->value.values.list[i] = val;
+  }
+
+  r = mc_nbt_encode(res, kNBTDeflate, &out);
+  ASSERT(r > 0, "Encode failed");
+  mc_nbt_destroy(res);
+
+  /* Wide compound in the per-node mode */
+  val = mc_nbt_parse(out, r, kNBTDeflate);
+  ASSERT(val != NULL, "Wide compound parse failed");
+  ASSERT(val->value.values.len == 5000, "Not enough items");
+  ASSERT(val->value.values.list[0]->value.i32 == 0, "Value mismatch");
+  mc_nbt_destroy(val);
+
+  val = mc_nbt_preparse(&parser, out, r, kNBTDeflate, kArenaLifetime);
+  ASSERT(val != NULL, "Arena parse failed");
+  ASSERT(parser.arena != NULL && parser.arena->next != NULL,
+         "Should use several arena chunks");
+  ASSERT(val->value.values.len == 5000, "Not enough items");
+  ASSERT(val->value.values.list[4999]->value.i32 == 4999, "Value mismatch");
+  ASSERT(val->value.values.list[4999]->name.len == 8, "Name mismatch");
+
+  /* Clone should be independent from the arena */
+  res = mc_nbt_clone(val->value.values.list[42]);
+  ASSERT(res != NULL, "Clone failed");
+  mc_nbt_postparse(&parser);
+  ASSERT(res->value.i32 == 42, "Clone mismatch");
+  mc_nbt_destroy(res);
+  free(out);
+}
+
+
+void test_nbt_index() {
+  int i;
+  int r;
+  char name[16];
+  mc_nbt_t* res;
+  mc_nbt_t* val;
+  mc_nbt_t* copy;
+  mc_nbt_key_t key;
+  unsigned char* out;
+
+  /* Compile-time and runtime hashes should agree */
+  ASSERT(MC_NBT_HASH("Level") == mc_nbt_hash("Level", 5),
+         "Short hash mismatch");
+  ASSERT(MC_NBT_HASH("a-rather-long-property-name-over-32-chars") ==
+             mc_nbt_hash("a-rather-long-property-name-over-32-chars", 41),
+         "Long hash mismatch");
+
+  res = mc_nbt_create_compound("index", 5, 100);
+  ASSERT(res != NULL, "Create compound failed");
+  for (i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "item%d", i);
+    val = mc_nbt_create_i32(name, strlen(name), i);
+    ASSERT(val != NULL, "Create i32 failed");
+    res->value.values.list[i] = val;
+  }
+
+  r = mc_nbt_encode(res, kNBTDeflate, &out);
+  ASSERT(r > 0, "Encode failed");
+  mc_nbt_destroy(res);
+
+  res = mc_nbt_parse(out, r, kNBTDeflate);
+  free(out);
+  ASSERT(res != NULL, "Parse failed");
+  ASSERT(res->value.values.index < 0, "Index should be reserved");
+
+  for (i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "item%d", i);
+    val = mc_nbt_get(res, name, strlen(name), kNBTInt);
+    ASSERT(val != NULL && val->value.i32 == i, "Indexed lookup failed");
+  }
+  ASSERT(res->value.values.index > 0, "Index should be built");
+
+  val = NBT_GET(res, "item42", kNBTInt);
+  ASSERT(val != NULL && val->value.i32 == 42, "Precomputed lookup failed");
+  ASSERT(NBT_GET(res, "item100", kNBTInt) == NULL, "Missing key found");
+  ASSERT(NBT_GET(res, "item42", kNBTByte) == NULL, "Type mismatch found");
+
+  /* Clone keeps lookups working */
+  copy = mc_nbt_clone(res);
+  mc_nbt_destroy(res);
+  ASSERT(copy != NULL, "Clone failed");
+  mc_nbt_key_init(&key, "item99", 6);
+  val = mc_nbt_get_key(copy, &key, kNBTInt);
+  ASSERT(val != NULL && val->value.i32 == 99, "Clone lookup failed");
+  ASSERT(copy->name.len == 5 && memcmp(copy->name.value, "index", 5) == 0,
+         "Clone name mismatch");
+  mc_nbt_destroy(copy);
+}
+
+
+void test_nbt_cow() {
+  int32_t v;
+  mc_nbt_t* res;
+  mc_nbt_t* copy;
+  mc_nbt_t* val;
+
+  res = mc_nbt_create_compound("cow", 3, 2);
+  ASSERT(res != NULL, "Create compound failed");
+  res->value.values.list[0] = mc_nbt_create_i32("x", 1, 1);
+  res->value.values.list[1] = mc_nbt_create_compound("tag", 3, 1);
+  ASSERT(res->value.values.list[0] != NULL &&
+             res->value.values.list[1] != NULL,
+         "Create failed");
+  val = res->value.values.list[1];
+  val->value.values.list[0] = mc_nbt_create_str("id", 2, "Pig", 3);
+  ASSERT(val->value.values.list[0] != NULL, "Create str failed");
+
+  /* Clone has its own root, children are shared */
+  copy = mc_nbt_clone(res);
+  ASSERT(copy != NULL && copy != res && res->refs == 1, "Clone failed");
+  ASSERT(NBT_GET(copy, "x", kNBTInt) == NBT_GET(res, "x", kNBTInt) &&
+             NBT_GET(res, "x", kNBTInt)->refs == 2,
+         "Children should be shared");
+  ASSERT(mc_nbt_size(copy) == mc_nbt_size(res) &&
+             mc_nbt_size(res) > mc_nbt_size(val) + (int) sizeof(*res),
+         "Wrong tree size");
+
+  /* Clone is edited right away, writer gets its own copy of the path */
+  v = 2;
+  ASSERT(mc_nbt_set(copy, "x", 1, kNBTInt, &v) == 0, "Set failed");
+  ASSERT(NBT_GET(copy, "x", kNBTInt)->value.i32 == 2, "Copy not updated");
+  ASSERT(NBT_GET(res, "x", kNBTInt)->value.i32 == 1, "Original updated");
+  ASSERT(NBT_GET(copy, "tag", kNBTCompound) ==
+             NBT_GET(res, "tag", kNBTCompound),
+         "Untouched child should be shared");
+
+  /* Nested edit of the original leaves the clone alone */
+  val = NBT_EDIT(res, "tag", kNBTCompound);
+  ASSERT(val != NULL && val != NBT_GET(copy, "tag", kNBTCompound),
+         "Edit should copy");
+  ASSERT(NBT_GET(copy, "tag", kNBTCompound)->refs == 1,
+         "Clone's child should be released");
+  ASSERT(mc_nbt_unshare(&copy) == copy, "Clone's root should be own");
+
+  /* Original goes away first, copy should stay intact */
+  mc_nbt_destroy(res);
+  val = NBT_GET(copy, "tag", kNBTCompound);
+  ASSERT(val->refs == 1, "Child should be released");
+  ASSERT(NBT_GET(val, "id", kNBTString)->value.str.len == 3,
+         "Child mismatch");
+  mc_nbt_destroy(copy);
+}
+
+
+void test_nbt_cursor() {
+  int i;
+  int r;
+  int len;
+  int32_t v;
+  int32_t arr_len;
+  int64_t l;
+  const void* arr;
+  mc_nbt_t* res;
+  mc_nbt_t* val;
+  mc_nbt_t* item;
+  mc_nbt_cursor_t root;
+  mc_nbt_cursor_t list;
+  mc_nbt_cursor_t cur;
+  mc_nbt_cursor_t field;
+  unsigned char* out;
+  unsigned char* uncompressed;
+
+  /* Generate data */
+  res = mc_nbt_create_compound("root", 4, 4);
+  ASSERT(res != NULL, "Create compound failed");
+  res->value.values.list[0] = mc_nbt_create_i64("long",
+                                                4,
+                                                0x0102030405060708LL);
+  ASSERT(res->value.values.list[0] != NULL, "Create i64 failed");
+  val = mc_nbt_create_list("items", 5, 3);
+  ASSERT(val != NULL, "Create list failed");
+  res->value.values.list[1] = val;
+  for (i = 0; i < 3; i++) {
+    item = mc_nbt_create_compound(NULL, 0, 1);
+    ASSERT(item != NULL, "Create compound failed");
+    item->value.values.list[0] = mc_nbt_create_i32("v", 1, i * 10);
+    ASSERT(item->value.values.list[0] != NULL, "Create i32 failed");
+    val->value.values.list[i] = item;
+  }
+  val = mc_nbt_create_i8l("bytes", 5, 10);
+  ASSERT(val != NULL, "Create i8l failed");
+  for (i = 0; i < 10; i++)
+    val->value.i8l.list[i] = i;
+  res->value.values.list[2] = val;
+  res->value.values.list[3] = mc_nbt_create_str("name", 4, "cursor", 6);
+  ASSERT(res->value.values.list[3] != NULL, "Create str failed");
+
+  len = mc_nbt_encode(res, kNBTUncompressed, &out);
+  ASSERT(len > 0, "Encode failed");
+  mc_nbt_destroy(res);
+
+  r = mc_nbt_cursor_init(&root, out, len);
+  ASSERT(r == 0, "Cursor init failed");
+  ASSERT(root.type == kNBTCompound, "Not compound root");
+  ASSERT(root.name.len == 4, "Root name mismatch");
+
+  /* Seek to key, past the list */
+  r = NBT_CURSOR_FIND(&root, "long", kNBTLong, &cur);
+  ASSERT(r == 0, "Find long failed");
+  r = mc_nbt_cursor_read(&cur, kNBTLong, &l);
+  ASSERT(r == 0, "Read long failed");
+  ASSERT(l == 0x0102030405060708LL, "Long mismatch");
+  r = NBT_CURSOR_FIND(&root, "name", kNBTString, &cur);
+  ASSERT(r == 0, "Find string failed");
+  r = mc_nbt_cursor_array(&cur, kNBTString, &arr, &arr_len);
+  ASSERT(r == 0 && arr_len == 6, "String length mismatch");
+  ASSERT(memcmp(arr, "cursor", 6) == 0, "String mismatch");
+  ASSERT((const unsigned char*) arr > out &&
+             (const unsigned char*) arr < out + len,
+         "String should point into input");
+
+  r = NBT_CURSOR_FIND(&root, "bytes", kNBTByteArray, &cur);
+  ASSERT(r == 0, "Find byte array failed");
+  r = mc_nbt_cursor_array(&cur, kNBTByteArray, &arr, &arr_len);
+  ASSERT(r == 0 && arr_len == 10, "Byte array length mismatch");
+  ASSERT(((const int8_t*) arr)[9] == 9, "Byte array mismatch");
+
+  ASSERT(NBT_CURSOR_FIND(&root, "missing", kNBTInt, &cur) != 0,
+         "Missing key found");
+  ASSERT(NBT_CURSOR_FIND(&root, "long", kNBTInt, &cur) != 0,
+         "Type mismatch found");
+
+  /* Enter list */
+  r = NBT_CURSOR_FIND(&root, "items", kNBTList, &list);
+  ASSERT(r == 0, "Find list failed");
+  i = 0;
+  for (r = mc_nbt_cursor_first(&list, &cur);
+       r == 0;
+       r = mc_nbt_cursor_next(&cur)) {
+    ASSERT(cur.type == kNBTCompound, "Not compound item");
+    r = NBT_CURSOR_FIND(&cur, "v", kNBTInt, &field);
+    ASSERT(r == 0, "Find v failed");
+    r = mc_nbt_cursor_read(&field, kNBTInt, &v);
+    ASSERT(r == 0, "Read v failed");
+    ASSERT(v == i * 10, "List item mismatch");
+    i++;
+  }
+  ASSERT(r == 1 && i == 3, "List iteration failed");
+
+  /* Materialize subtree */
+  val = mc_nbt_cursor_parse(&list);
+  ASSERT(val != NULL, "Cursor parse failed");
+  ASSERT(val->type == kNBTList && val->value.values.len == 3,
+         "Parsed list mismatch");
+  ASSERT(val->name.len == 5 && memcmp(val->name.value, "items", 5) == 0,
+         "Parsed name mismatch");
+  item = NBT_GET(val->value.values.list[2], "v", kNBTInt);
+  ASSERT(item != NULL && item->value.i32 == 20, "Parsed item mismatch");
+  mc_nbt_destroy(val);
+
+  /* Truncated input */
+  r = mc_nbt_cursor_init(&root, out, len - 20);
+  ASSERT(r == 0, "Cursor init failed");
+  ASSERT(NBT_CURSOR_FIND(&root, "name", kNBTString, &cur) != 0,
+         "Truncated data accepted");
+  free(out);
+
+  /* Compressed input */
+  res = mc_nbt_create_compound("", 0, 1);
+  ASSERT(res != NULL, "Create compound failed");
+  res->value.values.list[0] = mc_nbt_create_i32("x", 1, 42);
+  ASSERT(res->value.values.list[0] != NULL, "Create i32 failed");
+  len = mc_nbt_encode(res, kNBTDeflate, &out);
+  ASSERT(len > 0, "Encode failed");
+  mc_nbt_destroy(res);
+
+  r = mc_nbt_cursor_open(&root, out, len, kNBTDeflate, &uncompressed);
+  free(out);
+  ASSERT(r == 0, "Cursor open failed");
+  r = NBT_CURSOR_FIND(&root, "x", kNBTInt, &cur);
+  ASSERT(r == 0, "Find x failed");
+  r = mc_nbt_cursor_read(&cur, kNBTInt, &v);
+  ASSERT(r == 0, "Read x failed");
+  ASSERT(v == 42, "Int mismatch");
+  free(uncompressed);
+}
+
+
+typedef struct {
+  int depth;
+  int max_depth;
+  int compounds;
+  int lists;
+  int values;
+  int names;
+  uint64_t sum;
+  int32_t items;
+} test_sax_stats_t;
+
+
+static int test_sax_begin_compound(mc_nbt_sax_t* sax,
+                                   const char* name,
+                                   int name_len) {
+  test_sax_stats_t* stats;
+
+  stats = sax->data;
+  stats->compounds++;
+  stats->names += name_len;
+  if (++stats->depth > stats->max_depth)
+    stats->max_depth = stats->depth;
+  return 0;
+}
+
+
+static int test_sax_end(mc_nbt_sax_t* sax) {
+  test_sax_stats_t* stats;
+
+  stats = sax->data;
+  stats->depth--;
+  return 0;
+}
+
+
+static int test_sax_begin_list(mc_nbt_sax_t* sax,
+                               const char* name,
+                               int name_len,
+                               mc_nbt_type_t type,
+                               int32_t len) {
+  test_sax_stats_t* stats;
+
+  stats = sax->data;
+  stats->lists++;
+  stats->names += name_len;
+  if (++stats->depth > stats->max_depth)
+    stats->max_depth = stats->depth;
+  return 0;
+}
+
+
+static int test_sax_value(mc_nbt_sax_t* sax,
+                          const char* name,
+                          int name_len,
+                          mc_nbt_type_t type,
+                          const void* value) {
+  test_sax_stats_t* stats;
+
+  stats = sax->data;
+  stats->values++;
+  stats->names += name_len;
+  if (type == kNBTInt)
+    stats->sum += *(const int32_t*) value;
+  else if (type == kNBTLong)
+    stats->sum += *(const int64_t*) value;
+  return 0;
+}
+
+
+static int test_sax_array(mc_nbt_sax_t* sax,
+                          const char* name,
+                          int name_len,
+                          mc_nbt_type_t type,
+                          const void* data,
+                          int32_t len,
+                          int32_t offset,
+                          int32_t total) {
+  int32_t i;
+  test_sax_stats_t* stats;
+
+  stats = sax->data;
+  ASSERT(offset + len <= total, "Array chunk out of bounds");
+  ASSERT((offset == 0) == (name != NULL), "Name only in the first chunk");
+  stats->names += name_len;
+  stats->items += len;
+  for (i = 0; i < len; i++) {
+    if (type == kNBTIntArray)
+      stats->sum += (int32_t) ntohl(((const uint32_t*) data)[i]);
+    else
+      stats->sum += ((const uint8_t*) data)[i];
+  }
+  return 0;
+}
+
+
+static void test_nbt_sax_run(const unsigned char* data,
+                             int len,
+                             int step,
+                             test_sax_stats_t* stats) {
+  int i;
+  int r;
+  mc_nbt_sax_t sax;
+  mc_nbt_sax_cbs_t cbs = {
+    test_sax_begin_compound,
+    test_sax_end,
+    test_sax_begin_list,
+    test_sax_end,
+    test_sax_value,
+    test_sax_array
+  };
+
+  memset(stats, 0, sizeof(*stats));
+  r = mc_nbt_sax_init(&sax, kNBTGZip, &cbs);
+  ASSERT(r == 0, "SAX init failed");
+  sax.data = stats;
+
+  for (i = 0; i < len; i += step) {
+    r = mc_nbt_sax_write(&sax, data + i, len - i < step ? len - i : step);
+    ASSERT(r == 0, "SAX write failed");
+  }
+  r = mc_nbt_sax_finish(&sax);
+  ASSERT(r == 0, "SAX document is incomplete");
+  mc_nbt_sax_destroy(&sax);
+}
+
+
+void test_nbt_sax() {
+  int i;
+  int len;
+  mc_nbt_t* res;
+  mc_nbt_t* val;
+  mc_nbt_t* item;
+  unsigned char* out;
+  test_sax_stats_t whole;
+  test_sax_stats_t bytes;
+
+  /* Generate data, with arrays larger than the inflate window */
+  res = mc_nbt_create_compound("sax", 3, 4);
+  ASSERT(res != NULL, "Create compound failed");
+  val = mc_nbt_create_i8l("bytes", 5, 100000);
+  ASSERT(val != NULL, "Create i8l failed");
+  for (i = 0; i < 100000; i++)
+    val->value.i8l.list[i] = i & 0x7f;
+  res->value.values.list[0] = val;
+  val = mc_nbt_create_list("items", 5, 2);
+  ASSERT(val != NULL, "Create list failed");
+  for (i = 0; i < 2; i++) {
+    item = mc_nbt_create_compound(NULL, 0, 1);
+    ASSERT(item != NULL, "Create compound failed");
+    item->value.values.list[0] = mc_nbt_create_i64("l", 1, 1LL << 40);
+    ASSERT(item->value.values.list[0] != NULL, "Create i64 failed");
+    val->value.values.list[i] = item;
+  }
+  res->value.values.list[1] = val;
+  res->value.values.list[2] = mc_nbt_create_i32("int", 3, -5);
+  ASSERT(res->value.values.list[2] != NULL, "Create i32 failed");
+  res->value.values.list[3] = mc_nbt_create_list("empty", 5, 0);
+  ASSERT(res->value.values.list[3] != NULL, "Create list failed");
+
+  len = mc_nbt_encode(res, kNBTGZip, &out);
+  ASSERT(len > 0, "Encode failed");
+  mc_nbt_destroy(res);
+
+  test_nbt_sax_run(out, len, len, &whole);
+  test_nbt_sax_run(out, len, 1, &bytes);
+  free(out);
+
+  ASSERT(whole.compounds == 3 && whole.lists == 2, "Containers mismatch");
+  ASSERT(whole.values == 3 && whole.items == 100000, "Values mismatch");
+  ASSERT(whole.max_depth == 3 && whole.depth == 0, "Depth mismatch");
+  ASSERT(whole.names == 3 + 5 + 5 + 1 + 1 + 3 + 5, "Names mismatch");
+  ASSERT(whole.sum == (uint64_t) (2 * (1LL << 40) - 5 + 100000 / 128 * 8128 +
+                                   (100000 % 128) * (100000 % 128 - 1) / 2),
+         "Sum mismatch");
+  ASSERT(memcmp(&whole, &bytes, sizeof(whole)) == 0,
+         "Split input produced different events");
+
+  /* Predefined data, fed in small pieces */
+  test_nbt_sax_run(nbt_compressed_data,
+                   sizeof(nbt_compressed_data),
+                   7,
+                   &bytes);
+  ASSERT(bytes.compounds > 0 && bytes.depth == 0, "Predefined SAX failed");
+}
+
+
+void test_nbt_zlib() {
+  int i;
+  int r;
+  int len;
+  mc_nbt_comp_t comp;
+  mc_nbt_t* res;
+  mc_nbt_t* val;
+  unsigned char* out;
+
+  /* Compresses well, so that deflate output grows past the guess */
+  res = mc_nbt_create_i8l("zlib", 4, 4 * 1024 * 1024);
+  ASSERT(res != NULL, "Create i8l failed");
+  for (i = 0; i < res->value.i8l.len; i++)
+    res->value.i8l.list[i] = (i >> 12) & 0x7f;
+
+  for (comp = kNBTDeflate; comp <= kNBTGZip; comp++) {
+    /* Twice, to reuse cached streams */
+    for (r = 0; r < 2; r++) {
+      len = mc_nbt_encode(res, comp, &out);
+      ASSERT(len > 0, "Encode failed");
+      val = mc_nbt_parse(out, len, comp);
+      free(out);
+      ASSERT(val != NULL, "Parse failed");
+      ASSERT(val->value.i8l.len == res->value.i8l.len, "Length mismatch");
+      ASSERT(memcmp(val->value.i8l.list,
+                    res->value.i8l.list,
+                    res->value.i8l.len) == 0,
+             "Data mismatch");
+      mc_nbt_destroy(val);
+    }
+  }
+  mc_nbt_destroy(res);
+
+  /* Truncated input */
+  ASSERT(mc_nbt_parse(nbt_compressed_data,
+                      sizeof(nbt_compressed_data) - 16,
+                      kNBTGZip) == NULL,
+         "Truncated input accepted");
+}
+
+
+void test_nbt_writer() {
+  int i;
+  int r;
+  int len;
+  int32_t ints[600];
+  unsigned char* bytes;
+  unsigned char* out;
+  mc_nbt_comp_t comp;
+  mc_nbt_t* res;
+  mc_nbt_t* val;
+  mc_nbt_writer_t w;
+  mc_chain_t chain;
+
+  /* Bigger than writer's window and byte-swap buffer */
+  bytes = malloc(64 * 1024);
+  ASSERT(bytes != NULL, "Allocation failed");
+  for (i = 0; i < 64 * 1024; i++)
+    bytes[i] = i & 0x7f;
+  for (i = 0; i < (int) (sizeof(ints) / sizeof(ints[0])); i++)
+    ints[i] = i * 65537;
+
+  res = mc_nbt_create_compound("tree", 4, 1);
+  ASSERT(res != NULL, "Create compound failed");
+  res->value.values.list[0] = mc_nbt_create_str("license", 7, "MIT", 3);
+  ASSERT(res->value.values.list[0] != NULL, "Create str failed");
+
+  mc_chain_init(&chain);
+  for (comp = kNBTUncompressed; comp <= kNBTGZip; comp++) {
+    r = mc_nbt_writer_init(&w, &chain, comp);
+    ASSERT(r == 0, "Writer init failed");
+
+    /* Twice, to reuse writer's stream */
+    for (r = 0; r < 2; r++) {
+      ASSERT(mc_nbt_write_compound(&w, "w", 1) == 0 &&
+                 mc_nbt_write_i16(&w, "year", 4, 2013) == 0 &&
+                 mc_nbt_write_i8l(&w, "bytes", 5, bytes, 64 * 1024) == 0 &&
+                 mc_nbt_write_i32l(&w, "ints", 4, ints, 600) == 0 &&
+                 mc_nbt_write_list(&w, "list", 4, kNBTDouble, 2) == 0 &&
+                 mc_nbt_write_f64(&w, NULL, 0, 1.5) == 0 &&
+                 mc_nbt_write_f64(&w, NULL, 0, -1.5) == 0 &&
+                 mc_nbt_write_value(&w, res, 1) == 0 &&
+                 mc_nbt_write_end(&w) == 0 &&
+                 mc_nbt_writer_finish(&w) == 0,
+             "Write failed");
+
+      len = mc_chain_flatten(&chain, &out);
+      ASSERT(len > 0, "Flatten failed");
+      mc_chain_destroy(&chain);
+      mc_chain_init(&chain);
+
+      val = mc_nbt_parse(out, len, comp);
+      free(out);
+      ASSERT(val != NULL, "Parse failed");
+      ASSERT(val->value.values.len == 5, "Not enough items");
+      ASSERT(NBT_GET(val, "year", kNBTShort)->value.i16 == 2013,
+             "Short mismatch");
+      ASSERT(memcmp(NBT_GET(val, "bytes", kNBTByteArray)->value.i8l.list,
+                    bytes,
+                    64 * 1024) == 0,
+             "Byte array mismatch");
+      ASSERT(memcmp(NBT_GET(val, "ints", kNBTIntArray)->value.i32l.list,
+                    ints,
+                    sizeof(ints)) == 0,
+             "Int array mismatch");
+      ASSERT(NBT_GET(val, "list", kNBTList)->value.values.list[1]->value.f64 ==
+                 -1.5,
+             "List mismatch");
+      ASSERT(NBT_GET(NBT_GET(val, "tree", kNBTCompound),
+                     "license",
+                     kNBTString) != NULL,
+             "Tree mismatch");
+      mc_nbt_destroy(val);
+    }
+    mc_nbt_writer_destroy(&w);
+  }
+  mc_chain_destroy(&chain);
+  mc_nbt_destroy(res);
+  free(bytes);
+}
+
+
+typedef struct {
+  int16_t air;
+  int64_t uuid;
+  double pos[3];
+  int8_t flag;
+} test_fields_t;
+
+static const mc_nbt_field_t kTestFields[] = {
+  MC_NBT_FIELD(test_fields_t, "Air", kNBTShort, 0, air, 1)
+  MC_NBT_FIELD(test_fields_t, "UUID", kNBTLong, 0, uuid, 1)
+  MC_NBT_FIELD(test_fields_t, "Pos", kNBTDouble, 3, pos, 1)
+  MC_NBT_FIELD(test_fields_t, "Flag", kNBTByte, 0, flag, 0)
+};
+
+
+void test_nbt_fields() {
+  int r;
+  int len;
+  unsigned char* out;
+  mc_nbt_t* res;
+  mc_nbt_t* val;
+  mc_nbt_writer_t w;
+  mc_nbt_cursor_t cur;
+  mc_chain_t chain;
+  test_fields_t in;
+  test_fields_t fields;
+
+  in.air = 300;
+  in.uuid = -(1LL << 40);
+  in.pos[0] = 1.5;
+  in.pos[1] = -2.5;
+  in.pos[2] = 1e10;
+  in.flag = 7;
+
+  /* Write with a table, an extra property shouldn't be matched */
+  mc_chain_init(&chain);
+  r = mc_nbt_writer_init(&w, &chain, kNBTUncompressed);
+  ASSERT(r == 0, "Writer init failed");
+  ASSERT(mc_nbt_write_compound(&w, "", 0) == 0 &&
+             mc_nbt_write_i32(&w, "Other", 5, 1) == 0 &&
+             mc_nbt_write_fields(&w, kTestFields, 3, &in) == 0 &&
+             mc_nbt_write_end(&w) == 0 &&
+             mc_nbt_writer_finish(&w) == 0,
+         "Write failed");
+  mc_nbt_writer_destroy(&w);
+  len = mc_chain_flatten(&chain, &out);
+  mc_chain_destroy(&chain);
+  ASSERT(len > 0, "Flatten failed");
+
+  /* Cursor, optional field is missing */
+  memset(&fields, 0xff, sizeof(fields));
+  ASSERT(mc_nbt_cursor_init(&cur, out, len) == 0, "Cursor init failed");
+  r = mc_nbt_cursor_decode_fields(&cur, kTestFields, 4, &fields);
+  ASSERT(r == 0, "Cursor decode failed");
+  ASSERT(fields.air == 300 && fields.uuid == in.uuid, "Value mismatch");
+  ASSERT(fields.pos[1] == -2.5 && fields.pos[2] == 1e10, "List mismatch");
+  ASSERT(fields.flag == 0, "Missing optional field should be zeroed");
+
+  /* Tree */
+  res = mc_nbt_parse(out, len, kNBTUncompressed);
+  free(out);
+  ASSERT(res != NULL, "Parse failed");
+  memset(&fields, 0xff, sizeof(fields));
+  r = mc_nbt_decode_fields(res, kTestFields, 4, &fields);
+  ASSERT(r == 0, "Decode failed");
+  ASSERT(fields.air == 300 && fields.pos[0] == 1.5, "Tree mismatch");
+
+  /* Update shared tree, clone should keep old values */
+  val = mc_nbt_clone(res);
+  ASSERT(mc_nbt_unshare(&res) != NULL, "Unshare failed");
+  fields.pos[0] = 42.0;
+  fields.air = 1;
+  r = mc_nbt_update_fields(res, kTestFields, 4, &fields);
+  ASSERT(r == 0, "Update failed");
+  ASSERT(NBT_GET(res, "Air", kNBTShort)->value.i16 == 1, "Update mismatch");
+  ASSERT(NBT_GET(val, "Air", kNBTShort)->value.i16 == 300,
+         "Clone was updated");
+  mc_nbt_decode_fields(val, kTestFields, 4, &fields);
+  ASSERT(fields.pos[0] == 1.5, "Clone's list was updated");
+  mc_nbt_decode_fields(res, kTestFields, 4, &fields);
+  ASSERT(fields.pos[0] == 42.0, "List update mismatch");
+  mc_nbt_destroy(val);
+
+  /* Not a compound */
+  r = mc_nbt_decode_fields(NBT_GET(res, "Other", kNBTInt),
+                           kTestFields,
+                           4,
+                           &fields);
+  ASSERT(r != 0, "Decode of non-compound should fail");
+  mc_nbt_destroy(res);
+}
+
+
+void test_chunk() {
+  int i;
+  int x;
+  int y;
+  int z;
+  mc_chunk_t* chunk;
+  mc_block_t block;
+  mc_nbt_t* tile;
+  uint16_t states[MC_CHUNK_BLOCKS];
+  uint16_t check[MC_CHUNK_BLOCKS];
+  uint8_t blocks[MC_CHUNK_BLOCKS];
+  uint8_t add[MC_CHUNK_NIBBLES];
+  uint8_t data[MC_CHUNK_NIBBLES];
+
+  chunk = mc_chunk_new();
+  ASSERT(chunk != NULL, "Chunk allocation failed");
+  ASSERT(chunk->bits == 0 && chunk->data == NULL, "Empty chunk is packed");
+  ASSERT(mc_chunk_get_state(chunk, 3, 4, 5) == 0, "Empty chunk isn't air");
+
+  /* Grow palette through all index widths */
+  for (i = 0; i < 300; i++) {
+    x = i % kMCChunkMaxX;
+    y = (i / 7) % kMCChunkMaxY;
+    z = (i / 3) % kMCChunkMaxZ;
+    ASSERT(mc_chunk_set(chunk, x, y, z, i + 1, i & 0xf) == 0, "Set failed");
+    mc_chunk_get(chunk, x, y, z, &block);
+    ASSERT((int) block.id == i + 1 && block.metadata == (i & 0xf),
+           "Get after set failed");
+  }
+  ASSERT(chunk->bits == 16, "Palette should use 16 bit indices");
+  mc_chunk_get(chunk, 0, 0, 0, &block);
+  ASSERT(block.id == 1, "Old block lost after resize");
+
+  /* Bulk load */
+  for (i = 0; i < kMCChunkBlocks; i++)
+    states[i] = MC_CHUNK_STATE(i % 5, i % 3);
+  ASSERT(mc_chunk_load_states(chunk, states) == 0, "Load failed");
+  ASSERT(chunk->palette_len == 15 && chunk->bits == 4, "Wrong palette");
+  mc_chunk_get_states(chunk, check);
+  ASSERT(memcmp(states, check, sizeof(states)) == 0, "States mismatch");
+  ASSERT(mc_chunk_get_state(chunk, 1, 2, 3) ==
+             states[MC_CHUNK_INDEX(1, 2, 3)],
+         "State lookup mismatch");
+
+  /* Anvil arrays, even block is in low nibble */
+  states[0] = MC_CHUNK_STATE(0x123, 4);
+  states[1] = MC_CHUNK_STATE(0x456, 7);
+  ASSERT(mc_chunk_states_to_anvil(states, blocks, add, data) == 1,
+         "Add should be used");
+  ASSERT(blocks[0] == 0x23 && add[0] == 0x41 && data[0] == 0x74,
+         "Wrong Anvil arrays");
+  mc_chunk_states_from_anvil(blocks, add, data, check);
+  ASSERT(memcmp(states, check, sizeof(states)) == 0, "Anvil mismatch");
+  mc_chunk_states_from_anvil(blocks, NULL, data, check);
+  ASSERT(check[1] == MC_CHUNK_STATE(0x56, 7), "Missing Add isn't zero");
+
+  /* Uniform light isn't stored */
+  ASSERT(chunk->light == NULL && chunk->skylight == NULL,
+         "Light of new chunk is allocated");
+  ASSERT(mc_chunk_set_light(chunk, 5, 5, 5, 0) == 0, "Set light failed");
+  ASSERT(chunk->light == NULL, "Same light value materialized array");
+  memset(blocks, 0xff, kMCChunkNibbles);
+  ASSERT(mc_chunk_load_light(chunk, blocks, blocks) == 0, "Load failed");
+  ASSERT(chunk->light == NULL && mc_chunk_get_light(chunk, 1, 2, 3) == 15,
+         "Uniform light mismatch");
+  memset(blocks, 0, kMCChunkNibbles);
+  ASSERT(mc_chunk_load_light(chunk, blocks, blocks) == 0, "Load failed");
+
+  /* Nibbles, even block is in low nibble */
+  ASSERT(mc_chunk_set_light(chunk, 0, 0, 0, 7) == 0, "Set light failed");
+  ASSERT(mc_chunk_set_light(chunk, 1, 0, 0, 9) == 0, "Set light failed");
+  ASSERT(mc_chunk_set_skylight(chunk, 15, 15, 15, 15) == 0,
+         "Set skylight failed");
+  ASSERT(chunk->light[0] == 0x97, "Wrong nibble order");
+  ASSERT(mc_chunk_get_light(chunk, 2, 0, 0) == 0, "Wrong materialized light");
+  ASSERT(mc_chunk_get_light(chunk, 1, 0, 0) == 9, "Light mismatch");
+  ASSERT(mc_chunk_get_skylight(chunk, 15, 15, 15) == 15, "Sky mismatch");
+
+  /* Tiles are owned by chunk */
+  tile = mc_nbt_create_compound("", 0, 0);
+  ASSERT(tile != NULL, "Create compound failed");
+  ASSERT(mc_chunk_set_tile(chunk, 1, 2, 3, tile) == 0, "Set tile failed");
+  ASSERT(mc_chunk_get_tile(chunk, 1, 2, 3) == tile, "Get tile failed");
+  ASSERT(mc_chunk_get_tile(chunk, 3, 2, 1) == NULL, "Tile at wrong place");
+
+  /* Grow tile map, and remove every other tile */
+  for (i = 0; i < 200; i++) {
+    tile = mc_nbt_create_compound("", 0, 0);
+    ASSERT(tile != NULL, "Create compound failed");
+    ASSERT(mc_chunk_set_tile(chunk, i % 16, i / 16, 7, tile) == 0,
+           "Set tile failed");
+  }
+  for (i = 0; i < 200; i += 2)
+    ASSERT(mc_chunk_set_tile(chunk, i % 16, i / 16, 7, NULL) == 0,
+           "Remove tile failed");
+  ASSERT(chunk->tile_count == 101, "Wrong tile count");
+  for (i = 0; i < 200; i++) {
+    ASSERT((mc_chunk_get_tile(chunk, i % 16, i / 16, 7) != NULL) == (i % 2),
+           "Tile lookup after removal failed");
+  }
+  ASSERT(mc_chunk_get_tile(chunk, 1, 2, 3) != NULL, "First tile lost");
+
+  mc_chunk_destroy(chunk);
+}
+
+
+void test_chunk_kernels() {
+  int i;
+  int round;
+  int has_add;
+  uint8_t nibble;
+  uint16_t states[MC_CHUNK_BLOCKS];
+  uint16_t check[MC_CHUNK_BLOCKS];
+  uint8_t blocks[MC_CHUNK_BLOCKS];
+  uint8_t add[MC_CHUNK_NIBBLES];
+  uint8_t data[MC_CHUNK_NIBBLES];
+
+  /* SIMD paths should match the scalar definition, half of rounds w/o Add */
+  srand(0x1ee7);
+  for (round = 0; round < 16; round++) {
+    for (i = 0; i < kMCChunkBlocks; i++) {
+      states[i] = (uint16_t) rand();
+      if (round % 2 == 0)
+        states[i] &= 0x0fff;
+    }
+
+    has_add = mc_chunk_states_to_anvil(states, blocks, add, data);
+    ASSERT(has_add == (round % 2), "Wrong Add presence");
+    for (i = 0; i < kMCChunkBlocks; i++) {
+      ASSERT(blocks[i] == ((states[i] >> 4) & 0xff), "Blocks mismatch");
+      nibble = i % 2 == 0 ? data[i >> 1] & 0xf : data[i >> 1] >> 4;
+      ASSERT(nibble == (states[i] & 0xf), "Data mismatch");
+      nibble = i % 2 == 0 ? add[i >> 1] & 0xf : add[i >> 1] >> 4;
+      ASSERT(nibble == (states[i] >> 12), "Add mismatch");
+    }
+
+    mc_chunk_states_from_anvil(blocks, add, data, check);
+    ASSERT(memcmp(states, check, sizeof(states)) == 0, "Round-trip failed");
+
+    mc_chunk_states_from_anvil(blocks, NULL, data, check);
+    for (i = 0; i < kMCChunkBlocks; i++)
+      ASSERT(check[i] == (states[i] & 0x0fff), "No-Add mismatch");
+  }
+}
+
+
 void test_anvil() {
   int r;
+  int i;
+  int x;
+  int y;
+  int z;
   int len;
+  int col_x;
+  int col_z;
   unsigned char* out;
+  unsigned char* par;
   mc_region_t* reg;
+  mc_region_t* copy;
+  mc_region_t* lazy;
+  mc_column_t* col;
+  mc_column_t* lazy_col;
+  mc_nbt_t* shared;
+  uint32_t loc;
+  mc_block_t block;
+  mc_chunk_t* a;
+  mc_chunk_t* b;
+  uint16_t states[MC_CHUNK_BLOCKS];
+  uint16_t check[MC_CHUNK_BLOCKS];
+  uint8_t nibbles[2][MC_CHUNK_NIBBLES];
 
   len = mc_read_file("./test/anvil.mca", &out);
   ASSERT(len > 0, "Read file failed");
@@ -113,22 +986,712 @@ void test_anvil() {
 
   len = mc_anvil_encode(reg, &out);
   ASSERT(len > 0, "Encode failed");
-  mc_region_destroy(reg);
 
   /* And try to parse it again */
 
-  r = mc_anvil_parse(out, len, &reg);
+  r = mc_anvil_parse(out, len, &copy);
   free(out);
   ASSERT(r == 0, "Anvil parse#2 failed");
+
+  /* Blocks and light should survive the round-trip */
+  for (x = 0; x < kMCColumnMaxX; x++) {
+    for (z = 0; z < kMCColumnMaxZ; z++) {
+      for (y = 0; y < kMCColumnMaxY; y++) {
+        a = reg->columns[x][z].chunks[y];
+        b = copy->columns[x][z].chunks[y];
+        ASSERT((a == NULL) == (b == NULL), "Chunk presence mismatch");
+        if (a == NULL)
+          continue;
+        mc_chunk_get_states(a, states);
+        mc_chunk_get_states(b, check);
+        ASSERT(memcmp(states, check, sizeof(states)) == 0,
+               "Blocks mismatch");
+        for (i = 0; i < 2; i++) {
+          ASSERT(memcmp(mc_chunk_get_nibbles(a, i, nibbles[0]),
+                        mc_chunk_get_nibbles(b, i, nibbles[1]),
+                        kMCChunkNibbles) == 0,
+                 "Light mismatch");
+        }
+      }
+    }
+  }
+  mc_region_destroy(copy);
+
+  /* Parallel mode should produce exactly the same region */
+  len = mc_read_file("./test/anvil.mca", &out);
+  ASSERT(len > 0, "Read file failed");
+  r = mc_anvil_parse_parallel(out, len, 4, &copy);
+  free(out);
+  ASSERT(r == 0, "Parallel parse failed");
+
+  /* Columns may share cloned entities, workers must not touch refcounts */
+  shared = NULL;
+  for (x = 0; x < kMCColumnMaxX; x++) {
+    for (z = 0; z < kMCColumnMaxZ; z++) {
+      col = &copy->columns[x][z];
+      if (col->entity_count == 0)
+        continue;
+      if (shared == NULL) {
+        shared = col->entities[0].nbt;
+        continue;
+      }
+      mc_nbt_destroy(col->entities[0].nbt);
+      col->entities[0].nbt = mc_nbt_clone(shared);
+    }
+  }
+  ASSERT(shared != NULL && shared->value.values.len > 0 &&
+             shared->value.values.list[0]->refs > 2,
+         "No shared entities");
+  r = mc_anvil_encode_parallel(copy, 4, &par);
+  ASSERT(r > 0, "Parallel encode failed");
+  len = mc_anvil_encode(copy, &out);
+  ASSERT(r == len && memcmp(out, par, len) == 0, "Parallel encode mismatch");
+  free(out);
+  free(par);
+  mc_region_destroy(copy);
+
+  /* Both 4 KB headers are required, offsets can't point into them */
+  out = calloc(1, 4096);
+  ASSERT(out != NULL, "Allocation failed");
+  ASSERT(mc_anvil_open(out, 4096, &lazy) != 0, "Short header accepted");
+  for (i = 0; i < 3; i++) {
+    out = calloc(1, 3 * 4096);
+    ASSERT(out != NULL, "Allocation failed");
+    loc = i == 0 ? 0xffffff01 : i == 1 ? 0x101 : 0x201;
+    *(uint32_t*) (out + 4 * i) = htonl(loc);
+    r = mc_anvil_open(out, 3 * 4096, &lazy);
+    ASSERT((r == 0) == (i == 2), "Wrong column offset validation");
+    if (r == 0)
+      mc_region_destroy(lazy);
+  }
+
+  /* Lazy region decodes only touched columns */
+  len = mc_read_file("./test/anvil.mca", &out);
+  ASSERT(len > 0, "Read file failed");
+  r = mc_anvil_open(out, len, &lazy);
+  ASSERT(r == 0, "Anvil open failed");
+  for (x = 0; x < kMCColumnMaxX; x++)
+    for (z = 0; z < kMCColumnMaxZ; z++)
+      ASSERT(lazy->columns[x][z].generated == 0, "Column decoded eagerly");
+  ASSERT(mc_region_get_column(lazy, kMCColumnMaxX, 0) == NULL,
+         "Column out of region");
+
+  /* Find first generated column */
+  col = NULL;
+  for (x = 0; x < kMCColumnMaxX && col == NULL; x++)
+    for (z = 0; z < kMCColumnMaxZ && col == NULL; z++)
+      if (reg->columns[x][z].generated)
+        col = &reg->columns[x][z];
+  ASSERT(col != NULL, "No generated columns");
+  col_x = x - 1;
+  col_z = z - 1;
+  lazy_col = mc_region_get_column(lazy, col_x, col_z);
+  ASSERT(lazy_col != NULL && lazy_col->generated, "Lazy decode failed");
+  ASSERT(lazy_col->world_x == col->world_x &&
+             lazy_col->entity_count == col->entity_count,
+         "Lazy column mismatch");
+  ASSERT(mc_region_get_column(lazy, col_x, col_z) == lazy_col,
+         "Decoded twice");
+
+  /* Untouched columns are copied as they are */
+  len = mc_anvil_encode(lazy, &out);
+  ASSERT(len > 0, "Lazy encode failed");
+  mc_region_destroy(lazy);
+  r = mc_anvil_parse(out, len, &copy);
+  free(out);
+  ASSERT(r == 0, "Anvil parse#3 failed");
+  for (x = 0; x < kMCColumnMaxX; x++) {
+    for (z = 0; z < kMCColumnMaxZ; z++) {
+      ASSERT(reg->columns[x][z].generated == copy->columns[x][z].generated,
+             "Lazy round-trip mismatch");
+    }
+  }
+
+  mc_region_destroy(copy);
+
+  /* Mapped region reads columns straight from the file */
+  r = mc_anvil_open_file("./test/anvil.mca", &lazy);
+  ASSERT(r == 0, "Anvil open file failed");
+  ASSERT(lazy->mapped, "Region isn't mapped");
+  for (x = 0; x < kMCColumnMaxX; x++) {
+    for (z = 0; z < kMCColumnMaxZ; z++) {
+      lazy_col = mc_region_get_column(lazy, x, z);
+      ASSERT(lazy_col != NULL, "Mapped decode failed");
+      ASSERT(lazy_col->generated == reg->columns[x][z].generated,
+             "Mapped column mismatch");
+    }
+  }
+  mc_region_destroy(lazy);
+  ASSERT(mc_anvil_open_file("./test/missing.mca", &lazy) != 0,
+         "Missing file opened");
+
+  /*
+   * In-place save writes only dirty columns. Older encoder stored no sector
+   * counts, sectors of such columns must not be reused.
+   */
+  len = mc_read_file("./test/anvil.mca", &out);
+  ASSERT(len > 0, "Read file failed");
+  for (i = 0; i < kMCColumnMaxX * kMCColumnMaxZ; i++)
+    out[i * 4 + 3] = 0;
+  r = mc_write_file("./test/save.mca", out, len, 0);
+  free(out);
+  ASSERT(r == 0, "Write file failed");
+  r = mc_anvil_open_file("./test/save.mca", &lazy);
+  ASSERT(r == 0, "Anvil open file failed");
+  lazy_col = mc_region_get_column(lazy, col_x, col_z);
+  ASSERT(lazy_col != NULL && lazy_col->generated, "Lazy decode failed");
+  for (y = 0; lazy_col->chunks[y] == NULL; y++)
+    ;
+  ASSERT(mc_chunk_set(lazy_col->chunks[y], 1, 2, 3, 0x123, 4) == 0,
+         "Set failed");
+  lazy_col->dirty = 1;
+  for (i = 0; i < 2; i++) {
+    ASSERT(mc_anvil_save(lazy, "./test/save.mca") == 0, "Save failed");
+    ASSERT(lazy_col->dirty == 0, "Dirty flag wasn't cleared");
+    lazy_col->dirty = 1;
+  }
+  mc_region_destroy(lazy);
+
+  out = NULL;
+  r = mc_read_file("./test/save.mca", &out);
+  ASSERT(r > 0 && r - len <= 2 * 256 * 4096, "Region was rewritten");
+  remove("./test/save.mca");
+  r = mc_anvil_parse(out, r, &copy);
+  free(out);
+  ASSERT(r == 0, "Anvil parse#4 failed");
+  mc_chunk_get(copy->columns[col_x][col_z].chunks[y], 1, 2, 3, &block);
+  ASSERT(block.id == 0x123 && block.metadata == 4, "Saved block mismatch");
+  for (x = 0; x < kMCColumnMaxX; x++) {
+    for (z = 0; z < kMCColumnMaxZ; z++) {
+      ASSERT(reg->columns[x][z].generated == copy->columns[x][z].generated,
+             "Saved region mismatch");
+      ASSERT(reg->columns[x][z].world_x == copy->columns[x][z].world_x &&
+                 reg->columns[x][z].world_z == copy->columns[x][z].world_z,
+             "Saved column was overwritten");
+    }
+  }
+  mc_region_destroy(copy);
+
   mc_region_destroy(reg);
 }
 
 
+void test_world() {
+  int r;
+  int x;
+  int y;
+  int z;
+  int len;
+  unsigned char* out;
+  mc_world_t* world;
+  mc_column_t* col;
+  mc_block_t block;
+
+  /* World with a single region */
+  len = mc_read_file("./test/anvil.mca", &out);
+  ASSERT(len > 0, "Read file failed");
+  mkdir("./test/world", 0775);
+  mkdir("./test/world/region", 0775);
+  r = mc_write_file("./test/world/region/r.0.0.mca", out, len, 0);
+  free(out);
+  ASSERT(r == 0, "Write file failed");
+
+  world = mc_world_new("./test/world");
+  ASSERT(world != NULL, "World allocation failed");
+
+  /* Only the last column fits into the budget */
+  ASSERT(mc_world_set_budget(world, 1) == 0, "Set budget failed");
+  col = NULL;
+  for (x = 0; x < kMCColumnMaxX && (col == NULL || !col->generated); x++) {
+    for (z = 0; z < kMCColumnMaxZ; z++) {
+      col = mc_world_get_column(world, x, z);
+      ASSERT(col != NULL, "Get column failed");
+      if (col->generated)
+        break;
+    }
+  }
+  x--;
+  ASSERT(col->generated, "No generated columns");
+  ASSERT(world->column_count == 1, "Cache is over the budget");
+  ASSERT(world->stats.evictions == world->stats.misses - 1,
+         "Wrong eviction count");
+  ASSERT(mc_world_get_column(world, x, z) == col && world->stats.hits == 1,
+         "Cached column missed");
+
+  /* Pinned column survives, dirty one is written back on eviction */
+  ASSERT(mc_world_pin_column(world, x, z) == col, "Pin failed");
+  for (y = 0; col->chunks[y] == NULL; y++)
+    ;
+  ASSERT(mc_chunk_set(col->chunks[y], 1, 2, 3, 0x123, 4) == 0,
+         "Set failed");
+  col->dirty = 1;
+  ASSERT(mc_world_get_column(world, -1, -1) != NULL, "Empty region failed");
+  ASSERT(world->column_count == 2, "Pinned column was evicted");
+  ASSERT(mc_world_unpin_column(world, x, z) == 0, "Unpin failed");
+  ASSERT(mc_world_set_budget(world, 0) == 0, "Set budget failed");
+  ASSERT(world->column_count == 0 && world->regions == NULL,
+         "Unpinned columns weren't evicted");
+  ASSERT(world->stats.writebacks == 1, "Dirty column wasn't written back");
+
+  col = mc_world_get_column(world, x, z);
+  ASSERT(col != NULL && col->generated, "Reload failed");
+  mc_chunk_get(col->chunks[y], 1, 2, 3, &block);
+  ASSERT(block.id == 0x123 && block.metadata == 4, "Written back mismatch");
+
+  mc_world_release(world);
+  remove("./test/world/region/r.0.0.mca");
+  rmdir("./test/world/region");
+  rmdir("./test/world");
+}
+
+
+void test_world_new() {
+  int i;
+  mc_world_t* world;
+  mc_column_t* col;
+  mc_block_t block;
+
+  /* World without region files, directories are created on first save */
+  world = mc_world_new("./test/world-new");
+  ASSERT(world != NULL, "World allocation failed");
+
+  col = mc_world_get_column(world, 0, 0);
+  ASSERT(col != NULL && !col->generated, "Empty column failed");
+  col->chunks[0] = mc_chunk_new();
+  ASSERT(col->chunks[0] != NULL, "Chunk allocation failed");
+  ASSERT(mc_chunk_set(col->chunks[0], 1, 2, 3, 0x44, 6) == 0, "Set failed");
+  col->generated = 1;
+  col->dirty = 1;
+
+  /* Cached column is still the one saved after the region got its file */
+  ASSERT(mc_world_flush(world) == 0, "First flush failed");
+  ASSERT(world->regions->region->data != NULL &&
+             world->regions->region->decoded[0][0],
+         "Cached column would be decoded from the file");
+  ASSERT(mc_chunk_set(col->chunks[0], 1, 2, 3, 0x45, 6) == 0, "Set failed");
+  col->dirty = 1;
+  ASSERT(mc_world_set_budget(world, 1) == 0, "Set budget failed");
+
+  /* Open region is accounted, and the budget holds across regions */
+  for (i = 1; i < 200; i++)
+    ASSERT(mc_world_get_column(world, i, 0) != NULL, "Get column failed");
+  ASSERT(world->column_count == 1, "Cache is over the budget");
+  ASSERT(world->used >= (int64_t) sizeof(mc_region_t), "Region unaccounted");
+  ASSERT(world->stats.writebacks == 1, "Dirty column wasn't written back");
+  ASSERT(world->stats.evictions == 199, "Wrong eviction count");
+  ASSERT(mc_world_set_budget(world, 0) == 0, "Set budget failed");
+  ASSERT(world->column_count == 0 && world->used == 0, "Used is leaking");
+
+  col = mc_world_get_column(world, 0, 0);
+  ASSERT(col != NULL && col->generated, "Reload failed");
+  mc_chunk_get(col->chunks[0], 1, 2, 3, &block);
+  ASSERT(block.id == 0x45 && block.metadata == 6, "Written back mismatch");
+
+  mc_world_release(world);
+  remove("./test/world-new/region/r.0.0.mca");
+  rmdir("./test/world-new/region");
+  rmdir("./test/world-new");
+}
+
+
+static void test_framer_next(mc_framer_t* framer,
+                             const char* expected,
+                             int expected_len,
+                             int encrypted) {
+  int r;
+  int len;
+  mc_chain_t out;
+  unsigned char* data;
+
+  mc_chain_init(&out);
+  r = mc_framer_next(framer, &out);
+  ASSERT(r == encrypted, "Wrong encryption of the batch");
+  len = mc_chain_flatten(&out, &data);
+  mc_chain_destroy(&out);
+  ASSERT(len == expected_len && memcmp(data, expected, len) == 0,
+         "Wrong frames in the batch");
+  free(data);
+}
+
+
+static void test_framer_raw(mc_framer_t* framer,
+                            mc_frame_type_t type,
+                            const char* payload) {
+  int r;
+
+  r = mc_framer_raw(framer,
+                    type,
+                    (const unsigned char*) payload,
+                    strlen(payload));
+  ASSERT(r == 0, "Frame failed");
+}
+
+
+void test_framer() {
+  mc_framer_t framer;
+  EVP_CIPHER_CTX aes;
+
+  ASSERT(mc_framer_init(&framer) == 0, "Framer init failed");
+  ASSERT(mc_framer_lane(kMCKickType) == kMCFramerLaneControl &&
+             mc_framer_lane(kMCPlayerPosType) == kMCFramerLaneMovement &&
+             mc_framer_lane(kMCBlockChangeType) == kMCFramerLaneWorld &&
+             mc_framer_lane(kMCChunkDataType) == kMCFramerLaneBulk,
+         "Wrong lane of frame type");
+
+  /* Frame is its type byte ("3", "8", "5", "\"", "\0") and the payload */
+  mc_framer_set_budget(&framer, 10);
+  test_framer_raw(&framer, kMCChunkDataType, "aaaaaaaaaaa");
+  test_framer_raw(&framer, kMCMapChunkBulkType, "bb");
+  test_framer_raw(&framer, kMCBlockChangeType, "ccc");
+  test_framer_raw(&framer, kMCEntityTeleportType, "dd");
+  test_framer_raw(&framer, kMCKeepAliveType, "e");
+
+  /* Lanes by priority, until the budget is reached */
+  test_framer_next(&framer, "\0e\"dd5ccc", 9, 0);
+
+  /* At least one frame, even over the budget, then FIFO within the lane */
+  test_framer_next(&framer, "3aaaaaaaaaaa", 12, 0);
+  test_framer_next(&framer, "8bb", 3, 0);
+  test_framer_next(&framer, "", 0, 0);
+
+  /* Control frames don't count against the budget */
+  test_framer_raw(&framer, kMCBlockChangeType, "f");
+  test_framer_raw(&framer, kMCKickType, "gggggggg");
+  test_framer_raw(&framer, kMCKickType, "hhhhhhhh");
+  test_framer_next(&framer, "\xffgggggggg\xffhhhhhhhh", 18, 0);
+  test_framer_next(&framer, "5f", 2, 0);
+
+  /* Frames queued before encryption go first, and in plaintext */
+  test_framer_raw(&framer, kMCBlockChangeType, "i");
+  mc_framer_use_aes(&framer, &aes);
+  test_framer_raw(&framer, kMCKeepAliveType, "j");
+  test_framer_next(&framer, "5i", 2, 0);
+  test_framer_next(&framer, "\0j", 2, 1);
+  ASSERT(mc_framer_pending(&framer) == 0, "Frames left behind");
+
+  mc_framer_destroy(&framer);
+}
+
+
+static int test_framer_order;
+static int test_framer_first_call;
+static int test_framer_second_call;
+
+
+static void test_framer_first_cb(mc_framer_t* framer, int status) {
+  ASSERT(status == 0, "First send failed");
+  ASSERT(test_framer_second_call == 0, "Second callback went first");
+  test_framer_first_call = ++test_framer_order;
+}
+
+
+static void test_framer_second_cb(mc_framer_t* framer, int status) {
+  ASSERT(status == 0, "Second send failed");
+  test_framer_second_call = ++test_framer_order;
+}
+
+
+void test_framer_send() {
+  int fds[2];
+  char data[32];
+  uv_loop_t* loop;
+  uv_pipe_t pipe;
+  mc_framer_t framer;
+
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair failed");
+  loop = uv_loop_new();
+  ASSERT(loop != NULL, "Loop allocation failed");
+  ASSERT(uv_pipe_init(loop, &pipe, 0) == 0, "Pipe init failed");
+  uv_pipe_open(&pipe, fds[0]);
+
+  /* One frame per write, the second send is made during the first write */
+  ASSERT(mc_framer_init(&framer) == 0, "Framer init failed");
+  mc_framer_set_budget(&framer, 8);
+  test_framer_raw(&framer, kMCBlockChangeType, "aaaa");
+  test_framer_raw(&framer, kMCBlockChangeType, "bbbb");
+  ASSERT(mc_framer_send(&framer,
+                        (uv_stream_t*) &pipe,
+                        test_framer_first_cb) == 0,
+         "First send failed");
+  test_framer_raw(&framer, kMCBlockChangeType, "cccc");
+  ASSERT(mc_framer_send(&framer,
+                        (uv_stream_t*) &pipe,
+                        test_framer_second_cb) == 0,
+         "Second send failed");
+  ASSERT(test_framer_first_call == 0, "Callback before the write");
+
+  /* Each callback fires once its own frames are written */
+  uv_run(loop, UV_RUN_DEFAULT);
+  ASSERT(test_framer_first_call == 1 && test_framer_second_call == 2,
+         "Callbacks weren't invoked in order");
+  ASSERT(read(fds[1], data, sizeof(data)) == 15 &&
+             memcmp(data, "5aaaa5bbbb5cccc", 15) == 0,
+         "Written data mismatch");
+
+  mc_framer_destroy(&framer);
+  uv_close((uv_handle_t*) &pipe, NULL);
+  uv_run(loop, UV_RUN_DEFAULT);
+  uv_loop_delete(loop);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+
+void test_chain() {
+  int i;
+  int r;
+  int len;
+  int off;
+  mc_chain_t a;
+  mc_chain_t b;
+  unsigned char* out;
+  unsigned char* ext;
+  struct iovec iov[16];
+
+  mc_chain_init(&a);
+  mc_chain_init(&b);
+
+  off = mc_chain_reserve(&a, 8);
+  ASSERT(off == 0, "Reserve failed");
+  for (i = 0; i < 10000; i++) {
+    r = mc_chain_write_u32(&a, i);
+    ASSERT(r == 0, "Write u32 failed");
+  }
+  ASSERT(mc_chain_count(&a) > 1, "Chain should span multiple segments");
+  *mc_chain_reserve_ptr(&a, off) = 0xab;
+
+  /* Adopt external data without copying */
+  ext = malloc(3);
+  ASSERT(ext != NULL, "malloc failed");
+  memcpy(ext, "abc", 3);
+  r = mc_chain_append(&b, ext, 3);
+  ASSERT(r == 0, "Append failed");
+  r = mc_chain_write_u16(&b, 0x1234);
+  ASSERT(r == 0, "Write u16 failed");
+  ASSERT(mc_chain_count(&b) == 2, "Append should not be written into");
+
+  mc_chain_splice(&a, &b);
+  ASSERT(mc_chain_len(&b) == 0, "Splice should empty source");
+  ASSERT(mc_chain_len(&a) == 8 + 40000 + 5, "Splice length mismatch");
+  ASSERT(mc_chain_iovec(&a, iov, 16) == mc_chain_count(&a), "Iovec failed");
+
+  len = mc_chain_flatten(&a, &out);
+  ASSERT(len == mc_chain_len(&a), "Flatten failed");
+  ASSERT(out[0] == 0xab, "Reserved data mismatch");
+  ASSERT(out[8 + 4 * 9999 + 3] == (9999 & 0xff), "Written data mismatch");
+  ASSERT(memcmp(out + len - 5, "abc\x12\x34", 5) == 0, "Tail mismatch");
+  free(out);
+
+  /* Move head of the chain, splitting the segment in the middle */
+  r = mc_chain_shift(&a, 20000, &b);
+  ASSERT(r == 0, "Shift failed");
+  ASSERT(mc_chain_len(&b) == 20000, "Shift length mismatch");
+  ASSERT(mc_chain_len(&a) == 8 + 40000 + 5 - 20000, "Shift rest mismatch");
+  len = mc_chain_flatten(&a, &out);
+  ASSERT(len == mc_chain_len(&a), "Flatten after shift failed");
+  ASSERT(out[8 + 4 * 9999 + 3 - 20000] == (9999 & 0xff),
+         "Data after shift mismatch");
+  free(out);
+
+  mc_chain_truncate(&a, 10);
+  ASSERT(mc_chain_len(&a) == 10 && mc_chain_count(&a) == 1, "Truncate failed");
+  r = mc_chain_write_u8(&a, 0xcd);
+  ASSERT(r == 0 && mc_chain_len(&a) == 11, "Write after truncate failed");
+  mc_chain_destroy(&a);
+
+  /* Adopted data with spare room is written into */
+  ext = malloc(16);
+  ASSERT(ext != NULL, "malloc failed");
+  memcpy(ext, "abc", 3);
+  r = mc_chain_adopt(&a, ext, 3, 16);
+  ASSERT(r == 0, "Adopt failed");
+  r = mc_chain_write_u16(&a, 0x1234);
+  ASSERT(r == 0 && mc_chain_count(&a) == 1, "Slack should be written into");
+  ASSERT(memcmp(ext, "abc\x12\x34", 5) == 0, "Adopted data mismatch");
+
+  mc_chain_destroy(&a);
+  mc_chain_destroy(&b);
+}
+
+
+void test_string() {
+  int i;
+  mc_string_table_t table;
+  mc_string_t* interned[40];
+  int r;
+  int len;
+  char* out;
+  char ascii[100];
+  uint16_t units[100];
+  mc_string_t str;
+  mc_string_t back;
+  static const char utf8[] = "long ascii prefix, crossing vector width: "
+                             "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80!";
+
+  /* Long ASCII string goes through the vector paths */
+  for (i = 0; i < 99; i++)
+    ascii[i] = 'a' + (i % 26);
+  ascii[99] = 0;
+  mc_string_init(&str);
+  r = mc_string_from_ascii(&str, ascii);
+  ASSERT(r == 0, "From ASCII failed");
+  ASSERT(mc_string_ascii_len(&str) == 99, "ASCII len mismatch");
+  out = mc_string_to_ascii(&str);
+  ASSERT(out != NULL && strcmp(out, ascii) == 0, "ASCII roundtrip failed");
+  free(out);
+  mc_string_destroy(&str);
+
+  /* Non-ASCII and U+0001 in the middle of the vector */
+  for (i = 0; i < 40; i++)
+    units[i] = htons('a');
+  units[10] = htons(0x0001);
+  units[20] = htons(0x0400);
+  mc_string_set(&str, units, 40);
+  ASSERT(mc_string_ascii_len(&str) == 37, "ASCII len with skips mismatch");
+  r = mc_string_write_ascii(&str, ascii, 36);
+  ASSERT(r == -1, "Short ASCII write should fail");
+
+  /* UTF-8 with 2, 3 and 4 byte sequences */
+  len = sizeof(utf8) - 1;
+  mc_string_init(&str);
+  r = mc_string_from_utf8(&str, utf8, len);
+  ASSERT(r == 0, "From UTF-8 failed");
+  ASSERT(str.len == mc_string_utf16_len(utf8, len), "UTF-16 len mismatch");
+  ASSERT(str.len == len - 1 - 2 - 2, "Surrogate pair expected");
+  ASSERT(mc_string_utf8_len(&str) == len, "UTF-8 len mismatch");
+  out = mc_string_to_utf8(&str, &len);
+  ASSERT(out != NULL && strcmp(out, utf8) == 0, "UTF-8 roundtrip failed");
+  free(out);
+
+  mc_string_init(&back);
+  r = mc_string_copy(&back, &str);
+  ASSERT(r == 0, "Copy failed");
+  ASSERT(back.allocated && mc_string_equals(&back, &str), "Copy mismatch");
+  mc_string_destroy(&back);
+  mc_string_destroy(&str);
+
+  /* Short strings are stored inline */
+  mc_string_init(&str);
+  r = mc_string_from_ascii(&str, "username");
+  ASSERT(r == 0, "Inline from ASCII failed");
+  ASSERT(!str.allocated && str.data == str.inline_data, "Should be inline");
+  mc_string_destroy(&str);
+
+  /* Malformed input */
+  mc_string_init(&str);
+  r = mc_string_from_utf8(&str, "\xff\xc3", 2);
+  ASSERT(r == 0 && str.len == 2, "Malformed UTF-8 failed");
+  ASSERT(ntohs(str.data[0]) == 0xfffd, "Replacement char expected");
+  mc_string_destroy(&str);
+
+  /* Interning, enough strings to grow the table */
+  r = mc_string_table_init(&table);
+  ASSERT(r == 0, "Table init failed");
+  for (i = 0; i < 40; i++) {
+    snprintf(ascii, sizeof(ascii), "channel-%d", i);
+    interned[i] = mc_string_table_intern_ascii(&table, ascii);
+    ASSERT(interned[i] != NULL, "Intern failed");
+  }
+  for (i = 0; i < 40; i++) {
+    snprintf(ascii, sizeof(ascii), "channel-%d", i);
+    mc_string_init(&str);
+    r = mc_string_from_ascii(&str, ascii);
+    ASSERT(r == 0, "From ASCII failed");
+    ASSERT(mc_string_table_lookup(&table, &str) == interned[i],
+           "Lookup mismatch");
+    ASSERT(mc_string_table_intern(&table, &str) == interned[i],
+           "Intern should return same pointer");
+    mc_string_destroy(&str);
+  }
+  mc_string_init(&str);
+  r = mc_string_from_ascii(&str, "unknown");
+  ASSERT(r == 0, "From ASCII failed");
+  ASSERT(mc_string_table_lookup(&table, &str) == NULL, "Unexpected lookup");
+  ASSERT(table.count == 40, "Lookup should not insert");
+  mc_string_destroy(&str);
+  mc_string_table_destroy(&table);
+}
+
+
+void test_slot() {
+  int r;
+  int len;
+  unsigned char* nbt;
+  mc_buffer_t b;
+  mc_slot_t slot;
+  mc_nbt_t* tag;
+  mc_nbt_t* name;
+
+  tag = mc_nbt_create_compound("tag", 3, 1);
+  ASSERT(tag != NULL, "Create compound failed");
+  name = mc_nbt_create_str("Name", 4, "Sword", 5);
+  ASSERT(name != NULL, "Create str failed");
+  tag->value.values.list[0] = name;
+  len = mc_nbt_encode(tag, kNBTGZip, &nbt);
+  ASSERT(len > 0, "Slot NBT encode failed");
+  mc_nbt_destroy(tag);
+
+  r = mc_buffer_init(&b, 16);
+  ASSERT(r == 0, "Buffer init failed");
+  r = mc_buffer_write_u16(&b, 276);
+  r |= mc_buffer_write_u16(&b, 1);
+  r |= mc_buffer_write_u16(&b, 7);
+  r |= mc_buffer_write_u16(&b, len);
+  r |= mc_buffer_write_data(&b, nbt, len);
+  r |= mc_buffer_write_u16(&b, 1);
+  r |= mc_buffer_write_u16(&b, 1);
+  r |= mc_buffer_write_u16(&b, 0);
+  r |= mc_buffer_write_u16(&b, 0xffff);
+  ASSERT(r == 0, "Slot write failed");
+  free(nbt);
+  b.offset = 0;
+
+  /* Slot with NBT, parsed once and cached */
+  r = mc_buffer_read_slot(&b, &slot);
+  ASSERT(r == 0 && slot.id == 276 && slot.damage == 7, "Slot read failed");
+  ASSERT(!slot.parsed && slot.tag == NULL, "Slot NBT should be lazy");
+  tag = mc_slot_nbt(&slot);
+  ASSERT(tag != NULL, "Slot NBT parse failed");
+  ASSERT(mc_slot_nbt(&slot) == tag, "Slot NBT should be cached");
+  name = NBT_GET(tag, "Name", kNBTString);
+  ASSERT(name != NULL && name->value.str.len == 5, "Slot NBT name mismatch");
+  ASSERT(memcmp(name->value.str.value, "Sword", 5) == 0,
+         "Slot NBT name mismatch");
+  mc_slot_destroy(&slot);
+
+  /* Slot without NBT */
+  r = mc_buffer_read_slot(&b, &slot);
+  ASSERT(r == 0 && slot.nbt_len == 0, "Empty slot read failed");
+  ASSERT(mc_slot_nbt(&slot) == NULL, "Empty slot should not have NBT");
+  mc_slot_destroy(&slot);
+
+  mc_buffer_destroy(&b);
+}
+
+
 int main() {
   fprintf(stdout, "Running tests...\n");
   test_nbt_predefined();
   test_nbt_cycle();
+  test_nbt_arena();
+  test_nbt_index();
+  test_nbt_cow();
+  test_nbt_cursor();
+  test_nbt_sax();
+  test_nbt_zlib();
+  test_nbt_writer();
+  test_nbt_fields();
+  test_chain();
+  test_string();
+  test_slot();
+  test_chunk();
+  test_chunk_kernels();
   test_anvil();
+  test_world();
+  test_world_new();
+  test_framer();
+  test_framer_send();
+  mc_nbt_thread_cleanup();
   fprintf(stdout, "Done!\n");
 
   return 0;
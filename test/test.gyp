@@ -6,5 +6,24 @@
     "sources": [
       "test-runner.c",
     ],
+  }, {
+    "target_name": "bench-runner",
+    "type": "executable",
+    "dependencies": [ "../mine.gyp:mine.uv-lib" ],
+    "sources": [
+      "bench-runner.c",
+    ],
+    "conditions": [
+      # Count allocations by wrapping libc's allocator at link time
+      ["OS == 'linux'", {
+        "defines": [ "BENCH_WRAP_MALLOC" ],
+        "ldflags": [
+          "-Wl,--wrap=malloc",
+          "-Wl,--wrap=calloc",
+          "-Wl,--wrap=realloc",
+          "-Wl,--wrap=free",
+        ],
+      }],
+    ],
   }]
 }